@@ -5,8 +5,10 @@
 #include <cctype>
 #include <algorithm>
 #include <sstream>
+#ifdef _WIN32
 #define NOMINMAX
 #include <windows.h>
+#endif
 #include <filesystem>
 #include <map>
 #include <random>
@@ -14,6 +16,46 @@
 #include <unordered_set>
 #include <climits>
 #include <functional>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <csignal>
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BUSCADOR_SSE2 1
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <poll.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 namespace fs = std::filesystem;
 using namespace std;
@@ -35,35 +77,218 @@ struct ResourceCondition {
 	string target;
 };
 
-int memo_buffer[100][50][11];
+// Memo de matchPattern: uno por hilo para poder evaluar consultas en paralelo
+thread_local int memo_buffer[100][50][11];
+
+// Límites de una consulta: tiempo, trabajo (palabras o claves examinadas, permutaciones
+// de /ans, divisiones de /cal...) y cancelación externa (Ctrl-C). Los bucles largos lo
+// consultan cada cierto número de iteraciones y, si se ha agotado, terminan devolviendo
+// los resultados parciales.
+struct QueryBudget {
+	enum Reason { NONE, TIME, WORK, INTERRUPT };
+	chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+	uint64_t max_work = 0;                              // 0 = sin límite
+	const volatile sig_atomic_t* interrupt = nullptr;   // distinto de 0 = cancelar
+	atomic<uint64_t> work{ 0 };
+	atomic<bool> expired{ false };
+	atomic<int> reason{ NONE };
+
+	bool check() {
+		if (expired) return true;
+		int r = NONE;
+		if (interrupt && *interrupt) r = INTERRUPT;
+		else if (max_work && work >= max_work) r = WORK;
+		else if (chrono::steady_clock::now() >= deadline) r = TIME;
+		if (r == NONE) return false;
+		int none = NONE;
+		reason.compare_exchange_strong(none, r);
+		expired = true;
+		return true;
+	}
+
+	// Suma 'units' de trabajo y comprueba los límites
+	bool spend(uint64_t units) {
+		work += units;
+		return check();
+	}
+};
+
+// Presupuesto de la consulta que se está evaluando en este hilo (nullptr = sin límite)
+thread_local QueryBudget* t_budget = nullptr;
+
+static bool budgetExpired() { return t_budget && t_budget->check(); }
+static bool budgetSpend(uint64_t units) { return t_budget && t_budget->spend(units); }
+
+// Nombre del motivo por el que se agotó un presupuesto (campo "truncated_by" del JSON)
+static const char* budgetReasonName(int r) {
+	switch (r) {
+	case QueryBudget::TIME: return "timeout";
+	case QueryBudget::WORK: return "work";
+	case QueryBudget::INTERRUPT: return "interrupt";
+	default: return "";
+	}
+}
+
+// --- ESTADÍSTICAS DE CONSULTA (/stats) ---
+
+// Medidas de una consulta hoja (un patrón o comando dentro del árbol booleano)
+struct LeafStats {
+	string query;
+	double parse_ms = 0, resources_ms = 0, match_ms = 0, lev_ms = 0;
+	size_t patterns = 0;      // líneas de patrón evaluadas
+	size_t scanned = 0;       // formas normalizadas examinadas
+	size_t rejected = 0;      // descartadas por las restricciones [..]
+	size_t memo_hits = 0, memo_misses = 0;
+	size_t results = 0;
+};
+
+struct QueryStats {
+	deque<LeafStats> leaves;  // deque: los punteros a hojas ya creadas siguen siendo válidos
+	double bool_ms = 0;       // combinación de conjuntos en evalBoolExpr
+};
+
+// Estadísticas que se están recogiendo en este hilo (nullptr = /stats desactivado)
+thread_local QueryStats* t_stats = nullptr;
+thread_local LeafStats* t_leaf = nullptr;
+// Contadores del memo de matchPattern; se leen por diferencia al terminar cada palabra
+thread_local size_t t_memo_hits = 0, t_memo_misses = 0;
+
+static double msSince(chrono::steady_clock::time_point t0) {
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+// Abre una hoja nueva mientras vive el objeto; las hojas anidadas no se solapan
+class LeafScope {
+public:
+	explicit LeafScope(const string& query) : prev(t_leaf) {
+		if (!t_stats || t_leaf) return;
+		t_stats->leaves.emplace_back();
+		t_stats->leaves.back().query = query;
+		t_leaf = &t_stats->leaves.back();
+		owner = true;
+	}
+	~LeafScope() { if (owner) t_leaf = prev; }
+	LeafStats* get() const { return owner ? t_leaf : nullptr; }
+	LeafScope(const LeafScope&) = delete;
+	LeafScope& operator=(const LeafScope&) = delete;
+private:
+	LeafStats* prev;
+	bool owner = false;
+};
 
 // --- UTILIDADES DE TEXTO ---
 
-string normalizeWord(const string& w) {
-	string res;
-	res.reserve(w.size());
-	for (size_t i = 0; i < w.size(); ) {
-		unsigned char c = w[i];
-		if (c < 128) {
-			if (c >= 'a' && c <= 'z') res += (char)toupper(c);
-			else if (c >= 'A' && c <= 'Z') res += c;
-			i++; continue;
+// Tablas de normalizeWord: byte ASCII → letra en mayúscula (0 = se descarta) y segundo byte
+// de las secuencias 0xC3 xx (0x80–0xBF) → letra, marcando las vocales con tilde
+struct NormTables {
+	char ascii[128] = {};
+	char latin[64] = {};
+	bool accented[64] = {};
+
+	NormTables() {
+		for (int c = 'A'; c <= 'Z'; c++) { ascii[c] = (char)c; ascii[c + 32] = (char)c; }
+		const char* letters = "AEIOUUN";
+		const unsigned char upper[] = { 0x81, 0x89, 0x8D, 0x93, 0x9A, 0x9C, 0x91 }; // Á É Í Ó Ú Ü Ñ
+		for (int k = 0; k < 7; k++) {
+			char m = letters[k] == 'N' ? '~' : letters[k];
+			latin[upper[k] - 0x80] = latin[upper[k] + 0x20 - 0x80] = m;
+			accented[upper[k] - 0x80] = accented[upper[k] + 0x20 - 0x80] = k < 5;
 		}
-		if ((unsigned char)c == 0xC3 && i + 1 < w.size()) {
-			unsigned char d = w[i + 1];
-			switch (d) {
-			case 0x81: case 0xA1: res += 'A'; break;
-			case 0x89: case 0xA9: res += 'E'; break;
-			case 0x8D: case 0xAD: res += 'I'; break;
-			case 0x93: case 0xB3: res += 'O'; break;
-			case 0x9A: case 0xBA: res += 'U'; break;
-			case 0x9C: case 0xBC: res += 'U'; break;
-			case 0x91: case 0xB1: res += '~'; break;
+	}
+};
+static const NormTables kNorm;
+
+// Si los próximos 16 bytes (32 con AVX2) son todos ASCII, escribe en 'out' sus letras en
+// mayúsculas, descartando el resto, y devuelve cuántos bytes ha consumido; en 'written',
+// cuántas letras ha escrito. Con algún byte >= 0x80 (tildes, Ñ), o sin SIMD, devuelve 0.
+// La clasificación es vectorial; un bloque mixto se compacta con su máscara de letras, sin
+// saltos (cada byte se escribe y solo avanza la salida si es letra).
+static inline size_t asciiLetterBlock(const unsigned char* p, size_t left, char* out, size_t& written) {
+#ifdef __AVX2__
+	if (left >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		if (_mm256_movemask_epi8(v) == 0) {
+			__m256i t = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+			__m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(t, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), t));
+			uint32_t m = (uint32_t)_mm256_movemask_epi8(letter);
+			__m256i up = _mm256_andnot_si256(_mm256_set1_epi8(0x20), v);
+			if (m == 0xFFFFFFFFu) {
+				_mm256_storeu_si256((__m256i*)out, up);
+				written = 32;
+				return 32;
 			}
-			i += 2; continue;
+			alignas(32) char tmp[32];
+			_mm256_store_si256((__m256i*)tmp, up);
+			size_t w = 0;
+			for (int j = 0; j < 32; j++) { out[w] = tmp[j]; w += (m >> j) & 1; }
+			written = w;
+			return 32;
+		}
+	}
+#endif
+#ifdef BUSCADOR_SSE2
+	if (left >= 16) {
+		// Con bit 5 a 1, una letra queda en 'a'..'z'; los bytes >= 0x80 se descartan antes
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		if (_mm_movemask_epi8(v) == 0) {
+			__m128i t = _mm_or_si128(v, _mm_set1_epi8(0x20));
+			__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(t, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(t, _mm_set1_epi8('z' + 1)));
+			unsigned m = (unsigned)_mm_movemask_epi8(letter);
+			__m128i up = _mm_andnot_si128(_mm_set1_epi8(0x20), v);
+			if (m == 0xFFFF) {
+				_mm_storeu_si128((__m128i*)out, up);
+				written = 16;
+				return 16;
+			}
+			alignas(16) char tmp[16];
+			_mm_store_si128((__m128i*)tmp, up);
+			size_t w = 0;
+			for (int j = 0; j < 16; j++) { out[w] = tmp[j]; w += (m >> j) & 1; }
+			written = w;
+			return 16;
+		}
+	}
+#endif
+	(void)p; (void)left; (void)out; (void)written;
+	return 0;
+}
+
+// Mayúsculas sin tildes (Ü → U, Ñ → ~), descartando todo lo que no sea letra. Si se indica
+// 'accent', devuelve ahí la posición en el resultado de la última vocal con tilde (-1 si no
+// hay), que es lo que necesita getStressPosition: así ambos comparten una sola decodificación.
+// Los bloques de 16 o 32 bytes sin tildes se procesan con SIMD (asciiLetterBlock); el resto,
+// byte a byte con las tablas. La mayoría de las entradas de un diccionario tienen menos de
+// 16 bytes y van enteras por las tablas: la ganancia que mide --microbench en palabras
+// sueltas viene de ellas, y el SIMD solo cuenta en textos largos (consultas, líneas de .txt).
+string normalizeWord(const string& w, int* accent = nullptr) {
+	size_t n = w.size(), i = 0, k = 0;
+	string res(n, '\0');
+	char* out = &res[0];
+	const unsigned char* p = (const unsigned char*)w.data();
+	int acc = -1;
+	while (i < n) {
+		size_t wrote = 0, blk = asciiLetterBlock(p + i, n - i, out + k, wrote);
+		if (blk) { i += blk; k += wrote; continue; }
+		// Hasta el final del bloque que no ha podido copiarse entero
+		for (size_t end = (std::min)(n, i + 16); i < end; ) {
+			unsigned char c = p[i];
+			if (c < 128) {
+				if (char m = kNorm.ascii[c]) out[k++] = m;
+				i++;
+			}
+			else if (c == 0xC3 && i + 1 < n) {
+				unsigned char d = p[i + 1];
+				if (d >= 0x80 && d <= 0xBF && kNorm.latin[d - 0x80]) {
+					if (kNorm.accented[d - 0x80]) acc = (int)k;
+					out[k++] = kNorm.latin[d - 0x80];
+				}
+				i += 2;
+			}
+			else i++;
 		}
-		i++;
 	}
+	res.resize(k);
+	if (accent) *accent = acc;
 	return res;
 }
 
@@ -222,40 +447,10 @@ vector<string> getSyllables(const string& word) {
 	return syllables;
 }
 
-// Devuelve la posición de la sílaba tónica contando desde la derecha (1=aguda, 2=llana, 3=esdrújula...)
-int getStressPosition(const string& raw) {
-	string norm;
-	int accent_norm_pos = -1;
-
-	for (size_t i = 0; i < raw.size(); ) {
-		unsigned char c = raw[i];
-		if (c < 128) {
-			if (c >= 'a' && c <= 'z') { norm += (char)toupper(c); i++; }
-			else if (c >= 'A' && c <= 'Z') { norm += c; i++; }
-			else i++;
-		}
-		else if (c == 0xC3 && i + 1 < raw.size()) {
-			unsigned char d = raw[i + 1];
-			char mapped = 0; bool accented = false;
-			switch (d) {
-			case 0x81: case 0xA1: mapped = 'A'; accented = true; break;
-			case 0x89: case 0xA9: mapped = 'E'; accented = true; break;
-			case 0x8D: case 0xAD: mapped = 'I'; accented = true; break;
-			case 0x93: case 0xB3: mapped = 'O'; accented = true; break;
-			case 0x9A: case 0xBA: mapped = 'U'; accented = true; break;
-			case 0x9C: case 0xBC: mapped = 'U'; break;
-			case 0x91: case 0xB1: mapped = '~'; break;
-			}
-			if (mapped) { if (accented) accent_norm_pos = (int)norm.size(); norm += mapped; }
-			i += 2;
-		}
-		else i++;
-	}
-
-	if (norm.empty()) return 2;
-	vector<string> syllables = getSyllables(norm);
+// Posición de la sílaba tónica contando desde la derecha (1=aguda, 2=llana, 3=esdrújula...)
+// a partir de la forma normalizada, sus sílabas y la vocal con tilde que da normalizeWord
+static int stressFromSyllables(const string& norm, const vector<string>& syllables, int accent_norm_pos) {
 	int n_syl = (int)syllables.size();
-
 	if (accent_norm_pos >= 0) {
 		int pos = 0;
 		for (int s = 0; s < n_syl; s++) {
@@ -272,13 +467,22 @@ int getStressPosition(const string& raw) {
 	return 1; // aguda
 }
 
+// Devuelve la posición de la sílaba tónica contando desde la derecha (1=aguda, 2=llana, 3=esdrújula...)
+int getStressPosition(const string& raw) {
+	int accent_norm_pos;
+	string norm = normalizeWord(raw, &accent_norm_pos);
+	if (norm.empty()) return 2;
+	return stressFromSyllables(norm, getSyllables(norm), accent_norm_pos);
+}
+
 // Devuelve el sufijo de rima (desde la vocal tónica) en forma normalizada
 string getRhymeSuffix(const string& raw) {
-	string norm = normalizeWord(raw);
+	int accent;
+	string norm = normalizeWord(raw, &accent);
 	if (norm.empty()) return "";
 	vector<string> syllables = getSyllables(norm);
 	int n_syl = (int)syllables.size();
-	int stress_pos = getStressPosition(raw); // 1=aguda, 2=llana...
+	int stress_pos = stressFromSyllables(norm, syllables, accent); // 1=aguda, 2=llana...
 	int stress_idx = n_syl - stress_pos;
 	if (stress_idx < 0) stress_idx = 0;
 	if (stress_idx >= n_syl) stress_idx = n_syl - 1;
@@ -294,6 +498,64 @@ string getRhymeSuffix(const string& raw) {
 	return suffix;
 }
 
+// Clave fonética de una palabra (español con seseo y yeísmo): dos palabras que suenan
+// igual tienen la misma clave. B/V → B; H muda; LL/Y → Y; C(E,I)/Z/S → S; C(A,O,U)/K/QU → K;
+// G(E,I)/J → J; GU(E,I) → G; CH → C; X → KS; W → U; Y al final de sílaba (rey, hoy) → I.
+// La ü se conserva hasta aquí para distinguir GÜE (se pronuncia la U) de GUE.
+string phoneticKey(const string& raw) {
+	string marked;
+	marked.reserve(raw.size());
+	for (size_t i = 0; i < raw.size(); i++) {
+		if ((unsigned char)raw[i] == 0xC3 && i + 1 < raw.size() && ((unsigned char)raw[i + 1] == 0xBC || (unsigned char)raw[i + 1] == 0x9C)) { marked += 'W'; i++; }
+		else marked += raw[i];
+	}
+	string s = normalizeWord(marked);
+
+	// Y al final de sílaba suena como I
+	if (s.find('Y') != string::npos) {
+		string t;
+		for (const string& syl : getSyllables(s)) {
+			t += syl;
+			if (!syl.empty() && syl.back() == 'Y') t.back() = 'I';
+		}
+		if (t.size() == s.size()) s = t;
+	}
+
+	string k;
+	k.reserve(s.size() + 2);
+	for (size_t i = 0; i < s.size(); i++) {
+		char c = s[i];
+		char n1 = i + 1 < s.size() ? s[i + 1] : '\0';
+		char n2 = i + 2 < s.size() ? s[i + 2] : '\0';
+		bool soft = n1 == 'E' || n1 == 'I';
+		switch (c) {
+		case 'H':
+			if (n1 == 'I' && isVowel(n2)) { k += 'Y'; i++; } // hierba = yerba
+			break;
+		case 'V': k += 'B'; break;
+		case 'Z': k += 'S'; break;
+		case 'C':
+			if (n1 == 'H') { k += 'C'; i++; }
+			else k += soft ? 'S' : 'K';
+			break;
+		case 'Q': k += 'K'; if (n1 == 'U') i++; break;
+		case 'G':
+			if (soft) k += 'J';
+			else if (n1 == 'U' && (n2 == 'E' || n2 == 'I')) { k += 'G'; i++; }
+			else k += 'G';
+			break;
+		case 'L':
+			if (n1 == 'L') { k += 'Y'; i++; }
+			else k += 'L';
+			break;
+		case 'X': k += "KS"; break;
+		case 'W': k += 'U'; break;
+		default: k += c;
+		}
+	}
+	return k;
+}
+
 
 int levenshtein(const string& a, const string& b, int max_d = INT_MAX) {
 	int m = (int)a.size(), n = (int)b.size();
@@ -316,463 +578,3409 @@ int levenshtein(const string& a, const string& b, int max_d = INT_MAX) {
 	return prev[n];
 }
 
+// --- POOL DE HILOS ---
+
+// Pool de hilos de tamaño fijo con una cola de tareas compartida
+class ThreadPool {
+public:
+	explicit ThreadPool(int n) {
+		for (int i = 0; i < n; i++) workers.emplace_back([this] { workerLoop(); });
+	}
+
+	~ThreadPool() {
+		{
+			lock_guard<mutex> lk(mtx);
+			stopping = true;
+		}
+		cv.notify_all();
+		for (auto& w : workers) w.join();
+	}
+
+	template <class F>
+	auto submit(F f) -> future<decltype(f())> {
+		using R = decltype(f());
+		auto task = make_shared<packaged_task<R()>>(move(f));
+		future<R> fut = task->get_future();
+		{
+			lock_guard<mutex> lk(mtx);
+			tasks.push_back([task] { (*task)(); });
+		}
+		cv.notify_one();
+		return fut;
+	}
+
+	int size() const { return (int)workers.size(); }
+
+private:
+	void workerLoop() {
+		while (true) {
+			function<void()> job;
+			{
+				unique_lock<mutex> lk(mtx);
+				cv.wait(lk, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty()) return;
+				job = move(tasks.front());
+				tasks.pop_front();
+			}
+			job();
+		}
+	}
+
+	vector<thread> workers;
+	deque<function<void()>> tasks;
+	mutex mtx;
+	condition_variable cv;
+	bool stopping = false;
+};
+
+// Límite de hilos de cálculo (--threads); 0 = todos los núcleos. Se lee al crear el pool.
+static int g_computeThreads = 0;
+
+// Hilos que calculan cada consulta: el límite de --threads o todos los núcleos
+static int computeThreads() {
+	return g_computeThreads > 0 ? g_computeThreads : (std::max)(1, (int)thread::hardware_concurrency());
+}
+
+// Pool compartido para repartir el trabajo de una misma consulta (se crea con el primer uso).
+// Quien llama a parallelFor también trabaja, así que el pool tiene un hilo menos que el límite.
+static ThreadPool& computePool() {
+	static ThreadPool pool((std::max)(0, computeThreads() - 1));
+	return pool;
+}
+
+// Ejecuta body(0), ..., body(n-1) entre el hilo que llama y el pool de cálculo. Cada hilo
+// toma el siguiente índice libre al terminar el anterior, de modo que las tareas largas no
+// dejan hilos parados. Como quien llama también consume índices, puede usarse desde dentro
+// de otra tarea del pool sin bloquearse. Propaga el presupuesto de la consulta a los hilos
+// y relanza la primera excepción. Con /stats activo se ejecuta en serie para que las
+// medidas queden en la hoja del hilo que llama.
+static void parallelFor(size_t n, const function<void(size_t)>& body) {
+	if (n <= 1 || t_stats) {
+		for (size_t i = 0; i < n; i++) body(i);
+		return;
+	}
+	struct Shared {
+		atomic<size_t> next{ 0 }, done{ 0 };
+		mutex m;
+		condition_variable cv;
+		exception_ptr err;
+	};
+	auto sh = make_shared<Shared>();
+	QueryBudget* budget = t_budget;
+	const function<void(size_t)>* fn = &body;
+	auto work = [sh, n, fn, budget]() {
+		QueryBudget* prev = t_budget;
+		t_budget = budget;
+		size_t i;
+		while ((i = sh->next++) < n) {
+			try { (*fn)(i); }
+			catch (...) { lock_guard<mutex> lk(sh->m); if (!sh->err) sh->err = current_exception(); }
+			if (++sh->done == n) { lock_guard<mutex> lk(sh->m); sh->cv.notify_all(); }
+		}
+		t_budget = prev;
+	};
+	ThreadPool& pool = computePool();
+	size_t helpers = (std::min)(n - 1, (size_t)pool.size());
+	for (size_t h = 0; h < helpers; h++) pool.submit(work);
+	work();
+	unique_lock<mutex> lk(sh->m);
+	sh->cv.wait(lk, [&] { return sh->done == n; });
+	if (sh->err) rethrow_exception(sh->err);
+}
+
 // --- GESTIÓN DE ARCHIVOS Y CACHÉ ---
 
+// Progreso de una carga de diccionario: la etapa actual y cuánto lleva de 'total'
+// (bytes del .txt, entradas del .bin o formas del índice). Lo consulta el REPL mientras espera.
+struct LoadProgress {
+	atomic<const char*> stage{ "" };
+	atomic<size_t> done{ 0 }, total{ 0 };
+
+	void begin(const char* s, size_t t) { done = 0; total = t; stage = s; }
+};
+
+static uint64_t fnv1a(const char* p, size_t n, uint64_t h = 1469598103934665603ULL) {
+	for (size_t i = 0; i < n; i++) { h ^= (unsigned char)p[i]; h *= 1099511628211ULL; }
+	return h;
+}
+
+// Caché .bin (enteros en el orden de bytes de la máquina):
+//   cabecera: "BPBIN\0\0\0", versión (u32), 0 (u32), entradas (u64), bytes del cuerpo (u64),
+//             suma de control del cuerpo (u64)
+//   cuerpo:   por entrada, longitud (u64) y texto del original y de la forma normalizada
+// Una caché de otra versión, cortada o con otra suma no se usa: se vuelve a leer el .txt.
+static const char kBinMagic[8] = { 'B', 'P', 'B', 'I', 'N', 0, 0, 0 };
+static const uint32_t kBinVersion = 1;
+
+struct BinHeader {
+	char magic[8];
+	uint32_t version, reserved;
+	uint64_t entries, bodyBytes, checksum;
+};
+
+// Se escribe en un temporal y se renombra: otra carga nunca ve una caché a medias
 void saveBinaryCache(const string& filename, const vector<string>& raw, const vector<string>& norm) {
-	ofstream out(filename, ios::binary);
-	size_t size = raw.size();
-	out.write((char*)&size, sizeof(size));
-	for (size_t i = 0; i < size; ++i) {
-		size_t r_len = raw[i].size(), n_len = norm[i].size();
-		out.write((char*)&r_len, sizeof(r_len));
-		out.write(raw[i].c_str(), r_len);
-		out.write((char*)&n_len, sizeof(n_len));
-		out.write(norm[i].c_str(), n_len);
+	string tmp = filename + ".tmp";
+	{
+		ofstream out(tmp, ios::binary | ios::trunc);
+		BinHeader head{};
+		memcpy(head.magic, kBinMagic, sizeof(head.magic));
+		head.version = kBinVersion;
+		head.entries = raw.size();
+		head.checksum = fnv1a("", 0);
+		out.write((const char*)&head, sizeof(head));
+		auto write = [&](const char* p, size_t bytes) {
+			out.write(p, (streamsize)bytes);
+			head.checksum = fnv1a(p, bytes, head.checksum);
+			head.bodyBytes += bytes;
+		};
+		for (size_t i = 0; i < raw.size(); ++i) {
+			uint64_t r_len = raw[i].size(), n_len = norm[i].size();
+			write((const char*)&r_len, sizeof(r_len));
+			write(raw[i].data(), raw[i].size());
+			write((const char*)&n_len, sizeof(n_len));
+			write(norm[i].data(), norm[i].size());
+		}
+		out.seekp(0);
+		out.write((const char*)&head, sizeof(head));
+		if (!out) { out.close(); error_code ec; fs::remove(tmp, ec); return; }
 	}
+	error_code ec;
+	fs::rename(tmp, filename, ec);
+	if (ec) fs::remove(tmp, ec);
 }
 
-bool loadBinaryCache(const string& filename, vector<string>& raw, vector<string>& norm) {
+// Devuelve false si no hay caché o si no es válida (ver kBinMagic); 'damaged' dice cuál
+bool loadBinaryCache(const string& filename, vector<string>& raw, vector<string>& norm, LoadProgress* prog = nullptr, bool* damaged = nullptr) {
 	ifstream in(filename, ios::binary);
 	if (!in) return false;
-	size_t size;
-	in.read((char*)&size, sizeof(size));
-	raw.resize(size); norm.resize(size);
-	for (size_t i = 0; i < size; ++i) {
-		size_t r_len, n_len;
-		in.read((char*)&r_len, sizeof(r_len)); raw[i].resize(r_len);
-		in.read(&raw[i][0], r_len);
-		in.read((char*)&n_len, sizeof(n_len)); norm[i].resize(n_len);
-		in.read(&norm[i][0], n_len);
+	if (damaged) *damaged = true;
+	BinHeader head{};
+	in.read((char*)&head, sizeof(head));
+	error_code ec;
+	uint64_t size = fs::file_size(filename, ec);
+	// Cada entrada ocupa al menos sus dos longitudes
+	if (!in || ec || memcmp(head.magic, kBinMagic, sizeof(head.magic)) != 0 || head.version != kBinVersion
+		|| size - sizeof(head) != head.bodyBytes || head.entries > head.bodyBytes / (2 * sizeof(uint64_t))) return false;
+	string body((size_t)head.bodyBytes, '\0');
+	if (!in.read(&body[0], (streamsize)body.size()) || fnv1a(body.data(), body.size()) != head.checksum) return false;
+
+	size_t entries = (size_t)head.entries, pos = 0;
+	raw.resize(entries); norm.resize(entries);
+	if (prog) prog->begin("leyendo caché", entries);
+	auto get = [&](string& s) {
+		uint64_t len;
+		if (body.size() - pos < sizeof(len)) return false;
+		memcpy(&len, body.data() + pos, sizeof(len));
+		pos += sizeof(len);
+		if (body.size() - pos < len) return false;
+		s.assign(body, pos, (size_t)len);
+		pos += (size_t)len;
+		return true;
+	};
+	for (size_t i = 0; i < entries; ++i) {
+		if (prog && (i & 4095) == 0) prog->done = i;
+		if (!get(raw[i]) || !get(norm[i])) { raw.clear(); norm.clear(); return false; }
 	}
+	if (pos != body.size()) { raw.clear(); norm.clear(); return false; }
+	if (damaged) *damaged = false;
 	return true;
 }
 
-void listDictionaries() {
+// 'resident': los que ya están en memoria (se activan sin volver a cargarlos)
+void listDictionaries(const vector<string>& resident) {
 	cout << "\nDiccionarios disponibles (.txt):" << endl;
 	bool found = false;
 	for (const auto& entry : fs::directory_iterator(".")) {
-		if (entry.path().extension() == ".txt") {
-			cout << " - " << entry.path().stem().string() << endl;
+		auto ext = entry.path().extension();
+		bool shd = fs::exists(fs::path(entry.path()).replace_extension(".shd"));
+		// Los .shd se listan junto a su .txt o, si no lo tienen, solos
+		if (ext == ".txt" || (ext == ".shd" && !fs::exists(fs::path(entry.path()).replace_extension(".txt")))) {
+			string name = entry.path().stem().string();
+			bool loaded = find(resident.begin(), resident.end(), name) != resident.end();
+			cout << " - " << name << (shd ? " (fragmentado, .shd)" : "") << (loaded ? " (en memoria)" : "") << endl;
 			found = true;
 		}
 	}
 	if (!found) cout << " (No se encontraron archivos .txt)" << endl;
 }
 
-bool loadDictionary(string name, vector<string>& raw, vector<string>& norm) {
+// Lee el .txt de una vez, lo corta en trozos por saltos de línea y normaliza los trozos en
+// paralelo. Cada trozo se une después en su sitio, así que el orden es el de las líneas del
+// fichero (las vacías se omiten, como al leer con getline).
+static bool ingestText(const string& txtFile, vector<string>& raw, vector<string>& norm, LoadProgress* prog) {
+	ifstream file(txtFile, ios::binary);
+	if (!file) return false;
+	string text;
+	file.seekg(0, ios::end);
+	text.resize((size_t)(std::max)((streamoff)0, (streamoff)file.tellg()));
+	file.seekg(0);
+	if (!file.read(&text[0], (streamsize)text.size())) return false;
+	if (prog) prog->begin("normalizando", text.size());
+
+	const size_t kChunk = 1 << 20;
+	vector<size_t> cut(1, 0);
+	while (cut.back() < text.size()) {
+		size_t nl = text.find('\n', (std::min)(cut.back() + kChunk, text.size()) - 1);
+		cut.push_back(nl == string::npos ? text.size() : nl + 1);
+	}
+	size_t chunks = cut.size() - 1;
+	vector<vector<string>> rawPart(chunks), normPart(chunks);
+	parallelFor(chunks, [&](size_t c) {
+		for (size_t i = cut[c]; i < cut[c + 1]; ) {
+			size_t e = text.find('\n', i);
+			if (e == string::npos || e > cut[c + 1]) e = cut[c + 1];
+			size_t len = e - i;
+			if (len > 0 && text[e - 1] == '\r') len--; // finales de línea de Windows
+			if (len > 0) {
+				rawPart[c].emplace_back(text, i, len);
+				normPart[c].push_back(normalizeWord(rawPart[c].back()));
+			}
+			i = e + 1;
+		}
+		if (prog) prog->done += cut[c + 1] - cut[c];
+	});
+
+	vector<size_t> at(chunks + 1, 0);
+	for (size_t c = 0; c < chunks; c++) at[c + 1] = at[c] + rawPart[c].size();
+	raw.resize(at[chunks]);
+	norm.resize(at[chunks]);
+	parallelFor(chunks, [&](size_t c) {
+		move(rawPart[c].begin(), rawPart[c].end(), raw.begin() + at[c]);
+		move(normPart[c].begin(), normPart[c].end(), norm.begin() + at[c]);
+	});
+	return true;
+}
+
+// Si se indica 'cacheWrite', el .bin se escribe en otro hilo mientras sigue la carga: quien
+// llama debe esperar al futuro antes de modificar o mover 'raw' y 'norm'.
+bool loadDictionary(string name, vector<string>& raw, vector<string>& norm, ostream& log = cout, LoadProgress* prog = nullptr,
+	future<void>* cacheWrite = nullptr) {
 	string txtFile = name + ".txt";
 	string binFile = name + ".bin";
 	raw.clear(); norm.clear();
 
-	cout << "Cargando '" << name << "'... ";
-	if (!loadBinaryCache(binFile, raw, norm)) {
-		ifstream file(txtFile);
-		if (!file) { cout << "\nError: no se encontró el archivo '" << txtFile << "'\n"; return false; }
-		string line;
-		while (getline(file, line)) {
-			if (!line.empty()) {
-				raw.push_back(line);
-				norm.push_back(normalizeWord(line));
-			}
-		}
-		saveBinaryCache(binFile, raw, norm);
+	log << "Cargando '" << name << "'... ";
+	bool damaged = false;
+	if (!loadBinaryCache(binFile, raw, norm, prog, &damaged)) {
+		if (damaged) log << "('" << binFile << "' no es válido; se vuelve a generar) ";
+		if (!ingestText(txtFile, raw, norm, prog)) { log << "\nError: no se encontró el archivo '" << txtFile << "'\n"; return false; }
+		if (cacheWrite) *cacheWrite = async(launch::async, [binFile, &raw, &norm] { saveBinaryCache(binFile, raw, norm); });
+		else saveBinaryCache(binFile, raw, norm);
 	}
-	cout << "[OK] " << norm.size() << " palabras cargadas.\n";
+	log << "[OK] " << norm.size() << " palabras cargadas.\n";
 	return true;
 }
 
-// --- LÓGICA DE BÚSQUEDA ---
+// --- DICCIONARIO ACTIVO ---
+
+// Histogramas del diccionario con los que se estima qué restricciones descartan más palabras.
+// Cada histograma cuenta palabras por valor; el último cubo agrupa los valores mayores.
+struct DictStats {
+	static const int kMaxBucket = 31;
+	size_t words = 0;
+	vector<size_t> lenHist, vowelHist, consHist;
+	vector<vector<size_t>> letterHist;  // letra → apariciones en la palabra → nº de palabras
+	vector<size_t> bigramDocs;          // bigrama (b1 * 256 + b2) → nº de palabras que lo contienen
+	vector<size_t> sylHist, stressHist; // sobre una muestra de 'sampled' palabras
+	size_t sampled = 0;
+};
 
-void parseInput(string input, vector<PatternElement>& elems, vector<ResourceCondition>& resources, int& tolerance, bool& is_total, bool* parse_error = nullptr) {
-	input.erase(0, input.find_first_not_of(" "));
-	input.erase(input.find_last_not_of(" ") + 1);
+// Calcula los histogramas al cargar. Sílabas y acento se estiman con una muestra uniforme
+// de hasta 20000 palabras para no alargar la carga de diccionarios grandes.
+static void buildDictStats(DictStats& st, const vector<string>& norm, const vector<string>& raw) {
+	const int B = DictStats::kMaxBucket;
+	st = DictStats();
+	st.words = norm.size();
+	st.lenHist.assign(B + 1, 0); st.vowelHist.assign(B + 1, 0); st.consHist.assign(B + 1, 0);
+	st.letterHist.assign(256, vector<size_t>(B + 1, 0));
+	st.bigramDocs.assign(256 * 256, 0);
+	st.sylHist.assign(B + 1, 0); st.stressHist.assign(B + 1, 0);
+
+	vector<int> cnt(256, 0);
+	vector<size_t> lastSeen(256 * 256, SIZE_MAX);
+	for (size_t i = 0; i < norm.size(); i++) {
+		const string& w = norm[i];
+		int v = 0, c = 0;
+		for (char ch : w) {
+			cnt[(unsigned char)ch]++;
+			if (isVowel(ch)) v++;
+			if (isConsonant(ch)) c++;
+		}
+		st.lenHist[(std::min)((int)w.size(), B)]++;
+		st.vowelHist[(std::min)(v, B)]++;
+		st.consHist[(std::min)(c, B)]++;
+		for (char ch : w) {
+			int& n = cnt[(unsigned char)ch];
+			if (n) { st.letterHist[(unsigned char)ch][(std::min)(n, B)]++; n = 0; }
+		}
+		for (size_t k = 0; k + 1 < w.size(); k++) {
+			size_t bg = (unsigned char)w[k] * 256 + (unsigned char)w[k + 1];
+			if (lastSeen[bg] != i) { lastSeen[bg] = i; st.bigramDocs[bg]++; }
+		}
+	}
 
-	string p_str = input, r_str = "";
-	tolerance = 0;
-	is_total = false;
+	for (auto& h : st.letterHist) {
+		size_t present = 0;
+		for (int k = 1; k <= B; k++) present += h[k];
+		h[0] = st.words - present;
+	}
 
-	size_t b_start = input.find('[');
-	if (b_start != string::npos) {
-		size_t b_end = input.find(']', b_start);
-		if (b_end != string::npos) {
-			p_str = input.substr(0, b_start);
-			r_str = input.substr(b_start + 1, b_end - b_start - 1);
-			string rem = input.substr(b_end + 1);
-			rem.erase(0, rem.find_first_not_of(" "));
-			if (!rem.empty()) {
-				if (rem.back() == '*') { is_total = true; rem.pop_back(); }
-				if (!rem.empty() && all_of(rem.begin(), rem.end(), [](unsigned char ch) { return isdigit(ch); }))
-					tolerance = safeStoi(rem);
-				else is_total = false;
+	size_t step = (std::max)((size_t)1, norm.size() / 20000);
+	for (size_t i = 0; i < norm.size(); i += step) {
+		st.sylHist[(std::min)((int)getSyllables(norm[i]).size(), B)]++;
+		st.stressHist[(std::min)((std::max)(getStressPosition(raw[i]), 0), B)]++;
+		st.sampled++;
+	}
+}
+
+// Posición y tamaño de una sección del fichero .idx, con su suma de control (FNV-1a)
+struct IdxSection { uint64_t offset = 0, bytes = 0, checksum = 0; };
+
+// Columnas e índices derivados del diccionario, guardados en NOMBRE.idx (ver loadDictIndex).
+// Las secciones se leen la primera vez que un comando las pide; mientras tanto solo se
+// conoce su posición en el fichero. 'path' vacío: índice solo en memoria (ya calculado).
+struct DictIndex {
+	enum Section { FORMS, SYLLABLES, STRESS, PHONETIC, SECTION_COUNT };
+	string path;
+	uint64_t hash = 0;                      // huella de las entradas de las que se calculó
+	IdxSection sec[SECTION_COUNT];
+	mutex mtx;                              // protege la carga perezosa de las secciones
+	bool ready[SECTION_COUNT] = {};
+	vector<uint8_t> syllables, stress;      // nº de sílabas y posición de la tónica por entrada (255 = calcular)
+	unordered_map<string, vector<uint32_t>> phonIdx; // clave fonética → entradas, en orden
+};
+
+// Bit de una letra normalizada: A-Z, Ñ ('~') y un cubo común para el resto
+static int letterBit(char c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	return c == '~' ? 26 : 27;
+}
+
+static uint32_t letterMask(const string& w) {
+	uint32_t m = 0;
+	for (char c : w) m |= 1u << letterBit(c);
+	return m;
+}
+
+// --- MODO COMPACTO Y DICCIONARIOS FRAGMENTADOS ---
+//
+// Con --compact las entradas y las formas normalizadas se guardan con codificación por
+// prefijos (front coding) en bloques de kPackBlock cadenas: la primera de cada bloque va
+// entera y cada una de las demás como la longitud del prefijo que comparte con la anterior
+// (1 byte) y el resto (longitud en varint y texto). Las formas van en orden alfabético para
+// que compartan prefijos largos, y de cada bloque se guardan sus longitudes mínima y máxima
+// y las letras que aparecen en él: un recorrido puede descartar el bloque sin descomprimirlo.
+//
+// Un diccionario compacto es un solo fragmento en memoria. Uno fragmentado (NOMBRE.shd,
+// ver openShardFile) tiene muchos, que se leen del fichero proyectado en memoria, y cada
+// fragmento resume también sus longitudes y letras para saltarlo entero.
+
+static const size_t kPackBlock = 16;
+
+// Longitudes mínima y máxima y letras presentes (ver letterMask) de un bloque o fragmento
+struct PackedBlock {
+	uint8_t min_len = 255, max_len = 0;
+	uint16_t unused = 0;   // relleno explícito: se guarda tal cual en NOMBRE.shd
+	uint32_t mask = 0;
+
+	void add(const string& w) {
+		uint8_t len = (uint8_t)(std::min)(w.size(), (size_t)255);
+		min_len = (std::min)(min_len, len);
+		max_len = (std::max)(max_len, len);
+		mask |= letterMask(w);
+	}
+	void merge(const PackedBlock& b) {
+		min_len = (std::min)(min_len, b.min_len);
+		max_len = (std::max)(max_len, b.max_len);
+		mask |= b.mask;
+	}
+};
+
+// Lista comprimida de solo lectura, en memoria o proyectada desde un fichero
+struct FrontCodedView {
+	const char* bytes = nullptr;
+	const uint64_t* blockStart = nullptr;   // desplazamiento de cada bloque en 'bytes' (de 64 bits: pueden pasar de 4 GiB)
+	size_t count = 0;
+
+	size_t blocks() const { return (count + kPackBlock - 1) / kPackBlock; }
+
+	// Descomprime el bloque b en 's' llamando a fn(índice, cadena) hasta que devuelve false
+	template <typename Fn> bool forBlock(size_t b, string& s, Fn&& fn) const {
+		size_t pos = blockStart[b];
+		s.clear();
+		for (size_t i = b * kPackBlock; i < (std::min)(count, (b + 1) * kPackBlock); i++) {
+			size_t common = (unsigned char)bytes[pos++], n = 0;
+			for (int shift = 0; ; shift += 7) {
+				unsigned char c = bytes[pos++];
+				n |= (size_t)(c & 127) << shift;
+				if (!(c & 128)) break;
 			}
+			s.resize((std::min)(common, s.size()));
+			s.append(bytes + pos, n);
+			pos += n;
+			if (!fn(i, (const string&)s)) return false;
 		}
+		return true;
 	}
-	else {
-		size_t last_space = input.find_last_of(" ");
-		if (last_space != string::npos) {
-			string rem = input.substr(last_space + 1);
-			if (!rem.empty()) {
-				bool local_is_total = false;
-				if (rem.back() == '*') { local_is_total = true; rem.pop_back(); }
-				if (!rem.empty() && all_of(rem.begin(), rem.end(), [](unsigned char ch) { return isdigit(ch); })) {
-					tolerance = safeStoi(rem);
-					is_total = local_is_total;
-					p_str = input.substr(0, last_space);
+	// Comprueba una lista leída de un fichero: que cada bloque empieza y termina dentro de sus
+	// 'byteCount' bytes y que cada prefijo común cabe en la cadena anterior
+	bool valid(size_t byteCount) const {
+		for (size_t b = 0; b < blocks(); b++) {
+			size_t pos = blockStart[b], prev = 0;
+			for (size_t i = b * kPackBlock; i < (std::min)(count, (b + 1) * kPackBlock); i++) {
+				if (pos >= byteCount) return false;
+				size_t common = (unsigned char)bytes[pos++], n = 0;
+				if (common > prev) return false;
+				for (int shift = 0; ; shift += 7) {
+					if (pos >= byteCount || shift > 28) return false;
+					unsigned char c = bytes[pos++];
+					n |= (size_t)(c & 127) << shift;
+					if (!(c & 128)) break;
 				}
+				if (n > byteCount - pos) return false;
+				pos += n;
+				prev = common + n;
 			}
 		}
+		return true;
 	}
-
-	for (size_t i = 0; i < p_str.length(); ++i) {
-		char c = p_str[i];
-		if (c == '*') elems.push_back({ ANY, 1, 1, 0 });
-		else if (c == '.') elems.push_back({ ANY, 0, 99, 0 });
-		else if (c == '(') {
-			size_t j = p_str.find(')', i);
-			if (j == string::npos) break;
-			string inside = p_str.substr(i + 1, j - i - 1);
-			auto parts = split(inside, ',');
-			// Validate: a range spec has up to 3 parts: digits, digits, V|C
-			bool valid_range = (parts.size() <= 3);
-			if (valid_range && !parts.empty() && !parts[0].empty())
-				valid_range = all_of(parts[0].begin(), parts[0].end(), [](unsigned char ch) { return isdigit(ch); });
-			if (valid_range && parts.size() >= 2 && !parts[1].empty())
-				valid_range = all_of(parts[1].begin(), parts[1].end(), [](unsigned char ch) { return isdigit(ch); });
-			if (valid_range && parts.size() >= 3 && !parts[2].empty())
-				valid_range = (parts[2] == "V" || parts[2] == "C");
-			if (!valid_range) {
-				if (parse_error) *parse_error = true;
-				elems.clear();
-				break;
-			}
-			int min_c = (parts.size() > 0 && !parts[0].empty()) ? safeStoi(parts[0]) : 0;
-			int max_c = (parts.size() > 1 && !parts[1].empty()) ? safeStoi(parts[1]) : 99;
-			ElementType type = ANY;
-			if (parts.size() > 2 && !parts[2].empty()) {
-				if (parts[2] == "V") type = VOWEL;
-				else if (parts[2] == "C") type = CONSONANT;
-			}
-			elems.push_back({ type, min_c, max_c, 0 });
-			i = j;
+	string get(size_t i) const {
+		string s, out;
+		forBlock(i / kPackBlock, s, [&](size_t k, const string& w) { if (k == i) out = w; return k < i; });
+		return out;
+	}
+	// Posición de 'key' en una lista ordenada o SIZE_MAX: búsqueda binaria por la primera
+	// cadena de cada bloque y, dentro del bloque, lineal
+	size_t find(const string& key) const {
+		string s;
+		auto firstOf = [&](size_t b) { forBlock(b, s, [](size_t, const string&) { return false; }); return s; };
+		size_t lo = 0, hi = blocks();
+		while (hi - lo > 1) {
+			size_t mid = (lo + hi) / 2;
+			if (firstOf(mid) <= key) lo = mid; else hi = mid;
 		}
-		else if (isalpha((unsigned char)c) || c == '~') {
-			elems.push_back({ EXACT, 1, 1, (char)toupper((unsigned char)c) });
+		size_t found = SIZE_MAX;
+		if (hi > lo) forBlock(lo, s, [&](size_t i, const string& w) { if (w == key) found = i; return w < key; });
+		return found;
+	}
+};
+
+// Lista comprimida en construcción: push() en orden y finish() al terminar
+struct FrontCoded {
+	string bytes;
+	vector<uint64_t> blockStart;
+	size_t count = 0;
+	string last;                   // última cadena añadida
+
+	void push(const string& s) {
+		size_t common = 0;
+		if (count % kPackBlock == 0) blockStart.push_back(bytes.size());
+		else while (common < 255 && common < s.size() && common < last.size() && s[common] == last[common]) common++;
+		bytes += (char)common;
+		for (size_t n = s.size() - common; ; n >>= 7) {
+			bytes += (char)((n & 127) | (n >= 128 ? 128 : 0));
+			if (n < 128) break;
 		}
+		bytes.append(s, common, string::npos);
+		last = s;
+		count++;
 	}
+	void finish() { string().swap(last); bytes.shrink_to_fit(); blockStart.shrink_to_fit(); }
+	FrontCodedView view() const { return { bytes.data(), blockStart.data(), count }; }
+};
 
-	if (!r_str.empty())
-		resources = parseConditionList(r_str);
+// Fichero proyectado en memoria, de solo lectura
+struct MappedFile {
+	const char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE, mapping = NULL;
+	~MappedFile() {
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	}
+	void willNeed(const char*, size_t) const {}
+#else
+	~MappedFile() { if (data) munmap((void*)data, size); }
+	// Pide al sistema que lea por adelantado [p, p + n)
+	void willNeed(const char* p, size_t n) const {
+		uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE), a = (uintptr_t)p & ~(page - 1);
+		madvise((void*)a, (uintptr_t)p + n - a, MADV_WILLNEED);
+	}
+#endif
+};
+
+static shared_ptr<MappedFile> mapFile(const string& path) {
+	auto m = make_shared<MappedFile>();
+#ifdef _WIN32
+	m->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m->file == INVALID_HANDLE_VALUE) return nullptr;
+	LARGE_INTEGER sz;
+	if (!GetFileSizeEx(m->file, &sz) || sz.QuadPart == 0) return nullptr;
+	m->size = (size_t)sz.QuadPart;
+	m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!m->mapping) return nullptr;
+	m->data = (const char*)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m->data) return nullptr;
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return nullptr;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return nullptr; }
+	void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return nullptr;
+	m->data = (const char*)p;
+	m->size = (size_t)st.st_size;
+#endif
+	return m;
 }
 
-int checkResources(const string& word, const string& raw_word, const vector<ResourceCondition>& resources) {
-	if (resources.empty()) return 0;
-	int v_count = 0, c_count = 0, l_count[256] = { 0 };
-	for (char c : word) {
-		if (isVowel(c)) v_count++;
-		if (isConsonant(c)) c_count++;
-		l_count[(unsigned char)c]++;
+// Fragmento de un diccionario comprimido: sus formas, en orden alfabético, con las variantes
+// de cada una, y las entradas [entryBase, entryBase + raws.count) en orden de diccionario
+struct PackedShard {
+	FrontCodedView forms, raws;
+	const PackedBlock* blocks = nullptr;     // resumen de cada bloque de 'forms'
+	const uint32_t* formStart = nullptr;     // variantes de la forma local f: formIds[formStart[f], formStart[f + 1])
+	const uint32_t* formIds = nullptr;       // índices de entrada globales
+	FrontCodedView keys;                     // claves fonéticas ordenadas (solo en NOMBRE.shd)
+	const uint32_t* keyStart = nullptr;      // entradas de la clave k: keyIds[keyStart[k], keyStart[k + 1])
+	const uint32_t* keyIds = nullptr;
+	size_t entryBase = 0, formBase = 0;
+	PackedBlock summary;                     // de todas sus formas
+	const char* body = nullptr;              // zona del fichero que ocupa (para leerla por adelantado)
+	size_t bodyBytes = 0;
+};
+
+// Diccionario comprimido: un fragmento en memoria (compactDict) o los de NOMBRE.shd
+struct PackedDict {
+	vector<PackedShard> shards;
+	size_t entries = 0, forms = 0;
+	const uint8_t* syllables = nullptr, * stress = nullptr; // columnas de NOMBRE.shd
+	// Datos propios del modo compacto
+	FrontCoded formText, rawText;
+	vector<PackedBlock> blockInfo;
+	vector<uint32_t> formStart, formIds;
+	shared_ptr<MappedFile> file;             // NOMBRE.shd
+
+	size_t shardOfEntry(size_t i) const {
+		return (size_t)(partition_point(shards.begin(), shards.end(), [&](const PackedShard& s) { return s.entryBase <= i; }) - shards.begin()) - 1;
 	}
+	size_t shardOfForm(size_t f) const {
+		return (size_t)(partition_point(shards.begin(), shards.end(), [&](const PackedShard& s) { return s.formBase <= f; }) - shards.begin()) - 1;
+	}
+	string raw(size_t i) const { const PackedShard& s = shards[shardOfEntry(i)]; return s.raws.get(i - s.entryBase); }
+};
 
-	int total_errors = 0;
-	for (const auto& res : resources) {
-		int val = 0;
-		if (res.target == "V*") val = v_count;
-		else if (res.target == "C*") val = c_count;
-		else if (res.target == "S*") val = (int)getSyllables(word).size();
-		else if (res.target == "T*") val = getStressPosition(raw_word);
-		else if (res.target == "") val = (int)word.length();
-		else if (res.target.size() == 1) val = l_count[(unsigned char)res.target[0]];
+struct Dict;
+
+// Cambios de /add y /remove sobre un diccionario que ya no cambia (ver CAMBIOS
+// INCREMENTALES). Las entradas añadidas siguen a las de 'base' y las formas nuevas, a las
+// suyas. Una capa compartida no se modifica: cada cambio se hace en una copia, que ocupa
+// lo que ocupan los cambios y no lo que ocupa el diccionario.
+struct DictOverlay {
+	shared_ptr<const Dict> base;                     // sin comprimir y sin capa
+	size_t baseEntries = 0, baseForms = 0;
+	vector<string> raw, norm;                        // entradas añadidas: baseEntries + k
+	unordered_set<uint32_t> removed;                 // entradas quitadas desde 'base'
+	vector<string> forms;                            // formas nuevas: baseForms + k
+	unordered_map<string, uint32_t> normToForm;      // forma normalizada → forma nueva
+	map<int, vector<uint32_t>> formsByLen;           // formas nuevas por longitud
+	map<uint32_t, vector<uint32_t>> variants;        // forma que ha cambiado → todas sus variantes (también las quitadas)
+	unordered_map<string, vector<uint32_t>> phonIdx; // clave fonética que ha cambiado → sus entradas
+	vector<string> ops;                              // cambios aplicados, en orden (ver adoptFolded)
+};
+
+// Diccionario cargado junto con las estructuras auxiliares que usan los comandos.
+// Comprimido (modo compacto o NOMBRE.shd), 'dictionary', 'raw_dict', la tabla de formas y
+// las tablas de /calembour quedan vacías y todo se lee de 'packed'. Con una capa de cambios
+// (ver DictOverlay), las entradas están en overlay->base y aquí solo quedan el nombre, los
+// histogramas y el número de entradas quitadas.
+struct Dict {
+	string name;
+	vector<string> dictionary, raw_dict;        // formas normalizadas y originales
+	unordered_map<string, uint32_t> normToForm; // forma normalizada → su forma
+	map<int, vector<uint32_t>> formsByLen;      // longitud → formas de esa longitud
+	DictStats stats;                            // histogramas para ordenar restricciones
+	vector<uint32_t> formStart, formIds;        // formas distintas (ver buildFormTable)
+	shared_ptr<DictIndex> index;                // secciones del .idx (ver loadDictIndex)
+	shared_ptr<const PackedDict> packed;        // diccionario comprimido
+	vector<bool> removed;                       // entradas quitadas con /remove fuera de 'overlay' (vacío: ninguna)
+	size_t removedCount = 0;                    // todas las quitadas, también las de 'overlay'
+	shared_ptr<DictOverlay> overlay;            // cambios sin compactar (ver prepareUpdates)
+
+	size_t size() const { return overlay ? overlay->baseEntries + overlay->raw.size() : packed ? packed->entries : raw_dict.size(); }
+	size_t liveCount() const { return size() - removedCount; } // sin las quitadas con /remove
+	size_t formCount() const {
+		if (overlay) return overlay->baseForms + overlay->forms.size();
+		return packed ? packed->forms : formStart.empty() ? 0 : formStart.size() - 1;
+	}
+	// Solo sin comprimir; para recorrer las formas en cualquier caso, forEachForm
+	const string& formWord(size_t f) const {
+		if (overlay) return f < overlay->baseForms ? overlay->base->formWord(f) : overlay->forms[f - overlay->baseForms];
+		return dictionary[formIds[formStart[f]]];
+	}
+	string raw(size_t i) const { return packed ? packed->raw(i) : scanRaw(i); }
+	string norm(size_t i) const {
+		if (overlay) return i < overlay->baseEntries ? overlay->base->dictionary[i] : overlay->norm[i - overlay->baseEntries];
+		return packed ? normalizeWord(packed->raw(i)) : dictionary[i];
+	}
+	// Texto original para checkRestrictions en los recorridos. Comprimido no se descomprime:
+	// T* se lee siempre de la columna precalculada (ver attachColumns).
+	const string& scanRaw(size_t i) const {
+		static const string none;
+		if (overlay) return i < overlay->baseEntries ? overlay->base->raw_dict[i] : overlay->raw[i - overlay->baseEntries];
+		return packed ? none : raw_dict[i];
+	}
+	bool isRemoved(size_t i) const {
+		if (!removedCount) return false;
+		if (overlay) return overlay->removed.count((uint32_t)i) || (i < overlay->baseEntries && overlay->base->isRemoved(i));
+		return removed[i];
+	}
+};
+
+// Marcas de las entradas quitadas con /remove, una por entrada
+static vector<bool> removedMask(const Dict& d) {
+	if (!d.overlay) return d.removed;
+	vector<bool> m = d.overlay->base->removed;
+	m.resize(d.size(), false);
+	for (uint32_t i : d.overlay->removed) m[i] = true;
+	return m;
+}
+
+// Variantes de las formas sin comprimir sin las entradas quitadas con /remove: las de la
+// capa de cambios para las formas que ha tocado y, para el resto, las de la tabla de formas.
+// Las formas se piden en orden creciente a partir de la última llamada a seek.
+struct LiveVariants {
+	const Dict& d;
+	const Dict& base;
+	map<uint32_t, vector<uint32_t>>::const_iterator next, end;
+	vector<uint32_t> buf;
+
+	explicit LiveVariants(const Dict& dict, size_t from = 0) : d(dict), base(dict.overlay ? *dict.overlay->base : dict) { seek(from); }
+	void seek(size_t f) {
+		if (!d.overlay) return;
+		next = d.overlay->variants.lower_bound((uint32_t)(std::min)(f, (size_t)UINT32_MAX));
+		end = d.overlay->variants.end();
+	}
+	// Variantes [v0, v1) de la forma f (copiadas en 'buf' si hay alguna quitada). Devuelve
+	// false si no le queda ninguna.
+	bool get(size_t f, const uint32_t*& v0, const uint32_t*& v1) {
+		bool changed = false;
+		if (d.overlay) {
+			while (next != end && next->first < f) ++next;
+			changed = next != end && next->first == f;
+		}
+		if (changed) {
+			v0 = next->second.data();
+			v1 = v0 + next->second.size();
+		}
 		else {
-			// Subcadena: contar ocurrencias de res.target en word
-			size_t pos = 0;
-			while ((pos = word.find(res.target, pos)) != string::npos) { val++; pos++; }
+			v0 = base.formIds.data() + base.formStart[f];
+			v1 = base.formIds.data() + base.formStart[f + 1];
 		}
+		// Las quitadas de una forma que no ha cambiado son todas de la base
+		const Dict& owner = changed ? d : base;
+		if (!owner.removedCount) return true;
+		buf.clear();
+		for (const uint32_t* v = v0; v < v1; v++)
+			if (!owner.isRemoved(*v)) buf.push_back(*v);
+		v0 = buf.data();
+		v1 = v0 + buf.size();
+		return !buf.empty();
+	}
+};
 
-		if (res.op == "==") total_errors += abs(val - res.num);
-		else if (res.op == ">=") total_errors += (val < res.num) ? res.num - val : 0;
-		else if (res.op == "<=") total_errors += (val > res.num) ? val - res.num : 0;
-		else if (res.op == ">") total_errors += (val <= res.num) ? (res.num + 1) - val : 0;
-		else if (res.op == "<") total_errors += (val >= res.num) ? val - (res.num - 1) : 0;
+// Recorre las formas [from, to) llamando a fn(f, forma, v0, v1), con sus variantes en
+// [v0, v1), hasta que devuelve false. Comprimido, descomprime bloque a bloque y salta los
+// fragmentos y bloques para los que skip(resumen) es true; de NOMBRE.shd, además, pide al
+// sistema el fragmento siguiente mientras recorre el actual.
+template <typename Skip, typename Fn>
+static void forEachForm(const Dict& d, size_t from, size_t to, Skip&& skip, Fn&& fn) {
+	if (!d.packed) {
+		LiveVariants live(d, from);
+		const uint32_t *v0, *v1;
+		for (size_t f = from; f < to; f++)
+			if (live.get(f, v0, v1) && !fn(f, d.formWord(f), v0, v1)) return;
+		return;
+	}
+	const PackedDict& p = *d.packed;
+	string s;
+	for (size_t k = p.shardOfForm(from); k < p.shards.size() && p.shards[k].formBase < to; k++) {
+		const PackedShard& sh = p.shards[k];
+		if (sh.forms.count == 0 || skip(sh.summary)) continue;
+		if (p.file && k + 1 < p.shards.size()) p.file->willNeed(p.shards[k + 1].body, p.shards[k + 1].bodyBytes);
+		size_t lo = (std::max)(from, sh.formBase) - sh.formBase, hi = (std::min)(to - sh.formBase, sh.forms.count);
+		for (size_t b = lo / kPackBlock; b * kPackBlock < hi; b++) {
+			if (skip(sh.blocks[b])) continue;
+			bool more = sh.forms.forBlock(b, s, [&](size_t lf, const string& w) {
+				return lf < lo || (lf < hi && fn(sh.formBase + lf, w, sh.formIds + sh.formStart[lf], sh.formIds + sh.formStart[lf + 1]));
+			});
+			if (!more) return;
+		}
 	}
-	return total_errors;
 }
 
-bool matchPattern(const string& word, int w_idx, const vector<PatternElement>& elems, int e_idx, int err_left) {
-	if (err_left < 0) return false;
-	if (e_idx == (int)elems.size()) return (int)word.length() - w_idx <= err_left;
-	if (memo_buffer[w_idx][e_idx][err_left] != -1) return memo_buffer[w_idx][e_idx][err_left] == 1;
+static bool noSkip(const PackedBlock&) { return false; }
 
-	const auto& E = elems[e_idx];
-	bool matched = false;
-	int max_l = (E.max_count > 50) ? (int)word.length() - w_idx : E.max_count + err_left;
+// Lo mismo para las entradas [from, to) del diccionario, con su texto original
+template <typename Fn>
+static void forEachEntry(const Dict& d, size_t from, size_t to, Fn&& fn) {
+	if (!d.packed) {
+		for (size_t i = from; i < to; i++) fn(i, d.scanRaw(i));
+		return;
+	}
+	const PackedDict& p = *d.packed;
+	string s;
+	for (size_t k = p.shardOfEntry(from); k < p.shards.size() && p.shards[k].entryBase < to; k++) {
+		const PackedShard& sh = p.shards[k];
+		size_t lo = (std::max)(from, sh.entryBase) - sh.entryBase, hi = (std::min)(to - sh.entryBase, sh.raws.count);
+		for (size_t b = lo / kPackBlock; b * kPackBlock < hi; b++)
+			sh.raws.forBlock(b, s, [&](size_t li, const string& r) { if (li >= lo && li < hi) fn(sh.entryBase + li, r); return li + 1 < hi; });
+	}
+}
 
-	for (int L = 0; w_idx + L <= (int)word.length() && L <= max_l; ++L) {
-		int c_err = 0;
-		int m_chars = (std::min)(L, E.max_count);
-		int extra = (L > E.max_count) ? L - E.max_count : 0;
-		int miss = (L < E.min_count) ? E.min_count - L : 0;
+// Forma de un diccionario sin comprimir cuya forma normalizada es 'norm', o SIZE_MAX
+static size_t findForm(const Dict& d, const string& norm) {
+	if (d.overlay) {
+		auto it = d.overlay->normToForm.find(norm);
+		return it != d.overlay->normToForm.end() ? it->second : findForm(*d.overlay->base, norm);
+	}
+	auto it = d.normToForm.find(norm);
+	return it == d.normToForm.end() ? SIZE_MAX : it->second;
+}
 
-		for (int i = 0; i < m_chars; ++i) {
-			char c = word[w_idx + i];
-			if (E.type == EXACT && c != E.exact_char) c_err++;
-			else if (E.type == VOWEL && !isVowel(c)) c_err++;
-			else if (E.type == CONSONANT && !isConsonant(c)) c_err++;
-		}
-		if (c_err + extra + miss <= err_left) {
-			if (matchPattern(word, w_idx + L, elems, e_idx + 1, err_left - (c_err + extra + miss))) {
-				matched = true; break;
-			}
+// Primera entrada (en orden de diccionario) con la forma normalizada 'norm', o SIZE_MAX
+static size_t findEntry(const Dict& d, const string& norm) {
+	if (!d.packed) {
+		size_t f = findForm(d, norm);
+		if (f == SIZE_MAX) return SIZE_MAX;
+		LiveVariants live(d, f);
+		const uint32_t *v0, *v1;
+		return live.get(f, v0, v1) ? *v0 : SIZE_MAX;
+	}
+	PackedBlock key;
+	key.add(norm);
+	for (const PackedShard& sh : d.packed->shards) {
+		if (key.min_len < sh.summary.min_len || key.max_len > sh.summary.max_len || (key.mask & ~sh.summary.mask)) continue;
+		size_t lf = sh.forms.find(norm);
+		if (lf != SIZE_MAX) return sh.formIds[sh.formStart[lf]];
+	}
+	return SIZE_MAX;
+}
+
+// Recorre las formas de longitud [lo, hi] como forEachForm: sin comprimir, en orden de
+// longitud y de primera aparición; comprimido, en el orden de los fragmentos saltando los
+// bloques que no tienen ninguna.
+template <typename Fn>
+static void forEachFormOfLen(const Dict& d, int lo, int hi, Fn&& fn) {
+	if (!d.packed) {
+		LiveVariants live(d);
+		const uint32_t *v0, *v1;
+		auto visit = [&](const vector<uint32_t>& forms) {
+			if (!forms.empty()) live.seek(forms[0]);
+			for (uint32_t f : forms)
+				if (live.get(f, v0, v1) && !fn(f, d.formWord(f), v0, v1)) return false;
+			return true;
+		};
+		// De cada longitud, las formas de la base y después las nuevas de la capa de cambios
+		const map<int, vector<uint32_t>> none;
+		const auto& baseLens = live.base.formsByLen;
+		const auto& newLens = d.overlay ? d.overlay->formsByLen : none;
+		auto a = baseLens.lower_bound(lo), b = newLens.lower_bound(lo);
+		while (true) {
+			bool moreA = a != baseLens.end() && a->first <= hi, moreB = b != newLens.end() && b->first <= hi;
+			if (!moreA && !moreB) return;
+			int len = moreA && (!moreB || a->first <= b->first) ? a->first : b->first;
+			if (moreA && a->first == len && !visit((a++)->second)) return;
+			if (moreB && b->first == len && !visit((b++)->second)) return;
 		}
 	}
-	return (memo_buffer[w_idx][e_idx][err_left] = matched ? 1 : 0);
+	forEachForm(d, 0, d.formCount(), [&](const PackedBlock& b) { return b.max_len < lo || b.min_len > hi; },
+		[&](size_t f, const string& w, const uint32_t* v0, const uint32_t* v1) { return (int)w.size() < lo || (int)w.size() > hi || fn(f, w, v0, v1); });
 }
 
-// --- MOTOR DE CONSULTAS BOOLEANAS ---
+// Reconstruye las estructuras para /calembour a partir de la tabla de formas
+static void buildCalLookup(Dict& d) {
+	d.normToForm.clear();
+	d.formsByLen.clear();
+	if (d.packed) return;
+	d.normToForm.reserve(d.formCount());
+	for (size_t f = 0; f < d.formCount(); f++) {
+		d.normToForm.emplace(d.formWord(f), (uint32_t)f);
+		d.formsByLen[(int)d.formWord(f).size()].push_back((uint32_t)f);
+	}
+}
 
-// Devuelve true si s tiene operadores booleanos en el nivel 0 (fuera de () y [])
-static bool hasBoolOps(const string& s) {
-	int dp = 0, db = 0;
-	for (size_t i = 0; i < s.size(); i++) {
-		if (s[i] == '[') { db++; continue; }
-		if (s[i] == ']') { if (db > 0) db--; continue; }
-		if (db > 0) continue;
-		if (s[i] == '(') { dp++; continue; }
-		if (s[i] == ')') { if (dp > 0) dp--; continue; }
-		if (dp > 0) continue;
-		if (s[i] == '!') return true;
-		if (i + 1 < s.size() && s[i] == '&' && s[i + 1] == '&') return true;
-		if (i + 1 < s.size() && s[i] == '|' && s[i + 1] == '|') return true;
-		if (s[i] == '-' && i > 0 && s[i - 1] == ' ' && i + 1 < s.size() && s[i + 1] == ' ') return true;
+// Agrupa las entradas que comparten forma normalizada (como/cómo, esta/está/Está) para
+// evaluar cada forma una sola vez. Las variantes de la forma f son los índices
+// formIds[formStart[f], formStart[f + 1]), en orden creciente; las formas van en el orden
+// de su primera aparición.
+static void buildFormTable(Dict& d) {
+	unordered_map<string_view, uint32_t> idx;
+	idx.reserve(d.dictionary.size());
+	vector<uint32_t> formOf(d.dictionary.size());
+	vector<uint32_t> counts;
+	for (size_t i = 0; i < d.dictionary.size(); i++) {
+		auto it = idx.emplace(d.dictionary[i], (uint32_t)counts.size());
+		if (it.second) counts.push_back(0);
+		formOf[i] = it.first->second;
+		counts[formOf[i]]++;
 	}
-	return false;
+	d.formStart.assign(counts.size() + 1, 0);
+	for (size_t f = 0; f < counts.size(); f++) d.formStart[f + 1] = d.formStart[f] + counts[f];
+	d.formIds.resize(d.dictionary.size());
+	vector<uint32_t> pos(d.formStart.begin(), d.formStart.end() - 1);
+	for (size_t i = 0; i < formOf.size(); i++) d.formIds[pos[formOf[i]]++] = (uint32_t)i;
 }
 
-// Ejecuta una consulta hoja y devuelve un bitmask sobre el diccionario
-static vector<bool> runLeafQuery(
-	string input,
-	const vector<string>& dictionary,
-	const vector<string>& raw_dict,
-	const unordered_map<string, string>& normToRaw,
-	const map<int, vector<string>>& dictByLen,
-	ostream* vout = nullptr
-) {
-	vector<bool> matched(dictionary.size(), false);
-	input.erase(0, input.find_first_not_of(" \t\r\n"));
-	{ size_t l = input.find_last_not_of(" \t\r\n"); if (l != string::npos) input.erase(l + 1); }
-	for (char& c : input) if (c == '\\') c = '/';
-	if (input.empty()) return matched;
+// Índice clave fonética → entradas para /homophone (las claves se calculan en paralelo)
+static void buildPhoneticIndex(const Dict& d, unordered_map<string, vector<uint32_t>>& idx) {
+	const size_t kChunk = 16384;
+	size_t n = d.size();
+	vector<string> keys(n);
+	parallelFor((n + kChunk - 1) / kChunk, [&](size_t c) {
+		forEachEntry(d, c * kChunk, (std::min)(n, (c + 1) * kChunk), [&](size_t i, const string& r) { keys[i] = phoneticKey(r); });
+	});
+	idx.clear();
+	for (size_t i = 0; i < n; i++) idx[keys[i]].push_back((uint32_t)i);
+}
 
-	string inputLine = input;
-	vector<string> patterns_to_run;
+// --- ÍNDICE PERSISTENTE (.idx) ---
+//
+// Formato (enteros en el orden de bytes de la máquina, secciones alineadas a 8 bytes para
+// poder proyectarlas en memoria tal cual):
+//   cabecera: "BPIDX\0\0\0", versión (u32), nº de secciones (u32), huella (u64), entradas (u64)
+//   tabla:    por sección, desplazamiento, tamaño y suma de control (3 × u64)
+//   FORMS:     nº de formas + 1 (u32), formStart (u32 × F+1), formIds (u32 × N)
+//   SYLLABLES: u8 × N        STRESS: u8 × N
+//   PHONETIC:  nº de claves K (u32), inicio de cada clave en el texto (u32 × K+1),
+//              inicio de sus entradas (u32 × K+1), entradas (u32 × N), texto de las claves
+// Un fichero de otra versión, de otro diccionario o más corto que su tabla se regenera.
+
+static const char kIdxMagic[8] = { 'B', 'P', 'I', 'D', 'X', 0, 0, 0 };
+static const uint32_t kIdxVersion = 1; // cambiarla si cambia el formato o el cálculo de alguna sección
+
+// Huella de las entradas del diccionario (texto original, en orden)
+static uint64_t dictHash(const vector<string>& raw) {
+	uint64_t h = fnv1a("", 0);
+	for (const string& r : raw) { h = fnv1a(r.data(), r.size(), h); h = fnv1a("\n", 1, h); }
+	return h;
+}
 
-	// /rd: quitar el prefijo n, tratar el resto como consulta
-	{
-		bool isRd_ = (input.size() >= 7 && input.substr(0, 7) == "/random") ||
-			(input.size() >= 3 && input.substr(0, 3) == "/rd" && (input.size() == 3 || input[3] == ' '));
-		if (isRd_) {
-			string rest = (input.substr(0, 7) == "/random") ? input.substr(7) : input.substr(3);
-			rest.erase(0, rest.find_first_not_of(" "));
-			size_t sp = rest.find(' ');
-			string first = (sp != string::npos) ? rest.substr(0, sp) : rest;
-			bool fn = !first.empty() && all_of(first.begin(), first.end(), [](unsigned char c) { return isdigit(c); });
-			inputLine = fn ? rest.substr(sp + 1) : rest;
-			if (inputLine.empty()) inputLine = ".";
-			// Si la línea empieza directamente por '[', no hay patrón: añadir '.'
-			if (!inputLine.empty() && inputLine[0] == '[') inputLine = ". " + inputLine;
-			input = inputLine;
+template <typename T> static void putPod(string& out, const T& v) { out.append((const char*)&v, sizeof(T)); }
+template <typename T> static void putArray(string& out, const vector<T>& v) { out.append((const char*)v.data(), v.size() * sizeof(T)); }
+
+// Lee un array de 'count' elementos en 'pos' si cabe dentro de la sección
+template <typename T> static bool getArray(const string& in, size_t& pos, size_t count, vector<T>& v) {
+	if (count > (in.size() - pos) / sizeof(T)) return false;
+	v.resize(count);
+	memcpy(v.data(), in.data() + pos, count * sizeof(T));
+	pos += count * sizeof(T);
+	return true;
+}
+
+static uint8_t columnValue(int v) { return (uint8_t)(v >= 0 && v < 255 ? v : 255); }
+
+// Calcula las secciones perezosas en memoria (lo que se guardaría en el fichero)
+static void computeIndexColumns(const Dict& d, DictIndex& idx, LoadProgress* prog = nullptr) {
+	size_t n = d.size();
+	idx.syllables.assign(n, 255);
+	idx.stress.assign(n, 255);
+	const size_t kChunk = 16384, forms = d.formCount();
+	if (prog) prog->begin("generando índice", forms + n);
+	// Trozos de formas en paralelo: cada entrada pertenece a una sola forma
+	parallelFor((forms + kChunk - 1) / kChunk, [&](size_t c) {
+		size_t end = (std::min)(forms, (c + 1) * kChunk);
+		forEachForm(d, c * kChunk, end, noSkip, [&](size_t, const string& w, const uint32_t* v0, const uint32_t* v1) {
+			uint8_t syl = columnValue((int)getSyllables(w).size());
+			for (const uint32_t* v = v0; v < v1; ++v) idx.syllables[*v] = syl;
+			return true;
+		});
+		if (prog) prog->done += end - c * kChunk;
+	});
+	// La tónica depende de las tildes: se calcula por entrada
+	parallelFor((n + kChunk - 1) / kChunk, [&](size_t c) {
+		size_t end = (std::min)(n, (c + 1) * kChunk);
+		forEachEntry(d, c * kChunk, end, [&](size_t i, const string& r) { idx.stress[i] = columnValue(getStressPosition(r)); });
+		if (prog) prog->done += end - c * kChunk;
+	});
+	if (prog) prog->begin("claves fonéticas", 0);
+	buildPhoneticIndex(d, idx.phonIdx);
+	for (int s = 0; s < DictIndex::SECTION_COUNT; s++) idx.ready[s] = true;
+}
+
+static string encodeSection(const Dict& d, const DictIndex& idx, int s) {
+	string out;
+	if (s == DictIndex::FORMS) {
+		putPod(out, (uint32_t)d.formStart.size());
+		putArray(out, d.formStart);
+		putArray(out, d.formIds);
+	}
+	else if (s == DictIndex::SYLLABLES) putArray(out, idx.syllables);
+	else if (s == DictIndex::STRESS) putArray(out, idx.stress);
+	else {
+		// Claves en orden para que el fichero no dependa del orden de la tabla hash
+		vector<const pair<const string, vector<uint32_t>>*> keys;
+		for (const auto& kv : idx.phonIdx) keys.push_back(&kv);
+		sort(keys.begin(), keys.end(), [](auto a, auto b) { return a->first < b->first; });
+		vector<uint32_t> keyStart(1, 0), idStart(1, 0), ids;
+		string text;
+		for (auto kv : keys) {
+			text += kv->first;
+			ids.insert(ids.end(), kv->second.begin(), kv->second.end());
+			keyStart.push_back((uint32_t)text.size());
+			idStart.push_back((uint32_t)ids.size());
 		}
+		putPod(out, (uint32_t)keys.size());
+		putArray(out, keyStart);
+		putArray(out, idStart);
+		putArray(out, ids);
+		out += text;
 	}
+	return out;
+}
 
-	// /cal: devuelve conjunto de palabras individuales de las divisiones
-	{
-		bool isCal_ = (input.size() >= 10 && input.substr(0, 10) == "/calembour") ||
-			(input.size() >= 4 && input.substr(0, 4) == "/cal" && (input.size() == 4 || input[4] == ' '));
-		if (isCal_) {
-			string rest = (input.substr(0, 10) == "/calembour") ? input.substr(10) : input.substr(4);
-			rest.erase(0, rest.find_first_not_of(" "));
-			int cal_n = 0; string cal_word = rest, cal_restr = "";
-			size_t bs = rest.find('[');
-			if (bs != string::npos) {
-				size_t be = rest.find(']', bs);
-				if (be != string::npos) {
-					cal_word = rest.substr(0, bs);
-					cal_restr = rest.substr(bs + 1, be - bs - 1);
-					string rem = rest.substr(be + 1); rem.erase(0, rem.find_first_not_of(" "));
-					if (!rem.empty() && all_of(rem.begin(), rem.end(), [](unsigned char c) { return isdigit(c); })) cal_n = safeStoi(rem);
-				}
-			}
-			else {
-				size_t lsp = rest.find_last_of(" ");
-				if (lsp != string::npos) {
-					string pn = rest.substr(lsp + 1);
-					if (!pn.empty() && all_of(pn.begin(), pn.end(), [](unsigned char c) { return isdigit(c); })) { cal_n = safeStoi(pn); cal_word = rest.substr(0, lsp); }
-				}
-			}
-			cal_word.erase(remove(cal_word.begin(), cal_word.end(), ' '), cal_word.end());
-			string normCal = normalizeWord(cal_word);
-			if (normCal.empty() || (int)normCal.size() > 20) return matched;
+// Interpreta la sección FORMS ya leída y comprobada; false si no cuadra con el diccionario
+static bool decodeForms(Dict& d, const string& in) {
+	size_t n = d.dictionary.size(), pos = 0;
+	vector<uint32_t> count, start, ids;
+	if (!getArray(in, pos, 1, count) || count[0] == 0 || !getArray(in, pos, count[0], start) || !getArray(in, pos, n, ids)
+		|| pos != in.size()) return false;
+	if (start.front() != 0 || start.back() != n || !is_sorted(start.begin(), start.end())) return false;
+	if (any_of(ids.begin(), ids.end(), [&](uint32_t i) { return i >= n; })) return false;
+	d.formStart = move(start);
+	d.formIds = move(ids);
+	return true;
+}
 
-			vector<ResourceCondition> cal_res = parseConditionList(cal_restr);
+// Lo mismo para las secciones perezosas de un diccionario de 'n' entradas
+static bool decodeSection(size_t n, DictIndex& idx, int s, const string& in) {
+	size_t pos = 0;
+	if (s == DictIndex::SYLLABLES) return in.size() == n && getArray(in, pos, n, idx.syllables);
+	if (s == DictIndex::STRESS) return in.size() == n && getArray(in, pos, n, idx.stress);
+	vector<uint32_t> count, keyStart, idStart, ids;
+	if (!getArray(in, pos, 1, count)) return false;
+	if (!getArray(in, pos, (size_t)count[0] + 1, keyStart) || !getArray(in, pos, (size_t)count[0] + 1, idStart)
+		|| !getArray(in, pos, n, ids)) return false;
+	string text = in.substr(pos);
+	if (keyStart.back() != text.size() || idStart.back() != n) return false;
+	idx.phonIdx.clear();
+	idx.phonIdx.reserve(count[0]);
+	for (uint32_t k = 0; k < count[0]; k++) {
+		if (keyStart[k] > keyStart[k + 1] || idStart[k] > idStart[k + 1]) return false;
+		if (any_of(ids.begin() + idStart[k], ids.begin() + idStart[k + 1], [&](uint32_t i) { return i >= n; })) return false;
+		idx.phonIdx.emplace(text.substr(keyStart[k], keyStart[k + 1] - keyStart[k]),
+			vector<uint32_t>(ids.begin() + idStart[k], ids.begin() + idStart[k + 1]));
+	}
+	return true;
+}
 
-			int L = (int)normCal.size();
-			vector<vector<pair<int, string>>> best(L, vector<pair<int, string>>(L + 1, make_pair(INT_MAX, string(""))));
-			for (int i = 0; i < L; i++) for (int j = i + 1; j <= L; j++) {
-				string part = normCal.substr(i, j - i); int plen = (int)part.size();
-				auto it = normToRaw.find(part);
-				if (it != normToRaw.end()) {
-					if (cal_res.empty() || checkResources(part, it->second, cal_res) == 0) best[i][j] = make_pair(0, it->second);
-					continue;
-				}
-				if (cal_n == 0) continue;
-				int be = cal_n + 1; string bw = "";
-				for (int len = (std::max)(1, plen - cal_n); len <= plen + cal_n; len++) {
-					auto il = dictByLen.find(len); if (il == dictByLen.end()) continue;
-					for (const string& w : il->second) {
-						if (!cal_res.empty() && checkResources(w, normToRaw.at(w), cal_res) > 0) continue;
-						int d = levenshtein(part, w, be - 1);
-						if (d < be) { be = d; bw = normToRaw.at(w); if (be == 0) break; }
-					}
-					if (be == 0) break;
-				}
-				if (be <= cal_n) best[i][j] = make_pair(be, bw);
-			}
-
-			// Construir mapa norma→índice
-			unordered_map<string, size_t> normToIdx;
-			for (size_t i = 0; i < dictionary.size(); i++)
-				if (!normToIdx.count(dictionary[i])) normToIdx[dictionary[i]] = i;
-
-			// Colectar todas las divisiones válidas y marcar palabras
-			vector<vector<pair<string, int>>> cal_all;
-			std::function<void(int, int, vector<pair<string, int>>&)> cs =
-				[&](int pos, int err_left, vector<pair<string, int>>& cur) {
-				if (pos == L) { if ((int)cur.size() >= 2) cal_all.push_back(cur); return; }
-				for (int end = pos + 1; end <= L; end++) {
-					int berr = best[pos][end].first;
-					if (berr == INT_MAX || berr > err_left) continue;
-					cur.push_back(make_pair(best[pos][end].second, berr));
-					cs(end, err_left - berr, cur);
-					cur.pop_back();
-				}
-				};
-			vector<pair<string, int>> curt; cs(0, cal_n, curt);
+// Escribe el índice completo en un fichero temporal y lo renombra, para que nadie lea uno a medias
+static bool writeDictIndex(const Dict& d, DictIndex& idx) {
+	const int S = DictIndex::SECTION_COUNT;
+	string body[S];
+	for (int s = 0; s < S; s++) body[s] = encodeSection(d, idx, s);
+	string head(kIdxMagic, sizeof(kIdxMagic));
+	putPod(head, kIdxVersion);
+	putPod(head, (uint32_t)S);
+	putPod(head, idx.hash);
+	putPod(head, (uint64_t)d.dictionary.size());
+	uint64_t off = head.size() + S * sizeof(IdxSection);
+	for (int s = 0; s < S; s++) {
+		off = (off + 7) & ~(uint64_t)7;
+		idx.sec[s] = { off, body[s].size(), fnv1a(body[s].data(), body[s].size()) };
+		putPod(head, idx.sec[s]);
+		off += body[s].size();
+	}
 
-			for (size_t si = 0; si < cal_all.size(); si++)
-				for (size_t sj = 0; sj < cal_all[si].size(); sj++) {
-					string n2 = normalizeWord(cal_all[si][sj].first);
-					auto it2 = normToIdx.find(n2);
-					if (it2 != normToIdx.end()) matched[it2->second] = true;
-				}
-			return matched;
+	string tmp = idx.path + ".tmp";
+	{
+		ofstream out(tmp, ios::binary | ios::trunc);
+		if (!out) return false;
+		out.write(head.data(), head.size());
+		uint64_t at = head.size();
+		for (int s = 0; s < S; s++) {
+			out.write("\0\0\0\0\0\0\0", idx.sec[s].offset - at);
+			out.write(body[s].data(), body[s].size());
+			at = idx.sec[s].offset + body[s].size();
 		}
+		if (!out) { out.close(); error_code ec; fs::remove(tmp, ec); return false; }
 	}
+	error_code ec;
+	fs::rename(tmp, idx.path, ec);
+	if (ec) { fs::remove(tmp, ec); return false; }
+	return true;
+}
 
-	// /ang y /par
-	{
-		bool isAn_ = (input.size() >= 8 && input.substr(0, 8) == "/anagram") ||
-			(input.size() >= 4 && input.substr(0, 4) == "/ang" && (input.size() == 4 || input[4] == ' '));
-		bool isPar_ = (input.size() >= 12 && input.substr(0, 12) == "/paronomasia") ||
-			(input.size() >= 4 && input.substr(0, 4) == "/par" && (input.size() == 4 || input[4] == ' '));
-		if (isAn_ || isPar_) {
-			string rest;
-			if (isAn_) rest = (input.size() >= 8 && input.substr(0, 8) == "/anagram") ? input.substr(8) : input.substr(4);
-			else       rest = (input.size() >= 12 && input.substr(0, 12) == "/paronomasia") ? input.substr(12) : input.substr(4);
-			rest.erase(0, rest.find_first_not_of(" "));
+// Lee la sección 's' del fichero y comprueba su suma de control
+static bool readSection(const DictIndex& idx, int s, string& out) {
+	ifstream in(idx.path, ios::binary);
+	if (!in) return false;
+	out.resize(idx.sec[s].bytes);
+	in.seekg((streamoff)idx.sec[s].offset);
+	if (!in.read(&out[0], (streamsize)out.size())) return false;
+	return fnv1a(out.data(), out.size()) == idx.sec[s].checksum;
+}
 
-			auto [word, extra_r, tol_str] = extractWordRestrTol(rest);
-			string nw = normalizeWord(word);
-			if (isAn_) {
-				if (!tol_str.empty()) { string tmp = tol_str; if (tmp.back() == '*') tmp.pop_back(); if (all_of(tmp.begin(), tmp.end(), [](unsigned char c) {return isdigit(c);})) tol_str = tmp + "*"; }
-				map<char, int> cnt; for (char c : nw) cnt[c]++;
-				string exp = ". [";
-				for (auto it = cnt.begin(); it != cnt.end(); ++it) exp += to_string(it->second) + it->first + ",";
-				exp += to_string(nw.length());
-				if (!extra_r.empty()) exp += "," + extra_r;
-				exp += "] " + tol_str;
-				inputLine = exp;
-			}
-			else {
-				// Construir el esqueleto consonántico: las consonantes quedan en su
-				// posición y cada vocal (o grupo de vocales) se sustituye por *.
-				// Ejemplo: COCHE -> C*CH* [2V*]
-				string pat = ""; int vow = 0; string cgrp = "";
-				for (char c : nw) {
-					if (isVowel(c)) { pat += cgrp + "*"; cgrp = ""; vow++; }
-					else cgrp += c;
-				}
-				pat += cgrp; // consonantes finales sin vocal siguiente
-				string exp = pat + " [" + to_string(vow) + "V*";
-				if (!extra_r.empty()) exp += "," + extra_r;
-				exp += "] " + tol_str;
-				inputLine = exp;
-			}
-		}
+// Lee la cabecera y la tabla de secciones; false si el fichero no corresponde a 'd'
+static bool readIndexHeader(const Dict& d, DictIndex& idx) {
+	ifstream in(idx.path, ios::binary);
+	if (!in) return false;
+	char magic[8];
+	uint32_t version = 0, sections = 0;
+	uint64_t hash = 0, entries = 0;
+	in.read(magic, sizeof(magic));
+	in.read((char*)&version, sizeof(version));
+	in.read((char*)&sections, sizeof(sections));
+	in.read((char*)&hash, sizeof(hash));
+	in.read((char*)&entries, sizeof(entries));
+	if (!in || memcmp(magic, kIdxMagic, sizeof(magic)) != 0 || version != kIdxVersion || sections != DictIndex::SECTION_COUNT
+		|| hash != idx.hash || entries != d.dictionary.size()) return false;
+	in.read((char*)idx.sec, sizeof(idx.sec));
+	if (!in) return false;
+	error_code ec;
+	uint64_t size = fs::file_size(idx.path, ec);
+	if (ec) return false;
+	for (const IdxSection& sec : idx.sec)
+		if (sec.offset > size || sec.bytes > size - sec.offset) return false; // fichero incompleto
+	return true;
+}
+
+// Prepara el índice de un diccionario recién cargado. Si 'path' tiene un índice válido para
+// estas entradas, lee la tabla de formas (la usan todas las búsquedas) y deja el resto de
+// secciones para cuando se pidan; si no, calcula todas las secciones y reescribe el fichero.
+// Con 'path' vacío el índice se calcula solo en memoria.
+static void loadDictIndex(Dict& d, const string& path, ostream& log, LoadProgress* prog = nullptr) {
+	auto idx = make_shared<DictIndex>();
+	idx->path = path;
+	idx->hash = dictHash(d.raw_dict);
+	string forms;
+	if (!path.empty() && readIndexHeader(d, *idx) && readSection(*idx, DictIndex::FORMS, forms)
+		&& decodeForms(d, forms)) {
+		idx->ready[DictIndex::FORMS] = true;
+		d.index = idx;
+		return;
 	}
+	if (!path.empty()) log << "Generando índice '" << path << "'... ";
+	buildFormTable(d);
+	computeIndexColumns(d, *idx, prog);
+	if (!path.empty()) {
+		if (prog) prog->begin("guardando índice", 0);
+		if (writeDictIndex(d, *idx)) log << "[OK]\n";
+		else { log << "no se pudo escribir; se usa solo en memoria.\n"; idx->path.clear(); }
+	}
+	d.index = idx;
+}
 
-	// /ans
-	{
-		bool isAns_ = (input.size() >= 12 && input.substr(0, 12) == "/anasyllabic") ||
-			(input.size() >= 4 && input.substr(0, 4) == "/ans" && (input.size() == 4 || input[4] == ' '));
-		if (isAns_) {
-			string rest = (input.size() >= 12 && input.substr(0, 12) == "/anasyllabic") ? input.substr(12) : input.substr(4);
-			rest.erase(0, rest.find_first_not_of(" "));
-			auto [word, extra_r, tol_str] = extractWordRestrTol(rest);
-			string nw = normalizeWord(word);
-			vector<string> syl = getSyllables(nw); sort(syl.begin(), syl.end());
-			do {
-				string p = ""; for (const string& s2 : syl) p += s2;
-				if (!extra_r.empty()) p += " [" + extra_r + "]";
-				if (!tol_str.empty()) p += " " + tol_str;
-				patterns_to_run.push_back(p);
-			} while (next_permutation(syl.begin(), syl.end()));
-		}
+// Devuelve la sección 's' del índice, leyéndola del fichero la primera vez. Si la sección
+// está dañada se calcula en memoria y se borra el fichero para regenerarlo en la próxima carga.
+static DictIndex& indexSection(const Dict& d, int s) {
+	DictIndex& idx = *d.index;
+	lock_guard<mutex> lk(idx.mtx);
+	if (idx.ready[s]) return idx;
+	string bytes;
+	if (!readSection(idx, s, bytes) || !decodeSection(d.size(), idx, s, bytes)) {
+		error_code ec;
+		fs::remove(idx.path, ec);
+		DictIndex fresh;
+		computeIndexColumns(d, fresh);
+		idx.syllables = move(fresh.syllables);
+		idx.stress = move(fresh.stress);
+		idx.phonIdx = move(fresh.phonIdx);
+		for (int k = 0; k < DictIndex::SECTION_COUNT; k++) idx.ready[k] = true;
 	}
+	idx.ready[s] = true;
+	return idx;
+}
 
-	// /aso y /con (rima asonante / consonante)
-	{
-		bool isAso_ = (input.size() >= 9 && input.substr(0, 9) == "/assonant") ||
-			(input.size() >= 4 && input.substr(0, 4) == "/aso" && (input.size() == 4 || input[4] == ' '));
-		bool isCon_ = (input.size() >= 10 && input.substr(0, 10) == "/consonant") ||
-			(input.size() >= 4 && input.substr(0, 4) == "/con" && (input.size() == 4 || input[4] == ' '));
-		if (isAso_ || isCon_) {
-			int plen;
-			if (isAso_) plen = (input.size() >= 9 && input.substr(0, 9) == "/assonant") ? 9 : 4;
-			else        plen = (input.size() >= 10 && input.substr(0, 10) == "/consonant") ? 10 : 4;
+// Columnas por entrada: las de NOMBRE.shd o las secciones del .idx. Con una capa de cambios,
+// las de la base: las entradas añadidas no tienen (ver columnEntries).
+static const uint8_t* syllableColumn(const Dict& d) {
+	if (d.overlay) return syllableColumn(*d.overlay->base);
+	if (d.packed && d.packed->syllables) return d.packed->syllables;
+	return indexSection(d, DictIndex::SYLLABLES).syllables.data();
+}
+static const uint8_t* stressColumn(const Dict& d) {
+	if (d.overlay) return stressColumn(*d.overlay->base);
+	if (d.packed && d.packed->stress) return d.packed->stress;
+	return indexSection(d, DictIndex::STRESS).stress.data();
+}
+static size_t columnEntries(const Dict& d) { return d.overlay ? d.overlay->baseEntries : d.size(); }
+
+// El índice fonético de NOMBRE.shd va por fragmentos, con las claves ordenadas; el de los
+// demás diccionarios es la sección PHONETIC del .idx.
+static bool hasShardKeys(const Dict& d) { return d.packed && d.packed->file; }
+
+// Llama a fn(v0, v1) con las entradas [v0, v1) que tienen exactamente la clave 'key'
+template <typename Fn>
+static void forPhoneticKey(const Dict& d, const string& key, Fn&& fn) {
+	if (d.overlay) {
+		auto it = d.overlay->phonIdx.find(key);
+		if (it == d.overlay->phonIdx.end()) forPhoneticKey(*d.overlay->base, key, fn);
+		else if (!it->second.empty()) fn(it->second.data(), it->second.data() + it->second.size());
+		return;
+	}
+	if (!hasShardKeys(d)) {
+		const auto& phonIdx = indexSection(d, DictIndex::PHONETIC).phonIdx;
+		auto it = phonIdx.find(key);
+		if (it != phonIdx.end()) fn(it->second.data(), it->second.data() + it->second.size());
+		return;
+	}
+	for (const PackedShard& sh : d.packed->shards) {
+		size_t k = sh.keys.find(key);
+		if (k != SIZE_MAX) fn(sh.keyIds + sh.keyStart[k], sh.keyIds + sh.keyStart[k + 1]);
+	}
+}
 
-			string rest = input.substr(plen);
-			rest.erase(0, rest.find_first_not_of(" "));
-			auto [word, extra_r, tol_str] = extractWordRestrTol(rest);
-			string rhyme = getRhymeSuffix(word);
+// Recorre todas las claves llamando a fn(clave, v0, v1) hasta que devuelve false. En
+// NOMBRE.shd una misma clave aparece una vez por cada fragmento que la tiene.
+template <typename Fn>
+static void forEachPhoneticKey(const Dict& d, Fn&& fn) {
+	if (d.overlay) {
+		// Las claves de la base (que no está comprimida), con las entradas de la capa si han
+		// cambiado, y luego las nuevas
+		const auto& changed = d.overlay->phonIdx;
+		const auto& base = indexSection(*d.overlay->base, DictIndex::PHONETIC).phonIdx;
+		for (const auto& [pk, v] : base) {
+			auto it = changed.empty() ? changed.end() : changed.find(pk);
+			if (it == changed.end()) { if (!fn(pk, v.data(), v.data() + v.size())) return; }
+			else if (!it->second.empty() && !fn(pk, it->second.data(), it->second.data() + it->second.size())) return;
+		}
+		for (const auto& [pk, v] : changed)
+			if (!v.empty() && !base.count(pk) && !fn(pk, v.data(), v.data() + v.size())) return;
+		return;
+	}
+	if (!hasShardKeys(d)) {
+		for (const auto& [pk, v] : indexSection(d, DictIndex::PHONETIC).phonIdx)
+			if (!fn(pk, v.data(), v.data() + v.size())) return;
+		return;
+	}
+	string s;
+	for (const PackedShard& sh : d.packed->shards)
+		for (size_t b = 0; b < sh.keys.blocks(); b++) {
+			bool more = sh.keys.forBlock(b, s, [&](size_t k, const string& pk) {
+				return fn(pk, sh.keyIds + sh.keyStart[k], sh.keyIds + sh.keyStart[k + 1]);
+			});
+			if (!more) return;
+		}
+}
 
-			if (!rhyme.empty()) {
-				if (isCon_) {
-					// Rima consonante: mismo sufijo exacto desde vocal tónica
-					inputLine = "." + rhyme;
-				}
-				else {
-					// Rima asonante: solo las vocales del sufijo
-					string pat = ".(0,,C)";
-					for (char c : rhyme)
-						if (isVowel(c)) pat += string(1, c) + "(0,,C)";
-					inputLine = pat;
-				}
-				if (!extra_r.empty()) inputLine += " [" + extra_r + "]";
-				if (!tol_str.empty()) inputLine += " " + tol_str;
-			}
+static size_t phoneticKeyCount(const Dict& d) {
+	if (d.overlay) {
+		const auto& base = indexSection(*d.overlay->base, DictIndex::PHONETIC).phonIdx;
+		size_t n = base.size();
+		for (const auto& [pk, v] : d.overlay->phonIdx) {
+			bool had = base.count(pk) > 0;
+			if (had && v.empty()) n--;
+			if (!had && !v.empty()) n++;
 		}
+		return n;
 	}
+	if (!hasShardKeys(d)) return indexSection(d, DictIndex::PHONETIC).phonIdx.size();
+	size_t n = 0;
+	for (const PackedShard& sh : d.packed->shards) n += sh.keys.count;
+	return n;
+}
 
-	// /anp /epi /mul /uni
-	{
-		bool isAnp_ = (input.size() >= 9 && input.substr(0, 9) == "/anaphora") ||
-			(input.size() >= 4 && input.substr(0, 4) == "/anp" && (input.size() == 4 || input[4] == ' '));
-		bool isEpi_ = (input.size() >= 9 && input.substr(0, 9) == "/epiphora") ||
+// --compact: los diccionarios que se cargan pasan a modo compacto (ver compactDict)
+static bool g_compactDicts = false;
+
+// Comprime las formas (en orden alfabético, con sus variantes) y las entradas de un
+// diccionario sin comprimir en los datos propios de 'p', que queda con un solo fragmento.
+// Las entradas quitadas con /remove conservan su índice pero ya no son variante de ninguna
+// forma (y una forma sin variantes no se guarda).
+static void packDict(const Dict& d, PackedDict& p) {
+	size_t forms = d.formCount(), kept = 0;
+	vector<uint32_t> order(forms);
+	for (size_t f = 0; f < forms; f++) order[f] = (uint32_t)f;
+	sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return d.formWord(a) < d.formWord(b); });
+	p.formStart.assign(1, 0);
+	p.formStart.reserve(forms + 1);
+	p.formIds.reserve(d.formIds.size());
+	PackedShard sh;
+	for (size_t k = 0; k < forms; k++) {
+		const string& w = d.formWord(order[k]);
+		size_t before = p.formIds.size();
+		for (uint32_t j = d.formStart[order[k]]; j < d.formStart[order[k] + 1]; j++)
+			if (!d.isRemoved(d.formIds[j])) p.formIds.push_back(d.formIds[j]);
+		if (p.formIds.size() == before) continue;
+		if (kept++ % kPackBlock == 0) p.blockInfo.emplace_back();
+		p.blockInfo.back().add(w);
+		sh.summary.add(w);
+		p.formText.push(w);
+		p.formStart.push_back((uint32_t)p.formIds.size());
+	}
+	for (const string& r : d.raw_dict) p.rawText.push(r);
+	p.formText.finish();
+	p.rawText.finish();
+	sh.forms = p.formText.view();
+	sh.raws = p.rawText.view();
+	sh.blocks = p.blockInfo.data();
+	sh.formStart = p.formStart.data();
+	sh.formIds = p.formIds.data();
+	p.shards.assign(1, sh);
+	p.entries = d.size();
+	p.forms = kept;
+}
+
+// Pasa a modo compacto un diccionario ya cargado e indexado: un solo fragmento en memoria.
+// Las columnas del .idx van por entrada y no cambian; la tabla de formas del fichero
+// conserva el orden de primera aparición, que es el que usa el modo normal.
+static void compactDict(Dict& d) {
+	auto p = make_shared<PackedDict>();
+	packDict(d, *p);
+	vector<string>().swap(d.dictionary);
+	vector<string>().swap(d.raw_dict);
+	vector<uint32_t>().swap(d.formStart);
+	vector<uint32_t>().swap(d.formIds);
+	unordered_map<string, uint32_t>().swap(d.normToForm);
+	d.formsByLen.clear();
+	d.packed = p;
+#ifdef __GLIBC__
+	malloc_trim(0); // devolver al sistema la memoria de las cadenas liberadas
+#endif
+}
+
+// --- DICCIONARIOS FRAGMENTADOS (.shd) ---
+//
+// NOMBRE.shd guarda un diccionario ya comprimido para usarlo proyectado en memoria, sin
+// cargarlo: las búsquedas recorren los fragmentos uno tras otro y el sistema lee del disco
+// solo lo que se toca. Se genera desde NOMBRE.txt con --make-shards; cada fragmento son
+// --shard-size entradas consecutivas, indexadas por separado. Formato (enteros en el orden
+// de bytes de la máquina, todo alineado a 8 bytes):
+//   cabecera (ShdHeader), y por fragmento, sus zonas:
+//     formStart (u32 × F+1), formIds (u32 × N, índices globales), resúmenes de bloque
+//     (PackedBlock × ⌈F/16⌉), formas, entradas y claves fonéticas comprimidas (inicio de
+//     cada bloque u64 × ⌈K/16⌉ y texto), keyStart (u32 × K+1), keyIds (u32 × N)
+//   columnas SYLLABLES y STRESS de todo el diccionario (u8 × N cada una)
+//   histogramas (DictStats) y tabla de fragmentos (ShdShard × S)
+// Los índices de entrada son de 32 bits, como en el .idx. Una misma forma puede aparecer
+// en varios fragmentos, cada vez con las variantes de ese fragmento. Cada fragmento y la
+// zona final (columnas, histogramas y tabla) llevan su suma de control (FNV-1a).
+
+static const char kShdMagic[8] = { 'B', 'P', 'S', 'H', 'D', 0, 0, 0 };
+static const uint32_t kShdVersion = 3;
+static const size_t kDefaultShardSize = 1 << 20;
+
+struct ShdHeader {
+	char magic[8];
+	uint32_t version, shards;
+	uint64_t entries, forms;
+	uint64_t sourceSize;              // tamaño y fecha de NOMBRE.txt al generarlo
+	int64_t sourceTime;
+	uint64_t table, syllables, stress, stats, statsBytes;
+	uint64_t checksum;                // de [syllables, fin del fichero)
+};
+
+// Desplazamientos en el fichero de las zonas de un fragmento
+struct ShdShard {
+	uint64_t entryBase, entries, formBase, forms, keys;
+	PackedBlock summary;
+	uint64_t formStart, formIds, blocks;
+	uint64_t formIndex, formBytes, formByteCount;
+	uint64_t rawIndex, rawBytes, rawByteCount;
+	uint64_t keyIndex, keyBytes, keyByteCount, keyStart, keyIds;
+	uint64_t bodyStart, bodyEnd;
+	uint64_t checksum;                // de [bodyStart, bodyEnd)
+};
+
+static int64_t sourceTime(const string& path) {
+	error_code ec;
+	auto t = fs::last_write_time(path, ec);
+	return ec ? 0 : (int64_t)t.time_since_epoch().count();
+}
+
+// Suma los histogramas de otro trozo del diccionario
+static void mergeDictStats(DictStats& into, const DictStats& part) {
+	if (into.lenHist.empty()) { into = part; return; }
+	auto add = [](vector<size_t>& a, const vector<size_t>& b) { for (size_t k = 0; k < a.size() && k < b.size(); k++) a[k] += b[k]; };
+	into.words += part.words;
+	into.sampled += part.sampled;
+	add(into.lenHist, part.lenHist); add(into.vowelHist, part.vowelHist); add(into.consHist, part.consHist);
+	add(into.sylHist, part.sylHist); add(into.stressHist, part.stressHist); add(into.bigramDocs, part.bigramDocs);
+	for (size_t c = 0; c < into.letterHist.size() && c < part.letterHist.size(); c++) add(into.letterHist[c], part.letterHist[c]);
+}
+
+static string encodeStats(const DictStats& st) {
+	string out;
+	auto put = [&](const vector<size_t>& v) {
+		putPod(out, (uint64_t)v.size());
+		for (size_t x : v) putPod(out, (uint64_t)x);
+	};
+	putPod(out, (uint64_t)st.words);
+	putPod(out, (uint64_t)st.sampled);
+	put(st.lenHist); put(st.vowelHist); put(st.consHist); put(st.sylHist); put(st.stressHist); put(st.bigramDocs);
+	putPod(out, (uint64_t)st.letterHist.size());
+	for (const auto& h : st.letterHist) put(h);
+	return out;
+}
+
+static bool decodeStats(const char* p, size_t bytes, DictStats& st) {
+	const char* end = p + bytes;
+	auto get = [&](uint64_t& v) {
+		if ((size_t)(end - p) < sizeof(v)) return false;
+		memcpy(&v, p, sizeof(v));
+		p += sizeof(v);
+		return true;
+	};
+	auto getVec = [&](vector<size_t>& v) {
+		uint64_t n = 0;
+		if (!get(n) || n > (size_t)(end - p) / sizeof(uint64_t)) return false;
+		v.resize((size_t)n);
+		for (size_t& x : v) { uint64_t y = 0; get(y); x = (size_t)y; }
+		return true;
+	};
+	uint64_t words = 0, sampled = 0, letters = 0;
+	if (!get(words) || !get(sampled)) return false;
+	st.words = (size_t)words;
+	st.sampled = (size_t)sampled;
+	if (!getVec(st.lenHist) || !getVec(st.vowelHist) || !getVec(st.consHist) || !getVec(st.sylHist)
+		|| !getVec(st.stressHist) || !getVec(st.bigramDocs) || !get(letters) || letters > 256) return false;
+	st.letterHist.resize((size_t)letters);
+	for (auto& h : st.letterHist) if (!getVec(h)) return false;
+	return true;
+}
+
+// Genera NOMBRE.shd leyendo NOMBRE.txt por trozos de 'shardSize' entradas (las mismas
+// que daría la carga normal: una por línea no vacía). Solo un fragmento está en memoria
+// a la vez; las columnas se van escribiendo en ficheros temporales y se añaden al final.
+static bool buildShardFile(const string& name, size_t shardSize, ostream& log) {
+	string txt = name + ".txt", out = name + ".shd", tmp = out + ".tmp", sylTmp = out + ".syl.tmp", strTmp = out + ".str.tmp";
+	ifstream in(txt, ios::binary);
+	if (!in) { log << "Error: no se encontró el archivo '" << txt << "'\n"; return false; }
+	ofstream f(tmp, ios::binary | ios::trunc), sylOut(sylTmp, ios::binary | ios::trunc), strOut(strTmp, ios::binary | ios::trunc);
+	if (!f || !sylOut || !strOut) { log << "Error: no se pudo escribir '" << tmp << "'\n"; return false; }
+	ShdHeader head{};
+	f.write((const char*)&head, sizeof(head));
+	uint64_t sum = 0;               // suma de control de lo escrito desde el último reinicio
+	auto write = [&](const char* p, size_t bytes) { f.write(p, (streamsize)bytes); sum = fnv1a(p, bytes, sum); };
+	auto align = [&] { static const char zero[8] = {}; write(zero, (8 - (uint64_t)f.tellp() % 8) % 8); };
+	auto put = [&](const void* p, size_t bytes) { align(); uint64_t at = (uint64_t)f.tellp(); write((const char*)p, bytes); return at; };
+
+	vector<ShdShard> table;
+	DictStats stats;
+	size_t entries = 0, forms = 0;
+	vector<string> raw;
+	auto flush = [&] {
+		Dict sd;
+		sd.raw_dict.swap(raw);
+		size_t n = sd.raw_dict.size();
+		sd.dictionary.resize(n);
+		const size_t kChunk = 16384;
+		parallelFor((n + kChunk - 1) / kChunk, [&](size_t c) {
+			for (size_t i = c * kChunk; i < (std::min)(n, (c + 1) * kChunk); i++) sd.dictionary[i] = normalizeWord(sd.raw_dict[i]);
+		});
+		buildFormTable(sd);
+		DictIndex idx;
+		computeIndexColumns(sd, idx);
+		DictStats st;
+		buildDictStats(st, sd.dictionary, sd.raw_dict);
+		mergeDictStats(stats, st);
+		PackedDict p;
+		packDict(sd, p);
+		sylOut.write((const char*)idx.syllables.data(), (streamsize)n);
+		strOut.write((const char*)idx.stress.data(), (streamsize)n);
+
+		vector<const pair<const string, vector<uint32_t>>*> keys;
+		for (const auto& kv : idx.phonIdx) keys.push_back(&kv);
+		sort(keys.begin(), keys.end(), [](auto* a, auto* b) { return a->first < b->first; });
+		FrontCoded keyText;
+		vector<uint32_t> keyStart(1, 0), keyIds;
+		keyIds.reserve(n);
+		for (auto* kv : keys) {
+			keyText.push(kv->first);
+			for (uint32_t i : kv->second) keyIds.push_back((uint32_t)(i + entries));
+			keyStart.push_back((uint32_t)keyIds.size());
+		}
+		for (uint32_t& i : p.formIds) i += (uint32_t)entries;
+
+		ShdShard s{};
+		s.entryBase = entries; s.entries = n; s.formBase = forms; s.forms = p.forms; s.keys = keyText.count;
+		s.summary = p.shards[0].summary;
+		align();
+		s.bodyStart = (uint64_t)f.tellp();
+		sum = fnv1a("", 0);
+		s.formStart = put(p.formStart.data(), p.formStart.size() * sizeof(uint32_t));
+		s.formIds = put(p.formIds.data(), p.formIds.size() * sizeof(uint32_t));
+		s.blocks = put(p.blockInfo.data(), p.blockInfo.size() * sizeof(PackedBlock));
+		s.formIndex = put(p.formText.blockStart.data(), p.formText.blockStart.size() * sizeof(uint64_t));
+		s.formBytes = put(p.formText.bytes.data(), s.formByteCount = p.formText.bytes.size());
+		s.rawIndex = put(p.rawText.blockStart.data(), p.rawText.blockStart.size() * sizeof(uint64_t));
+		s.rawBytes = put(p.rawText.bytes.data(), s.rawByteCount = p.rawText.bytes.size());
+		s.keyIndex = put(keyText.blockStart.data(), keyText.blockStart.size() * sizeof(uint64_t));
+		s.keyBytes = put(keyText.bytes.data(), s.keyByteCount = keyText.bytes.size());
+		s.keyStart = put(keyStart.data(), keyStart.size() * sizeof(uint32_t));
+		s.keyIds = put(keyIds.data(), keyIds.size() * sizeof(uint32_t));
+		s.bodyEnd = (uint64_t)f.tellp();
+		s.checksum = sum;
+		table.push_back(s);
+		entries += n;
+		forms += p.forms;
+		log << "  fragmento " << table.size() << ": " << n << " entradas, " << p.forms << " formas\n";
+	};
+
+	log << "Generando '" << out << "' (fragmentos de " << shardSize << " entradas)...\n";
+	string line;
+	bool tooBig = false;
+	while (getline(in, line)) {
+		if (!line.empty() && line.back() == '\r') line.pop_back(); // finales de línea de Windows
+		if (line.empty()) continue;
+		if (entries + raw.size() >= UINT32_MAX) { tooBig = true; break; }
+		raw.push_back(move(line));
+		if (raw.size() == shardSize) flush();
+	}
+	if (!raw.empty()) flush();
+	sylOut.close();
+	strOut.close();
+
+	// Columnas y, tras ellas, histogramas y tabla
+	auto append = [&](const string& path) {
+		align();
+		uint64_t at = (uint64_t)f.tellp();
+		ifstream col(path, ios::binary);
+		char buf[1 << 16];
+		while (col.read(buf, sizeof(buf)) || col.gcount()) write(buf, (size_t)col.gcount());
+		return at;
+	};
+	align();
+	sum = fnv1a("", 0);
+	head.syllables = append(sylTmp);
+	head.stress = append(strTmp);
+	string st = encodeStats(stats);
+	head.stats = put(st.data(), st.size());
+	head.statsBytes = st.size();
+	head.table = put(table.data(), table.size() * sizeof(ShdShard));
+	head.checksum = sum;
+	memcpy(head.magic, kShdMagic, sizeof(head.magic));
+	head.version = kShdVersion;
+	head.shards = (uint32_t)table.size();
+	head.entries = entries;
+	head.forms = forms;
+	error_code ec;
+	head.sourceSize = (uint64_t)fs::file_size(txt, ec);
+	head.sourceTime = sourceTime(txt);
+	f.seekp(0);
+	f.write((const char*)&head, sizeof(head));
+	f.close();
+	fs::remove(sylTmp, ec);
+	fs::remove(strTmp, ec);
+	if (tooBig || !f) {
+		fs::remove(tmp, ec);
+		log << (tooBig ? "Error: demasiadas entradas para índices de 32 bits\n" : "Error: no se pudo escribir '" + tmp + "'\n");
+		return false;
+	}
+	fs::rename(tmp, out, ec);
+	if (ec) { log << "Error: no se pudo escribir '" << out << "'\n"; return false; }
+	log << "[OK] " << entries << " entradas en " << table.size() << " fragmentos.\n";
+	return true;
+}
+
+// Comprueba el contenido de un fragmento de NOMBRE.shd cuyas zonas ya se sabe que caben en
+// el fichero: su suma de control, las listas comprimidas y que las tablas de variantes y de
+// claves son crecientes y solo apuntan a entradas del fragmento
+static bool validShard(const PackedShard& sh, const ShdShard& s) {
+	if (fnv1a(sh.body, sh.bodyBytes) != s.checksum || !sh.forms.valid((size_t)s.formByteCount)
+		|| !sh.raws.valid((size_t)s.rawByteCount) || !sh.keys.valid((size_t)s.keyByteCount)) return false;
+	auto table = [&](const uint32_t* start, size_t n, const uint32_t* ids) {
+		if (start[0] != 0 || start[n] != s.entries) return false;
+		for (size_t k = 0; k < n; k++) if (start[k] > start[k + 1]) return false;
+		for (size_t i = 0; i < s.entries; i++) if (ids[i] < s.entryBase || ids[i] - s.entryBase >= s.entries) return false;
+		return true;
+	};
+	return table(sh.formStart, sh.forms.count, sh.formIds) && table(sh.keyStart, sh.keys.count, sh.keyIds);
+}
+
+// Abre NOMBRE.shd si existe, está completo y corresponde al NOMBRE.txt actual (si lo hay).
+// Antes de usarlo se lee entero una vez para comprobarlo (ver validShard): uno dañado se
+// ignora y se carga el .txt.
+static bool openShardFile(const string& name, Dict& d, ostream& log) {
+	string path = name + ".shd", txt = name + ".txt";
+	auto m = mapFile(path);
+	if (!m) return false;
+	auto fits = [&](uint64_t at, uint64_t bytes) { return at % 4 == 0 && at <= m->size && bytes <= m->size - at; };
+	ShdHeader head;
+	if (m->size < sizeof(head)) return false;
+	memcpy(&head, m->data, sizeof(head));
+	if (memcmp(head.magic, kShdMagic, sizeof(head.magic)) != 0 || head.version != kShdVersion
+		|| !fits(head.table, (uint64_t)head.shards * sizeof(ShdShard)) || !fits(head.syllables, head.entries)
+		|| !fits(head.stress, head.entries) || !fits(head.stats, head.statsBytes)
+		|| fnv1a(m->data + head.syllables, m->size - (size_t)head.syllables) != head.checksum) {
+		log << "'" << path << "' no es válido; se ignora.\n";
+		return false;
+	}
+	error_code ec;
+	if (fs::exists(txt, ec) && ((uint64_t)fs::file_size(txt, ec) != head.sourceSize || sourceTime(txt) != head.sourceTime)) {
+		log << "'" << path << "' es anterior a '" << txt << "'; se ignora (regenérelo con --make-shards " << name << ").\n";
+		return false;
+	}
+
+	auto p = make_shared<PackedDict>();
+	const char* base = m->data;
+	const ShdShard* table = (const ShdShard*)(base + head.table);
+	size_t entries = 0, forms = 0;
+	for (uint32_t k = 0; k < head.shards; k++) {
+		const ShdShard& s = table[k];
+		uint64_t blocks = (s.forms + kPackBlock - 1) / kPackBlock;
+		auto index = [](uint64_t count) { return (count + kPackBlock - 1) / kPackBlock * sizeof(uint64_t); };
+		if (s.entryBase != entries || s.formBase != forms || !fits(s.formStart, (s.forms + 1) * 4) || !fits(s.formIds, s.entries * 4)
+			|| !fits(s.blocks, blocks * sizeof(PackedBlock)) || !fits(s.formIndex, index(s.forms)) || !fits(s.formBytes, s.formByteCount)
+			|| !fits(s.rawIndex, index(s.entries)) || !fits(s.rawBytes, s.rawByteCount) || !fits(s.keyIndex, index(s.keys))
+			|| !fits(s.keyBytes, s.keyByteCount) || !fits(s.keyStart, (s.keys + 1) * 4) || !fits(s.keyIds, s.entries * 4)
+			|| !fits(s.bodyStart, s.bodyEnd - s.bodyStart)) {
+			log << "'" << path << "' está incompleto; se ignora.\n";
+			return false;
+		}
+		PackedShard sh;
+		sh.forms = { base + s.formBytes, (const uint64_t*)(base + s.formIndex), (size_t)s.forms };
+		sh.raws = { base + s.rawBytes, (const uint64_t*)(base + s.rawIndex), (size_t)s.entries };
+		sh.keys = { base + s.keyBytes, (const uint64_t*)(base + s.keyIndex), (size_t)s.keys };
+		sh.blocks = (const PackedBlock*)(base + s.blocks);
+		sh.formStart = (const uint32_t*)(base + s.formStart);
+		sh.formIds = (const uint32_t*)(base + s.formIds);
+		sh.keyStart = (const uint32_t*)(base + s.keyStart);
+		sh.keyIds = (const uint32_t*)(base + s.keyIds);
+		sh.entryBase = (size_t)s.entryBase;
+		sh.formBase = (size_t)s.formBase;
+		sh.summary = s.summary;
+		sh.body = base + s.bodyStart;
+		sh.bodyBytes = (size_t)(s.bodyEnd - s.bodyStart);
+		p->shards.push_back(sh);
+		entries += (size_t)s.entries;
+		forms += (size_t)s.forms;
+	}
+	DictStats stats;
+	if (entries != head.entries || forms != head.forms || !decodeStats(base + head.stats, (size_t)head.statsBytes, stats)) {
+		log << "'" << path << "' está incompleto; se ignora.\n";
+		return false;
+	}
+	atomic<bool> intact{ true };
+	parallelFor(p->shards.size(), [&](size_t k) { if (intact && !validShard(p->shards[k], table[k])) intact = false; });
+	if (!intact) {
+		log << "'" << path << "' está dañado; se ignora.\n";
+		return false;
+	}
+	p->entries = entries;
+	p->forms = forms;
+	p->syllables = (const uint8_t*)(base + head.syllables);
+	p->stress = (const uint8_t*)(base + head.stress);
+	p->file = m;
+	d.name = name;
+	d.stats = move(stats);
+	d.packed = p;
+	log << "Usando '" << path << "' (" << entries << " palabras en " << p->shards.size() << " fragmentos, proyectado en memoria).\n";
+	return true;
+}
+
+// --- CAMBIOS INCREMENTALES (/add, /remove) ---
+//
+// /add y /remove cambian el diccionario cargado sin reconstruirlo ni copiarlo: los cambios
+// van a una capa (DictOverlay) sobre sus entradas, que no cambian y pueden seguir usándose
+// en las consultas en curso. Una entrada añadida va al final, como una variante más de su
+// forma si la forma ya existe; una quitada conserva su índice, marcada como quitada, para
+// que las columnas del índice sigan valiendo. Cada cambio efectivo se añade como una línea
+// "+palabra" o "-palabra" a NOMBRE.delta, junto al .bin, y loadDict lo vuelve a aplicar al
+// cargar. Cuando el fichero acumula kDeltaCompact cambios, un hilo aparte escribe un .bin y
+// un .idx nuevos con el resultado y deja en NOMBRE.delta solo los que llegaron mientras
+// tanto; de paso, pasa la capa del diccionario en memoria a unas entradas sin capa, que
+// adopta el cambio siguiente (ver adoptFolded).
+// Los cambios fijan si una palabra está o no (añadir una que ya está o quitar una que no
+// está no hace nada), así que aplicar dos veces los mismos da el mismo conjunto de palabras.
+
+static const size_t kDeltaCompact = 1000;
+
+// Capa de cambios 'from' ya pasada a un diccionario sin capa
+struct FoldedDict {
+	shared_ptr<const DictOverlay> from;
+	shared_ptr<const Dict> dict;
+};
+
+struct DeltaLog {
+	mutex mtx;                    // protege los NOMBRE.delta y la sustitución del .bin
+	map<string, size_t> pending;  // diccionario → cambios que tiene su .delta
+	map<string, unsigned> epoch;  // cambia al reescribir el .bin desde el .txt (ver rewriteFromText)
+	map<string, FoldedDict> folded; // diccionario → última capa compactada en memoria
+	thread compactor;
+	atomic<bool> compacting{ false };
+};
+
+static DeltaLog g_delta;
+
+// Cambios de NOMBRE.delta, como mucho los 'maxBytes' primeros bytes
+static vector<string> readDeltaOps(const string& file, size_t maxBytes = SIZE_MAX) {
+	vector<string> ops;
+	ifstream in(file, ios::binary);
+	string line;
+	size_t read = 0;
+	while (read < maxBytes && getline(in, line)) {
+		read += line.size() + 1;
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (line.size() >= 2 && (line[0] == '+' || line[0] == '-')) ops.push_back(line);
+	}
+	return ops;
+}
+
+// Capa vacía sobre 'base'. Lee ya todas las secciones del .idx de la base y la desliga del
+// fichero, que la compactación puede reescribir con otras entradas.
+static shared_ptr<DictOverlay> emptyOverlay(const shared_ptr<const Dict>& base) {
+	if (base->index) {
+		for (int s = DictIndex::SYLLABLES; s < DictIndex::SECTION_COUNT; s++) indexSection(*base, s);
+		lock_guard<mutex> lk(base->index->mtx);
+		base->index->path.clear();
+	}
+	auto ov = make_shared<DictOverlay>();
+	ov->base = base;
+	ov->baseEntries = base->size();
+	ov->baseForms = base->formCount();
+	return ov;
+}
+
+// Diccionario sin capa con las mismas entradas, formas, columnas y claves fonéticas que 'd'
+// con su capa. Tarda en proporción al tamaño del diccionario: se hace al cargar y, en
+// segundo plano, al compactar (ver recordUpdates).
+static Dict foldOverlay(const Dict& d) {
+	const DictOverlay& ov = *d.overlay;
+	const Dict& b = *ov.base;
+	Dict nd;
+	nd.name = d.name;
+	nd.stats = d.stats;
+	nd.raw_dict.reserve(d.size());
+	nd.raw_dict = b.raw_dict;
+	nd.raw_dict.insert(nd.raw_dict.end(), ov.raw.begin(), ov.raw.end());
+	nd.dictionary.reserve(d.size());
+	nd.dictionary = b.dictionary;
+	nd.dictionary.insert(nd.dictionary.end(), ov.norm.begin(), ov.norm.end());
+	nd.removedCount = d.removedCount;
+	if (d.removedCount) nd.removed = removedMask(d);
+
+	nd.formStart.assign(1, 0);
+	nd.formIds.reserve(d.size());
+	auto changed = ov.variants.begin();
+	for (size_t f = 0; f < d.formCount(); f++) {
+		if (changed != ov.variants.end() && changed->first == f) {
+			nd.formIds.insert(nd.formIds.end(), changed->second.begin(), changed->second.end());
+			++changed;
+		}
+		else nd.formIds.insert(nd.formIds.end(), b.formIds.begin() + b.formStart[f], b.formIds.begin() + b.formStart[f + 1]);
+		nd.formStart.push_back((uint32_t)nd.formIds.size());
+	}
+	buildCalLookup(nd);
+
+	// Índice solo en memoria, como el de la base (ver emptyOverlay)
+	auto idx = make_shared<DictIndex>();
+	idx->syllables = indexSection(b, DictIndex::SYLLABLES).syllables;
+	idx->stress = indexSection(b, DictIndex::STRESS).stress;
+	idx->phonIdx = indexSection(b, DictIndex::PHONETIC).phonIdx;
+	for (size_t k = 0; k < ov.raw.size(); k++) {
+		idx->syllables.push_back(columnValue((int)getSyllables(ov.norm[k]).size()));
+		idx->stress.push_back(columnValue(getStressPosition(ov.raw[k])));
+	}
+	for (const auto& [key, ids] : ov.phonIdx) {
+		if (ids.empty()) idx->phonIdx.erase(key);
+		else idx->phonIdx[key] = ids;
+	}
+	for (bool& r : idx->ready) r = true;
+	nd.index = idx;
+	return nd;
+}
+
+// Variantes de la forma f en la capa de 'd', copiadas de la base la primera vez
+static vector<uint32_t>& changedVariants(Dict& d, size_t f) {
+	DictOverlay& ov = *d.overlay;
+	auto it = ov.variants.find((uint32_t)f);
+	if (it != ov.variants.end()) return it->second;
+	vector<uint32_t> ids;
+	if (f < ov.baseForms) ids.assign(ov.base->formIds.begin() + ov.base->formStart[f], ov.base->formIds.begin() + ov.base->formStart[f + 1]);
+	return ov.variants.emplace((uint32_t)f, move(ids)).first->second;
+}
+
+// Entradas de la clave fonética 'key' en la capa de 'd', copiadas de la base la primera vez
+static vector<uint32_t>& changedKey(Dict& d, const string& key) {
+	DictOverlay& ov = *d.overlay;
+	auto it = ov.phonIdx.find(key);
+	if (it != ov.phonIdx.end()) return it->second;
+	vector<uint32_t> ids;
+	forPhoneticKey(*ov.base, key, [&](const uint32_t* v0, const uint32_t* v1) { ids.assign(v0, v1); });
+	return ov.phonIdx.emplace(key, move(ids)).first->second;
+}
+
+// Aplica un cambio "+palabra" o "-palabra" a la capa propia de 'd' (ver prepareUpdates).
+// Devuelve false si no cambia nada. Las entradas con el mismo texto tienen la misma clave
+// fonética, así que se buscan en el índice de /homophone.
+static bool applyUpdate(Dict& d, const string& op) {
+	DictOverlay& ov = *d.overlay;
+	string raw = op.substr(1), key = phoneticKey(raw);
+	vector<uint32_t> same;
+	forPhoneticKey(d, key, [&](const uint32_t* v0, const uint32_t* v1) {
+		for (const uint32_t* v = v0; v < v1; v++)
+			if (d.scanRaw(*v) == raw) same.push_back(*v);
+	});
+
+	if (op[0] == '+') {
+		if (!same.empty()) return false;
+		uint32_t id = (uint32_t)d.size();
+		string norm = normalizeWord(raw);
+		size_t f = findForm(d, norm);
+		if (f == SIZE_MAX) {
+			f = d.formCount();
+			ov.forms.push_back(norm);
+			ov.normToForm.emplace(norm, (uint32_t)f);
+			ov.formsByLen[(int)norm.size()].push_back((uint32_t)f);
+		}
+		ov.raw.push_back(raw);
+		ov.norm.push_back(norm);
+		changedVariants(d, f).push_back(id);
+		changedKey(d, key).push_back(id);
+		ov.ops.push_back(op);
+		return true;
+	}
+
+	if (same.empty()) return false;
+	// La forma pasa a la capa, que sabe qué variantes se han quitado (ver LiveVariants)
+	changedVariants(d, findForm(d, d.norm(same[0])));
+	vector<uint32_t>& ids = changedKey(d, key);
+	for (uint32_t id : same) {
+		ov.removed.insert(id);
+		d.removedCount++;
+		ids.erase(find(ids.begin(), ids.end(), id));
+	}
+	ov.ops.push_back(op);
+	return true;
+}
+
+// Si la compactación ha pasado a un diccionario sin capa una capa anterior de 'd' (ver
+// recordUpdates), toma ese diccionario como base y vuelve a aplicar encima los cambios que
+// llegaron después. Los índices de entradas y formas no cambian.
+static void adoptFolded(Dict& d) {
+	FoldedDict fd;
+	{
+		lock_guard<mutex> lk(g_delta.mtx);
+		auto it = g_delta.folded.find(d.name);
+		if (it == g_delta.folded.end()) return;
+		fd = move(it->second);
+		g_delta.folded.erase(it);
+	}
+	const vector<string>& ops = d.overlay->ops;
+	size_t n = fd.from->ops.size();
+	if (fd.from->base != d.overlay->base || n > ops.size() || !equal(fd.from->ops.begin(), fd.from->ops.end(), ops.begin())) return;
+	vector<string> later(ops.begin() + n, ops.end());
+	d.overlay = emptyOverlay(fd.dict);
+	d.removedCount = fd.dict->removedCount;
+	for (const string& op : later) applyUpdate(d, op);
+}
+
+// Deja 'd' listo para cambiar sus entradas con una capa propia: una copia de la que tenga
+// o, si no tiene, una vacía sobre sus entradas, que pasan sin copiarse a la base
+static void prepareUpdates(Dict& d) {
+	if (d.overlay) {
+		adoptFolded(d);
+		d.overlay = make_shared<DictOverlay>(*d.overlay);
+		return;
+	}
+	auto base = make_shared<Dict>(move(d));
+	d = Dict();
+	d.name = base->name;
+	d.stats = base->stats;
+	d.removedCount = base->removedCount;
+	d.overlay = emptyOverlay(base);
+}
+
+// Diccionario con las entradas de 'd', sin copiarlas, para cambiarlo mientras otras
+// consultas siguen usando 'd'. Uno comprimido no admite cambios: se devuelve tal cual.
+static shared_ptr<Dict> updatableView(const shared_ptr<const Dict>& d) {
+	if (d->packed) return make_shared<Dict>(*d);
+	auto nd = make_shared<Dict>();
+	nd->name = d->name;
+	nd->stats = d->stats;
+	nd->removedCount = d->removedCount;
+	nd->overlay = d->overlay ? d->overlay : emptyOverlay(d);
+	return nd;
+}
+
+// Aplica los cambios en orden y devuelve los que han cambiado algo
+static vector<string> applyUpdates(Dict& d, const vector<string>& ops) {
+	prepareUpdates(d);
+	vector<string> done;
+	for (const string& op : ops)
+		if (applyUpdate(d, op)) done.push_back(op);
+	return done;
+}
+
+// Escribe el .bin y el .idx de 'name' con los cambios de los 'bytes' primeros bytes de
+// NOMBRE.delta ya aplicados y deja en NOMBRE.delta los que haya detrás
+static void compactDelta(const string& name, size_t bytes) {
+	string deltaFile = name + ".delta";
+	unsigned epoch;
+	{
+		lock_guard<mutex> lk(g_delta.mtx);
+		epoch = g_delta.epoch[name];
+	}
+	vector<string> ops = readDeltaOps(deltaFile, bytes);
+	vector<string> raw, norm;
+	ostringstream quiet;
+	if (!loadDictionary(name, raw, norm, quiet)) return;
+
+	// Lo mismo que applyUpdate, sobre las listas de entradas
+	unordered_map<string, vector<size_t>> where;
+	for (const string& op : ops) where.emplace(op.substr(1), vector<size_t>());
+	for (size_t i = 0; i < raw.size(); i++) {
+		auto it = where.find(raw[i]);
+		if (it != where.end()) it->second.push_back(i);
+	}
+	vector<bool> gone(raw.size(), false);
+	for (const string& op : ops) {
+		vector<size_t>& ids = where[op.substr(1)];
+		if (op[0] == '-') {
+			for (size_t i : ids) gone[i] = true;
+			ids.clear();
+		}
+		else if (ids.empty()) {
+			ids.push_back(raw.size());
+			raw.push_back(op.substr(1));
+			norm.push_back(normalizeWord(raw.back()));
+			gone.push_back(false);
+		}
+	}
+	Dict cd;
+	for (size_t i = 0; i < raw.size(); i++)
+		if (!gone[i]) {
+			cd.raw_dict.push_back(move(raw[i]));
+			cd.dictionary.push_back(move(norm[i]));
+		}
+	saveBinaryCache(name + ".bin.new", cd.raw_dict, cd.dictionary);
+	loadDictIndex(cd, name + ".idx.new", quiet);
+
+	lock_guard<mutex> lk(g_delta.mtx);
+	error_code ec;
+	if (g_delta.epoch[name] != epoch) { fs::remove(name + ".bin.new", ec); fs::remove(name + ".idx.new", ec); return; }
+	fs::rename(name + ".bin.new", name + ".bin", ec);
+	if (ec) { fs::remove(name + ".bin.new", ec); fs::remove(name + ".idx.new", ec); return; }
+	fs::rename(name + ".idx.new", name + ".idx", ec);
+	if (ec) fs::remove(name + ".idx", ec); // se regenera en la próxima carga
+	string tail;
+	{
+		ifstream in(deltaFile, ios::binary);
+		in.seekg((streamoff)bytes);
+		tail.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	}
+	if (tail.empty()) fs::remove(deltaFile, ec);
+	else {
+		{ ofstream out(deltaFile + ".tmp", ios::binary | ios::trunc); out << tail; }
+		fs::rename(deltaFile + ".tmp", deltaFile, ec);
+	}
+	g_delta.pending[name] = count(tail.begin(), tail.end(), '\n');
+}
+
+// Añade a NOMBRE.delta los cambios ya aplicados a 'd' y, si se han acumulado bastantes,
+// lanza la compactación (una cada vez). Devuelve false si no se pudo escribir.
+static bool recordUpdates(const Dict& d, const vector<string>& ops) {
+	lock_guard<mutex> lk(g_delta.mtx);
+	string deltaFile = d.name + ".delta";
+	{
+		ofstream out(deltaFile, ios::binary | ios::app);
+		for (const string& op : ops) out << op << "\n";
+		if (!out) return false;
+	}
+	size_t& pending = g_delta.pending[d.name];
+	pending += ops.size();
+	if (pending >= kDeltaCompact && !g_delta.compacting.exchange(true)) {
+		if (g_delta.compactor.joinable()) g_delta.compactor.join();
+		error_code ec;
+		size_t bytes = (size_t)fs::file_size(deltaFile, ec);
+		// La capa actual ya no cambia (cada cambio trabaja sobre una copia, ver prepareUpdates)
+		shared_ptr<Dict> view;
+		if (d.overlay) {
+			view = make_shared<Dict>();
+			view->name = d.name;
+			view->stats = d.stats;
+			view->removedCount = d.removedCount;
+			view->overlay = d.overlay;
+		}
+		g_delta.compactor = thread([name = d.name, bytes, view] {
+			compactDelta(name, bytes);
+			if (view) {
+				auto flat = make_shared<const Dict>(foldOverlay(*view));
+				lock_guard<mutex> lk(g_delta.mtx);
+				g_delta.folded[name] = { view->overlay, flat };
+			}
+			g_delta.compacting = false;
+		});
+	}
+	return true;
+}
+
+// Espera a que termine la compactación en curso (al salir del programa)
+static void finishCompaction() {
+	thread t;
+	{
+		lock_guard<mutex> lk(g_delta.mtx);
+		t = move(g_delta.compactor);
+	}
+	if (t.joinable()) t.join();
+}
+
+// --- PROCESOS TRABAJADORES (--workers) ---
+//
+// Con --workers N, este proceso coordina N copias de sí mismo que cargan el mismo
+// diccionario y se reparten sus formas en N tramos consecutivos (las claves de /hom, por su
+// huella). Los recorridos completos (patrones, consultas anidadas, /hom con tolerancia) se
+// envían a todos; cada trabajador devuelve los índices globales de su tramo en orden y el
+// coordinador los fusiona. La lógica booleana, las anidadas, /cal y la impresión se hacen
+// aquí con los índices ya fusionados. Cada trabajador atiende un recorrido a la vez.
+//
+// Mensajes (u32 con la longitud y el contenido) por un socket local:
+//   petición:  tipo ('L' carga, 'M' patrones, 'H' homófonos, 'S' muestra) y campos separados
+//              por '\n'; los de recorrido empiezan por el tiempo (ms) y el trabajo que quedan
+//   respuesta: 'L' → "OK palabras formas" o el error; el resto → motivo de agotamiento (i32),
+//              trabajo gastado (u64), total (u64) y listas (u32 con el tamaño y u32 × n);
+//              en 'M' el total es el de palabras que coinciden con algún patrón, sin recortar
+
+// Tramo de este proceso cuando es un trabajador (parte g_partIndex de g_partCount)
+static size_t g_partIndex = 0, g_partCount = 1;
+
+// Máximo de resultados que se mostrarán (modo servidor): permite pedir a los trabajadores
+// solo los primeros de cada uno (0 = todos)
+thread_local int t_resultLimit = 0;
+
+// Formas [from, to) que recorre este proceso: todas, salvo en un trabajador
+static pair<size_t, size_t> ownedForms(const Dict& d) {
+	size_t forms = d.formCount();
+	return { forms * g_partIndex / g_partCount, forms * (g_partIndex + 1) / g_partCount };
+}
+
+static bool ownsKey(const string& key) { return g_partCount == 1 || fnv1a(key.data(), key.size()) % g_partCount == g_partIndex; }
+
+// Marca el presupuesto de la consulta como agotado por 'reason' (la de un trabajador)
+static void budgetExpire(int reason) {
+	if (!t_budget || reason == QueryBudget::NONE) return;
+	int none = QueryBudget::NONE;
+	t_budget->reason.compare_exchange_strong(none, reason);
+	t_budget->expired = true;
+}
+
+// Índices de varias listas ordenadas y disjuntas, fusionados en orden (los 'limit' primeros si no es 0)
+static vector<size_t> mergeSorted(const vector<vector<size_t>>& parts, size_t limit = 0) {
+	vector<size_t> out;
+	for (const auto& p : parts) {
+		size_t mid = out.size();
+		out.insert(out.end(), p.begin(), p.end());
+		inplace_merge(out.begin(), out.begin() + mid, out.end());
+		if (limit && out.size() > limit) out.resize(limit);
+	}
+	return out;
+}
+
+// Los trabajadores se lanzan con /proc/self/exe, así que solo hay en Linux
+#ifdef __linux__
+
+static bool writeMessage(int fd, const string& msg) {
+	string buf;
+	putPod(buf, (uint32_t)msg.size());
+	buf += msg;
+	for (size_t sent = 0; sent < buf.size(); ) {
+		ssize_t w = send(fd, buf.data() + sent, buf.size() - sent, MSG_NOSIGNAL);
+		if (w <= 0) { if (w < 0 && errno == EINTR) continue; return false; }
+		sent += (size_t)w;
+	}
+	return true;
+}
+
+static bool readMessage(int fd, string& msg) {
+	auto readAll = [&](char* p, size_t n) {
+		while (n) {
+			ssize_t r = read(fd, p, n);
+			if (r <= 0) { if (r < 0 && errno == EINTR) continue; return false; }
+			p += r; n -= (size_t)r;
+		}
+		return true;
+	};
+	uint32_t len = 0;
+	if (!readAll((char*)&len, sizeof(len))) return false;
+	msg.resize(len);
+	return readAll(&msg[0], len);
+}
+
+struct WorkerLink {
+	int fd = -1;
+	pid_t pid = -1;
+	mutex mtx;
+};
+
+struct Cluster {
+	vector<unique_ptr<WorkerLink>> workers;
+	string name;                  // diccionario que tienen cargado los trabajadores
+	size_t words = 0, forms = 0;
+	atomic<bool> ready{ false };
+	shared_mutex updates;         // los recorridos lo comparten; /add y /remove lo bloquean
+};
+
+static Cluster* g_cluster = nullptr;
+
+// Cierra los sockets (cada trabajador termina al leer el fin) y espera a los procesos
+static void stopWorkers(Cluster& c) {
+	c.ready = false;
+	for (auto& w : c.workers) {
+		lock_guard<mutex> lk(w->mtx);
+		if (w->fd >= 0) close(w->fd);
+		w->fd = -1;
+	}
+	for (auto& w : c.workers)
+		if (w->pid > 0) while (waitpid(w->pid, nullptr, 0) < 0 && errno == EINTR) {}
+	c.workers.clear();
+}
+
+// Al salir del programa (ver main)
+static void stopWorkers() {
+	if (!g_cluster) return;
+	stopWorkers(*g_cluster);
+	delete g_cluster;
+	g_cluster = nullptr;
+}
+
+// Lanza 'n' trabajadores (este mismo ejecutable con --worker) unidos por socketpair. Si
+// alguno no arranca, se paran los ya lanzados.
+static bool startWorkers(int n, const vector<string>& flags) {
+	auto c = make_unique<Cluster>();
+	for (int k = 0; k < n; k++) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) { cerr << "Error: no se pudo crear el socket del trabajador\n"; stopWorkers(*c); return false; }
+		fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+		pid_t pid = fork();
+		if (pid < 0) { cerr << "Error: no se pudo lanzar el trabajador " << k + 1 << "\n"; close(sv[0]); close(sv[1]); stopWorkers(*c); return false; }
+		if (pid == 0) {
+			close(sv[0]);
+			vector<string> args = { "BuscadorPalabras", "--worker", to_string(sv[1]), to_string(k) + "/" + to_string(n) };
+			args.insert(args.end(), flags.begin(), flags.end());
+			vector<char*> argv;
+			for (string& a : args) argv.push_back(&a[0]);
+			argv.push_back(nullptr);
+			execv("/proc/self/exe", argv.data());
+			_exit(127);
+		}
+		close(sv[1]);
+		c->workers.push_back(make_unique<WorkerLink>());
+		c->workers.back()->fd = sv[0];
+		c->workers.back()->pid = pid;
+	}
+	g_cluster = c.release();
+	return true;
+}
+
+// Envía 'req' a todos los trabajadores y recoge sus respuestas. Si alguno falla, los
+// trabajadores dejan de usarse y la consulta sigue en este proceso.
+static bool broadcast(const string& req, vector<string>& resp) {
+	Cluster& c = *g_cluster;
+	vector<unique_lock<mutex>> locks;
+	for (auto& w : c.workers) locks.emplace_back(w->mtx);
+	resp.assign(c.workers.size(), string());
+	bool ok = true;
+	for (auto& w : c.workers) ok = ok && writeMessage(w->fd, req);
+	for (size_t k = 0; ok && k < c.workers.size(); k++) ok = readMessage(c.workers[k]->fd, resp[k]);
+	if (!ok && c.ready.exchange(false)) cerr << "(Un proceso trabajador no responde; se sigue sin trabajadores)\n";
+	return ok;
+}
+
+// Carga en los trabajadores el diccionario que acaba de cargar este proceso
+static void clusterLoad(const Dict& d) {
+	if (!g_cluster) return;
+	g_cluster->ready = false;
+	vector<string> resp;
+	if (!broadcast("L" + d.name, resp)) return;
+	for (const string& r : resp) {
+		istringstream in(r);
+		string ok;
+		size_t words = 0, forms = 0;
+		if (!(in >> ok >> words >> forms) || ok != "OK" || words != d.size() || forms != d.formCount()) {
+			cerr << "(Los procesos trabajadores no han cargado '" << d.name << "' igual; se sigue sin ellos)\n";
+			return;
+		}
+	}
+	g_cluster->name = d.name;
+	g_cluster->words = d.size();
+	g_cluster->forms = d.formCount();
+	g_cluster->ready = true;
+}
+
+static bool clusterActive(const Dict& d) {
+	return g_cluster && g_cluster->ready && d.name == g_cluster->name && d.size() == g_cluster->words && d.formCount() == g_cluster->forms;
+}
+
+static size_t clusterWorkers(const Dict& d) { return clusterActive(d) ? g_cluster->workers.size() : 0; }
+
+// Cabecera de una petición de recorrido: lo que queda del presupuesto, repartido
+static string scanRequest(char type) {
+	long long ms = 0;
+	uint64_t work = 0;
+	if (t_budget) {
+		if (t_budget->deadline != chrono::steady_clock::time_point::max())
+			ms = (std::max)(1LL, (long long)chrono::duration_cast<chrono::milliseconds>(t_budget->deadline - chrono::steady_clock::now()).count());
+		if (t_budget->max_work) work = (std::max)((uint64_t)1, (t_budget->max_work - (std::min)(t_budget->max_work, t_budget->work.load())) / g_cluster->workers.size());
+	}
+	return string(1, type) + to_string(ms) + "\n" + to_string(work);
+}
+
+// Lee una respuesta de recorrido: aplica al presupuesto lo gastado y devuelve total y listas
+static bool parseScanReply(const string& r, size_t& total, vector<vector<size_t>>& lists) {
+	size_t pos = 0;
+	auto get = [&](auto& v) {
+		if (r.size() - pos < sizeof(v)) return false;
+		memcpy(&v, r.data() + pos, sizeof(v));
+		pos += sizeof(v);
+		return true;
+	};
+	int32_t reason = 0;
+	uint64_t work = 0, tot = 0;
+	if (!get(reason) || !get(work) || !get(tot)) return false;
+	budgetSpend(work);
+	budgetExpire(reason);
+	total = (size_t)tot;
+	lists.clear();
+	uint32_t n = 0;
+	while (pos < r.size()) {
+		if (!get(n) || n > (r.size() - pos) / sizeof(uint32_t)) return false;
+		lists.emplace_back(n);
+		for (size_t& id : lists.back()) { uint32_t v; memcpy(&v, r.data() + pos, sizeof(v)); pos += sizeof(v); id = v; }
+	}
+	return true;
+}
+
+// Patrones: por patrón, los índices de todo el diccionario en orden (los 'limit' primeros si
+// no es 0). Si se pide, 'matches' recibe cuántas palabras coinciden con alguno de ellos.
+static bool clusterScan(const vector<string>& patterns, const Dict& d, size_t limit, vector<vector<size_t>>& out, size_t* matches = nullptr) {
+	if (!clusterActive(d)) return false;
+	shared_lock<shared_mutex> lk(g_cluster->updates);
+	if (!clusterActive(d)) return false;
+	string req = scanRequest('M') + "\n" + to_string(limit);
+	for (const string& p : patterns) req += "\n" + p;
+	vector<string> resp;
+	if (!broadcast(req, resp)) return false;
+	vector<vector<vector<size_t>>> parts(resp.size());
+	size_t total, sum = 0;
+	for (size_t k = 0; k < resp.size(); k++) {
+		if (!parseScanReply(resp[k], total, parts[k]) || parts[k].size() != patterns.size()) return false;
+		sum += total; // los tramos de los trabajadores no se solapan
+	}
+	if (matches) *matches = sum;
+	out.assign(patterns.size(), {});
+	for (size_t p = 0; p < patterns.size(); p++) {
+		vector<vector<size_t>> per(parts.size());
+		for (size_t k = 0; k < parts.size(); k++) per[k] = move(parts[k][p]);
+		out[p] = mergeSorted(per, limit);
+	}
+	return true;
+}
+
+static bool clusterHomophones(const string& word, const string& restr, int n, const Dict& d, vector<size_t>& ids) {
+	if (!clusterActive(d)) return false;
+	shared_lock<shared_mutex> lk(g_cluster->updates);
+	if (!clusterActive(d)) return false;
+	vector<string> resp;
+	if (!broadcast(scanRequest('H') + "\n" + to_string(n) + "\n" + word + "\n" + restr, resp)) return false;
+	vector<vector<size_t>> parts;
+	for (const string& r : resp) {
+		vector<vector<size_t>> one;
+		size_t total;
+		if (!parseScanReply(r, total, one) || one.size() != 1) return false;
+		parts.push_back(move(one[0]));
+	}
+	ids = mergeSorted(parts);
+	return true;
+}
+
+// /rd: cada trabajador devuelve cuántas palabras de su tramo coinciden con la unión de los
+// patrones y una muestra uniforme de hasta 'n' en orden aleatorio. Se combinan eligiendo
+// cada vez un trabajador con probabilidad proporcional a lo que le queda sin elegir, así
+// que el resultado es una muestra uniforme de todas (distinta de la de un solo proceso).
+static bool clusterSample(const vector<string>& patterns, int n, const Dict& d, mt19937& rng, vector<size_t>& ids, size_t& total) {
+	if (!clusterActive(d) || n < 0) return false;
+	shared_lock<shared_mutex> lk(g_cluster->updates);
+	if (!clusterActive(d)) return false;
+	string req = scanRequest('S') + "\n" + to_string(n) + "\n" + to_string(rng());
+	for (const string& p : patterns) req += "\n" + p;
+	vector<string> resp;
+	if (!broadcast(req, resp)) return false;
+	vector<size_t> left(resp.size());
+	vector<vector<size_t>> samples(resp.size());
+	total = 0;
+	for (size_t k = 0; k < resp.size(); k++) {
+		vector<vector<size_t>> one;
+		if (!parseScanReply(resp[k], left[k], one) || one.size() != 1) return false;
+		samples[k] = move(one[0]);
+		total += left[k];
+	}
+	ids.clear();
+	vector<size_t> next(resp.size(), 0);
+	for (size_t remaining = total; ids.size() < (size_t)n && remaining > 0; remaining--) {
+		size_t r = uniform_int_distribution<size_t>(0, remaining - 1)(rng), k = 0;
+		while (r >= left[k]) r -= left[k++];
+		ids.push_back(samples[k][next[k]++]);
+		left[k]--;
+	}
+	return true;
+}
+
+// Aplica en los trabajadores los cambios de /add y /remove que ya se aplicaron a 'd'. Espera
+// a que acaben los recorridos en curso: ninguno ve a los trabajadores a medio cambiar.
+static void clusterUpdate(const Dict& d, const vector<string>& ops) {
+	if (!g_cluster || !g_cluster->ready || g_cluster->name != d.name) return;
+	unique_lock<shared_mutex> lk(g_cluster->updates);
+	string req = "U";
+	for (size_t i = 0; i < ops.size(); i++) req += (i ? "\n" : "") + ops[i];
+	vector<string> resp;
+	if (!broadcast(req, resp)) return;
+	for (const string& r : resp) {
+		istringstream in(r);
+		string ok;
+		size_t words = 0, forms = 0;
+		if (!(in >> ok >> words >> forms) || ok != "OK" || words != d.size() || forms != d.formCount()) {
+			cerr << "(Los procesos trabajadores no han aplicado los cambios igual; se sigue sin ellos)\n";
+			g_cluster->ready = false;
+			return;
+		}
+	}
+	g_cluster->words = d.size();
+	g_cluster->forms = d.formCount();
+}
+
+#else
+
+static bool startWorkers(int, const vector<string>&) { cerr << "Los procesos trabajadores solo están disponibles en Linux\n"; return false; }
+static void stopWorkers() {}
+static void clusterLoad(const Dict&) {}
+static bool clusterActive(const Dict&) { return false; }
+static size_t clusterWorkers(const Dict&) { return 0; }
+static bool clusterScan(const vector<string>&, const Dict&, size_t, vector<vector<size_t>>&, size_t* = nullptr) { return false; }
+static bool clusterHomophones(const string&, const string&, int, const Dict&, vector<size_t>&) { return false; }
+static bool clusterSample(const vector<string>&, int, const Dict&, mt19937&, vector<size_t>&, size_t&) { return false; }
+static void clusterUpdate(const Dict&, const vector<string>&) {}
+
+#endif
+
+// El .bin y NOMBRE.delta se leen sin que cambien entre medias (ver compactDelta), y los
+// trabajadores cargan los mismos.
+static bool loadDict(const string& name, Dict& d, ostream& log = cout, LoadProgress* prog = nullptr) {
+	Dict nd; nd.name = name;
+	lock_guard<mutex> lk(g_delta.mtx);
+	string deltaFile = name + ".delta";
+	// NOMBRE.shd, si está al día, se usa directamente desde el disco
+	if (fs::exists(name + ".shd") && openShardFile(name, nd, log)) {
+		if (fs::exists(deltaFile)) log << "(Los cambios de '" << deltaFile << "' no se aplican a '" << name << ".shd'.)\n";
+		d = move(nd);
+		clusterLoad(d);
+		return true;
+	}
+	future<void> cacheWrite;
+	if (!loadDictionary(name, nd.raw_dict, nd.dictionary, log, prog, &cacheWrite)) return false;
+	if (prog) prog->begin("preparando índices", 0);
+	loadDictIndex(nd, name + ".idx", log, prog);
+	if (prog) prog->begin("estadísticas", 0);
+	buildDictStats(nd.stats, nd.dictionary, nd.raw_dict);
+	if (cacheWrite.valid()) cacheWrite.get();
+	vector<string> ops = readDeltaOps(deltaFile);
+	g_delta.pending[name] = ops.size();
+	if (!g_compactDicts || !ops.empty()) buildCalLookup(nd);
+	if (!ops.empty()) {
+		if (prog) prog->begin("aplicando cambios", 0);
+		applyUpdates(nd, ops);
+		nd = foldOverlay(nd);
+		log << "(Aplicados " << ops.size() << " cambios de '" << deltaFile << "')\n";
+	}
+	if (g_compactDicts) {
+		if (prog) prog->begin("compactando", 0);
+		compactDict(nd);
+	}
+	d = move(nd);
+	clusterLoad(d);
+	return true;
+}
+
+// --- DICCIONARIOS RESIDENTES ---
+//
+// Los diccionarios cargados se quedan en memoria hasta /unload, así que volver con /load a
+// uno ya cargado solo cambia cuál es el activo. Las expresiones booleanas eligen el
+// diccionario de cada hoja con @NOMBRE(...), como en @slang(/aso AMOR) - @default(/aso AMOR);
+// una hoja sin @ usa el activo. Si la expresión usa otro diccionario que el activo, los
+// conjuntos se combinan sobre la unión de sus palabras (ver DictUnion), que salen en el
+// orden de los diccionarios por nombre. Los procesos trabajadores solo tienen el último
+// diccionario cargado; los demás se recorren en este proceso.
+
+struct ResidentDicts {
+	mutex mtx;
+	map<string, shared_ptr<Dict>> dicts;
+};
+
+static ResidentDicts g_resident;
+
+static const uint32_t kNotInUnion = UINT32_MAX; // entrada quitada con /remove
+
+// Unión de las palabras de varios diccionarios: cada texto distinto (sin las entradas
+// quitadas con /remove) tiene un índice propio, esté en uno o en varios. El texto no se
+// copia: 'origin' dice en qué diccionario y entrada aparece primero.
+struct DictUnion {
+	vector<shared_ptr<const Dict>> dicts;
+	vector<pair<size_t, size_t>> stamps;      // entradas y quitadas de cada uno al construirla
+	vector<vector<uint32_t>> toUnion;         // diccionario → entrada → palabra (o kNotInUnion)
+	vector<pair<uint32_t, uint32_t>> origin;  // palabra → (diccionario, entrada)
+
+	size_t size() const { return origin.size(); }
+	string word(size_t u) const { return dicts[origin[u].first]->raw(origin[u].second); }
+
+	// Los diccionarios son los mismos y no han cambiado desde que se construyó
+	bool matches(const vector<shared_ptr<const Dict>>& ds) const {
+		if (ds.size() != dicts.size()) return false;
+		for (size_t k = 0; k < ds.size(); k++)
+			if (ds[k] != dicts[k] || stamps[k] != make_pair(ds[k]->size(), ds[k]->removedCount)) return false;
+		return true;
+	}
+};
+
+// Uniones ya calculadas, por nombres de sus diccionarios (se rehacen si alguno cambia)
+struct UnionCache {
+	mutex mtx;
+	map<string, shared_ptr<const DictUnion>> byNames;
+};
+
+static UnionCache g_unions;
+
+// Olvida las uniones en las que está 'name' (con mtx de g_unions bloqueado)
+static void forgetUnions(const string& name) {
+	for (auto it = g_unions.byNames.begin(); it != g_unions.byNames.end(); ) {
+		const auto& ds = it->second->dicts;
+		bool uses = any_of(ds.begin(), ds.end(), [&](const shared_ptr<const Dict>& d) { return d->name == name; });
+		it = uses ? g_unions.byNames.erase(it) : next(it);
+	}
+}
+
+static shared_ptr<Dict> residentDict(const string& name) {
+	lock_guard<mutex> lk(g_resident.mtx);
+	auto it = g_resident.dicts.find(name);
+	return it == g_resident.dicts.end() ? nullptr : it->second;
+}
+
+// Guarda 'd' como diccionario residente; sustituye al que tuviera su nombre
+static void keepResident(shared_ptr<Dict> d) {
+	{
+		lock_guard<mutex> lk(g_unions.mtx);
+		forgetUnions(d->name);
+	}
+	lock_guard<mutex> lk(g_resident.mtx);
+	g_resident.dicts[d->name] = move(d);
+}
+
+// Saca de memoria el diccionario 'name'. Las consultas que lo estén usando lo conservan
+// hasta terminar. Devuelve false si no estaba.
+static bool dropResident(const string& name) {
+	shared_ptr<Dict> gone;
+	{
+		lock_guard<mutex> lk(g_resident.mtx);
+		auto it = g_resident.dicts.find(name);
+		if (it == g_resident.dicts.end()) return false;
+		gone = move(it->second);
+		g_resident.dicts.erase(it);
+	}
+	{
+		lock_guard<mutex> lk(g_unions.mtx);
+		forgetUnions(name);
+	}
+	if (gone.use_count() == 1) {
+		gone.reset();
+#ifdef __GLIBC__
+		malloc_trim(0);
+#endif
+	}
+	return true;
+}
+
+static vector<string> residentNames() {
+	lock_guard<mutex> lk(g_resident.mtx);
+	vector<string> names;
+	for (const auto& r : g_resident.dicts) names.push_back(r.first);
+	return names;
+}
+
+// Recorre las entradas de cada diccionario en orden y da índice a los textos nuevos. Las
+// claves apuntan a las cadenas del diccionario; las de uno comprimido, que se descomprime
+// bloque a bloque, se copian mientras dura la construcción.
+static shared_ptr<const DictUnion> buildDictUnion(const vector<shared_ptr<const Dict>>& dicts) {
+	auto u = make_shared<DictUnion>();
+	u->dicts = dicts;
+	unordered_map<string_view, uint32_t> ids;
+	deque<string> copies;
+	for (size_t k = 0; k < dicts.size(); k++) {
+		const Dict& d = *dicts[k];
+		u->stamps.push_back({ d.size(), d.removedCount });
+		u->toUnion.emplace_back(d.size(), kNotInUnion);
+		vector<uint32_t>& map = u->toUnion.back();
+		forEachEntry(d, 0, d.size(), [&](size_t i, const string& raw) {
+			if (d.isRemoved(i)) return;
+			auto it = ids.find(raw);
+			if (it == ids.end()) {
+				string_view key = d.packed ? string_view(copies.emplace_back(raw)) : string_view(raw);
+				it = ids.emplace(key, (uint32_t)u->origin.size()).first;
+				u->origin.push_back({ (uint32_t)k, (uint32_t)i });
+			}
+			map[i] = it->second;
+		});
+	}
+	return u;
+}
+
+// Unión de 'dicts', en ese orden. Con 'cache' se guarda para las consultas siguientes
+// (solo si todos son residentes: la caché los mantiene vivos).
+static shared_ptr<const DictUnion> dictUnion(const vector<shared_ptr<const Dict>>& dicts, bool cache) {
+	string key;
+	for (const auto& d : dicts) key += d->name + "\n";
+	if (cache) {
+		lock_guard<mutex> lk(g_unions.mtx);
+		auto it = g_unions.byNames.find(key);
+		if (it != g_unions.byNames.end() && it->second->matches(dicts)) return it->second;
+	}
+	shared_ptr<const DictUnion> u = buildDictUnion(dicts);
+	if (cache) {
+		lock_guard<mutex> lk(g_unions.mtx);
+		g_unions.byNames[key] = u;
+	}
+	return u;
+}
+
+// --- LÓGICA DE BÚSQUEDA ---
+
+void parseInput(string input, vector<PatternElement>& elems, vector<ResourceCondition>& resources, int& tolerance, bool& is_total, bool* parse_error = nullptr) {
+	input.erase(0, input.find_first_not_of(" "));
+	input.erase(input.find_last_not_of(" ") + 1);
+
+	string p_str = input, r_str = "";
+	tolerance = 0;
+	is_total = false;
+
+	size_t b_start = input.find('[');
+	if (b_start != string::npos) {
+		size_t b_end = input.find(']', b_start);
+		if (b_end != string::npos) {
+			p_str = input.substr(0, b_start);
+			r_str = input.substr(b_start + 1, b_end - b_start - 1);
+			string rem = input.substr(b_end + 1);
+			rem.erase(0, rem.find_first_not_of(" "));
+			if (!rem.empty()) {
+				if (rem.back() == '*') { is_total = true; rem.pop_back(); }
+				if (!rem.empty() && all_of(rem.begin(), rem.end(), [](unsigned char ch) { return isdigit(ch); }))
+					tolerance = safeStoi(rem);
+				else is_total = false;
+			}
+		}
+	}
+	else {
+		size_t last_space = input.find_last_of(" ");
+		if (last_space != string::npos) {
+			string rem = input.substr(last_space + 1);
+			if (!rem.empty()) {
+				bool local_is_total = false;
+				if (rem.back() == '*') { local_is_total = true; rem.pop_back(); }
+				if (!rem.empty() && all_of(rem.begin(), rem.end(), [](unsigned char ch) { return isdigit(ch); })) {
+					tolerance = safeStoi(rem);
+					is_total = local_is_total;
+					p_str = input.substr(0, last_space);
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < p_str.length(); ++i) {
+		char c = p_str[i];
+		if (c == '*') elems.push_back({ ANY, 1, 1, 0 });
+		else if (c == '.') elems.push_back({ ANY, 0, 99, 0 });
+		else if (c == '(') {
+			size_t j = p_str.find(')', i);
+			if (j == string::npos) break;
+			string inside = p_str.substr(i + 1, j - i - 1);
+			auto parts = split(inside, ',');
+			// Validate: a range spec has up to 3 parts: digits, digits, V|C
+			bool valid_range = (parts.size() <= 3);
+			if (valid_range && !parts.empty() && !parts[0].empty())
+				valid_range = all_of(parts[0].begin(), parts[0].end(), [](unsigned char ch) { return isdigit(ch); });
+			if (valid_range && parts.size() >= 2 && !parts[1].empty())
+				valid_range = all_of(parts[1].begin(), parts[1].end(), [](unsigned char ch) { return isdigit(ch); });
+			if (valid_range && parts.size() >= 3 && !parts[2].empty())
+				valid_range = (parts[2] == "V" || parts[2] == "C");
+			if (!valid_range) {
+				if (parse_error) *parse_error = true;
+				elems.clear();
+				break;
+			}
+			int min_c = (parts.size() > 0 && !parts[0].empty()) ? safeStoi(parts[0]) : 0;
+			int max_c = (parts.size() > 1 && !parts[1].empty()) ? safeStoi(parts[1]) : 99;
+			ElementType type = ANY;
+			if (parts.size() > 2 && !parts[2].empty()) {
+				if (parts[2] == "V") type = VOWEL;
+				else if (parts[2] == "C") type = CONSONANT;
+			}
+			elems.push_back({ type, min_c, max_c, 0 });
+			i = j;
+		}
+		else if (isalpha((unsigned char)c) || c == '~') {
+			elems.push_back({ EXACT, 1, 1, (char)toupper((unsigned char)c) });
+		}
+	}
+
+	if (!r_str.empty())
+		resources = parseConditionList(r_str);
+}
+
+// Errores de una condición para el valor 'val' de la palabra (0 = la cumple)
+static int resourceError(const ResourceCondition& res, int val) {
+	if (res.op == "==") return abs(val - res.num);
+	if (res.op == ">=") return (val < res.num) ? res.num - val : 0;
+	if (res.op == "<=") return (val > res.num) ? val - res.num : 0;
+	if (res.op == ">") return (val <= res.num) ? (res.num + 1) - val : 0;
+	if (res.op == "<") return (val >= res.num) ? val - (res.num - 1) : 0;
+	return 0;
+}
+
+int checkResources(const string& word, const string& raw_word, const vector<ResourceCondition>& resources) {
+	if (resources.empty()) return 0;
+	int v_count = 0, c_count = 0, l_count[256] = { 0 };
+	for (char c : word) {
+		if (isVowel(c)) v_count++;
+		if (isConsonant(c)) c_count++;
+		l_count[(unsigned char)c]++;
+	}
+
+	int total_errors = 0;
+	for (const auto& res : resources) {
+		int val = 0;
+		if (res.target == "V*") val = v_count;
+		else if (res.target == "C*") val = c_count;
+		else if (res.target == "S*") val = (int)getSyllables(word).size();
+		else if (res.target == "T*") val = getStressPosition(raw_word);
+		else if (res.target == "") val = (int)word.length();
+		else if (res.target.size() == 1) val = l_count[(unsigned char)res.target[0]];
+		else {
+			// Subcadena: contar ocurrencias de res.target en word
+			size_t pos = 0;
+			while ((pos = word.find(res.target, pos)) != string::npos) { val++; pos++; }
+		}
+
+		total_errors += resourceError(res, val);
+	}
+	return total_errors;
+}
+
+// --- ORDEN DE RESTRICCIONES ---
+
+// Restricciones de un patrón en el orden en que conviene evaluarlas: primero las baratas
+// (conteos y subcadenas) y, al final, las que calculan sílabas o acento. Dentro de cada
+// grupo van antes las que más palabras descartan por unidad de coste.
+struct RestrictionPlan {
+	vector<ResourceCondition> conds;
+	vector<double> pass;      // fracción estimada de palabras que cumplen cada condición
+	size_t costly_from = 0;   // índice de la primera condición de S* o T*
+	bool raw_dependent = false; // alguna condición depende de la forma raw (T*)
+	const uint8_t* syllables = nullptr; // columnas del .idx por entrada (ver attachColumns)
+	const uint8_t* stress = nullptr;
+	size_t columnEntries = 0;           // entradas que tienen columna
+};
+
+static bool isCostlyCondition(const ResourceCondition& r) { return r.target == "S*" || r.target == "T*"; }
+
+// Valor de una condición para una palabra (el mismo que calcula checkResources)
+static int conditionValue(const ResourceCondition& res, const string& word, const string& raw_word) {
+	if (res.target == "V*") return (int)count_if(word.begin(), word.end(), [](char c) { return isVowel(c); });
+	if (res.target == "C*") return (int)count_if(word.begin(), word.end(), [](char c) { return isConsonant(c); });
+	if (res.target == "S*") return (int)getSyllables(word).size();
+	if (res.target == "T*") return getStressPosition(raw_word);
+	if (res.target == "") return (int)word.length();
+	if (res.target.size() == 1) return (int)count(word.begin(), word.end(), res.target[0]);
+	int val = 0;
+	size_t pos = 0;
+	while ((pos = word.find(res.target, pos)) != string::npos) { val++; pos++; }
+	return val;
+}
+
+// Fracción de palabras del diccionario que cumplen la condición, según los histogramas
+static double estimatePass(const ResourceCondition& r, const DictStats& st) {
+	vector<size_t> two;
+	const vector<size_t>* h = nullptr;
+	if (r.target == "") h = &st.lenHist;
+	else if (r.target == "V*") h = &st.vowelHist;
+	else if (r.target == "C*") h = &st.consHist;
+	else if (r.target == "S*") h = &st.sylHist;
+	else if (r.target == "T*") h = &st.stressHist;
+	else if (r.target.size() == 1) { if (!st.letterHist.empty()) h = &st.letterHist[(unsigned char)r.target[0]]; }
+	else if (!st.bigramDocs.empty()) {
+		// Subcadena: como mucho, las palabras que contienen su bigrama menos frecuente
+		size_t docs = st.words;
+		for (size_t k = 0; k + 1 < r.target.size(); k++)
+			docs = (std::min)(docs, st.bigramDocs[(unsigned char)r.target[k] * 256 + (unsigned char)r.target[k + 1]]);
+		two = { st.words - docs, docs };
+		h = &two;
+	}
+	if (!h) return 1.0;
+	size_t total = 0, ok = 0;
+	for (size_t k = 0; k < h->size(); k++) {
+		total += (*h)[k];
+		if (resourceError(r, (int)k) == 0) ok += (*h)[k];
+	}
+	return total ? (double)ok / total : 1.0;
+}
+
+static RestrictionPlan planRestrictions(const vector<ResourceCondition>& resources, const DictStats& st) {
+	struct Item { ResourceCondition r; double pass, key; bool costly; };
+	vector<Item> items;
+	for (const auto& r : resources) {
+		bool costly = isCostlyCondition(r);
+		double cost = costly ? 40.0 : (r.target.size() > 1 ? 2.0 : 1.0);
+		double pass = estimatePass(r, st);
+		items.push_back({ r, pass, cost / (std::max)(1.0 - pass, 1e-3), costly });
+	}
+	stable_sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+		if (a.costly != b.costly) return !a.costly;
+		return a.key < b.key;
+	});
+	RestrictionPlan plan;
+	plan.costly_from = items.size();
+	for (size_t i = 0; i < items.size(); i++) {
+		if (items[i].costly && plan.costly_from == items.size()) plan.costly_from = i;
+		plan.conds.push_back(items[i].r);
+		plan.pass.push_back(items[i].pass);
+		if (items[i].r.target == "T*") plan.raw_dependent = true;
+	}
+	return plan;
+}
+
+// Con columnas precalculadas, S* y T* se leen del índice en vez de silabificar la palabra.
+// Solo se cargan si el plan las usa.
+static void attachColumns(RestrictionPlan& plan, const Dict& d) {
+	plan.columnEntries = columnEntries(d);
+	for (const auto& r : plan.conds) {
+		if (r.target == "S*" && !plan.syllables) plan.syllables = syllableColumn(d);
+		if (r.target == "T*" && !plan.stress) plan.stress = stressColumn(d);
+	}
+}
+
+// Suma los errores de las condiciones [from, to) del plan y se detiene en cuanto superan
+// 'budget'. Mientras no lo superan, el total coincide con el de checkResources.
+// 'id' es la entrada del diccionario, para leer las columnas del plan si la tiene (una añadida
+// con /add aún no tiene), o SIZE_MAX si no se conoce.
+static int checkRestrictions(const string& word, const string& raw_word, const RestrictionPlan& plan,
+	size_t from, size_t to, int budget, size_t id = SIZE_MAX) {
+	int errors = 0;
+	for (size_t k = from; k < to; k++) {
+		const ResourceCondition& c = plan.conds[k];
+		uint8_t col = 255;
+		if (id < plan.columnEntries && plan.syllables && c.target == "S*") col = plan.syllables[id];
+		else if (id < plan.columnEntries && plan.stress && c.target == "T*") col = plan.stress[id];
+		errors += resourceError(c, col != 255 ? col : conditionValue(c, word, raw_word));
+		if (errors > budget) break;
+	}
+	return errors;
+}
+
+// Qué parte de un patrón hay que repetir para cada variante raw de una forma normalizada.
+// Sin T*, nada: el resultado de la forma vale para todas. Con T* y tolerancia n, solo las
+// restricciones posteriores al patrón (T* siempre va al final). Con n*, todo, porque los
+// errores de T* cambian la tolerancia que le queda al patrón.
+enum class VariantMode { SHARED, POST, ALL };
+
+static VariantMode variantMode(const RestrictionPlan& plan, bool is_total) {
+	if (!plan.raw_dependent) return VariantMode::SHARED;
+	return is_total ? VariantMode::ALL : VariantMode::POST;
+}
+
+bool matchPattern(const string& word, int w_idx, const vector<PatternElement>& elems, int e_idx, int err_left) {
+	if (err_left < 0) return false;
+	if (e_idx == (int)elems.size()) return (int)word.length() - w_idx <= err_left;
+	if (memo_buffer[w_idx][e_idx][err_left] != -1) { t_memo_hits++; return memo_buffer[w_idx][e_idx][err_left] == 1; }
+	t_memo_misses++;
+
+	const auto& E = elems[e_idx];
+	bool matched = false;
+	int max_l = (E.max_count > 50) ? (int)word.length() - w_idx : E.max_count + err_left;
+
+	for (int L = 0; w_idx + L <= (int)word.length() && L <= max_l; ++L) {
+		int c_err = 0;
+		int m_chars = (std::min)(L, E.max_count);
+		int extra = (L > E.max_count) ? L - E.max_count : 0;
+		int miss = (L < E.min_count) ? E.min_count - L : 0;
+
+		for (int i = 0; i < m_chars; ++i) {
+			char c = word[w_idx + i];
+			if (E.type == EXACT && c != E.exact_char) c_err++;
+			else if (E.type == VOWEL && !isVowel(c)) c_err++;
+			else if (E.type == CONSONANT && !isConsonant(c)) c_err++;
+		}
+		if (c_err + extra + miss <= err_left) {
+			if (matchPattern(word, w_idx + L, elems, e_idx + 1, err_left - (c_err + extra + miss))) {
+				matched = true; break;
+			}
+		}
+	}
+	return (memo_buffer[w_idx][e_idx][err_left] = matched ? 1 : 0);
+}
+
+// Línea de patrón ya analizada, con los filtros previos que permiten descartar
+// una palabra sin llamar a matchPattern
+struct CompiledPattern {
+	bool ok = false;                 // false si el patrón tiene errores de sintaxis
+	vector<PatternElement> elems;
+	RestrictionPlan rplan;
+	int tolerance = 0;
+	bool is_total = false;
+	int min_len = 0, max_len = 0;    // longitudes de palabra con las que puede coincidir
+	uint32_t need_mask = 0;          // letras exactas obligatorias (ver letterBit)
+	int need[28] = { 0 };            // por letra, errores mínimos si la palabra no la contiene
+};
+
+// Analiza el patrón y calcula sus cotas. Cada elemento cuesta al menos lo que le falte
+// para llegar a su mínimo y lo que exceda su máximo, así que una palabra de longitud n
+// solo puede coincidir si sum(min) - tol <= n <= sum(max) + tol. Del mismo modo, cada
+// letra exacta obligatoria ausente en la palabra cuesta al menos un error por aparición.
+static CompiledPattern compilePattern(const string& pLine, const DictStats& st) {
+	CompiledPattern cp;
+	vector<ResourceCondition> resources;
+	bool parse_err = false;
+	parseInput(pLine, cp.elems, resources, cp.tolerance, cp.is_total, &parse_err);
+	if (parse_err) return cp;
+	cp.ok = true;
+	cp.rplan = planRestrictions(resources, st);
+
+	long long lo = 0, hi = 0;
+	for (const auto& E : cp.elems) {
+		lo += E.min_count;
+		hi += E.max_count;
+		if (E.type == EXACT && E.min_count > 0) {
+			int b = letterBit(E.exact_char);
+			cp.need_mask |= 1u << b;
+			cp.need[b] += E.min_count;
+		}
+	}
+	cp.min_len = (int)(std::max)(0LL, lo - cp.tolerance);
+	cp.max_len = (int)(std::min)((long long)INT_MAX, hi + cp.tolerance);
+	return cp;
+}
+
+// Errores mínimos por las letras exactas obligatorias que faltan en una palabra con letras 'mask'
+static int missingLetterCost(const CompiledPattern& cp, uint32_t mask) {
+	uint32_t missing = cp.need_mask & ~mask;
+	int cost = 0;
+	for (int b = 0; missing && b < 28; b++) if (missing & (1u << b)) cost += cp.need[b];
+	return cost;
+}
+
+// true si ninguna forma de un bloque del modo compacto puede coincidir con el patrón: las
+// mismas cotas que se aplican palabra a palabra, con las letras de todo el bloque
+static bool blockExcluded(const CompiledPattern& cp, const PackedBlock& b) {
+	return !cp.ok || b.min_len >= 100 || b.min_len > cp.max_len || b.max_len < cp.min_len
+		|| missingLetterCost(cp, b.mask) > cp.tolerance;
+}
+
+// Versión de scanPattern que además mide cada etapa en la hoja activa de /stats.
+// Va aparte para que el camino normal no pague las llamadas al reloj.
+static bool scanPatternProfiled(const string& pLine, const Dict& d, vector<bool>& matched, vector<size_t>* hits, LeafStats& ls) {
+	auto t0 = chrono::steady_clock::now();
+	CompiledPattern cp = compilePattern(pLine, d.stats);
+	if (!cp.ok) { ls.parse_ms += msSince(t0); return false; }
+	const vector<PatternElement>& elems = cp.elems;
+	RestrictionPlan& rplan = cp.rplan;
+	int tolerance = cp.tolerance;
+	bool is_total = cp.is_total;
+	attachColumns(rplan, d);
+	ls.parse_ms += msSince(t0);
+	ls.patterns++;
+
+	size_t pre_end = is_total ? rplan.conds.size() : rplan.costly_from;
+	int budget = is_total ? tolerance : 0;
+	VariantMode mode = variantMode(rplan, is_total);
+	size_t hits0 = t_memo_hits, misses0 = t_memo_misses, first_hit = hits ? hits->size() : 0;
+	double res_ms = 0, match_ms = 0;
+
+	// Restricciones previas y patrón sobre la forma normalizada w
+	auto matchForm = [&](const string& w, uint32_t id) {
+		auto t1 = chrono::steady_clock::now();
+		int res_errors = checkRestrictions(w, d.scanRaw(id), rplan, 0, pre_end, budget, id);
+		auto t2 = chrono::steady_clock::now();
+		res_ms += chrono::duration<double, milli>(t2 - t1).count();
+		if (res_errors > budget) { ls.rejected++; return false; }
+		int remaining_tolerance = tolerance - (is_total ? res_errors : 0);
+
+		for (int r = 0; r <= (int)w.length(); ++r)
+			for (int e = 0; e <= (int)elems.size(); ++e)
+				for (int t = 0; t <= remaining_tolerance; ++t) memo_buffer[r][e][t] = -1;
+
+		bool ok = matchPattern(w, 0, elems, 0, remaining_tolerance);
+		match_ms += msSince(t2);
+		return ok;
+	};
+	// Restricciones posteriores (S*, T*)
+	auto postOk = [&](const string& w, uint32_t id) {
+		if (pre_end >= rplan.conds.size()) return true;
+		auto t3 = chrono::steady_clock::now();
+		bool ok = checkRestrictions(w, d.scanRaw(id), rplan, pre_end, rplan.conds.size(), 0, id) == 0;
+		res_ms += msSince(t3);
+		if (!ok) ls.rejected++;
+		return ok;
+	};
+
+	auto [from, to] = ownedForms(d);
+	forEachForm(d, from, to, [&](const PackedBlock& b) { return blockExcluded(cp, b); }, [&](size_t f, const string& w, const uint32_t* v0, const uint32_t* v1) {
+		if ((f & 255) == 0 && budgetSpend(256)) return false;
+		if (w.length() >= 100) return true;
+		if (all_of(v0, v1, [&](uint32_t i) { return matched[i]; })) return true; // Ya fue encontrada por otro patrón
+		ls.scanned++;
+
+		if (mode != VariantMode::ALL && !matchForm(w, *v0)) return true;
+		bool shared_ok = mode != VariantMode::SHARED || postOk(w, *v0);
+		for (const uint32_t* v = v0; v < v1; ++v) {
+			if (matched[*v]) continue;
+			if (mode == VariantMode::ALL && !matchForm(w, *v)) continue;
+			if (mode == VariantMode::SHARED ? !shared_ok : !postOk(w, *v)) continue;
+			matched[*v] = true;
+			if (hits) hits->push_back(*v);
+		}
+		return true;
+	});
+	if (hits) sort(hits->begin() + first_hit, hits->end());
+	ls.resources_ms += res_ms;
+	ls.match_ms += match_ms;
+	ls.memo_hits += t_memo_hits - hits0;
+	ls.memo_misses += t_memo_misses - misses0;
+	return true;
+}
+
+// Evalúa una línea de patrón (ESTRUCTURA [R] n) sobre todo el diccionario.
+// Marca en 'matched' las coincidencias nuevas y, si se indica, añade sus índices a 'hits'
+// en orden de diccionario. Devuelve false si el patrón tiene errores de sintaxis.
+//
+// Las restricciones se evalúan en el orden de planRestrictions y se abandonan en cuanto
+// los errores superan lo permitido (n* reparte la tolerancia; con n deben dar 0). Con n,
+// las de sílabas y acento se dejan para después de matchPattern, que suele ser más barato.
+static bool scanPattern(const string& pLine, const Dict& d, vector<bool>& matched, vector<size_t>* hits = nullptr) {
+	// Con --workers, el recorrido lo hacen los trabajadores
+	if (clusterActive(d)) {
+		if (!compilePattern(pLine, d.stats).ok) return false;
+		vector<vector<size_t>> found;
+		if (clusterScan({ pLine }, d, 0, found)) {
+			for (size_t id : found[0])
+				if (!matched[id]) { matched[id] = true; if (hits) hits->push_back(id); }
+			if (t_leaf) t_leaf->patterns++;
+			return true;
+		}
+	}
+	if (t_leaf) return scanPatternProfiled(pLine, d, matched, hits, *t_leaf);
+
+	CompiledPattern cp = compilePattern(pLine, d.stats);
+	if (!cp.ok) return false;
+	const vector<PatternElement>& elems = cp.elems;
+	RestrictionPlan& rplan = cp.rplan;
+	int tolerance = cp.tolerance;
+	bool is_total = cp.is_total;
+	attachColumns(rplan, d);
+
+	// Con n*, todas las restricciones van antes del patrón: sus errores reducen la tolerancia
+	size_t pre_end = is_total ? rplan.conds.size() : rplan.costly_from;
+	int budget = is_total ? tolerance : 0;
+	VariantMode mode = variantMode(rplan, is_total);
+	size_t first_hit = hits ? hits->size() : 0;
+
+	auto matchForm = [&](const string& w, uint32_t id) {
+		int res_errors = checkRestrictions(w, d.scanRaw(id), rplan, 0, pre_end, budget, id);
+		if (res_errors > budget) return false;
+		int remaining_tolerance = tolerance - (is_total ? res_errors : 0);
+
+		for (int r = 0; r <= (int)w.length(); ++r)
+			for (int e = 0; e <= (int)elems.size(); ++e)
+				for (int t = 0; t <= remaining_tolerance; ++t) memo_buffer[r][e][t] = -1;
+
+		return matchPattern(w, 0, elems, 0, remaining_tolerance);
+	};
+	auto postOk = [&](const string& w, uint32_t id) {
+		return pre_end >= rplan.conds.size() || checkRestrictions(w, d.scanRaw(id), rplan, pre_end, rplan.conds.size(), 0, id) == 0;
+	};
+
+	// Una evaluación por forma normalizada; el resultado se reparte entre sus variantes raw.
+	// En modo compacto se saltan los bloques de formas que no pueden coincidir.
+	auto [from, to] = ownedForms(d);
+	forEachForm(d, from, to, [&](const PackedBlock& b) { return blockExcluded(cp, b); }, [&](size_t f, const string& w, const uint32_t* v0, const uint32_t* v1) {
+		if ((f & 255) == 0 && budgetSpend(256)) return false;
+		if (w.length() >= 100) return true;
+		if (all_of(v0, v1, [&](uint32_t i) { return matched[i]; })) return true; // Ya fue encontrada por otro patrón
+
+		if (mode != VariantMode::ALL && !matchForm(w, *v0)) return true;
+		bool shared_ok = mode != VariantMode::SHARED || postOk(w, *v0);
+		for (const uint32_t* v = v0; v < v1; ++v) {
+			if (matched[*v]) continue;
+			if (mode == VariantMode::ALL && !matchForm(w, *v)) continue;
+			if (mode == VariantMode::SHARED ? !shared_ok : !postOk(w, *v)) continue;
+			matched[*v] = true;
+			if (hits) hits->push_back(*v);
+		}
+		return true;
+	});
+	// Las variantes de una forma no son contiguas: devolver los índices en orden de diccionario
+	if (hits) sort(hits->begin() + first_hit, hits->end());
+	return true;
+}
+
+// --- EVALUACIÓN CONJUNTA DE PATRONES ---
+
+// Evalúa varias líneas de patrón en una sola pasada por el diccionario: cada palabra se
+// prueba contra todos los patrones cuyas cotas de longitud y letras la admiten.
+// Devuelve, por patrón, los índices encontrados en orden de diccionario (lo mismo que
+// scanPattern con cada uno por separado; vacío si el patrón tiene errores de sintaxis).
+static vector<vector<size_t>> runSearchMulti(const vector<string>& patterns, const Dict& d) {
+	vector<vector<size_t>> out(patterns.size());
+	if (clusterScan(patterns, d, 0, out)) return out;
+	auto t0 = chrono::steady_clock::now();
+	vector<CompiledPattern> cps;
+	cps.reserve(patterns.size());
+	for (const string& p : patterns) {
+		cps.push_back(compilePattern(p, d.stats));
+		attachColumns(cps.back().rplan, d);
+	}
+
+	// Patrones candidatos por longitud de palabra (las palabras de 100 o más letras no se evalúan)
+	vector<vector<int>> byLen(100);
+	for (int p = 0; p < (int)cps.size(); p++) {
+		if (!cps[p].ok) continue;
+		for (int n = cps[p].min_len; n < 100 && n <= cps[p].max_len; n++) byLen[n].push_back(p);
+	}
+
+	LeafScope leaf(patterns.size() == 1 ? patterns[0] : "(" + to_string(patterns.size()) + " patrones en una pasada)");
+	LeafStats* ls = leaf.get();
+	size_t hits0 = t_memo_hits, misses0 = t_memo_misses;
+	auto t1 = chrono::steady_clock::now();
+
+	// En modo compacto, un bloque de formas se salta si no puede coincidir con ningún patrón
+	auto skipBlock = [&](const PackedBlock& b) {
+		return all_of(cps.begin(), cps.end(), [&](const CompiledPattern& cp) { return blockExcluded(cp, b); });
+	};
+
+	// Recorre las formas [from, to) y deja en res[patrón] los índices de las variantes encontradas
+	auto scanRange = [&](size_t from, size_t to, vector<vector<size_t>>& res) {
+		forEachForm(d, from, to, skipBlock, [&](size_t f, const string& w, const uint32_t* v0, const uint32_t* v1) {
+			if ((f & 255) == 0 && budgetSpend(256)) return false;
+			if (w.length() >= 100) return true;
+			const vector<int>& cand = byLen[w.length()];
+			if (cand.empty()) return true;
+			if (ls) ls->scanned++;
+			uint32_t mask = letterMask(w);
+
+			for (int p : cand) {
+				const CompiledPattern& cp = cps[p];
+				if ((cp.need_mask & ~mask) && missingLetterCost(cp, mask) > cp.tolerance) continue;
+
+				// Igual que scanPattern
+				size_t pre_end = cp.is_total ? cp.rplan.conds.size() : cp.rplan.costly_from;
+				int budget = cp.is_total ? cp.tolerance : 0;
+				VariantMode mode = variantMode(cp.rplan, cp.is_total);
+				auto matchForm = [&](uint32_t id) {
+					int res_errors = checkRestrictions(w, d.scanRaw(id), cp.rplan, 0, pre_end, budget, id);
+					if (res_errors > budget) { if (ls) ls->rejected++; return false; }
+					int remaining_tolerance = cp.tolerance - (cp.is_total ? res_errors : 0);
+
+					for (int r = 0; r <= (int)w.length(); ++r)
+						for (int e = 0; e <= (int)cp.elems.size(); ++e)
+							for (int t = 0; t <= remaining_tolerance; ++t) memo_buffer[r][e][t] = -1;
+
+					return matchPattern(w, 0, cp.elems, 0, remaining_tolerance);
+				};
+				auto postOk = [&](uint32_t id) {
+					return pre_end >= cp.rplan.conds.size() || checkRestrictions(w, d.scanRaw(id), cp.rplan, pre_end, cp.rplan.conds.size(), 0, id) == 0;
+				};
+
+				if (mode != VariantMode::ALL && !matchForm(*v0)) continue;
+				bool shared_ok = mode != VariantMode::SHARED || postOk(*v0);
+				for (const uint32_t* v = v0; v < v1; ++v) {
+					if (mode == VariantMode::ALL && !matchForm(*v)) continue;
+					if (mode == VariantMode::SHARED ? !shared_ok : !postOk(*v)) continue;
+					res[p].push_back(*v);
+				}
+			}
+			return true;
+		});
+	};
+
+	// Trozos de la tabla de formas en paralelo; al final, cada lista se ordena por índice de diccionario
+	const size_t kChunk = 8192;
+	auto [first, forms] = ownedForms(d);
+	size_t chunks = (forms - first + kChunk - 1) / kChunk;
+	if (chunks <= 1) scanRange(first, forms, out);
+	else {
+		vector<vector<vector<size_t>>> parts(chunks, vector<vector<size_t>>(patterns.size()));
+		parallelFor(chunks, [&](size_t c) { scanRange(first + c * kChunk, (std::min)(forms, first + (c + 1) * kChunk), parts[c]); });
+		for (auto& part : parts)
+			for (size_t p = 0; p < patterns.size(); p++) out[p].insert(out[p].end(), part[p].begin(), part[p].end());
+	}
+	for (auto& r : out) sort(r.begin(), r.end());
+
+	if (ls) {
+		// En la pasada conjunta no se separan restricciones y patrón: todo cuenta como patrón
+		ls->parse_ms += chrono::duration<double, milli>(t1 - t0).count();
+		ls->match_ms += msSince(t1);
+		ls->patterns += patterns.size();
+		ls->memo_hits += t_memo_hits - hits0;
+		ls->memo_misses += t_memo_misses - misses0;
+		for (const auto& r : out) ls->results += r.size();
+	}
+	return out;
+}
+
+// --- MOTOR DE CONSULTAS BOOLEANAS ---
+
+// Si en s[i] empieza una etiqueta de diccionario "@NOMBRE(", posición de su '(' (si no, npos)
+static size_t dictTagEnd(const string& s, size_t i) {
+	if (s[i] != '@') return string::npos;
+	size_t j = i + 1;
+	while (j < s.size() && s[j] != '(' && s[j] != ')' && s[j] != ' ' && s[j] != '\t') j++;
+	return j > i + 1 && j < s.size() && s[j] == '(' ? j : string::npos;
+}
+
+// Devuelve true si s tiene operadores booleanos en el nivel 0 (fuera de () y []). Una
+// etiqueta @NOMBRE(...) también cuenta: la consulta se evalúa en ese diccionario.
+static bool hasBoolOps(const string& s) {
+	int dp = 0, db = 0;
+	for (size_t i = 0; i < s.size(); i++) {
+		if (s[i] == '[') { db++; continue; }
+		if (s[i] == ']') { if (db > 0) db--; continue; }
+		if (db > 0) continue;
+		if (s[i] == '(') { dp++; continue; }
+		if (s[i] == ')') { if (dp > 0) dp--; continue; }
+		if (dp > 0) continue;
+		if (s[i] == '!' || dictTagEnd(s, i) != string::npos) return true;
+		if (i + 1 < s.size() && s[i] == '&' && s[i + 1] == '&') return true;
+		if (i + 1 < s.size() && s[i] == '|' && s[i + 1] == '|') return true;
+		if (s[i] == '-' && i > 0 && s[i - 1] == ' ' && i + 1 < s.size() && s[i + 1] == ' ') return true;
+	}
+	return false;
+}
+
+// --- CALEMBOUR ---
+
+// Divisiones de 'normCal' (ya normalizada, max 20 letras) en al menos dos palabras del
+// diccionario, con error total <= n. Cada división es la lista de (forma raw, error) de sus
+// trozos. Primero se busca la mejor palabra para cada segmento [i, j): exacta por el índice
+// de formas o, si n > 0, la más cercana por Levenshtein entre las de longitud ±n (a igual
+// distancia, la más corta y, entre esas, la que aparece antes en el diccionario).
+// Las filas i son independientes y se calculan en paralelo.
+static vector<vector<pair<string, int>>> calembourSplits(const string& normCal, const string& restr, int cal_n,
+	const Dict& d, LeafStats* ls = nullptr) {
+	vector<ResourceCondition> cal_res = parseConditionList(restr);
+	RestrictionPlan cal_plan = planRestrictions(cal_res, d.stats);
+	attachColumns(cal_plan, d);
+
+	int L = (int)normCal.size();
+	vector<vector<pair<int, string>>> best(L, vector<pair<int, string>>(L + 1, { INT_MAX, "" }));
+	parallelFor((size_t)L, [&](size_t row) {
+		int i = (int)row;
+		for (int j = i + 1; j <= L; j++) {
+			if (budgetExpired()) return;
+			string part = normCal.substr(i, j - i); int plen = (int)part.size();
+			size_t id = findEntry(d, part);
+			if (id != SIZE_MAX) {
+				if (cal_res.empty() || checkRestrictions(part, d.scanRaw(id), cal_plan, 0, cal_plan.conds.size(), 0, id) == 0) best[i][j] = { 0, d.raw(id) };
+				continue;
+			}
+			if (cal_n == 0) continue;
+			auto t0 = chrono::steady_clock::now();
+			int be = cal_n + 1, blen = 0;
+			size_t bid = SIZE_MAX, seen = 0;
+			forEachFormOfLen(d, (std::max)(1, plen - cal_n), plen + cal_n, [&](size_t, const string& w, const uint32_t* v0, const uint32_t*) {
+				if ((++seen & 255) == 0 && budgetSpend(256)) return false;
+				uint32_t id = *v0;
+				if (!cal_res.empty() && checkRestrictions(w, d.scanRaw(id), cal_plan, 0, cal_plan.conds.size(), 0, id) > 0) return true;
+				int dist = levenshtein(part, w, be);
+				int len = (int)w.size();
+				if (dist < be || (dist == be && bid != SIZE_MAX && (len < blen || (len == blen && id < bid)))) {
+					be = dist; blen = len; bid = id;
+				}
+				return true;
+			});
+			if (ls) ls->scanned += seen;
+			if (ls) ls->lev_ms += msSince(t0);
+			if (bid != SIZE_MAX && be <= cal_n) best[i][j] = { be, d.raw(bid) };
+		}
+		});
+
+	// Con L = 20 puede haber cientos de miles de divisiones: el presupuesto se consulta cada 1024 pasos
+	vector<vector<pair<string, int>>> all;
+	size_t steps = 0;
+	bool stop = false;
+	function<void(int, int, vector<pair<string, int>>&)> search =
+		[&](int pos, int err_left, vector<pair<string, int>>& cur) {
+		if (stop || ((++steps & 1023) == 0 && (stop = budgetSpend(1024)))) return;
+		if (pos == L) { if ((int)cur.size() >= 2) all.push_back(cur); return; }
+		for (int end = pos + 1; end <= L; end++) {
+			int berr = best[pos][end].first;
+			if (berr == INT_MAX || berr > err_left) continue;
+			cur.push_back({ best[pos][end].second, berr });
+			search(end, err_left - berr, cur);
+			cur.pop_back();
+		}
+		};
+	vector<pair<string, int>> cur;
+	search(0, cal_n, cur);
+	return all;
+}
+
+// --- HOMÓFONOS ---
+
+// Tolerancia de /hom: "n" o "n*" (el asterisco no cambia nada); sin número, 0
+static int homophoneTolerance(string tol) {
+	if (!tol.empty() && tol.back() == '*') tol.pop_back();
+	if (tol.empty() || !all_of(tol.begin(), tol.end(), [](unsigned char c) { return isdigit(c); })) return 0;
+	return safeStoi(tol);
+}
+
+// Entradas cuya clave fonética está a distancia <= n de la de 'word' y que cumplen
+// 'restr', en orden de diccionario. Con n = 0 basta una consulta al índice; si no, se
+// compara con Levenshtein acotado cada clave distinta de longitud compatible.
+static vector<size_t> homophoneSearch(const string& word, const string& restr, int n, const Dict& d, LeafStats* ls = nullptr) {
+	vector<size_t> ids;
+	string key = phoneticKey(word);
+	if (key.empty()) return ids;
+	vector<ResourceCondition> res = parseConditionList(restr);
+	RestrictionPlan plan = planRestrictions(res, d.stats);
+	attachColumns(plan, d);
+	auto take = [&](const uint32_t* v0, const uint32_t* v1) {
+		for (const uint32_t* v = v0; v != v1; v++) {
+			uint32_t i = *v;
+			if (!res.empty() && checkRestrictions(d.norm(i), d.raw(i), plan, 0, plan.conds.size(), 0, i) > 0) {
+				if (ls) ls->rejected++;
+				continue;
+			}
+			ids.push_back(i);
+		}
+	};
+
+	if (n <= 0) {
+		if (ls) ls->scanned++;
+		forPhoneticKey(d, key, take);
+		return ids;
+	}
+	if (clusterHomophones(word, restr, n, d, ids)) {
+		if (ls) ls->scanned++;
+		return ids;
+	}
+	auto t0 = chrono::steady_clock::now();
+	size_t k = 0;
+	forEachPhoneticKey(d, [&](const string& pk, const uint32_t* v0, const uint32_t* v1) {
+		if ((++k & 255) == 0 && budgetSpend(256)) return false;
+		if (abs((int)pk.size() - (int)key.size()) > n || !ownsKey(pk)) return true;
+		if (ls) ls->scanned++;
+		if (levenshtein(key, pk, n) <= n) take(v0, v1);
+		return true;
+	});
+	if (ls) ls->lev_ms += msSince(t0);
+	sort(ids.begin(), ids.end());
+	return ids;
+}
+
+// Plan de una consulta hoja: los patrones en los que se traduce el comando y cómo se evalúan
+struct LeafPlan {
+	enum Kind { PATTERNS, CALEMBOUR, WORDPLAY, HOMOPHONE } kind = PATTERNS;
+	string command;              // comando reconocido ("" = patrón directo)
+	int rd_n = -1;               // n de /rd (-1 = no es /rd)
+	vector<string> patterns;     // patrones cuya unión es el resultado (PATTERNS)
+	string cal_word, cal_restr;  // CALEMBOUR
+	int cal_n = 0;
+	string wp_word, wp_restr;    // WORDPLAY: se evalúa wp_word [wp_restr] n con n creciente
+	int wp_n = 1;
+	bool wp_ast = false;
+	string hom_word, hom_restr;  // HOMOPHONE: claves fonéticas a distancia <= hom_n
+	int hom_n = 0;
+};
+
+// Traduce una consulta hoja (patrón o comando) a su plan, sin tocar el diccionario
+static LeafPlan planLeaf(string input) {
+	LeafPlan plan;
+	input.erase(0, input.find_first_not_of(" \t\r\n"));
+	{ size_t l = input.find_last_not_of(" \t\r\n"); if (l != string::npos) input.erase(l + 1); }
+	for (char& c : input) if (c == '\\') c = '/';
+	if (input.empty()) return plan;
+
+	string inputLine = input;
+	vector<string> patterns_to_run;
+
+	// /rd: quitar el prefijo n, tratar el resto como consulta
+	{
+		bool isRd_ = (input.size() >= 7 && input.substr(0, 7) == "/random") ||
+			(input.size() >= 3 && input.substr(0, 3) == "/rd" && (input.size() == 3 || input[3] == ' '));
+		if (isRd_) {
+			string rest = (input.substr(0, 7) == "/random") ? input.substr(7) : input.substr(3);
+			rest.erase(0, rest.find_first_not_of(" "));
+			size_t sp = rest.find(' ');
+			string first = (sp != string::npos) ? rest.substr(0, sp) : rest;
+			bool fn = !first.empty() && all_of(first.begin(), first.end(), [](unsigned char c) { return isdigit(c); });
+			plan.rd_n = fn ? safeStoi(first) : 1;
+			inputLine = fn ? rest.substr(sp + 1) : rest;
+			if (inputLine.empty()) inputLine = ".";
+			// Si la línea empieza directamente por '[', no hay patrón: añadir '.'
+			if (!inputLine.empty() && inputLine[0] == '[') inputLine = ". " + inputLine;
+			input = inputLine;
+		}
+	}
+
+	// /cal: devuelve conjunto de palabras individuales de las divisiones
+	{
+		bool isCal_ = (input.size() >= 10 && input.substr(0, 10) == "/calembour") ||
+			(input.size() >= 4 && input.substr(0, 4) == "/cal" && (input.size() == 4 || input[4] == ' '));
+		if (isCal_) {
+			string rest = (input.substr(0, 10) == "/calembour") ? input.substr(10) : input.substr(4);
+			rest.erase(0, rest.find_first_not_of(" "));
+			int cal_n = 0; string cal_word = rest, cal_restr = "";
+			size_t bs = rest.find('[');
+			if (bs != string::npos) {
+				size_t be = rest.find(']', bs);
+				if (be != string::npos) {
+					cal_word = rest.substr(0, bs);
+					cal_restr = rest.substr(bs + 1, be - bs - 1);
+					string rem = rest.substr(be + 1); rem.erase(0, rem.find_first_not_of(" "));
+					if (!rem.empty() && all_of(rem.begin(), rem.end(), [](unsigned char c) { return isdigit(c); })) cal_n = safeStoi(rem);
+				}
+			}
+			else {
+				size_t lsp = rest.find_last_of(" ");
+				if (lsp != string::npos) {
+					string pn = rest.substr(lsp + 1);
+					if (!pn.empty() && all_of(pn.begin(), pn.end(), [](unsigned char c) { return isdigit(c); })) { cal_n = safeStoi(pn); cal_word = rest.substr(0, lsp); }
+				}
+			}
+			cal_word.erase(remove(cal_word.begin(), cal_word.end(), ' '), cal_word.end());
+			plan.kind = LeafPlan::CALEMBOUR;
+			plan.command = "/cal";
+			plan.cal_word = cal_word;
+			plan.cal_restr = cal_restr;
+			plan.cal_n = cal_n;
+			return plan;
+		}
+	}
+
+	// /hom
+	{
+		bool isHom_ = (input.size() >= 10 && input.substr(0, 10) == "/homophone") ||
+			(input.size() >= 4 && input.substr(0, 4) == "/hom" && (input.size() == 4 || input[4] == ' '));
+		if (isHom_) {
+			string rest = (input.substr(0, 10) == "/homophone") ? input.substr(10) : input.substr(4);
+			rest.erase(0, rest.find_first_not_of(" "));
+			auto [word, restr, tol] = extractWordRestrTol(rest);
+			plan.kind = LeafPlan::HOMOPHONE;
+			plan.command = "/hom";
+			plan.hom_word = word;
+			plan.hom_restr = restr;
+			plan.hom_n = homophoneTolerance(tol);
+			return plan;
+		}
+	}
+
+	// /ang y /par
+	{
+		bool isAn_ = (input.size() >= 8 && input.substr(0, 8) == "/anagram") ||
+			(input.size() >= 4 && input.substr(0, 4) == "/ang" && (input.size() == 4 || input[4] == ' '));
+		bool isPar_ = (input.size() >= 12 && input.substr(0, 12) == "/paronomasia") ||
+			(input.size() >= 4 && input.substr(0, 4) == "/par" && (input.size() == 4 || input[4] == ' '));
+		if (isAn_ || isPar_) {
+			plan.command = isAn_ ? "/ang" : "/par";
+			string rest;
+			if (isAn_) rest = (input.size() >= 8 && input.substr(0, 8) == "/anagram") ? input.substr(8) : input.substr(4);
+			else       rest = (input.size() >= 12 && input.substr(0, 12) == "/paronomasia") ? input.substr(12) : input.substr(4);
+			rest.erase(0, rest.find_first_not_of(" "));
+
+			auto [word, extra_r, tol_str] = extractWordRestrTol(rest);
+			string nw = normalizeWord(word);
+			if (isAn_) {
+				if (!tol_str.empty()) { string tmp = tol_str; if (tmp.back() == '*') tmp.pop_back(); if (all_of(tmp.begin(), tmp.end(), [](unsigned char c) {return isdigit(c);})) tol_str = tmp + "*"; }
+				map<char, int> cnt; for (char c : nw) cnt[c]++;
+				string exp = ". [";
+				for (auto it = cnt.begin(); it != cnt.end(); ++it) exp += to_string(it->second) + it->first + ",";
+				exp += to_string(nw.length());
+				if (!extra_r.empty()) exp += "," + extra_r;
+				exp += "] " + tol_str;
+				inputLine = exp;
+			}
+			else {
+				// Construir el esqueleto consonántico: las consonantes quedan en su
+				// posición y cada vocal (o grupo de vocales) se sustituye por *.
+				// Ejemplo: COCHE -> C*CH* [2V*]
+				string pat = ""; int vow = 0; string cgrp = "";
+				for (char c : nw) {
+					if (isVowel(c)) { pat += cgrp + "*"; cgrp = ""; vow++; }
+					else cgrp += c;
+				}
+				pat += cgrp; // consonantes finales sin vocal siguiente
+				string exp = pat + " [" + to_string(vow) + "V*";
+				if (!extra_r.empty()) exp += "," + extra_r;
+				exp += "] " + tol_str;
+				inputLine = exp;
+			}
+		}
+	}
+
+	// /ans
+	bool isAns_ = (input.size() >= 12 && input.substr(0, 12) == "/anasyllabic") ||
+		(input.size() >= 4 && input.substr(0, 4) == "/ans" && (input.size() == 4 || input[4] == ' '));
+	if (isAns_) {
+		plan.command = "/ans";
+		string rest = (input.size() >= 12 && input.substr(0, 12) == "/anasyllabic") ? input.substr(12) : input.substr(4);
+		rest.erase(0, rest.find_first_not_of(" "));
+		auto [word, extra_r, tol_str] = extractWordRestrTol(rest);
+		string nw = normalizeWord(word);
+		vector<string> syl = getSyllables(nw); sort(syl.begin(), syl.end());
+		do {
+			string p = ""; for (const string& s2 : syl) p += s2;
+			if (!extra_r.empty()) p += " [" + extra_r + "]";
+			if (!tol_str.empty()) p += " " + tol_str;
+			patterns_to_run.push_back(p);
+		} while (!budgetSpend(1) && next_permutation(syl.begin(), syl.end()));
+	}
+
+	// /aso y /con (rima asonante / consonante)
+	{
+		bool isAso_ = (input.size() >= 9 && input.substr(0, 9) == "/assonant") ||
+			(input.size() >= 4 && input.substr(0, 4) == "/aso" && (input.size() == 4 || input[4] == ' '));
+		bool isCon_ = (input.size() >= 10 && input.substr(0, 10) == "/consonant") ||
+			(input.size() >= 4 && input.substr(0, 4) == "/con" && (input.size() == 4 || input[4] == ' '));
+		if (isAso_ || isCon_) {
+			plan.command = isAso_ ? "/aso" : "/con";
+			int plen;
+			if (isAso_) plen = (input.size() >= 9 && input.substr(0, 9) == "/assonant") ? 9 : 4;
+			else        plen = (input.size() >= 10 && input.substr(0, 10) == "/consonant") ? 10 : 4;
+
+			string rest = input.substr(plen);
+			rest.erase(0, rest.find_first_not_of(" "));
+			auto [word, extra_r, tol_str] = extractWordRestrTol(rest);
+			string rhyme = getRhymeSuffix(word);
+
+			if (!rhyme.empty()) {
+				if (isCon_) {
+					// Rima consonante: mismo sufijo exacto desde vocal tónica
+					inputLine = "." + rhyme;
+				}
+				else {
+					// Rima asonante: solo las vocales del sufijo
+					string pat = ".(0,,C)";
+					for (char c : rhyme)
+						if (isVowel(c)) pat += string(1, c) + "(0,,C)";
+					inputLine = pat;
+				}
+				if (!extra_r.empty()) inputLine += " [" + extra_r + "]";
+				if (!tol_str.empty()) inputLine += " " + tol_str;
+			}
+		}
+	}
+
+	// /anp /epi /mul /uni
+	{
+		bool isAnp_ = (input.size() >= 9 && input.substr(0, 9) == "/anaphora") ||
+			(input.size() >= 4 && input.substr(0, 4) == "/anp" && (input.size() == 4 || input[4] == ' '));
+		bool isEpi_ = (input.size() >= 9 && input.substr(0, 9) == "/epiphora") ||
 			(input.size() >= 4 && input.substr(0, 4) == "/epi" && (input.size() == 4 || input[4] == ' '));
 		bool isMul_ = (input.size() >= 14 && input.substr(0, 14) == "/multisyllabic") ||
 			(input.size() >= 4 && input.substr(0, 4) == "/mul" && (input.size() == 4 || input[4] == ' '));
 		bool isUni_ = (input.size() >= 12 && input.substr(0, 12) == "/univocalism") ||
 			(input.size() >= 4 && input.substr(0, 4) == "/uni" && (input.size() == 4 || input[4] == ' '));
 		if (isAnp_ || isEpi_ || isMul_ || isUni_) {
+			plan.command = isAnp_ ? "/anp" : isEpi_ ? "/epi" : isMul_ ? "/mul" : "/uni";
 			string rest;
 			if (isAnp_)      rest = (input.size() >= 9 && input.substr(0, 9) == "/anaphora") ? input.substr(9) : input.substr(4);
 			else if (isEpi_) rest = (input.size() >= 9 && input.substr(0, 9) == "/epiphora") ? input.substr(9) : input.substr(4);
@@ -781,402 +3989,3667 @@ static vector<bool> runLeafQuery(
 			rest.erase(0, rest.find_first_not_of(" "));
 			auto [word, extra_r, tol_str] = extractWordRestrTol(rest);
 			string nw = normalizeWord(word);
-			if (isAnp_) {
-				inputLine = nw + ".";
-				if (!extra_r.empty()) inputLine += " [" + extra_r + "]";
-				if (!tol_str.empty()) inputLine += " " + tol_str;
+			if (isAnp_) {
+				inputLine = nw + ".";
+				if (!extra_r.empty()) inputLine += " [" + extra_r + "]";
+				if (!tol_str.empty()) inputLine += " " + tol_str;
+			}
+			else if (isEpi_) {
+				inputLine = "." + nw;
+				if (!extra_r.empty()) inputLine += " [" + extra_r + "]";
+				if (!tol_str.empty()) inputLine += " " + tol_str;
+			}
+			else if (isMul_) {
+				string pat = "."; int vow = 0;
+				for (char c : nw) if (isVowel(c)) { pat += c; pat += "."; vow++; }
+				inputLine = pat + " [" + to_string(vow) + "V*";
+				if (!extra_r.empty()) inputLine += "," + extra_r;
+				inputLine += "]";
+				if (!tol_str.empty()) inputLine += " " + tol_str;
+			}
+			else if (isUni_) {
+				char v = '\0'; for (char c : nw) if (isVowel(c)) { v = c; break; }
+				if (v) {
+					inputLine = ". [" + string(1, v);
+					string av = "AEIOU"; for (char c : av) if (c != v) inputLine += ",0" + string(1, c);
+					if (!extra_r.empty()) inputLine += "," + extra_r;
+					inputLine += "]";
+					if (!tol_str.empty()) inputLine += " " + tol_str;
+				}
+			}
+		}
+	}
+
+	// /wp
+	bool isWp_ = (input.size() >= 9 && input.substr(0, 9) == "/wordplay") ||
+		(input.size() >= 3 && input.substr(0, 3) == "/wp" && (input.size() == 3 || input[3] == ' '));
+	if (isWp_) {
+		string wp_word_ = "", wp_restr_ = "";
+		int wp_n_ = 1; bool wp_ast_ = false;
+		string rest = (input.substr(0, 9) == "/wordplay") ? input.substr(9) : input.substr(3);
+		rest.erase(0, rest.find_first_not_of(" "));
+		size_t b2 = rest.find('['); size_t ls = rest.find_last_of(" ");
+		if (b2 != string::npos) {
+			wp_word_ = rest.substr(0, b2);
+			size_t be = rest.find(']', b2);
+			if (be != string::npos) {
+				wp_restr_ = rest.substr(b2 + 1, be - b2 - 1);
+				string pn = rest.substr(be + 1); pn.erase(0, pn.find_first_not_of(" "));
+				if (!pn.empty()) { if (pn.back() == '*') { wp_ast_ = true; pn.pop_back(); } if (!pn.empty() && all_of(pn.begin(), pn.end(), [](unsigned char c) {return isdigit(c);})) wp_n_ = safeStoi(pn); }
+			}
+		}
+		else if (ls != string::npos) {
+			string pn = rest.substr(ls + 1); string cn = pn; if (!cn.empty() && cn.back() == '*') { wp_ast_ = true; cn.pop_back(); }
+			if (!cn.empty() && all_of(cn.begin(), cn.end(), [](unsigned char c) { return isdigit(c); })) { wp_word_ = rest.substr(0, ls); wp_n_ = safeStoi(cn); }
+			else wp_word_ = rest;
+		}
+		else wp_word_ = rest;
+		wp_word_.erase(remove(wp_word_.begin(), wp_word_.end(), ' '), wp_word_.end());
+		plan.kind = LeafPlan::WORDPLAY;
+		plan.command = "/wp";
+		plan.wp_word = wp_word_;
+		plan.wp_restr = wp_restr_;
+		plan.wp_n = wp_n_;
+		plan.wp_ast = wp_ast_;
+		return plan;
+	}
+
+	if (plan.command.empty() && plan.rd_n >= 0) plan.command = "/rd";
+	plan.patterns = isAns_ ? patterns_to_run : vector<string>{ inputLine };
+	return plan;
+}
+
+// Patrón de la iteración actual de /wp
+static string wordplayPattern(const LeafPlan& plan, int n) {
+	string il = plan.wp_word;
+	if (!plan.wp_restr.empty()) il += " [" + plan.wp_restr + "]";
+	return il + " " + to_string(n) + (plan.wp_ast ? "*" : "");
+}
+
+// Ejecuta una consulta hoja y devuelve un bitmask sobre el diccionario
+static vector<bool> runLeafQuery(
+	string input,
+	const Dict& d,
+	ostream* vout = nullptr
+) {
+	vector<bool> matched(d.size(), false);
+
+	LeafScope leaf(input);
+	LeafPlan plan = planLeaf(input);
+
+	// /cal: devuelve conjunto de palabras individuales de las divisiones
+	if (plan.kind == LeafPlan::CALEMBOUR) {
+		string normCal = normalizeWord(plan.cal_word);
+		if (normCal.empty() || (int)normCal.size() > 20) return matched;
+
+		vector<vector<pair<string, int>>> cal_all = calembourSplits(normCal, plan.cal_restr, plan.cal_n, d, leaf.get());
+
+		// Marcar las palabras de todas las divisiones válidas (la primera entrada de cada forma)
+		for (size_t si = 0; si < cal_all.size(); si++)
+			for (size_t sj = 0; sj < cal_all[si].size(); sj++) {
+				size_t id = findEntry(d, normalizeWord(cal_all[si][sj].first));
+				if (id != SIZE_MAX) matched[id] = true;
+			}
+		if (LeafStats* ls = leaf.get()) ls->results = count(matched.begin(), matched.end(), true);
+		return matched;
+	}
+
+	// /hom: consulta al índice fonético
+	if (plan.kind == LeafPlan::HOMOPHONE) {
+		vector<size_t> ids = homophoneSearch(plan.hom_word, plan.hom_restr, plan.hom_n, d, leaf.get());
+		for (size_t id : ids) matched[id] = true;
+		if (LeafStats* ls = leaf.get()) ls->results = ids.size();
+		return matched;
+	}
+
+	// Bucle de búsqueda
+	int wp_n_ = plan.wp_n;
+	while (true) {
+		vector<string> patterns_to_run = plan.patterns;
+		if (plan.kind == LeafPlan::WORDPLAY) patterns_to_run = { wordplayPattern(plan, wp_n_) };
+		fill(matched.begin(), matched.end(), false);
+		for (const string& pLine : patterns_to_run)
+			scanPattern(pLine, d, matched);
+		if (plan.kind == LeafPlan::WORDPLAY) {
+			int cnt = 0; for (bool b : matched) if (b) cnt++;
+			bool self_only = false;
+			if (cnt == 1) {
+				for (size_t i = 0; i < d.size(); i++)
+					if (matched[i] && d.norm(i) == normalizeWord(plan.wp_word)) { self_only = true; break; }
+			}
+			if ((cnt == 0 || self_only) && wp_n_ < 99 && !budgetExpired()) { wp_n_++; continue; }
+			if (vout) *vout << "(B\xC3\xBAsqueda completada con n = " << wp_n_ << ")\n";
+		}
+		break;
+	}
+	if (LeafStats* ls = leaf.get()) ls->results = count(matched.begin(), matched.end(), true);
+	return matched;
+}
+
+// --- CONJUNTOS DE ÍNDICES ---
+
+static inline int popcount64(uint64_t x) {
+#if defined(_MSC_VER)
+	return (int)__popcnt64(x);
+#else
+	return __builtin_popcountll(x);
+#endif
+}
+
+static inline int ctz64(uint64_t x) {
+#if defined(_MSC_VER)
+	unsigned long i; _BitScanForward64(&i, x); return (int)i;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+// Conjunto de índices del diccionario comprimido al estilo de los roaring bitmaps: los
+// índices se agrupan en bloques de 2^16 y cada bloque se guarda como lista ordenada (pocos
+// índices), mapa de bits (muchos) o tramos [inicio, fin] (índices consecutivos), lo que
+// ocupe menos. Los bloques vacíos no se guardan, así que la memoria depende del número
+// de resultados y no del tamaño del diccionario.
+class IdSet {
+public:
+	static IdSet fromBitmask(const vector<bool>& m) {
+		IdSet s;
+		vector<uint64_t> w(kWords);
+		for (size_t base = 0; base < m.size(); base += kChunk) {
+			size_t end = (std::min)(m.size(), base + kChunk);
+			bool any = false;
+			fill(w.begin(), w.end(), 0);
+			for (size_t i = base; i < end; i++)
+				if (m[i]) { w[(i - base) >> 6] |= 1ull << ((i - base) & 63); any = true; }
+			if (any) s.append((uint32_t)(base >> 16), w.data());
+		}
+		return s;
+	}
+
+	// 'ids' en orden creciente y sin repetidos
+	static IdSet fromSorted(const vector<size_t>& ids) {
+		IdSet s;
+		vector<uint64_t> w(kWords);
+		for (size_t k = 0; k < ids.size();) {
+			uint32_t key = (uint32_t)(ids[k] >> 16);
+			fill(w.begin(), w.end(), 0);
+			for (; k < ids.size() && (ids[k] >> 16) == key; k++) w[(ids[k] & 0xFFFF) >> 6] |= 1ull << (ids[k] & 63);
+			s.append(key, w.data());
+		}
+		return s;
+	}
+
+	size_t size() const { return total; }
+	bool empty() const { return total == 0; }
+
+	bool contains(size_t id) const {
+		uint32_t key = (uint32_t)(id >> 16);
+		auto it = lower_bound(chunks.begin(), chunks.end(), key, [](const Chunk& c, uint32_t k) { return c.key < k; });
+		return it != chunks.end() && it->key == key && chunkContains(*it, (uint16_t)(id & 0xFFFF));
+	}
+
+	// Llama a f(id) para cada índice, en orden creciente
+	template <class F> void forEach(F f) const {
+		for (const Chunk& c : chunks) {
+			size_t base = (size_t)c.key << 16;
+			if (c.kind == Chunk::ARRAY) for (uint16_t v : c.data) f(base + v);
+			else if (c.kind == Chunk::RUNS) {
+				for (size_t r = 0; r < c.data.size(); r += 2)
+					for (size_t v = c.data[r]; v <= c.data[r + 1]; v++) f(base + v);
+			}
+			else {
+				for (size_t k = 0; k < kWords; k++)
+					for (uint64_t x = c.bits[k]; x; x &= x - 1) f(base + k * 64 + ctz64(x));
+			}
+		}
+	}
+
+	vector<size_t> ids() const {
+		vector<size_t> out;
+		out.reserve(total);
+		forEach([&](size_t id) { out.push_back(id); });
+		return out;
+	}
+
+	// Memoria ocupada por los bloques
+	size_t bytes() const {
+		size_t b = sizeof(IdSet) + chunks.capacity() * sizeof(Chunk);
+		for (const Chunk& c : chunks) b += c.data.capacity() * sizeof(uint16_t) + c.bits.capacity() * sizeof(uint64_t);
+		return b;
+	}
+
+	static IdSet unite(const IdSet& a, const IdSet& b) {
+		return merge(a, b, true, true, [](uint64_t x, uint64_t y) { return x | y; });
+	}
+
+	static IdSet intersect(const IdSet& a, const IdSet& b) {
+		return merge(a, b, false, false, [](uint64_t x, uint64_t y) { return x & y; });
+	}
+
+	// a \ b
+	static IdSet subtract(const IdSet& a, const IdSet& b) {
+		return merge(a, b, true, false, [](uint64_t x, uint64_t y) { return x & ~y; });
+	}
+
+private:
+	static const size_t kChunk = 1 << 16, kWords = kChunk / 64;
+
+	struct Chunk {
+		enum Kind : uint8_t { ARRAY, BITMAP, RUNS };
+		uint32_t key = 0;        // índice >> 16
+		uint32_t card = 0;       // índices del bloque
+		Kind kind = ARRAY;
+		vector<uint16_t> data;   // ARRAY: valores ordenados; RUNS: pares inicio, fin (incluido)
+		vector<uint64_t> bits;   // BITMAP: kWords palabras
+	};
+
+	vector<Chunk> chunks;        // ordenados por key
+	size_t total = 0;
+
+	static bool chunkContains(const Chunk& c, uint16_t v) {
+		if (c.kind == Chunk::ARRAY) return binary_search(c.data.begin(), c.data.end(), v);
+		if (c.kind == Chunk::BITMAP) return (c.bits[v >> 6] >> (v & 63)) & 1;
+		size_t lo = 0, hi = c.data.size() / 2;   // primer tramo que empieza después de v
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (c.data[2 * mid] <= v) lo = mid + 1; else hi = mid;
+		}
+		return lo > 0 && v <= c.data[2 * (lo - 1) + 1];
+	}
+
+	static void toWords(const Chunk& c, uint64_t* w) {
+		if (c.kind == Chunk::BITMAP) { copy(c.bits.begin(), c.bits.end(), w); return; }
+		fill(w, w + kWords, 0);
+		if (c.kind == Chunk::ARRAY) {
+			for (uint16_t v : c.data) w[v >> 6] |= 1ull << (v & 63);
+			return;
+		}
+		for (size_t r = 0; r < c.data.size(); r += 2)
+			for (uint32_t v = c.data[r], hi = c.data[r + 1]; v <= hi;) {
+				if ((v & 63) == 0 && v + 63 <= hi) { w[v >> 6] = ~0ull; v += 64; }
+				else { w[v >> 6] |= 1ull << (v & 63); v++; }
+			}
+	}
+
+	// Añade al final el bloque 'key' descrito por el mapa de bits 'w', con la representación
+	// más pequeña (nada si está vacío)
+	void append(uint32_t key, const uint64_t* w) {
+		size_t card = 0, runs = 0;
+		uint64_t carry = 0;
+		for (size_t k = 0; k < kWords; k++) {
+			card += popcount64(w[k]);
+			runs += popcount64(w[k] & ~((w[k] << 1) | carry));
+			carry = w[k] >> 63;
+		}
+		if (card == 0) return;
+		Chunk c;
+		c.key = key;
+		c.card = (uint32_t)card;
+		size_t arrBytes = 2 * card, runBytes = 4 * runs, bmBytes = 8 * kWords;
+		if (bmBytes < arrBytes && bmBytes < runBytes) {
+			c.kind = Chunk::BITMAP;
+			c.bits.assign(w, w + kWords);
+		}
+		else if (runBytes < arrBytes) {
+			c.kind = Chunk::RUNS;
+			c.data.reserve(2 * runs);
+			for (size_t k = 0; k < kWords; k++)
+				for (uint64_t x = w[k]; x; x &= x - 1) {
+					uint32_t v = (uint32_t)(k * 64 + ctz64(x));
+					if (!c.data.empty() && c.data.back() + 1u == v) c.data.back() = (uint16_t)v;
+					else { c.data.push_back((uint16_t)v); c.data.push_back((uint16_t)v); }
+				}
+		}
+		else {
+			c.data.reserve(card);
+			for (size_t k = 0; k < kWords; k++)
+				for (uint64_t x = w[k]; x; x &= x - 1) c.data.push_back((uint16_t)(k * 64 + ctz64(x)));
+		}
+		total += card;
+		chunks.push_back(move(c));
+	}
+
+	void appendChunk(const Chunk& c) {
+		total += c.card;
+		chunks.push_back(c);
+	}
+
+	// Recorre los bloques de a y b en orden de key. Los que solo están en uno se copian si
+	// keepA/keepB; los comunes se combinan palabra a palabra con op (o, si a es una lista y
+	// op no añade índices de b, filtrando la lista)
+	template <class Op>
+	static IdSet merge(const IdSet& a, const IdSet& b, bool keepA, bool keepB, Op op) {
+		IdSet out;
+		vector<uint64_t> wa(kWords), wb(kWords);
+		size_t i = 0, j = 0;
+		while (i < a.chunks.size() || j < b.chunks.size()) {
+			if (j == b.chunks.size() || (i < a.chunks.size() && a.chunks[i].key < b.chunks[j].key)) {
+				if (keepA) out.appendChunk(a.chunks[i]);
+				i++;
+				continue;
+			}
+			if (i == a.chunks.size() || b.chunks[j].key < a.chunks[i].key) {
+				if (keepB) out.appendChunk(b.chunks[j]);
+				j++;
+				continue;
+			}
+			const Chunk& ca = a.chunks[i++];
+			const Chunk& cb = b.chunks[j++];
+			if (!keepB && ca.kind == Chunk::ARRAY) {
+				Chunk c;
+				c.key = ca.key;
+				for (uint16_t v : ca.data)
+					if (op(1, chunkContains(cb, v) ? 1 : 0)) c.data.push_back(v);
+				c.card = (uint32_t)c.data.size();
+				if (c.card) { out.total += c.card; out.chunks.push_back(move(c)); }
+				continue;
+			}
+			toWords(ca, wa.data());
+			toWords(cb, wb.data());
+			for (size_t k = 0; k < kWords; k++) wa[k] = op(wa[k], wb[k]);
+			out.append(ca.key, wa.data());
+		}
+		return out;
+	}
+};
+
+// --- EXPRESIONES BOOLEANAS ---
+
+struct BoolExpr {
+	enum Op { LEAF, AND_OP, OR_OP, NOT_OP, DIFF_OP } op;
+	string query;
+	string dict;            // hoja de @NOMBRE(...): diccionario residente (vacío: el activo)
+	vector<BoolExpr> children;
+	BoolExpr() : op(LEAF) {}
+};
+
+enum BoolTokT { BT_AND, BT_OR, BT_DIFF, BT_NOT, BT_ATOM };
+struct BoolToken { BoolTokT type; string content; string dict = ""; };
+
+static vector<BoolToken> tokenizeBool(const string& s) {
+	vector<BoolToken> toks;
+	size_t i = 0, n = s.size();
+	while (i < n) {
+		if (s[i] == ' ' || s[i] == '\t') { i++; continue; }
+		if (s[i] == '!') { toks.push_back({ BT_NOT, "" }); i++; continue; }
+		if (i + 1 < n && s[i] == '&' && s[i + 1] == '&') { toks.push_back({ BT_AND, "" }); i += 2; continue; }
+		if (i + 1 < n && s[i] == '|' && s[i + 1] == '|') { toks.push_back({ BT_OR, "" }); i += 2; continue; }
+		if (s[i] == '-' && i > 0 && s[i - 1] == ' ' && i + 1 < n && s[i + 1] == ' ') { toks.push_back({ BT_DIFF, "" }); i++; continue; }
+		string dict;
+		size_t open = dictTagEnd(s, i);
+		if (open != string::npos) {
+			dict = s.substr(i + 1, open - i - 1);
+			i = open;
+		}
+		if (s[i] == '(') {
+			int dp = 0, db = 0; size_t start = i;
+			while (i < n) {
+				if (s[i] == '[') db++;
+				else if (s[i] == ']' && db > 0) db--;
+				else if (s[i] == '(' && db == 0) dp++;
+				else if (s[i] == ')' && db == 0) { dp--; if (dp == 0) { i++; break; } }
+				i++;
+			}
+			string content = s.substr(start + 1, i - start - 2);
+			for (char& c : content) if (c == '\\') c = '/';
+			toks.push_back({ BT_ATOM, content, dict });
+			continue;
+		}
+		i++;
+	}
+	return toks;
+}
+
+// @NOMBRE((A) && (B)): las hojas que no tienen su propio @ pasan a ser de NOMBRE
+static void tagLeaves(BoolExpr& e, const string& dict) {
+	if (e.op == BoolExpr::LEAF) { if (e.dict.empty()) e.dict = dict; return; }
+	for (BoolExpr& c : e.children) tagLeaves(c, dict);
+}
+
+struct BoolParser {
+	vector<BoolToken> toks;
+	size_t pos;
+	BoolParser(const vector<BoolToken>& t) : toks(t), pos(0) {}
+	bool atEnd() const { return pos >= toks.size(); }
+	BoolTokT peekType() const { return pos < toks.size() ? toks[pos].type : BT_ATOM; }
+	BoolToken consume() { return toks[pos++]; }
+
+	BoolExpr parseExpr() {
+		BoolExpr left = parseDiff();
+		while (!atEnd() && peekType() == BT_OR) {
+			consume();
+			BoolExpr right = parseDiff();
+			BoolExpr node; node.op = BoolExpr::OR_OP;
+			node.children.push_back(left); node.children.push_back(right);
+			left = node;
+		}
+		return left;
+	}
+	BoolExpr parseDiff() {
+		BoolExpr left = parseConj();
+		while (!atEnd() && peekType() == BT_DIFF) {
+			consume();
+			BoolExpr right = parseConj();
+			BoolExpr node; node.op = BoolExpr::DIFF_OP;
+			node.children.push_back(left); node.children.push_back(right);
+			left = node;
+		}
+		return left;
+	}
+	BoolExpr parseConj() {
+		BoolExpr left = parseUnary();
+		while (!atEnd() && peekType() == BT_AND) {
+			consume();
+			BoolExpr right = parseUnary();
+			BoolExpr node; node.op = BoolExpr::AND_OP;
+			node.children.push_back(left); node.children.push_back(right);
+			left = node;
+		}
+		return left;
+	}
+	BoolExpr parseUnary() {
+		if (!atEnd() && peekType() == BT_NOT) {
+			consume();
+			BoolExpr child = parseUnary();
+			BoolExpr node; node.op = BoolExpr::NOT_OP;
+			node.children.push_back(child);
+			return node;
+		}
+		return parseAtom();
+	}
+	BoolExpr parseAtom() {
+		if (!atEnd() && peekType() == BT_ATOM) {
+			BoolToken tok = consume();
+			if (hasBoolOps(tok.content)) {
+				BoolParser inner(tokenizeBool(tok.content));
+				BoolExpr e = inner.parseExpr();
+				if (!tok.dict.empty()) tagLeaves(e, tok.dict);
+				return e;
+			}
+			BoolExpr leaf; leaf.op = BoolExpr::LEAF; leaf.query = tok.content; leaf.dict = tok.dict;
+			return leaf;
+		}
+		return BoolExpr(); // vacío
+	}
+};
+
+static BoolExpr parseBoolExpr(const string& s) {
+	BoolParser p(tokenizeBool(s));
+	return p.parseExpr();
+}
+
+// Coste estimado de una hoja en palabras examinadas. Solo sirve para ordenar las hojas
+// entre sí: los patrones cuentan las palabras de longitud compatible por (1 + tolerancia);
+// /cal, las comparaciones de Levenshtein de todos sus segmentos; /wp, varias pasadas;
+// /hom, una consulta al índice o una comparación por clave fonética.
+static double estimateLeafCost(const string& query, const Dict& d) {
+	LeafPlan plan = planLeaf(query);
+	const vector<size_t>& lh = d.stats.lenHist;
+	auto wordsWithLen = [&](int lo, int hi) {
+		double s = 0;
+		for (int n = (std::max)(0, lo); n <= hi && n < (int)lh.size(); n++) s += lh[n];
+		return s;
+	};
+	if (plan.kind == LeafPlan::CALEMBOUR) {
+		int L = (int)normalizeWord(plan.cal_word).size();
+		double c = L * (L + 1) / 2.0;
+		if (plan.cal_n > 0)
+			for (int p = 1; p <= L; p++) c += (L - p + 1) * wordsWithLen(p - plan.cal_n, p + plan.cal_n);
+		return c;
+	}
+	if (plan.kind == LeafPlan::WORDPLAY) return (double)d.size() * (plan.wp_n + 2);
+	if (plan.kind == LeafPlan::HOMOPHONE) return plan.hom_n > 0 ? (double)phoneticKeyCount(d) : 1.0;
+	double c = 0;
+	for (const string& p : plan.patterns) {
+		CompiledPattern cp = compilePattern(p, d.stats);
+		if (cp.ok) c += wordsWithLen(cp.min_len, cp.max_len) * (1 + cp.tolerance);
+	}
+	return c;
+}
+
+// Forma canónica de un subárbol, para reconocer subexpresiones repetidas: hojas sin
+// espacios en los extremos y los dos hijos de && y || en orden ((A) && (B) = (B) && (A))
+static string boolExprKey(const BoolExpr& e) {
+	static const char* ops[] = { "", " && ", " || ", "!", " - " };
+	if (e.op == BoolExpr::LEAF) {
+		string q = e.query;
+		q.erase(0, q.find_first_not_of(" \t\r\n"));
+		size_t l = q.find_last_not_of(" \t\r\n");
+		if (l != string::npos) q.erase(l + 1);
+		return (e.dict.empty() ? "" : "@" + e.dict) + "(" + q + ")";
+	}
+	if (e.op == BoolExpr::NOT_OP) return "!" + boolExprKey(e.children[0]);
+	if (e.children.size() < 2) return "()";
+	string a = boolExprKey(e.children[0]), b = boolExprKey(e.children[1]);
+	if ((e.op == BoolExpr::AND_OP || e.op == BoolExpr::OR_OP) && b < a) swap(a, b);
+	return "(" + a + ops[e.op] + b + ")";
+}
+
+// Resultado de una (sub)expresión booleana. Con 'inverted' representa el complemento de
+// 'set' sin materializarlo: !A solo cambia la marca, comparte el conjunto de A y su tamaño
+// es N - |A|. El complemento se recorre entero solo al enumerar las palabras.
+struct BoolSet {
+	shared_ptr<const IdSet> set;
+	size_t universe = 0;    // tamaño del diccionario
+	bool inverted = false;
+	shared_ptr<const DictUnion> space; // índices de esta unión de diccionarios (vacío: del activo)
+
+	size_t size() const { return inverted ? universe - set->size() : set->size(); }
+
+	// Índices de las palabras del conjunto, en orden de diccionario
+	vector<size_t> ids() const {
+		if (!inverted) return set->ids();
+		vector<size_t> out;
+		out.reserve(size());
+		size_t next = 0;
+		set->forEach([&](size_t id) {
+			for (; next < id; next++) out.push_back(next);
+			next = id + 1;
+			});
+		for (; next < universe; next++) out.push_back(next);
+		return out;
+	}
+
+	// Texto de las palabras del conjunto; 'd' es el diccionario activo
+	vector<string> words(const Dict& d) const {
+		vector<string> out;
+		for (size_t id : ids()) out.push_back(space ? space->word(id) : d.raw(id));
+		return out;
+	}
+};
+
+// X ∩ Y, donde X e Y son los conjuntos de 'x' e 'y' complementados según 'xi' e 'yi'.
+// Nunca materializa un complemento: A ∩ !B = A \ B y !A ∩ !B = !(A ∪ B).
+static BoolSet intersectSets(const BoolSet& x, bool xi, const BoolSet& y, bool yi) {
+	BoolSet out;
+	out.universe = x.universe;
+	out.space = x.space;
+	if (xi && yi) {
+		out.inverted = true;
+		out.set = make_shared<const IdSet>(IdSet::unite(*x.set, *y.set));
+	}
+	else if (xi) out.set = make_shared<const IdSet>(IdSet::subtract(*y.set, *x.set));
+	else if (yi) out.set = make_shared<const IdSet>(IdSet::subtract(*x.set, *y.set));
+	else out.set = make_shared<const IdSet>(IdSet::intersect(*x.set, *y.set));
+	return out;
+}
+
+// Primer @NOMBRE de la expresión que no es el activo ni está en memoria ("" si no hay)
+static string missingDict(const BoolExpr& e, const Dict& d) {
+	if (e.op == BoolExpr::LEAF) return e.dict.empty() || e.dict == d.name || residentDict(e.dict) ? "" : e.dict;
+	for (const BoolExpr& c : e.children) {
+		string m = missingDict(c, d);
+		if (!m.empty()) return m;
+	}
+	return "";
+}
+
+// Evalúa el árbol en dos fases. Las hojas distintas (una vez cada una aunque se repitan)
+// son independientes: se reparten entre hilos con parallelFor, empezando por las más
+// baratas, y su resultado se guarda comprimido (IdSet). Después se combinan de abajo
+// arriba, reutilizando los subárboles repetidos: ! invierte la marca, && y - se reducen
+// a intersecciones y || a !(!X && !Y).
+// Si alguna hoja es de otro diccionario (@NOMBRE), cada una se evalúa en el suyo y se pasa
+// a índices de la unión de los diccionarios de la expresión, que es entonces el universo.
+static BoolSet evalBoolExpr(
+	const BoolExpr& expr,
+	const Dict& d
+) {
+	// @NOMBRE del diccionario activo es lo mismo que no ponerlo
+	BoolExpr e = expr;
+	function<void(BoolExpr&)> untag = [&](BoolExpr& x) {
+		if (x.dict == d.name) x.dict.clear();
+		for (BoolExpr& c : x.children) untag(c);
+	};
+	untag(e);
+
+	vector<string> leaves, leafDict;
+	unordered_map<string, size_t> leafIdx;
+	function<void(const BoolExpr&)> collect = [&](const BoolExpr& x) {
+		if (x.op == BoolExpr::LEAF) {
+			if (leafIdx.emplace(boolExprKey(x), leaves.size()).second) {
+				leaves.push_back(x.query);
+				leafDict.push_back(x.dict);
+			}
+			return;
+		}
+		for (const BoolExpr& c : x.children) collect(c);
+	};
+	collect(e);
+
+	// Diccionario de cada hoja y, si no son todas del activo, su posición en la unión (los
+	// diccionarios van por nombre: la misma unión sirve en cualquier orden). El activo entra
+	// en la caché de uniones solo si es el residente con su nombre.
+	vector<const Dict*> src(leaves.size(), &d);
+	vector<size_t> part(leaves.size(), 0);
+	shared_ptr<const DictUnion> space;
+	if (any_of(leafDict.begin(), leafDict.end(), [](const string& n) { return !n.empty(); })) {
+		vector<shared_ptr<const Dict>> dicts;
+		bool cache = true;
+		for (size_t i = 0; i < leaves.size(); i++) {
+			shared_ptr<const Dict> t = residentDict(leafDict[i].empty() ? d.name : leafDict[i]);
+			if (leafDict[i].empty() && t.get() != &d) {
+				t = shared_ptr<const Dict>(shared_ptr<const Dict>(), &d);
+				cache = false;
+			}
+			if (!t) throw invalid_argument("diccionario no cargado: " + leafDict[i]);
+			if (find(dicts.begin(), dicts.end(), t) == dicts.end()) dicts.push_back(t);
+			src[i] = t.get();
+		}
+		sort(dicts.begin(), dicts.end(), [](const shared_ptr<const Dict>& a, const shared_ptr<const Dict>& b) { return a->name < b->name; });
+		for (size_t i = 0; i < leaves.size(); i++)
+			part[i] = find_if(dicts.begin(), dicts.end(), [&](const shared_ptr<const Dict>& t) { return t.get() == src[i]; }) - dicts.begin();
+		space = dictUnion(dicts, cache);
+	}
+	size_t N = space ? space->size() : d.size();
+
+	vector<pair<double, size_t>> order;
+	for (size_t i = 0; i < leaves.size(); i++) order.push_back({ estimateLeafCost(leaves[i], *src[i]), i });
+	stable_sort(order.begin(), order.end(), [](const pair<double, size_t>& a, const pair<double, size_t>& b) { return a.first < b.first; });
+	vector<BoolSet> leafRes(leaves.size());
+	parallelFor(order.size(), [&](size_t k) {
+		size_t i = order[k].second;
+		vector<bool> m = runLeafQuery(leaves[i], *src[i]);
+		if (space) {
+			vector<bool> inUnion(N, false);
+			const vector<uint32_t>& to = space->toUnion[part[i]];
+			for (size_t j = 0; j < m.size(); j++)
+				if (m[j] && to[j] != kNotInUnion) inUnion[to[j]] = true;
+			m.swap(inUnion);
+		}
+		leafRes[i].set = make_shared<const IdSet>(IdSet::fromBitmask(m));
+		leafRes[i].universe = N;
+		leafRes[i].space = space;
+		});
+
+	auto t0 = chrono::steady_clock::now();
+	unordered_map<string, BoolSet> memo;
+	function<BoolSet(const BoolExpr&)> combine = [&](const BoolExpr& x) -> BoolSet {
+		string key = boolExprKey(x);
+		if (x.op == BoolExpr::LEAF) return leafRes[leafIdx[key]];
+		auto it = memo.find(key);
+		if (it != memo.end()) return it->second;
+		BoolSet res;
+		if (x.op == BoolExpr::NOT_OP) {
+			res = combine(x.children[0]);
+			res.inverted = !res.inverted;
+		}
+		else if (x.children.size() >= 2) {
+			BoolSet left = combine(x.children[0]);
+			BoolSet right = combine(x.children[1]);
+			if (x.op == BoolExpr::AND_OP) res = intersectSets(left, left.inverted, right, right.inverted);
+			else if (x.op == BoolExpr::DIFF_OP) res = intersectSets(left, left.inverted, right, !right.inverted);
+			else {
+				res = intersectSets(left, !left.inverted, right, !right.inverted);
+				res.inverted = !res.inverted;
+			}
+		}
+		else {
+			res.set = make_shared<const IdSet>();
+			res.universe = N;
+			res.space = space;
+		}
+		return memo.emplace(key, move(res)).first->second;
+	};
+	BoolSet res = combine(e);
+	// Un complemento no incluye las entradas quitadas con /remove (la unión ya no las tiene)
+	if (res.inverted && !space && d.removedCount) res.set = make_shared<const IdSet>(IdSet::unite(*res.set, IdSet::fromBitmask(removedMask(d))));
+	if (t_stats) t_stats->bool_ms += msSince(t0);
+	return res;
+}
+
+// --- CONSULTAS ANIDADAS ---
+
+// Separa una consulta anidada al principio de 'arg': '(inner) after'. Devuelve false si
+// 'arg' no empieza por '(', los paréntesis no cierran o es un rango de patrón (ej: "1,3,V").
+static bool splitNestedArg(const string& arg, string& inner, string& after) {
+	string a = arg;
+	a.erase(0, a.find_first_not_of(" "));
+	if (a.empty() || a[0] != '(') return false;
+
+	// Buscar el ) que cierra el primero ( (respetando [ ] anidados)
+	int depth = 0, bdepth = 0;
+	size_t i = 0;
+	for (; i < a.size(); i++) {
+		if (a[i] == '[') bdepth++;
+		else if (a[i] == ']' && bdepth > 0) bdepth--;
+		else if (a[i] == '(' && bdepth == 0) depth++;
+		else if (a[i] == ')' && bdepth == 0) { depth--; if (!depth) { i++; break; } }
+	}
+	if (depth != 0) return false;
+
+	inner = a.substr(1, i - 2);
+	after = a.substr(i);
+	after.erase(0, after.find_first_not_of(" "));
+
+	// ¿Es un rango de patrón? (ej: "1,3,V")
+	{
+		auto p = split(inner, ',');
+		bool is_range = (p.size() <= 3);
+		if (is_range && !p.empty() && !p[0].empty())
+			is_range = all_of(p[0].begin(), p[0].end(), [](unsigned char c) { return isdigit(c); });
+		if (is_range && p.size() >= 2 && !p[1].empty())
+			is_range = all_of(p[1].begin(), p[1].end(), [](unsigned char c) { return isdigit(c); });
+		if (is_range && p.size() >= 3 && !p[2].empty())
+			is_range = (p[2] == "V" || p[2] == "C");
+		if (is_range) return false;
+	}
+	return true;
+}
+
+// Comprueba si 'arg' empieza por una consulta anidada (expr entre paréntesis que NO sea un rango de patrón).
+// Si sí, resuelve la consulta, llena 'words' con los resultados y 'after' con el texto restante.
+static bool tryResolveNestedArg(
+	const string& arg,
+	const Dict& d,
+	mt19937& rng,
+	vector<string>& words,
+	string& after
+) {
+	string inner;
+	if (!splitNestedArg(arg, inner, after)) return false;
+
+	// Resolver como subconsulta
+	// Caso especial: /rd n PATRON → limitar a n resultados aleatorios
+	int nested_rd_n = -1; // -1 = no es /rd
+	string inner_for_search = inner;
+	{
+		string t = inner; t.erase(0, t.find_first_not_of(" "));
+		bool is_rd_n = (t.size() >= 7 && t.substr(0, 7) == "/random") ||
+			(t.size() >= 3 && t.substr(0, 3) == "/rd" && (t.size() == 3 || t[3] == ' '));
+		if (is_rd_n) {
+			string rest_r = (t.substr(0, 7) == "/random") ? t.substr(7) : t.substr(3);
+			rest_r.erase(0, rest_r.find_first_not_of(" "));
+			size_t sp2 = rest_r.find(' ');
+			string ftok = (sp2 != string::npos) ? rest_r.substr(0, sp2) : rest_r;
+			if (!ftok.empty() && all_of(ftok.begin(), ftok.end(), [](unsigned char c) {return isdigit(c);})) {
+				nested_rd_n = safeStoi(ftok);
+				string pat_part = (sp2 != string::npos) ? rest_r.substr(sp2 + 1) : "";
+				pat_part.erase(0, pat_part.find_first_not_of(" "));
+				if (pat_part.empty()) pat_part = ".";
+				if (!pat_part.empty() && pat_part[0] == '[') pat_part = ". " + pat_part;
+				inner_for_search = pat_part;
+			}
+		}
+	}
+
+	if (hasBoolOps(inner_for_search)) words = evalBoolExpr(parseBoolExpr(inner_for_search), d).words(d);
+	else {
+		vector<bool> matched = runLeafQuery(inner_for_search, d);
+		for (size_t j = 0; j < d.size(); j++)
+			if (matched[j]) words.push_back(d.raw(j));
+	}
+
+	// Aplicar selección aleatoria si era /rd n
+	if (nested_rd_n > 0 && (int)words.size() > nested_rd_n) {
+		shuffle(words.begin(), words.end(), rng);
+		words.resize(nested_rd_n);
+	}
+	return true;
+}
+
+// --- EJECUCIÓN DE CONSULTAS ---
+
+// Bloque de resultados: uno por palabra de una consulta anidada (o por palabra de /cal)
+// Las palabras se guardan como índices del diccionario; el texto se busca al imprimir.
+struct ResultBlock {
+	string source;          // palabra de origen (vacío en consultas simples)
+	vector<size_t> ids;     // palabras encontradas (índices del diccionario)
+	string note;            // mensaje asociado al bloque, si lo hay
+	vector<string> items;   // líneas que no son índices del diccionario (divisiones de /cal, palabras de @NOMBRE)
+	size_t omitted = 0;     // resultados que no están en ids/items por el máximo de resultados
+
+	size_t size() const { return ids.size() + items.size(); }
+};
+
+// Resultado estructurado de una consulta: el REPL lo imprime y el modo batch lo serializa
+struct QueryResult {
+	vector<string> notes;        // mensajes informativos previos a los resultados
+	vector<ResultBlock> blocks;
+	string footer;               // mensaje tras el total (ej: n final de /wp)
+	string error;                // si no está vacío, la consulta no se ha podido ejecutar
+	bool bullets = true;         // "- palabra" (las divisiones de /cal se imprimen tal cual)
+	bool show_total = true;      // /random no imprime "Total:"
+	bool truncated = false;      // resultados parciales (límite de tiempo, de trabajo o de resultados)
+	string truncated_by;         // motivo del recorte: "timeout", "work", "interrupt" o "limit"
+	bool count_only = false;     // /count: solo el número de resultados
+	size_t counted = 0;          // resultados contados sin enumerarlos (/count de una expresión booleana)
+
+	// Con un máximo de resultados, total() cuenta también los recortados y returned() solo
+	// los que se envían
+	int total() const {
+		int t = (int)counted;
+		for (const auto& b : blocks) t += (int)(b.size() + b.omitted);
+		return t;
+	}
+	int returned() const {
+		int t = (int)counted;
+		for (const auto& b : blocks) t += (int)b.size();
+		return t;
+	}
+};
+
+// Consultas anidadas: evalúa en una sola pasada los patrones generados para cada palabra
+// (bloque, patrón) y añade lo encontrado a su bloque. Con 'dedupe', un bloque con varios
+// patrones no repite formas normalizadas (unión de permutaciones de /ans).
+static void runFanOut(const vector<pair<size_t, string>>& jobs, QueryResult& qr, const Dict& d, bool dedupe = false) {
+	vector<string> pats;
+	pats.reserve(jobs.size());
+	for (const auto& j : jobs) pats.push_back(j.second);
+	vector<vector<size_t>> found = runSearchMulti(pats, d);
+	vector<unordered_set<string>> seen(dedupe ? qr.blocks.size() : 0);
+	for (size_t k = 0; k < jobs.size(); k++) {
+		vector<size_t>& ids = qr.blocks[jobs[k].first].ids;
+		if (!dedupe) { ids.insert(ids.end(), found[k].begin(), found[k].end()); continue; }
+		for (size_t id : found[k])
+			if (seen[jobs[k].first].insert(d.norm(id)).second) ids.push_back(id);
+	}
+}
+
+// Imprime un resultado en el formato del REPL. 'd' debe ser el diccionario con el que se ejecutó.
+static void printQueryResult(const QueryResult& qr, const Dict& d, ostream& out) {
+	if (!qr.error.empty()) { out << qr.error << endl; return; }
+	if (qr.count_only) out << "Total: " << qr.total() << "\n";
+	else {
+		for (const string& n : qr.notes) out << n << "\n";
+		for (size_t bi = 0; bi < qr.blocks.size(); bi++) {
+			if (bi > 0) out << "\n";
+			const ResultBlock& b = qr.blocks[bi];
+			if (!b.note.empty()) out << b.note << "\n";
+			for (size_t id : b.ids) out << (qr.bullets ? "- " : "") << d.raw(id) << "\n";
+			for (const string& r : b.items) out << (qr.bullets ? "- " : "") << r << "\n";
+		}
+		if (qr.show_total) out << "Total: " << qr.total() << "\n";
+		if (!qr.footer.empty()) out << qr.footer << "\n";
+	}
+	if (qr.truncated) {
+		string why = qr.truncated_by == "interrupt" ? "consulta interrumpida con Ctrl-C"
+			: qr.truncated_by == "timeout" ? "se agotó el tiempo máximo"
+			: qr.truncated_by == "work" ? "se agotó el trabajo máximo"
+			: "se alcanzó el máximo de resultados";
+		out << "(Resultados parciales: " << why << ")\n";
+	}
+	out.flush();
+}
+
+// Imprime las estadísticas de /stats: una entrada por hoja del árbol de la consulta
+static void printQueryStats(const QueryStats& st, double total_ms, ostream& out) {
+	auto ms = [](double v) { ostringstream o; o.setf(ios::fixed); o.precision(2); o << v << " ms"; return o.str(); };
+	out << "\n--- ESTADÍSTICAS ---\n";
+	out << "Tiempo total: " << ms(total_ms);
+	if (st.bool_ms > 0) out << " (combinación booleana: " << ms(st.bool_ms) << ")";
+	out << "\n";
+	for (size_t i = 0; i < st.leaves.size(); i++) {
+		const LeafStats& l = st.leaves[i];
+		out << "[" << i + 1 << "] " << l.query << "\n";
+		out << "    parseo " << ms(l.parse_ms) << " | restricciones " << ms(l.resources_ms)
+			<< " | patrón " << ms(l.match_ms);
+		if (l.lev_ms > 0) out << " | levenshtein " << ms(l.lev_ms);
+		out << "\n";
+		out << "    patrones " << l.patterns << " | examinadas " << l.scanned << " | descartadas por restricciones " << l.rejected
+			<< " | memo " << l.memo_hits << " aciertos / " << l.memo_misses << " fallos | resultados " << l.results << "\n";
+	}
+	out.flush();
+}
+
+// Ejecuta una consulta completa (patrón, comando, expresión booleana o consulta anidada)
+// sobre el diccionario dado. No escribe nada: todo se devuelve en el QueryResult.
+static QueryResult executeQuery(const string& rawInput, const Dict& d, mt19937& rng) {
+	QueryResult qr;
+
+	string input = rawInput;
+	input.erase(0, input.find_first_not_of(" \t\r\n"));
+	size_t last = input.find_last_not_of(" \t\r\n");
+	if (last != string::npos) input.erase(last + 1);
+	if (input.empty()) { qr.show_total = false; return qr; }
+	string inputLine = input;
+
+	// --- /count: solo el número de resultados (antes de la lógica booleana: abarca toda la línea) ---
+	if (input == "/count" || input.substr(0, 7) == "/count ") {
+		string rest = input.substr(6);
+		rest.erase(0, rest.find_first_not_of(" "));
+		if (rest.empty()) { qr.error = "(Uso: /count CONSULTA)"; return qr; }
+		if (hasBoolOps(rest)) {
+			// El tamaño se conoce sin enumerar las palabras (también el de un complemento)
+			BoolExpr expr = parseBoolExpr(rest);
+			string missing = missingDict(expr, d);
+			if (!missing.empty()) { qr.error = "(El diccionario '" + missing + "' no está cargado: usa antes /load " + missing + ")"; return qr; }
+			qr.counted = evalBoolExpr(expr, d).size();
+			qr.count_only = true;
+			return qr;
+		}
+		int limit = t_resultLimit;
+		t_resultLimit = 0; // el total necesita todos los resultados
+		qr = executeQuery(rest, d, rng);
+		t_resultLimit = limit;
+		qr.count_only = true;
+		return qr;
+	}
+
+	// --- LÓGICA BOOLEANA ---
+	if (hasBoolOps(input)) {
+		BoolExpr expr = parseBoolExpr(input);
+		string missing = missingDict(expr, d);
+		if (!missing.empty()) { qr.error = "(El diccionario '" + missing + "' no está cargado: usa antes /load " + missing + ")"; return qr; }
+		BoolSet res = evalBoolExpr(expr, d);
+		// Con otros diccionarios, las palabras no son índices del activo: van como texto
+		ResultBlock b;
+		if (res.space) b.items = res.words(d);
+		else b.ids = res.ids();
+		qr.blocks.push_back(move(b));
+		return qr;
+	}
+
+	// --- DETECCIÓN DE COMANDOS ---
+	bool isAn = (input.substr(0, 8) == "/anagram" || (input.substr(0, 4) == "/ang" && (input.size() == 4 || input[4] == ' ')));
+	bool isPar = (input.substr(0, 12) == "/paronomasia" || (input.substr(0, 4) == "/par" && (input.size() == 4 || input[4] == ' ')));
+	bool isAns = (input.substr(0, 12) == "/anasyllabic" || (input.substr(0, 4) == "/ans" && (input.size() == 4 || input[4] == ' ')));
+	bool isAnp = (input.substr(0, 9) == "/anaphora" || (input.substr(0, 4) == "/anp" && (input.size() == 4 || input[4] == ' ')));
+	bool isEpi = (input.substr(0, 9) == "/epiphora" || (input.substr(0, 4) == "/epi" && (input.size() == 4 || input[4] == ' ')));
+	bool isMul = (input.substr(0, 14) == "/multisyllabic" || (input.substr(0, 4) == "/mul" && (input.size() == 4 || input[4] == ' ')));
+	bool isUni = (input.substr(0, 12) == "/univocalism" || (input.substr(0, 4) == "/uni" && (input.size() == 4 || input[4] == ' ')));
+	bool isAso = (input.size() >= 9 && input.substr(0, 9) == "/assonant") || (input.size() >= 4 && input.substr(0, 4) == "/aso" && (input.size() == 4 || input[4] == ' '));
+	bool isCon = (input.size() >= 10 && input.substr(0, 10) == "/consonant") || (input.size() >= 4 && input.substr(0, 4) == "/con" && (input.size() == 4 || input[4] == ' '));
+
+	// --- DETECCIÓN DE /random (/rd) ---
+	bool isRd = (input.substr(0, 7) == "/random" || (input.substr(0, 3) == "/rd" && (input.size() == 3 || input[3] == ' ')));
+	int rd_n = 1;           // número de palabras a devolver
+	string rd_pattern = ""; // patrón (vacío = ".")
+
+	if (isRd) {
+		// Extraer el resto del comando
+		string rest = (input.substr(0, 7) == "/random") ? input.substr(7) : input.substr(3);
+		rest.erase(0, rest.find_first_not_of(" "));
+
+		// El primer token debe ser n (número entero)
+		// Si el primer token no es un número, asumimos n=1 y todo es el patrón
+		size_t sp = rest.find(' ');
+		string first_token = (sp != string::npos) ? rest.substr(0, sp) : rest;
+		string after_first = (sp != string::npos) ? rest.substr(sp + 1) : "";
+
+		bool first_is_number = !first_token.empty() &&
+			all_of(first_token.begin(), first_token.end(), [](unsigned char c) { return isdigit(c); });
+
+		if (first_is_number) {
+			rd_n = safeStoi(first_token);
+			rd_pattern = after_first;
+		}
+		else {
+			rd_n = 1;
+			rd_pattern = rest;
+		}
+
+		// Si no hay patrón, usar "." (cualquier palabra)
+		if (rd_pattern.empty()) rd_pattern = ".";
+		// Si el patrón empieza por '[', no tiene estructura: añadir '.' implícito
+		if (!rd_pattern.empty() && rd_pattern[0] == '[') rd_pattern = ". " + rd_pattern;
+
+		// Construir el inputLine para la búsqueda normal
+		inputLine = rd_pattern;
+	}
+
+	// Vector para almacenar todos los patrones a evaluar en esta ronda
+	vector<string> patterns_to_run;
+
+	if (isAso || isCon) {
+		int plen = 4;
+		if (isAso && input.size() >= 9 && input.substr(0, 9) == "/assonant") plen = 9;
+		else if (isCon && input.size() >= 10 && input.substr(0, 10) == "/consonant") plen = 10;
+		string rest_full = input.substr(plen);
+		rest_full.erase(0, rest_full.find_first_not_of(" "));
+
+		// Helper: de un 'rest' extrae word, extra_r, tolerance_str y devuelve inputLine para aso/con
+		auto computeRhymeIL = [&](const string& r) -> string {
+			string w2, extra_r2 = "", tol2 = "", rest2 = r;
+			size_t bs = rest2.find('[');
+			size_t ls = rest2.find_last_of(" ");
+			if (bs != string::npos) {
+				size_t be = rest2.find(']', bs);
+				if (be != string::npos) { w2 = rest2.substr(0, bs); extra_r2 = rest2.substr(bs + 1, be - bs - 1); tol2 = rest2.substr(be + 1); tol2.erase(0, tol2.find_first_not_of(" ")); }
+			}
+			else if (ls != string::npos) {
+				string pn = rest2.substr(ls + 1); string cn = pn; if (!cn.empty() && cn.back() == '*') cn.pop_back();
+				if (!cn.empty() && all_of(cn.begin(), cn.end(), [](unsigned char c) {return isdigit(c);})) { w2 = rest2.substr(0, ls); tol2 = pn; }
+				else w2 = rest2;
+			}
+			else w2 = rest2;
+			w2.erase(remove(w2.begin(), w2.end(), ' '), w2.end());
+			string rhyme = getRhymeSuffix(w2);
+			if (rhyme.empty()) return "";
+			string il2;
+			if (isCon) il2 = "." + rhyme;
+			else { il2 = ".(0,,C)"; for (char c : rhyme) if (isVowel(c)) il2 += string(1, c) + "(0,,C)"; }
+			if (!extra_r2.empty()) il2 += " [" + extra_r2 + "]";
+			if (!tol2.empty()) il2 += " " + tol2;
+			return il2;
+			};
+
+		vector<string> nested_words_ac; string nested_after_ac;
+		bool is_nested_ac = tryResolveNestedArg(rest_full, d, rng, nested_words_ac, nested_after_ac);
+		if (is_nested_ac) {
+			if (nested_words_ac.empty()) { qr.notes.push_back("(La consulta anidada no devolvió resultados)"); qr.show_total = false; return qr; }
+			vector<pair<size_t, string>> jobs;
+			for (const string& nw : nested_words_ac) {
+				string r = nw + (nested_after_ac.empty() ? "" : " " + nested_after_ac);
+				string il = computeRhymeIL(r);
+				if (il.empty()) { qr.blocks.push_back({ nw, {}, "(No se pudo determinar la rima de '" + nw + "')", {} }); continue; }
+				jobs.push_back({ qr.blocks.size(), il });
+				qr.blocks.push_back({ nw, {}, "", {} });
+			}
+			runFanOut(jobs, qr, d);
+			return qr;
+		}
+		// Caso normal (una sola palabra)
+		string il = computeRhymeIL(rest_full);
+		if (il.empty()) { qr.error = "(No se pudo determinar la rima de '" + rest_full + "')"; return qr; }
+		string rhyme_disp = getRhymeSuffix(rest_full.substr(0, rest_full.find(' ')));
+		if (isCon) qr.notes.push_back("(Buscando rima consonante con sufijo: " + rhyme_disp + ")");
+		else { string vd; for (char c : rhyme_disp) if (isVowel(c)) vd += c; qr.notes.push_back("(Buscando rima asonante con vocales: " + vd + ")"); }
+		inputLine = il;
+	}
+
+	// Detección de comandos inválidos (empieza por / pero no es reconocido)
+	if (input[0] == '/' && !isAn && !isPar && !isAns && !isAnp && !isEpi && !isMul && !isUni
+		&& !isAso && !isCon
+		&& !(input.size() >= 7 && input.substr(0, 7) == "/random") && !(input.size() >= 3 && input.substr(0, 3) == "/rd" && (input.size() == 3 || input[3] == ' '))
+		&& !(input.size() >= 10 && input.substr(0, 10) == "/calembour") && !(input.size() >= 4 && input.substr(0, 4) == "/cal" && (input.size() == 4 || input[4] == ' '))
+		&& !(input.size() >= 9 && input.substr(0, 9) == "/wordplay") && !(input.size() >= 3 && input.substr(0, 3) == "/wp" && (input.size() == 3 || input[3] == ' '))
+		&& !(input.size() >= 10 && input.substr(0, 10) == "/homophone") && !(input.size() >= 4 && input.substr(0, 4) == "/hom" && (input.size() == 4 || input[4] == ' '))) {
+		qr.error = "(Sintaxis inválida o comando desconocido. Usa /help o /commands para ver las opciones.)";
+		return qr;
+	}
+
+	// extractWordArgs: alias local para extractWordRestrTol (definida globalmente)
+	auto extractWordArgs = extractWordRestrTol;
+
+	if (isAn || isPar) {
+		bool isAnagram = isAn;
+		string rest_full;
+		if (isAn) rest_full = (input.substr(0, 8) == "/anagram") ? input.substr(8) : input.substr(4);
+		else      rest_full = (input.substr(0, 12) == "/paronomasia") ? input.substr(12) : input.substr(4);
+		rest_full.erase(0, rest_full.find_first_not_of(" "));
+
+		auto computeAnIL = [&](const string& r) -> string {
+			auto [word, extra_r, tol_str] = extractWordArgs(r);
+			string nw = normalizeWord(word);
+			if (isAnagram) {
+				// Normalizar la tolerancia para que siempre incluya '*' (es total)
+				string ts = tol_str;
+				if (!ts.empty()) {
+					string tmp = ts;
+					if (tmp.back() == '*') tmp.pop_back();
+					if (all_of(tmp.begin(), tmp.end(), [](unsigned char c) { return isdigit(c); }))
+						ts = tmp + "*";
+				}
+				map<char, int> cnt;
+				for (char c : nw) cnt[c]++;
+				string exp = ". [";
+				for (auto& [ch, co] : cnt) exp += to_string(co) + ch + ",";
+				exp += to_string(nw.length());
+				if (!extra_r.empty()) exp += "," + extra_r;
+				exp += "] " + ts;
+				return exp;
+			}
+			else {
+				// Esqueleto consonántico: consonantes en su posición, vocales → '*'
+				// Ejemplo: COCHE → C*CH* [2V*]
+				string pat = ""; int vow = 0; string cgrp = "";
+				for (char c : nw) {
+					if (isVowel(c)) { pat += cgrp + "*"; cgrp = ""; vow++; }
+					else cgrp += c;
+				}
+				pat += cgrp; // consonantes finales
+				string exp = pat + " [" + to_string(vow) + "V*";
+				if (!extra_r.empty()) exp += "," + extra_r;
+				exp += "] " + tol_str;
+				return exp;
+			}
+			};
+
+		vector<string> nw_an; string na_an;
+		if (tryResolveNestedArg(rest_full, d, rng, nw_an, na_an)) {
+			if (nw_an.empty()) { qr.notes.push_back("(La consulta anidada no devolvió resultados)"); qr.show_total = false; return qr; }
+			vector<pair<size_t, string>> jobs;
+			for (const string& nw : nw_an) {
+				string r = nw + (na_an.empty() ? "" : " " + na_an);
+				jobs.push_back({ qr.blocks.size(), computeAnIL(r) });
+				qr.blocks.push_back({ nw, {}, "", {} });
+			}
+			runFanOut(jobs, qr, d);
+			return qr;
+		}
+		inputLine = computeAnIL(rest_full);
+	}
+
+	if (isAns) {
+		string rest_full = (input.substr(0, 12) == "/anasyllabic") ? input.substr(12) : input.substr(4);
+		rest_full.erase(0, rest_full.find_first_not_of(" "));
+
+		auto computeAnsPatterns = [&](const string& r) -> vector<string> {
+			auto [word, extra_r, tol_str] = extractWordArgs(r);
+			string nw = normalizeWord(word);
+			vector<string> syls = getSyllables(nw); sort(syls.begin(), syls.end());
+			vector<string> result;
+			do {
+				string p = ""; for (const string& s : syls) p += s;
+				if (!extra_r.empty()) p += " [" + extra_r + "]";
+				if (!tol_str.empty()) p += " " + tol_str;
+				result.push_back(p);
+			} while (!budgetSpend(1) && next_permutation(syls.begin(), syls.end()));
+			return result;
+			};
+
+		vector<string> nw_ans; string na_ans;
+		if (tryResolveNestedArg(rest_full, d, rng, nw_ans, na_ans)) {
+			if (nw_ans.empty()) { qr.notes.push_back("(La consulta anidada no devolvió resultados)"); qr.show_total = false; return qr; }
+			vector<pair<size_t, string>> jobs;
+			for (const string& nw : nw_ans) {
+				string r = nw + (na_ans.empty() ? "" : " " + na_ans);
+				auto pats = computeAnsPatterns(r);
+				qr.notes.push_back("(Buscando en " + to_string(pats.size()) + " permutaciones para '" + nw + "'...)");
+				// Union de todas las permutaciones
+				for (string& pLine : pats) jobs.push_back({ qr.blocks.size(), move(pLine) });
+				qr.blocks.push_back({ nw, {}, "", {} });
+			}
+			runFanOut(jobs, qr, d, true);
+			return qr;
+		}
+		patterns_to_run = computeAnsPatterns(rest_full);
+		qr.notes.push_back("(Buscando en " + to_string(patterns_to_run.size()) + " permutaciones silábicas...)");
+	}
+
+	if (isAnp || isEpi || isMul || isUni) {
+		string rest_full;
+		if (isAnp)      rest_full = (input.substr(0, 9) == "/anaphora") ? input.substr(9) : input.substr(4);
+		else if (isEpi) rest_full = (input.substr(0, 9) == "/epiphora") ? input.substr(9) : input.substr(4);
+		else if (isMul) rest_full = (input.substr(0, 14) == "/multisyllabic") ? input.substr(14) : input.substr(4);
+		else            rest_full = (input.substr(0, 12) == "/univocalism") ? input.substr(12) : input.substr(4);
+		rest_full.erase(0, rest_full.find_first_not_of(" "));
+
+		auto computeAnpIL = [&](const string& r) -> string {
+			auto [word, extra_r, tol_str] = extractWordArgs(r);
+			string nw = normalizeWord(word);
+			string exp;
+			if (isAnp) {
+				exp = nw + "."; if (!extra_r.empty()) exp += " [" + extra_r + "]"; if (!tol_str.empty()) exp += " " + tol_str;
+			}
+			else if (isEpi) {
+				exp = "." + nw; if (!extra_r.empty()) exp += " [" + extra_r + "]"; if (!tol_str.empty()) exp += " " + tol_str;
+			}
+			else if (isMul) {
+				string pat = "."; int vow = 0;
+				for (char c : nw) if (isVowel(c)) { pat += c; pat += "."; vow++; }
+				exp = pat + " [" + to_string(vow) + "V*"; if (!extra_r.empty()) exp += "," + extra_r; exp += "]"; if (!tol_str.empty()) exp += " " + tol_str;
+			}
+			else { // isUni
+				char v = '\0';
+				for (char c : nw) if (isVowel(c)) { v = c; break; }
+				if (v) {
+					exp = ". [" + string(1, v);
+					string av = "AEIOU";
+					for (char c : av) if (c != v) exp += ",0" + string(1, c);
+					if (!extra_r.empty()) exp += "," + extra_r;
+					exp += "]";
+					if (!tol_str.empty()) exp += " " + tol_str;
+				}
+			}
+			return exp;
+			};
+
+		vector<string> nw_anp; string na_anp;
+		if (tryResolveNestedArg(rest_full, d, rng, nw_anp, na_anp)) {
+			if (nw_anp.empty()) { qr.notes.push_back("(La consulta anidada no devolvió resultados)"); qr.show_total = false; return qr; }
+			vector<pair<size_t, string>> jobs;
+			for (const string& nw : nw_anp) {
+				string r = nw + (na_anp.empty() ? "" : " " + na_anp);
+				jobs.push_back({ qr.blocks.size(), computeAnpIL(r) });
+				qr.blocks.push_back({ nw, {}, "", {} });
+			}
+			runFanOut(jobs, qr, d);
+			return qr;
+		}
+		inputLine = computeAnpIL(rest_full);
+	}
+
+	// --- DETECCIÓN DE /calembour (/cal) ---
+	bool isCal = (input.substr(0, 10) == "/calembour" || (input.substr(0, 4) == "/cal" && (input.size() == 4 || input[4] == ' ')));
+
+	if (isCal) {
+		string rest = (input.substr(0, 10) == "/calembour") ? input.substr(10) : input.substr(4);
+		rest.erase(0, rest.find_first_not_of(" "));
+		qr.bullets = false;
+
+		// Detectar consulta anidada: /cal (/rd 2 [E]) [>1]
+		vector<string> nw_cal; string na_cal;
+		bool cal_nested = tryResolveNestedArg(rest, d, rng, nw_cal, na_cal);
+		if (cal_nested) {
+			if (nw_cal.empty()) { qr.notes.push_back("(La consulta anidada no devolvió resultados)"); qr.show_total = false; return qr; }
+			rest = ""; // se reasignará por cada palabra
+		}
+
+		// Lista de (word, cal_restr, cal_n) a procesar
+		vector<tuple<string, string, int>> cal_tasks;
+		auto parseCal = [](const string& r) -> tuple<string, string, int> {
+			int cal_n = 0; string cal_word = r, cal_restr = "";
+			size_t bs = r.find('[');
+			if (bs != string::npos) {
+				size_t be = r.find(']', bs);
+				if (be != string::npos) {
+					cal_word = r.substr(0, bs); cal_restr = r.substr(bs + 1, be - bs - 1);
+					string rem = r.substr(be + 1); rem.erase(0, rem.find_first_not_of(" "));
+					if (!rem.empty() && all_of(rem.begin(), rem.end(), [](unsigned char c) {return isdigit(c);})) cal_n = stoi(rem);
+				}
+			}
+			else {
+				size_t lsp = r.find_last_of(" ");
+				if (lsp != string::npos) {
+					string pn = r.substr(lsp + 1);
+					if (!pn.empty() && all_of(pn.begin(), pn.end(), [](unsigned char c) {return isdigit(c);})) { cal_n = stoi(pn); cal_word = r.substr(0, lsp); }
+				}
+			}
+			cal_word.erase(remove(cal_word.begin(), cal_word.end(), ' '), cal_word.end());
+			return { cal_word, cal_restr, cal_n };
+			};
+
+		if (cal_nested) {
+			for (const string& nw : nw_cal)
+				cal_tasks.push_back(parseCal(nw + (na_cal.empty() ? "" : " " + na_cal)));
+		}
+		else {
+			cal_tasks.push_back(parseCal(rest));
+		}
+
+		// Cada palabra es independiente: se reparten entre hilos y los bloques se añaden en orden
+		vector<ResultBlock> cal_blocks(cal_tasks.size());
+		parallelFor(cal_tasks.size(), [&](size_t t) {
+			const auto& [cal_word, cal_restr, cal_n] = cal_tasks[t];
+			ResultBlock& b = cal_blocks[t];
+			b.source = cal_word;
+			LeafScope leaf("/cal " + cal_word + (cal_restr.empty() ? "" : " [" + cal_restr + "]") + " " + to_string(cal_n));
+			string normCal = normalizeWord(cal_word);
+			if (normCal.empty()) { b.note = "(Indica una palabra para /cal)"; return; }
+			if ((int)normCal.size() > 20) { b.note = "(Palabra demasiado larga, max 20: " + cal_word + ")"; return; }
+
+			vector<vector<pair<string, int>>> all_results = calembourSplits(normCal, cal_restr, cal_n, d, leaf.get());
+			if (LeafStats* ls = leaf.get()) ls->results = all_results.size();
+			if (all_results.empty()) b.note = "(Sin resultados para " + cal_word + ")";
+			for (auto& parts2 : all_results) {
+				string line;
+				for (int k = 0; k < (int)parts2.size(); k++) {
+					if (k > 0) line += " ";
+					line += parts2[k].first;
+					if (parts2[k].second > 0) line += "(~" + to_string(parts2[k].second) + ")";
+				}
+				b.items.push_back(line);
+			}
+			});
+		for (ResultBlock& b : cal_blocks) qr.blocks.push_back(move(b));
+		return qr;
+	}
+	// --- DETECCIÓN DE /homophone (/hom) ---
+	bool isHom = (input.substr(0, 10) == "/homophone" || (input.substr(0, 4) == "/hom" && (input.size() == 4 || input[4] == ' ')));
+
+	if (isHom) {
+		string rest = (input.substr(0, 10) == "/homophone") ? input.substr(10) : input.substr(4);
+		rest.erase(0, rest.find_first_not_of(" "));
+
+		// Una búsqueda por palabra (varias si el argumento es una consulta anidada)
+		vector<string> hom_args;
+		vector<string> nw_hom; string na_hom;
+		bool hom_nested = tryResolveNestedArg(rest, d, rng, nw_hom, na_hom);
+		if (hom_nested) {
+			if (nw_hom.empty()) { qr.notes.push_back("(La consulta anidada no devolvió resultados)"); qr.show_total = false; return qr; }
+			for (const string& nw : nw_hom) hom_args.push_back(nw + (na_hom.empty() ? "" : " " + na_hom));
+		}
+		else hom_args.push_back(rest);
+
+		vector<ResultBlock> hom_blocks(hom_args.size());
+		parallelFor(hom_args.size(), [&](size_t t) {
+			auto [word, restr, tol] = extractWordArgs(hom_args[t]);
+			ResultBlock& b = hom_blocks[t];
+			if (hom_nested) b.source = word;
+			LeafScope leaf("/hom " + hom_args[t]);
+			if (normalizeWord(word).empty()) { b.note = "(Indica una palabra para /hom)"; return; }
+			b.ids = homophoneSearch(word, restr, homophoneTolerance(tol), d, leaf.get());
+			if (LeafStats* ls = leaf.get()) ls->results = b.ids.size();
+			if (hom_nested && b.ids.empty()) b.note = "(Sin resultados para " + word + ")";
+			});
+		string hom_key = hom_nested ? "" : phoneticKey(get<0>(extractWordArgs(rest)));
+		if (!hom_key.empty()) qr.notes.push_back("(Clave fonética: " + hom_key + ")");
+		for (ResultBlock& b : hom_blocks) qr.blocks.push_back(move(b));
+		return qr;
+	}
+
+	// --- CONFIGURACIÓN DE WORDPLAY ---
+	bool is_wordplay = false;
+	string wp_word = "";
+	string wp_restr = "";
+	int wp_n = 1;
+	bool wp_asterisk = false;
+
+	bool isWp = (input.substr(0, 9) == "/wordplay" || (input.substr(0, 3) == "/wp" && (input.size() == 3 || input[3] == ' ')));
+
+	if (isWp) {
+		is_wordplay = true;
+		string rest = (input.substr(0, 9) == "/wordplay") ? input.substr(9) : input.substr(3);
+		rest.erase(0, rest.find_first_not_of(" "));
+
+		size_t b_start = rest.find('[');
+		size_t last_space = rest.find_last_of(" ");
+
+		if (b_start != string::npos) {
+			wp_word = rest.substr(0, b_start);
+			size_t b_end = rest.find(']', b_start);
+			if (b_end != string::npos) {
+				wp_restr = rest.substr(b_start + 1, b_end - b_start - 1);
+				string possible_n = rest.substr(b_end + 1);
+				possible_n.erase(0, possible_n.find_first_not_of(" "));
+				if (!possible_n.empty()) {
+					if (possible_n.back() == '*') { wp_asterisk = true; possible_n.pop_back(); }
+					if (!possible_n.empty() && all_of(possible_n.begin(), possible_n.end(), [](unsigned char c) { return isdigit(c); })) {
+						wp_n = safeStoi(possible_n);
+					}
+				}
 			}
-			else if (isEpi_) {
-				inputLine = "." + nw;
-				if (!extra_r.empty()) inputLine += " [" + extra_r + "]";
-				if (!tol_str.empty()) inputLine += " " + tol_str;
+		}
+		else if (last_space != string::npos) {
+			string possible_n = rest.substr(last_space + 1);
+			string check_n = possible_n;
+			if (!check_n.empty() && check_n.back() == '*') { wp_asterisk = true; check_n.pop_back(); }
+
+			if (!check_n.empty() && all_of(check_n.begin(), check_n.end(), [](unsigned char c) { return isdigit(c); })) {
+				wp_word = rest.substr(0, last_space);
+				wp_n = safeStoi(check_n);
 			}
-			else if (isMul_) {
-				string pat = "."; int vow = 0;
-				for (char c : nw) if (isVowel(c)) { pat += c; pat += "."; vow++; }
-				inputLine = pat + " [" + to_string(vow) + "V*";
-				if (!extra_r.empty()) inputLine += "," + extra_r;
-				inputLine += "]";
-				if (!tol_str.empty()) inputLine += " " + tol_str;
+			else wp_word = rest;
+		}
+		else {
+			wp_word = rest;
+		}
+		wp_word.erase(remove(wp_word.begin(), wp_word.end(), ' '), wp_word.end());
+	}
+
+	// --- LÓGICA DE BÚSQUEDA ---
+	LeafScope leaf(input);
+	while (true) {
+		if (is_wordplay) {
+			inputLine = wp_word;
+			if (!wp_restr.empty()) inputLine += " [" + wp_restr + "]";
+			inputLine += " " + to_string(wp_n) + (wp_asterisk ? "*" : "");
+			patterns_to_run = { inputLine };
+		}
+		else if (!isAns) {
+			patterns_to_run = { inputLine };
+		}
+
+		// Con --workers, /rd combina las muestras de los trabajadores y, con un máximo de
+		// resultados, cada uno envía solo sus primeros índices
+		bool remote = clusterActive(d) && all_of(patterns_to_run.begin(), patterns_to_run.end(),
+			[&](const string& p) { return compilePattern(p, d.stats).ok; });
+		if (isRd && remote) {
+			vector<size_t> sample;
+			size_t total = 0;
+			if (clusterSample(patterns_to_run, rd_n, d, rng, sample, total)) {
+				qr.show_total = false;
+				if (total == 0) qr.notes.push_back("(Sin resultados para el patron dado)");
+				else {
+					qr.notes.push_back("(Mostrando " + to_string(sample.size()) + " de " + to_string(total) + " resultados)");
+					qr.blocks.push_back({ "", move(sample), "", {} });
+				}
+				break;
+			}
+		}
+		vector<vector<size_t>> top;
+		size_t matches = 0;
+		if (!isRd && !is_wordplay && remote && t_resultLimit > 0 && clusterScan(patterns_to_run, d, (size_t)t_resultLimit + 1, top, &matches)) {
+			vector<size_t> ids;
+			for (const auto& t : top) {
+				size_t mid = ids.size();
+				ids.insert(ids.end(), t.begin(), t.end());
+				inplace_merge(ids.begin(), ids.begin() + mid, ids.end());
+				ids.erase(unique(ids.begin(), ids.end()), ids.end());
+				if (ids.size() > (size_t)t_resultLimit + 1) ids.resize((size_t)t_resultLimit + 1);
+			}
+			if (LeafStats* ls = leaf.get()) ls->results = matches;
+			size_t omitted = matches - (std::min)(matches, ids.size());
+			qr.blocks.push_back({ "", move(ids), "", {}, omitted });
+			break;
+		}
+
+		// Usamos un vector booleano para evitar duplicados si una palabra matchea más de un patrón (O(1) lookup)
+		vector<bool> matched_words(d.size(), false);
+		vector<size_t> hits;
+
+		for (const string& pLine : patterns_to_run) {
+			if (!scanPattern(pLine, d, matched_words, &hits)) {
+				qr.error = "(Sintaxis inválida en el patrón. El programa continúa.)";
+				return qr;
+			}
+		}
+		vector<size_t>& results = hits;
+		if (LeafStats* ls = leaf.get()) ls->results = results.size();
+
+		// Control de ciclo para Wordplay
+		if (is_wordplay) {
+			bool empty_or_self = false;
+			if (results.empty()) {
+				empty_or_self = true;
+			}
+			else if (results.size() == 1 && d.norm(results[0]) == normalizeWord(wp_word)) {
+				empty_or_self = true;
+			}
+
+			if (empty_or_self && wp_n < 99 && !budgetExpired()) {
+				wp_n++;
+				continue;
+			}
+		}
+
+		// --- SELECCIÓN ALEATORIA para /random ---
+		if (isRd) {
+			qr.show_total = false;
+			if (results.empty()) {
+				qr.notes.push_back("(Sin resultados para el patron dado)");
+			}
+			else {
+				// Mezclar y tomar los primeros rd_n (o todos si hay menos)
+				shuffle(results.begin(), results.end(), rng);
+				int take = (std::min)(rd_n, (int)results.size());
+				qr.notes.push_back("(Mostrando " + to_string(take) + " de " + to_string(results.size()) + " resultados)");
+				results.resize(take);
+				qr.blocks.push_back({ "", move(results), "", {} });
+			}
+			break;
+		}
+
+		qr.blocks.push_back({ "", move(results), "", {} });
+
+		if (is_wordplay) {
+			qr.footer = "(B\xC3\xBAsqueda completada con n = " + to_string(wp_n) + ")";
+		}
+
+		break;
+	}
+	return qr;
+}
+
+// Ejecuta la consulta con el presupuesto dado y marca el resultado como parcial si se agotó.
+// Los hilos de cálculo que reparten la consulta heredan el presupuesto (ver parallelFor).
+static QueryResult executeBudgeted(const string& input, const Dict& d, mt19937& rng, QueryBudget& budget) {
+	QueryBudget* prev = t_budget;
+	t_budget = &budget;
+	QueryResult qr;
+	try { qr = executeQuery(input, d, rng); }
+	catch (...) { t_budget = prev; throw; }
+	t_budget = prev;
+	if (budget.expired && qr.error.empty()) {
+		qr.truncated = true;
+		qr.truncated_by = budgetReasonName(budget.reason);
+	}
+	return qr;
+}
+
+// --- EXPLICACIÓN DE CONSULTAS (/explain) ---
+
+// Describe un elemento de estructura: letra o clase (V, C, ·) y su rango de repetición
+static string describeElement(const PatternElement& E) {
+	string s = E.type == EXACT ? string(1, E.exact_char) : E.type == VOWEL ? "V" : E.type == CONSONANT ? "C" : "\xC2\xB7";
+	if (E.min_count == 1 && E.max_count == 1) return s;
+	return s + "{" + to_string(E.min_count) + "," + (E.max_count > 50 ? string("\xE2\x88\x9E") : to_string(E.max_count)) + "}";
+}
+
+// Explica cómo se evalúa una línea de patrón sobre el diccionario
+static void explainPattern(const string& pLine, const Dict& d, ostream& out, const string& ind) {
+	vector<PatternElement> elems;
+	vector<ResourceCondition> resources;
+	int tolerance = 0;
+	bool is_total = false, parse_err = false;
+	parseInput(pLine, elems, resources, tolerance, is_total, &parse_err);
+	if (parse_err) { out << ind << "(Sintaxis inválida en el patrón)\n"; return; }
+
+	string st;
+	for (const auto& E : elems) st += (st.empty() ? "" : " ") + describeElement(E);
+	out << ind << "Estructura: " << (st.empty() ? "(vacía)" : st) << "\n";
+	RestrictionPlan rplan = planRestrictions(resources, d.stats);
+	if (!rplan.conds.empty()) {
+		// En el orden en que se evalúan, con la fracción estimada de palabras que las cumplen
+		string rs;
+		for (size_t k = 0; k < rplan.conds.size(); k++) {
+			const auto& r = rplan.conds[k];
+			rs += (rs.empty() ? "" : ", ") + string("#") + (r.target.empty() ? "letras" : r.target) + " " + r.op + " " + to_string(r.num)
+				+ " (~" + to_string((int)(rplan.pass[k] * 100 + 0.5)) + "%)";
+		}
+		out << ind << "Restricciones (orden de evaluación): " << rs << "\n";
+	}
+	out << ind << "Tolerancia: " << tolerance << (is_total ? " (total: estructura + restricciones)" : " (solo estructura)") << "\n";
+
+	out << ind << "Estrategia: recorrido completo de " << d.formCount() << " formas normalizadas (" << d.size() << " palabras)";
+	if (!resources.empty()) {
+		out << "; las restricciones se comprueban antes del patrón y se abandonan al superar " << (is_total ? tolerance : 0) << " error(es)";
+		if (!is_total && rplan.costly_from < rplan.conds.size()) out << "; las de S*/T* se comprueban después del patrón";
+	}
+	out << "\n";
+	if (d.packed) {
+		CompiledPattern cp = compilePattern(pLine, d.stats);
+		size_t blocks = 0, skipped = 0, shardsSkipped = 0;
+		for (const PackedShard& sh : d.packed->shards) {
+			size_t nb = sh.forms.blocks();
+			blocks += nb;
+			if (blockExcluded(cp, sh.summary)) { skipped += nb; shardsSkipped++; continue; }
+			skipped += count_if(sh.blocks, sh.blocks + nb, [&](const PackedBlock& b) { return blockExcluded(cp, b); });
+		}
+		out << ind << "  Diccionario comprimido: " << skipped << " de " << blocks << " bloques de formas se descartan sin descomprimir (por longitud y letras)";
+		if (d.packed->shards.size() > 1) out << "; " << shardsSkipped << " de " << d.packed->shards.size() << " fragmentos enteros";
+		out << "\n";
+	}
+	bool syl = false, stress = false;
+	for (const auto& r : resources) { if (r.target == "S*") syl = true; if (r.target == "T*") stress = true; }
+	if (syl) out << ind << "  S* lee el número de sílabas de la columna precalculada del índice (.idx)\n";
+	if (stress) out << ind << "  T* lee la posición del acento de cada variante (con tilde o sin ella) de la columna del índice (.idx)"
+		<< (is_total ? "; con n* el patrón también se evalúa por variante" : "") << "\n";
+	bool anyOnly = all_of(elems.begin(), elems.end(), [](const PatternElement& E) { return E.type == ANY && E.min_count == 0; });
+	if (anyOnly && !resources.empty()) out << ind << "  Estructura libre: el resultado lo deciden solo las restricciones\n";
+}
+
+// Explica una consulta hoja: comando, patrones reescritos y estrategia
+static void explainLeaf(const string& query, const Dict& d, ostream& out, const string& ind) {
+	LeafPlan plan = planLeaf(query);
+	out << ind << "Consulta: " << query << "\n";
+	out << ind << "Comando: " << (plan.command.empty() ? "patrón directo" : plan.command) << "\n";
+	if (plan.rd_n >= 0) out << ind << "Selección aleatoria de " << plan.rd_n << " resultado(s) sobre lo encontrado\n";
+
+	if (plan.kind == LeafPlan::CALEMBOUR) {
+		string nc = normalizeWord(plan.cal_word);
+		int L = (int)nc.size();
+		out << ind << "Palabra: " << nc << " (" << L << " letras), tolerancia " << plan.cal_n;
+		if (!plan.cal_restr.empty()) out << ", restricciones por segmento [" << plan.cal_restr << "]";
+		out << "\n";
+		if (L == 0 || L > 20) { out << ind << "(Palabra vacía o demasiado larga, max 20: no se evalúa)\n"; return; }
+		out << ind << "Estrategia: " << L * (L + 1) / 2 << " segmentos; cada uno se busca exacto en el índice de formas ("
+			<< (d.packed ? "búsqueda binaria, modo compacto" : "hash") << ")\n";
+		if (plan.cal_n > 0) {
+			size_t cand = 0;
+			forEachFormOfLen(d, 1, L + plan.cal_n, [&](size_t, const string&, const uint32_t*, const uint32_t*) { cand++; return true; });
+			out << ind << "  Sin coincidencia exacta: Levenshtein acotado sobre el índice por longitud (len \xC2\xB1 " << plan.cal_n
+				<< ", hasta " << cand << " candidatas por segmento)\n";
+		}
+		out << ind << "  Después se enumeran las divisiones con error total <= " << plan.cal_n << "\n";
+		return;
+	}
+	if (plan.kind == LeafPlan::HOMOPHONE) {
+		string key = phoneticKey(plan.hom_word);
+		out << ind << "Palabra: " << plan.hom_word << ", clave fonética " << key << ", tolerancia " << plan.hom_n;
+		if (!plan.hom_restr.empty()) out << ", restricciones [" << plan.hom_restr << "]";
+		out << "\n";
+		if (plan.hom_n == 0) {
+			size_t found = 0;
+			forPhoneticKey(d, key, [&](const uint32_t* v0, const uint32_t* v1) { found += v1 - v0; });
+			out << ind << "Estrategia: búsqueda exacta en el índice fonético (" << (hasShardKeys(d) ? "por fragmentos, " : "hash, ")
+				<< found << " entradas con esa clave)\n";
+		}
+		else out << ind << "Estrategia: Levenshtein acotado (max " << plan.hom_n << ") sobre las " << phoneticKeyCount(d)
+			<< " claves fonéticas" << (hasShardKeys(d) ? " (por fragmento)" : " distintas") << " de longitud compatible\n";
+		return;
+	}
+	if (plan.kind == LeafPlan::WORDPLAY) {
+		string p = wordplayPattern(plan, plan.wp_n);
+		out << ind << "Patrón inicial: " << p << "\n";
+		out << ind << "Se repite con n+1 mientras no haya resultados o solo aparezca la propia palabra (max n = 99)\n";
+		explainPattern(p, d, out, ind);
+		return;
+	}
+
+	const size_t shown = 10;
+	out << ind << "Patrones (" << plan.patterns.size() << (plan.patterns.size() > 1 ? ", unión" : "") << "):\n";
+	for (size_t i = 0; i < plan.patterns.size() && i < shown; i++) out << ind << "  " << plan.patterns[i] << "\n";
+	if (plan.patterns.size() > shown) out << ind << "  ... (" << plan.patterns.size() - shown << " más)\n";
+	if (!plan.patterns.empty()) explainPattern(plan.patterns[0], d, out, ind);
+	if (plan.patterns.size() > 1) out << ind << "  Cada patrón recorre solo las palabras que aún no han coincidido\n";
+}
+
+static void explainBoolTree(const BoolExpr& e, const Dict& d, ostream& out, const string& ind) {
+	static const char* names[] = { "HOJA", "AND (&&)", "OR (||)", "NOT (!)", "DIFERENCIA (-)" };
+	if (e.op == BoolExpr::LEAF && !e.dict.empty() && e.dict != d.name) {
+		shared_ptr<const Dict> other = residentDict(e.dict);
+		out << ind << "En '" << e.dict << "'" << (other ? " (" + to_string(other->liveCount()) + " palabras):" : ": no está cargado") << "\n";
+		if (other) explainLeaf(e.query, *other, out, ind + "  ");
+		return;
+	}
+	if (e.op == BoolExpr::LEAF) { explainLeaf(e.query, d, out, ind); return; }
+	out << ind << names[e.op] << "\n";
+	for (const BoolExpr& c : e.children) explainBoolTree(c, d, out, ind + "  ");
+}
+
+// Comandos que aceptan una consulta anidada como argumento y la regla con que se reescriben
+static const vector<pair<vector<string>, string>> kNestedRules = {
+	{ { "/assonant", "/aso" }, ".(0,,C)V(0,,C)... con las vocales de la rima de P" },
+	{ { "/consonant", "/con" }, ".SUFIJO con la rima de P desde la vocal tónica" },
+	{ { "/anagram", "/ang" }, ". [nL...,longitud] con el recuento de letras de P" },
+	{ { "/paronomasia", "/par" }, "esqueleto consonántico de P con * en las vocales y [kV*]" },
+	{ { "/anasyllabic", "/ans" }, "una línea por permutación de las sílabas de P (unión)" },
+	{ { "/anaphora", "/anp" }, "P." },
+	{ { "/epiphora", "/epi" }, ".P" },
+	{ { "/multisyllabic", "/mul" }, ".V.V. con las vocales de P y [kV*]" },
+	{ { "/univocalism", "/uni" }, ". [V,0X,...] con la primera vocal de P" },
+	{ { "/calembour", "/cal" }, "división de P en palabras del diccionario" },
+	{ { "/homophone", "/hom" }, "consulta al índice fonético con la clave de P" },
+};
+
+// Muestra cómo se evaluaría una consulta completa, sin ejecutarla
+static void explainQuery(const string& rawInput, const Dict& d, ostream& out) {
+	string input = rawInput;
+	input.erase(0, input.find_first_not_of(" \t\r\n"));
+	size_t last = input.find_last_not_of(" \t\r\n");
+	if (last != string::npos) input.erase(last + 1);
+	for (char& c : input) if (c == '\\') c = '/';
+	if (input.empty()) { out << "(Uso: /explain CONSULTA)" << endl; return; }
+	if (size_t n = clusterWorkers(d))
+		out << "Recorridos repartidos entre " << n << " procesos trabajadores (un tramo de formas cada uno);\n"
+			<< "la lógica booleana, las anidadas y /cal se combinan en este proceso\n";
+
+	if (hasBoolOps(input)) {
+		out << "Expresión booleana (cada hoja se evalúa a un bitmask de " << d.size() << " palabras):\n";
+		explainBoolTree(parseBoolExpr(input), d, out, "  ");
+		out << "Las hojas distintas se evalúan en paralelo, de la más barata a la más cara;\n"
+			<< "las subexpresiones repetidas se calculan una sola vez\n";
+		if (input.find('@') != string::npos)
+			out << "Si hay hojas de otros diccionarios (@NOMBRE), se combinan sobre la unión de sus\n"
+				<< "palabras (una vez por texto), que se calcula al usarla y se guarda para las siguientes\n";
+		out.flush();
+		return;
+	}
+
+	for (const auto& rule : kNestedRules) {
+		for (const string& name : rule.first) {
+			if (input.compare(0, name.size(), name) != 0 || (input.size() > name.size() && input[name.size()] != ' ')) continue;
+			string inner, after;
+			if (!splitNestedArg(input.substr(name.size()), inner, after)) break;
+			out << "Consulta anidada: " << rule.first.back() << " por cada palabra P de:\n";
+			string t = inner; t.erase(0, t.find_first_not_of(" "));
+			if (hasBoolOps(t)) explainBoolTree(parseBoolExpr(t), d, out, "  ");
+			else explainLeaf(t, d, out, "  ");
+			out << "Por cada P se evalúa: " << rule.first.back() << " P" << (after.empty() ? "" : " " + after) << "\n";
+			out << "  Reescritura: " << rule.second << "\n";
+			if (rule.first.back() != "/cal")
+				out << "  Los patrones de todas las P se evalúan juntos en una sola pasada por el diccionario,\n"
+				<< "  descartando por longitud y letras obligatorias antes de comparar cada palabra\n";
+			out.flush();
+			return;
+		}
+	}
+
+	explainLeaf(input, d, out, "");
+	out.flush();
+}
+
+// --- AYUDA ---
+
+// Imprime la ayuda correspondiente si 'input' es un comando de ayuda. Devuelve false si no lo es.
+static bool printHelp(const string& input) {
+	if (input == "/commands" || input == "/cmd") {
+		cout << "\n--- LÓGICA BOOLEANA ---\n" << endl;
+		cout << "Combina consultas entre paréntesis con operadores:" << endl;
+		cout << "  (A) && (B)   ->  palabras en A y en B (intersección)" << endl;
+		cout << "  (A) || (B)   ->  palabras en A o en B (unión)" << endl;
+		cout << "  (A) - (B)    ->  palabras en A pero no en B (diferencia)" << endl;
+		cout << "  !(A)         ->  palabras que NO están en A (complemento)" << endl;
+		cout << "  Precedencia: ! > && > - > ||    Agrupables con (())" << endl;
+		cout << "  Ejemplo: ((/cal SUMANDOBLE [>1]) - (* [C*])) || !(\\uni E)" << endl;
+		cout << "  @NOMBRE(A)   ->  A en el diccionario NOMBRE (cargado antes con /load)" << endl;
+		cout << "  Ejemplo: @slang(/aso AMOR) - @default(/aso AMOR)" << endl;
+		cout << "\n--- LISTA DE COMANDOS ---\n" << endl;
+		cout << "/random,        /rd   -> Ejecuta una búsqueda y devuelve n palabras al azar." << endl;
+		cout << "  /rd n PATRON [R] m  -> n palabras aleatorias del resultado de PATRON [R] m" << endl;
+		cout << "  Si no se indica PATRON, se usa '.' (todas las palabras)." << endl;
+		cout << "/calembour,     /cal  -> Divide la palabra en trozos que estén en el diccionario." << endl;
+		cout << "  /cal PALABRA           -> Solo divisiones exactas." << endl;
+		cout << "  /cal PALABRA [R1,R2]   -> Solo segmentos que cumplan las restricciones." << endl;
+		cout << "  /cal PALABRA [R1,R2] n -> Ídem con n errores totales permitidos." << endl;
+		cout << "/anagram,       /ang  -> Busca anagramas de la palabra." << endl;
+		cout << "  /ang PALABRA -> . [3A,1B,2R,L,P]" << endl;
+		cout << "/paronomasia,   /par  -> Busca palabras con igual esqueleto consonántico." << endl;
+		cout << "  /par COCHE -> C*CH* [2V*]   (vocales sustituidas por *)" << endl;
+		cout << "/anasyllabic,   /ans  -> Busca palabras reordenando las sílabas de la original." << endl;
+		cout << "  /ans PALABRA -> PABRALA || BRAPALA || BRALAPA || ..." << endl;
+		cout << "/anaphora,      /anp  -> Busca palabras que empiecen por la palabra o letras dadas." << endl;
+		cout << "  /anp PAL -> PAL." << endl;
+		cout << "/epiphora,      /epi  -> Busca palabras que terminen por la palabra o letras dadas." << endl;
+		cout << "  /epi BRA -> .BRA" << endl;
+		cout << "/multisyllabic, /mul  -> Busca palabras con la misma estructura vocálica." << endl;
+		cout << "  /mul PALABRITA -> .A.A.I.A. [4V*]" << endl;
+		cout << "/univocalism,   /uni  -> Busca palabras que solo contengan la vocal indicada." << endl;
+		cout << "  /uni E -> . [E,0A,0I,0O,0U]" << endl;
+		cout << "/assonant,      /aso  -> Busca rima asonante (vocales del sufijo tónico coinciden)." << endl;
+		cout << "  /aso corazón -> palabras cuya estructura vocálica final es O-O" << endl;
+		cout << "/consonant,     /con  -> Busca rima consonante (sufijo exacto desde vocal tónica)." << endl;
+		cout << "  /con corazón -> palabras que terminan en '-azón'" << endl;
+		cout << "/wordplay,      /wp   -> Busca iterando la tolerancia hasta encontrar resultados nuevos." << endl;
+		cout << "  /wp PALABRA -> prueba PALABRA 1, si no hay resultados PALABRA 2, ..." << endl;
+		cout << "/homophone,     /hom  -> Busca palabras que suenan igual (B/V, H muda, LL/Y, C/Z/S, G/J, QU/K)." << endl;
+		cout << "  /hom VACA -> baca, vaca...   /hom HOLA 1 -> además, claves fonéticas a 1 error" << endl;
+		cout << "\n--- Todos los comandos admiten restricciones [] y tolerancia n ---\n" << endl;
+		cout << "/help,          /hp   -> Explicación general del buscador." << endl;
+		cout << "/pattern,       /pat  -> Cómo definir la estructura (comodines y rangos)." << endl;
+		cout << "/restriction,   /res  -> Cómo usar filtros entre corchetes []." << endl;
+		cout << "/tolerance,     /tol  -> Cómo permitir errores en la búsqueda." << endl;
+		cout << "/nested,        /nes  -> Cómo realizar busquedas anidadas." << endl;
+		cout << "/load,          /ld   -> Muestra o cambia el diccionario activo (los cargados se quedan en memoria)." << endl;
+		cout << "/unload NOMBRE        -> Saca de memoria un diccionario que no es el activo." << endl;
+		cout << "/add PALABRA...       -> Añade palabras al diccionario activo (se guardan en NOMBRE.delta)." << endl;
+		cout << "/remove,        /rm   -> Quita palabras del diccionario activo." << endl;
+		cout << "/count                -> Devuelve solo el número de resultados de una consulta." << endl;
+		cout << "  /count (/aso AMOR) - (. [>6]) -> Total: n" << endl;
+		cout << "/explain              -> Muestra cómo se evaluaría una consulta, sin ejecutarla." << endl;
+		cout << "  /explain (/ang ROMA) - (. [S*>2]) -> árbol booleano, patrones reescritos y estrategia" << endl;
+		cout << "/stats on | off       -> Tras cada consulta, tiempos y contadores de cada parte." << endl;
+		cout << "/budget time MS | work N | off -> Límite de tiempo o de trabajo por consulta (Ctrl-C la cancela)." << endl;
+		cout << "/exit,          /ex   -> Cierra la aplicación." << endl;
+		return true;
+	}
+
+	if (input == "/help" || input == "/hp") {
+
+		cout << "\n--- BUSCADOR DE PALABRAS ---\n\n";
+		cout << "Busca palabras en un diccionario usando un lenguaje de patrones.\n\n";
+		cout << "Una búsqueda se define en una sola línea con hasta 3 partes:\n\n";
+		cout << "  1) Estructura (obligatoria)  ->  describe la forma de la palabra\n";
+		cout << "  2) Restricciones  [R1,R2,...] (opcional)  ->  filtros globales\n";
+		cout << "  3) Tolerancia  n  o  n*  (opcional)  ->  errores permitidos\n\n";
+		cout << "Cada parte es independiente y pueden combinarse libremente.\n\n";
+		cout << "  Usa /pattern     para aprender a definir estructuras.\n";
+		cout << "  Usa /restriction para aprender a usar filtros.\n";
+		cout << "  Usa /tolerance   para entender la tolerancia a errores.\n";
+		cout << "  Usa /nested      para entender las consultas anidadas.\n";
+		cout << "  Usa /commands    para ver todos los comandos disponibles.\n";
+		return true;
+	}
+
+	if (input == "/pattern" || input == "/pat") {
+
+		cout << "\n--- 1. ESTRUCTURA DE LA PALABRA ---\n\n";
+		cout << "Describe la forma interna de la palabra, de izquierda a derecha.\n";
+		cout << "El patrón debe cubrir la palabra completa.\n\n";
+		cout << "ELEMENTOS DISPONIBLES:\n";
+		cout << "  *        ->  exactamente 1 letra cualquiera\n";
+		cout << "  X        ->  la letra X exacta (ej: A, B, ~)\n";
+		cout << "  .        ->  cualquier número de letras (incluido cero)\n\n";
+		cout << "RANGOS (entre paréntesis):\n";
+		cout << "  (n,m)    ->  entre n y m letras cualquiera\n";
+		cout << "  (n,m,V)  ->  entre n y m vocales\n";
+		cout << "  (n,m,C)  ->  entre n y m consonantes\n\n";
+		cout << "NOTAS:\n";
+		cout << "  - Si n está vacío, se asume 0\n";
+		cout << "  - Si m está vacío, se asume infinito\n";
+		cout << "  - Cada elemento consume letras consecutivas\n\n";
+		cout << "EJEMPLOS:\n";
+		cout << "  (1,2,C)A.   -> 1-2 consonantes, luego 'A', luego cualquier cosa\n";
+		cout << "  CAS*        -> palabras de 4 letras que empiecen por CAS\n";
+		return true;
+
+	}
+
+
+
+	if (input == "/restriction" || input == "/res") {
+		cout << "\n--- 2. RESTRICCIONES [Filtros] ---\n\n";
+		cout << "Se escriben entre corchetes después del patrón: PATRON [R1,R2,...]\n";
+		cout << "Cada restricción tiene la forma: [operador][número][elemento]\n\n";
+		cout << "OPERADORES: ==  >=  <=  >  <   (si se omite, se asume ==)\n\n";
+		cout << "ELEMENTOS DISPONIBLES:\n";
+		cout << "  V*       ->  número total de vocales\n";
+		cout << "  C*       ->  número total de consonantes\n";
+		cout << "  S*       ->  número de sílabas\n";
+		cout << "  T*       ->  posición de la sílaba tónica desde la derecha\n";
+		cout << "               (1 = aguda, 2 = llana, 3 = esdrújula)\n";
+		cout << "  A-Z      ->  ocurrencias de una letra concreta\n";
+		cout << "  (vacío)  ->  longitud total de la palabra\n\n";
+		cout << "EJEMPLOS:\n";
+		cout << "  [3S*]          ->  palabras de exactamente 3 sílabas\n";
+		cout << "  [>=2V*,0K]     ->  al menos 2 vocales y ninguna K\n";
+		cout << "  A. [2S*, <7]   ->  empieza por A, 2 sílabas y menos de 7 letras\n";
+		cout << "  . [T*==1]      ->  palabras agudas\n";
+		return true;
+	}
+
+
+
+	if (input == "/tolerance" || input == "/tol") {
+		cout << "\n--- 3. TOLERANCIA A ERRORES ---\n\n";
+		cout << "Número al final del patrón que indica cuántos errores se permiten.\n\n";
+		cout << "Se considera un error, por ejemplo:\n";
+		cout << "  - Una letra que no cumple el tipo esperado (vocal en lugar de consonante, etc.)\n";
+		cout << "  - Letras que sobran o faltan para satisfacer un rango\n\n";
+		cout << "TOLERANCIA PARCIAL (n):\n";
+		cout << "  Solo se aplica al patrón. Las restricciones [] son siempre obligatorias.\n\n";
+		cout << "TOLERANCIA TOTAL (n*):\n";
+		cout << "  El asterisco hace que la tolerancia sea global: los errores en las\n";
+		cout << "  restricciones [] también consumen del límite.\n\n";
+		cout << "EJEMPLOS:\n";
+		cout << "  HOLA 1       ->  permite 1 error en el patrón (BOLA, OLA, HOLI...)\n";
+		cout << "  . [3A] 1*    ->  busca 3 letras 'A', pero acepta 2 o 4 con 1 error total\n";
+		return true;
+	}
+
+	if (input == "/nested" || input == "/nes") {
+		cout << "\n--- CONSULTAS ANIDADAS ---\n\n";
+		cout << "Una consulta anidada es una búsqueda escrita entre paréntesis que se evalúa primero,\n";
+		cout << "y cuyo resultado (una lista de palabras) se usa como entrada de otro comando.\n\n";
+		cout << "Permite encadenar búsquedas complejas y componer operaciones en varios niveles.\n\n";
+
+		cout << "SINTAXIS GENERAL:\n\n";
+		cout << "  COMANDO (CONSULTA_INTERNA) [RESTRICCIONES] n\n\n";
+
+		cout << "La CONSULTA_INTERNA puede ser cualquier búsqueda válida:\n";
+		cout << "  - un patrón normal\n";
+		cout << "  - un comando (/cal, /aso, /an, /mul, etc.)\n";
+		cout << "  - una expresión booleana\n";
+		cout << "  - una búsqueda aleatoria (/rd)\n\n";
+
+		cout << "EJEMPLOS BÁSICOS:\n\n";
+		cout << "  /cal (CASA)\n";
+		cout << "    -> divide CASA solo usando palabras que estén en el diccionario\n\n";
+		cout << "  /aso (AMOR)\n";
+		cout << "    -> busca rima asonante con cada resultado de la consulta interna\n\n";
+
+		cout << "EJEMPLOS CON /random:\n\n";
+		cout << "  /cal (/rd 3 [E])\n";
+		cout << "    -> elige 3 palabras al azar que tengan E y aplica /cal a cada una\n\n";
+		cout << "  /con (/rd 5 .)\n";
+		cout << "    -> rima consonante con 5 palabras aleatorias del diccionario\n\n";
+
+		cout << "EJEMPLOS AVANZADOS:\n\n";
+		cout << "  /cal ((/rd 2 [>=3V*]) || (/rd 2 [>=3C*]))\n";
+		cout << "    -> mezcla dos conjuntos aleatorios y divide cada palabra\n\n";
+		cout << "  /anp (/rd 5 . [3S*])\n";
+		cout << "    -> busca anáforas de 5 palabras trisílabas al azar\n\n";
+		cout << "  /aso ((/cal SOL) || (/cal LUNA))\n";
+		cout << "    -> rima asonante con todas las palabras obtenidas de ambos calembours\n\n";
+
+		cout << "NOTAS IMPORTANTES:\n\n";
+		cout << "  - La consulta interna se evalúa completamente antes del comando externo.\n";
+		cout << "  - Puede contener operadores booleanos: &&, ||, -, !\n";
+		cout << "  - Puede incluir /random (/rd n).\n";
+		cout << "  - Los paréntesis de consultas NO se confunden con rangos de patrón (n,m,V).\n";
+		cout << "  - Si la consulta anidada no devuelve resultados, el comando externo no se ejecuta.\n\n";
+
+		cout << "Los comandos que aceptan consultas anidadas incluyen, entre otros:\n";
+		cout << "  /cal, /anagram, /paronomasia, /anasyllabic,\n";
+		cout << "  /anaphora, /epiphora, /multisyllabic, /univocalism,\n";
+		cout << "  /assonant, /consonant, /wordplay\n";
+		return true;
+	}
+	return false;
+}
+
+static bool isHelpCommand(const string& input) {
+	return input == "/help" || input == "/hp" || input == "/commands" || input == "/cmd" || input == "/pattern" || input == "/pat" ||
+		input == "/restriction" || input == "/res" || input == "/tolerance" || input == "/tol" || input == "/nested" || input == "/nes";
+}
+
+static bool isLoadCommand(const string& input) {
+	return (input.size() >= 5 && input.substr(0, 5) == "/load") || (input.size() >= 3 && input.substr(0, 3) == "/ld");
+}
+
+static string loadArgument(const string& input) {
+	string rest = (input.substr(0, 5) == "/load") ? input.substr(5) : input.substr(3);
+	rest.erase(0, rest.find_first_not_of(" \t"));
+	return rest;
+}
+
+static bool isUnloadCommand(const string& input) {
+	return input.compare(0, 7, "/unload") == 0 && (input.size() == 7 || input[7] == ' ');
+}
+
+// /unload NOMBRE: saca de memoria un diccionario residente que no es el activo
+static QueryResult runUnloadCommand(const string& input, const string& active) {
+	QueryResult qr;
+	qr.show_total = false;
+	string name = input.substr(7);
+	name.erase(0, name.find_first_not_of(" \t"));
+	if (name.empty()) qr.error = "(Uso: /unload NOMBRE)";
+	else if (name == active) qr.error = "(No se puede descargar el diccionario activo)";
+	else if (!dropResident(name)) qr.error = "(El diccionario '" + name + "' no está en memoria)";
+	else qr.notes.push_back("(Diccionario '" + name + "' descargado)");
+	return qr;
+}
+
+static bool isUpdateCommand(const string& input) {
+	for (const char* c : { "/add", "/remove", "/rm" }) {
+		size_t n = strlen(c);
+		if (input.compare(0, n, c) == 0 && (input.size() == n || input[n] == ' ')) return true;
+	}
+	return false;
+}
+
+// /add PALABRA... y /remove PALABRA...: cambia 'd' (ver CAMBIOS INCREMENTALES), lo apunta
+// en NOMBRE.delta y lo aplica también en los procesos trabajadores
+static QueryResult runUpdateCommand(const string& input, Dict& d) {
+	QueryResult qr;
+	qr.show_total = false;
+	bool add = input.compare(0, 4, "/add") == 0;
+	istringstream args(input.substr(input.find(' ') == string::npos ? input.size() : input.find(' ')));
+	vector<string> words, done;
+	for (string w; args >> w; ) words.push_back(w);
+	if (words.empty()) { qr.error = add ? "(Uso: /add PALABRA...)" : "(Uso: /remove PALABRA...)"; return qr; }
+	if (d.packed) { qr.error = "(El diccionario '" + d.name + "' está comprimido (--compact o .shd) y no admite cambios)"; return qr; }
+	prepareUpdates(d);
+	size_t before = d.liveCount();
+	for (const string& w : words) {
+		string op = (add ? "+" : "-") + w;
+		if (applyUpdate(d, op)) done.push_back(op);
+		else qr.notes.push_back((add ? "(Ya estaba: " : "(No estaba: ") + w + ")");
+	}
+	if (!done.empty()) {
+		if (!recordUpdates(d, done)) qr.notes.push_back("(No se pudo escribir '" + d.name + ".delta': los cambios solo duran esta sesión)");
+		clusterUpdate(d, done);
+	}
+	// Una palabra repetida en el diccionario quita todas sus entradas
+	size_t changed = add ? d.liveCount() - before : before - d.liveCount();
+	qr.notes.push_back(string(add ? "(Añadida(s): " : "(Quitada(s): ") + to_string(changed) + "; '" + d.name + "' tiene "
+		+ to_string(d.liveCount()) + " palabras)");
+	return qr;
+}
+
+// --- RECARGA AUTOMÁTICA (--watch) ---
+//
+// Con --watch, el REPL y el servidor vigilan NOMBRE.txt del diccionario activo (con inotify
+// en Linux; en otros sistemas, mirando su tamaño y fecha cada segundo). Cuando cambia, un
+// hilo aparte lo lee entero y sus líneas se comparan con las entradas cargadas: las que
+// faltan se añaden y las que sobran se quitan como con /add y /remove, así que solo se
+// recalcula lo que cambia y los cambios quedan en NOMBRE.delta. El .txt manda: una palabra
+// añadida con /add que no esté en él se quita. Un diccionario compacto, o uno en el que
+// cambia cuántas veces está una línea repetida, se vuelve a cargar entero, tras reescribir
+// el .bin desde el .txt; NOMBRE.shd hay que regenerarlo a mano.
+
+static const int kWatchSettleMs = 300; // espera tras el último cambio: el editor termina de escribir
+
+// Cambios que llevan las entradas de 'd' (sin comprimir) a las líneas de NOMBRE.txt: se
+// quitan las que ya no están y se añaden las nuevas, en el orden del fichero. Las líneas se
+// cuentan con sus repeticiones, como al cargar el .txt; /add no añade una segunda copia ni
+// /remove quita solo una, así que devuelve false si cambia cuántas veces está una palabra
+// que está o va a estar repetida (hay que cargar el diccionario entero).
+static bool textChanges(const Dict& d, const vector<string>& lines, vector<string>& ops) {
+	unordered_map<string_view, size_t> now, had;
+	for (const string& l : lines) now[l]++;
+	forEachEntry(d, 0, d.size(), [&](size_t i, const string& r) { if (!d.isRemoved(i)) had[r]++; });
+	ops.clear();
+	unordered_set<string_view> seen;
+	bool same = true;
+	forEachEntry(d, 0, d.size(), [&](size_t i, const string& r) {
+		if (d.isRemoved(i) || !seen.insert(r).second) return;
+		auto it = now.find(r);
+		if (it == now.end()) ops.push_back("-" + r);
+		else if (it->second != had[r]) same = false;
+	});
+	if (!same) return false;
+	for (const string& l : lines)
+		if (seen.insert(l).second) {
+			if (now[l] > 1) return false;
+			ops.push_back("+" + l);
+		}
+	return true;
+}
+
+// Lleva 'd' a las líneas de NOMBRE.txt con los cambios de textChanges: los guarda en
+// NOMBRE.delta y los envía a los trabajadores, como /add y /remove. Describe en 'log' lo que
+// ha cambiado. Devuelve false si no se puede sin cargarlo entero (ver textChanges) o si no
+// acaba con tantas entradas como líneas, que sería un fallo: 'd' no debe usarse entonces.
+static bool applyTextChanges(Dict& d, const vector<string>& lines, ostream& log) {
+	vector<string> ops;
+	if (!textChanges(d, lines, ops)) return false;
+	if (ops.empty()) return true;
+	prepareUpdates(d);
+	vector<string> done;
+	size_t before = d.liveCount(), added = 0;
+	for (const string& op : ops)
+		if (applyUpdate(d, op)) {
+			done.push_back(op);
+			added += op[0] == '+';
+		}
+	if (!done.empty()) {
+		recordUpdates(d, done);
+		clusterUpdate(d, done);
+		log << "('" << d.name << ".txt' ha cambiado: " << added << " palabras añadidas y " << before + added - d.liveCount()
+			<< " quitadas; '" << d.name << "' tiene " << d.liveCount() << ")\n";
+	}
+	return d.liveCount() == lines.size();
+}
+
+// Reescribe el .bin desde las líneas de NOMBRE.txt y descarta NOMBRE.delta, para volver a
+// cargar un diccionario que no admite cambios incrementales
+static void rewriteFromText(const string& name, const vector<string>& lines, const vector<string>& norms) {
+	lock_guard<mutex> lk(g_delta.mtx);
+	saveBinaryCache(name + ".bin", lines, norms);
+	error_code ec;
+	fs::remove(name + ".delta", ec);
+	g_delta.pending[name] = 0;
+	g_delta.epoch[name]++;
+}
+
+// Vigila NOMBRE.txt del diccionario que se le indica con follow() y, cuando cambia, llama a
+// onChange(nombre, líneas, formas normalizadas) desde su propio hilo
+class DictWatcher {
+public:
+	using Callback = function<void(const string&, vector<string>&, vector<string>&)>;
+
+	explicit DictWatcher(Callback cb) : onChange(move(cb)) {
+#ifdef __linux__
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+		worker = thread([this] { run(); });
+	}
+
+	~DictWatcher() {
+		stop = true;
+		worker.join();
+#ifdef __linux__
+		if (fd >= 0) close(fd);
+#endif
+	}
+
+	// Pasa a vigilar NOMBRE.txt. Si es más reciente que la caché, se recarga ya.
+	void follow(const string& name) {
+		lock_guard<mutex> lk(mtx);
+		txt = name + ".txt";
+		dict = name;
+		stamp = fileStamp(txt);
+		error_code ec;
+		auto bin = fs::last_write_time(name + ".bin", ec);
+		dirty = !ec && fs::exists(txt) && fs::last_write_time(txt, ec) > bin;
+		if (dirty) changedAt = chrono::steady_clock::now() - chrono::milliseconds(kWatchSettleMs);
+#ifdef __linux__
+		if (fd < 0) return;
+		if (wd >= 0) inotify_rm_watch(fd, wd);
+		fs::path dir = fs::path(txt).parent_path();
+		wd = inotify_add_watch(fd, dir.empty() ? "." : dir.string().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+#endif
+	}
+
+private:
+	static pair<uintmax_t, int64_t> fileStamp(const string& path) {
+		error_code ec;
+		uintmax_t size = fs::file_size(path, ec);
+		return { ec ? 0 : size, sourceTime(path) };
+	}
+
+	void run() {
+		while (!stop) {
+			waitForEvents();
+			string name, path;
+			{
+				lock_guard<mutex> lk(mtx);
+				auto now = chrono::steady_clock::now();
+#ifdef __linux__
+				bool check = fd < 0 || dirty;   // sin inotify, se mira la fecha en cada vuelta
+#else
+				bool check = true;
+#endif
+				if (!check || now - changedAt < chrono::milliseconds(kWatchSettleMs) || dict.empty()) continue;
+				auto st = fileStamp(txt);
+				if (!dirty && st == stamp) continue;
+				dirty = false;
+				stamp = st;
+				name = dict;
+				path = txt;
+			}
+			vector<string> lines, norms;
+			if (ingestText(path, lines, norms, nullptr)) onChange(name, lines, norms);
+		}
+	}
+
+	// Espera hasta un segundo a que cambie algo en el directorio vigilado
+	void waitForEvents() {
+#ifdef __linux__
+		if (fd >= 0) {
+			pollfd p{ fd, POLLIN, 0 };
+			if (poll(&p, 1, dirty ? 50 : 1000) <= 0) return;
+			alignas(inotify_event) char buf[4096];
+			ssize_t n;
+			while ((n = read(fd, buf, sizeof(buf))) > 0)
+				for (char* at = buf; at < buf + n; at += sizeof(inotify_event) + ((inotify_event*)at)->len) {
+					const inotify_event* ev = (const inotify_event*)at;
+					lock_guard<mutex> lk(mtx);
+					if (ev->len && fs::path(txt).filename() == ev->name) {
+						dirty = true;
+						changedAt = chrono::steady_clock::now();
+					}
+				}
+			return;
+		}
+#endif
+		for (int k = 0; k < 10 && !stop; k++) this_thread::sleep_for(chrono::milliseconds(100));
+	}
+
+	Callback onChange;
+	mutex mtx;
+	string dict, txt;                      // diccionario vigilado y su .txt
+	pair<uintmax_t, int64_t> stamp;        // tamaño y fecha del .txt en la última lectura
+	atomic<bool> dirty{ false };           // el .txt ha cambiado desde la última lectura
+	chrono::steady_clock::time_point changedAt;
+	atomic<bool> stop{ false };
+#ifdef __linux__
+	int fd = -1, wd = -1;
+#endif
+	thread worker;
+};
+
+// Recarga pendiente en el REPL: el vigilante deja aquí el .txt leído y el bucle principal la
+// aplica antes del siguiente comando (ver finishReload)
+struct TextReload {
+	mutex mtx;
+	bool ready = false;
+	string name;
+	vector<string> lines, norms;
+};
+
+// --- MODO BATCH ---
+
+// Escapa un texto para incluirlo como cadena JSON (los bytes UTF-8 pasan tal cual)
+static string jsonEscape(const string& s) {
+	string out;
+	out.reserve(s.size() + 2);
+	for (unsigned char c : s) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (c < 0x20) { char buf[8]; snprintf(buf, sizeof(buf), "\\u%04x", c); out += buf; }
+			else out += (char)c;
+		}
+	}
+	return out;
+}
+
+static string jsonStringArray(const vector<string>& v) {
+	string out = "[";
+	for (size_t i = 0; i < v.size(); i++) {
+		if (i > 0) out += ",";
+		out += "\"" + jsonEscape(v[i]) + "\"";
+	}
+	return out + "]";
+}
+
+// Escribe las palabras del bloque (índices y líneas sueltas) como elementos de un array JSON
+static void jsonBlockItems(ostream& js, const ResultBlock& b, const Dict& d, bool& first) {
+	for (size_t id : b.ids) { js << (first ? "" : ",") << "\"" << jsonEscape(d.raw(id)) << "\""; first = false; }
+	for (const string& r : b.items) { js << (first ? "" : ",") << "\"" << jsonEscape(r) << "\""; first = false; }
+}
+
+// Serializa el resultado de una consulta como un objeto JSON de una línea.
+// 'head' es el primer campo del objeto ya formateado (ej: "\"line\":3").
+// 'd' debe ser el diccionario con el que se ejecutó la consulta.
+static string queryResultToJson(const string& head, const string& query, const QueryResult& qr, const Dict& d, double ms) {
+	ostringstream js;
+	js << "{" << head << ",\"query\":\"" << jsonEscape(query) << "\"";
+	if (!qr.error.empty()) js << ",\"ok\":false,\"error\":\"" << jsonEscape(qr.error) << "\"";
+	else {
+		js << ",\"ok\":true,\"count\":" << qr.total();
+		bool nested = any_of(qr.blocks.begin(), qr.blocks.end(), [](const ResultBlock& b) { return !b.source.empty(); });
+		if (qr.count_only) {}
+		else if (nested) {
+			js << ",\"blocks\":[";
+			for (size_t bi = 0; bi < qr.blocks.size(); bi++) {
+				const ResultBlock& b = qr.blocks[bi];
+				if (bi > 0) js << ",";
+				js << "{\"source\":\"" << jsonEscape(b.source) << "\",\"count\":" << b.size() + b.omitted << ",\"results\":[";
+				bool first = true;
+				jsonBlockItems(js, b, d, first);
+				js << "]";
+				if (!b.note.empty()) js << ",\"note\":\"" << jsonEscape(b.note) << "\"";
+				js << "}";
+			}
+			js << "]";
+		}
+		else {
+			js << ",\"results\":[";
+			bool first = true;
+			for (const auto& b : qr.blocks) jsonBlockItems(js, b, d, first);
+			js << "]";
+		}
+		vector<string> notes = qr.notes;
+		if (!qr.footer.empty()) notes.push_back(qr.footer);
+		if (!notes.empty()) js << ",\"notes\":" << jsonStringArray(notes);
+		if (qr.returned() != qr.total()) js << ",\"returned\":" << qr.returned();
+		if (qr.truncated) js << ",\"truncated\":true";
+		if (!qr.truncated_by.empty()) js << ",\"truncated_by\":\"" << qr.truncated_by << "\"";
+	}
+	char tbuf[32]; snprintf(tbuf, sizeof(tbuf), "%.3f", ms);
+	js << ",\"time_ms\":" << tbuf << "}";
+	return js.str();
+}
+
+// Ejecuta las consultas de 'in' (una por línea) y escribe un objeto JSON por consulta en 'out'.
+// Las consultas se reparten entre 'jobs' hilos; la salida conserva el orden de entrada.
+// Cada consulta tiene su propio presupuesto de 'timeout_ms' y 'max_work' (0 = sin límite).
+// /load, /unload, /add y /remove actúan como barrera: esperan a que terminen las consultas
+// pendientes antes de cambiar el diccionario. /load de uno que ya está en memoria solo lo activa.
+static int runBatch(istream& in, ostream& out, shared_ptr<Dict> d, int jobs, unsigned seed, int timeout_ms, uint64_t max_work) {
+	struct Task { size_t seq, line; string query; shared_ptr<const Dict> dict; };
+	mutex mtx;
+	condition_variable cv_task, cv_done;
+	deque<Task> tasks;
+	map<size_t, string> ready;
+	size_t next_out = 0, pending = 0;
+	bool closing = false;
+
+	// Guarda la línea JSON 'seq' y vuelca todas las que ya estén en orden (con mtx bloqueado)
+	auto emit = [&](size_t seq, string js) {
+		ready[seq] = move(js);
+		while (!ready.empty() && ready.begin()->first == next_out) {
+			out << ready.begin()->second << "\n";
+			ready.erase(ready.begin());
+			next_out++;
+		}
+		out.flush();
+	};
+
+	vector<thread> workers;
+	for (int t = 0; t < jobs; t++) {
+		workers.emplace_back([&]() {
+			while (true) {
+				Task task;
+				{
+					unique_lock<mutex> lk(mtx);
+					cv_task.wait(lk, [&] { return closing || !tasks.empty(); });
+					if (tasks.empty()) return;
+					task = move(tasks.front());
+					tasks.pop_front();
+				}
+				// Semilla por línea: /rd da el mismo resultado sea cual sea el reparto entre hilos
+				mt19937 rng(seed + (unsigned)task.line);
+				auto t0 = chrono::steady_clock::now();
+				QueryBudget budget;
+				if (timeout_ms > 0) budget.deadline = t0 + chrono::milliseconds(timeout_ms);
+				budget.max_work = max_work;
+				QueryResult qr;
+				try { qr = executeBudgeted(task.query, *task.dict, rng, budget); }
+				catch (...) { qr = QueryResult(); qr.error = "(Sintaxis inválida. El programa continúa.)"; }
+				double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+				string js = queryResultToJson("\"line\":" + to_string(task.line), task.query, qr, *task.dict, ms);
+				{
+					lock_guard<mutex> lk(mtx);
+					emit(task.seq, move(js));
+					pending--;
+				}
+				cv_done.notify_all();
+			}
+			});
+	}
+
+	size_t seq = 0, line_no = 0;
+	string line;
+	while (getline(in, line)) {
+		line_no++;
+		string q = line;
+		q.erase(0, q.find_first_not_of(" \t\r\n"));
+		size_t lq = q.find_last_not_of(" \t\r\n");
+		if (lq != string::npos) q.erase(lq + 1);
+		if (q.empty()) continue;
+		if (q == "/exit" || q == "/ex") break;
+
+		if (isLoadCommand(q)) {
+			unique_lock<mutex> lk(mtx);
+			cv_done.wait(lk, [&] { return pending == 0; });
+			string name = loadArgument(q);
+			auto t0 = chrono::steady_clock::now();
+			QueryResult qr;
+			shared_ptr<Dict> nd = name.empty() ? nullptr : residentDict(name);
+			if (!name.empty() && !nd) {
+				nd = make_shared<Dict>();
+				if (!loadDict(name, *nd, cerr)) nd.reset();
+			}
+			if (name.empty()) qr.error = "(Indica el diccionario a cargar)";
+			else if (!nd) qr.error = "(No se pudo cargar el diccionario '" + name + "')";
+			else {
+				keepResident(nd);
+				d = nd;
+				qr.notes.push_back("(Diccionario activo: " + d->name + ", " + to_string(d->liveCount()) + " palabras)");
+			}
+			qr.show_total = false;
+			double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+			emit(seq++, queryResultToJson("\"line\":" + to_string(line_no), q, qr, *d, ms));
+			continue;
+		}
+		if (isUnloadCommand(q) || isUpdateCommand(q)) {
+			unique_lock<mutex> lk(mtx);
+			cv_done.wait(lk, [&] { return pending == 0; });
+			auto t0 = chrono::steady_clock::now();
+			QueryResult qr = isUnloadCommand(q) ? runUnloadCommand(q, d->name) : runUpdateCommand(q, *d);
+			double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+			emit(seq++, queryResultToJson("\"line\":" + to_string(line_no), q, qr, *d, ms));
+			continue;
+		}
+
+		lock_guard<mutex> lk(mtx);
+		if (isHelpCommand(q)) {
+			QueryResult qr; qr.error = "(Comando de ayuda no disponible en modo batch)";
+			emit(seq++, queryResultToJson("\"line\":" + to_string(line_no), q, qr, *d, 0.0));
+			continue;
+		}
+		tasks.push_back({ seq++, line_no, q, d });
+		pending++;
+		cv_task.notify_one();
+	}
+
+	{
+		lock_guard<mutex> lk(mtx);
+		closing = true;
+	}
+	cv_task.notify_all();
+	for (auto& w : workers) w.join();
+	return 0;
+}
+
+// --- MODO TRABAJADOR (--workers) ---
+
+#ifdef __linux__
+
+// Bucle de un proceso trabajador: atiende las peticiones del coordinador por 'fd' (ver
+// PROCESOS TRABAJADORES) hasta que este cierra el socket
+static int runWorker(int fd) {
+	signal(SIGINT, SIG_IGN); // Ctrl-C lo atiende el coordinador
+	Dict d;
+	string req;
+	while (readMessage(fd, req)) {
+		if (req.empty()) continue;
+		string resp;
+		if (req[0] == 'L') {
+			ostringstream log;
+			Dict nd;
+			if (loadDict(req.substr(1), nd, log)) {
+				d = move(nd);
+				resp = "OK " + to_string(d.size()) + " " + to_string(d.formCount());
+			}
+			else resp = "ERROR " + log.str();
+			if (!writeMessage(fd, resp)) break;
+			continue;
+		}
+		if (req[0] == 'U') {
+			vector<string> ops;
+			istringstream in(req.substr(1));
+			for (string op; getline(in, op); ) ops.push_back(op);
+			if (!d.name.empty() && !d.packed) {
+				applyUpdates(d, ops);
+				// Sin compactación propia: la capa se pasa a unas entradas sin capa cada tanto
+				if (d.overlay->ops.size() >= kDeltaCompact) { Dict flat = foldOverlay(d); d = move(flat); }
+			}
+			resp = "OK " + to_string(d.size()) + " " + to_string(d.formCount());
+			if (!writeMessage(fd, resp)) break;
+			continue;
+		}
+
+		vector<string> f;
+		for (size_t at = 1; ; ) {
+			size_t nl = req.find('\n', at);
+			f.push_back(req.substr(at, nl == string::npos ? string::npos : nl - at));
+			if (nl == string::npos) break;
+			at = nl + 1;
+		}
+		while (f.size() < 4) f.emplace_back();
+		QueryBudget budget;
+		long long ms = atoll(f[0].c_str());
+		if (ms > 0) budget.deadline = chrono::steady_clock::now() + chrono::milliseconds(ms);
+		budget.max_work = (uint64_t)atoll(f[1].c_str());
+		t_budget = &budget;
+		vector<vector<size_t>> lists;
+		uint64_t total = 0;
+		if (req[0] == 'M') {
+			// El total es el de la unión de los patrones, antes de recortar las listas
+			size_t limit = (size_t)atoll(f[2].c_str());
+			lists = runSearchMulti(vector<string>(f.begin() + 3, f.end()), d);
+			if (lists.size() == 1) total = lists[0].size();
+			else {
+				vector<size_t> all;
+				for (const auto& l : lists) all.insert(all.end(), l.begin(), l.end());
+				sort(all.begin(), all.end());
+				total = (size_t)(unique(all.begin(), all.end()) - all.begin());
+			}
+			for (auto& l : lists)
+				if (limit && l.size() > limit) l.resize(limit);
+		}
+		else if (req[0] == 'H') {
+			while (f.size() < 5) f.emplace_back();
+			lists.push_back(homophoneSearch(f[3], f[4], safeStoi(f[2]), d));
+			total = lists[0].size();
+		}
+		else if (req[0] == 'S') {
+			// Muestra de reservorio sobre la unión de los patrones
+			size_t n = (size_t)(std::max)(0LL, atoll(f[2].c_str()));
+			mt19937 rng((unsigned)strtoul(f[3].c_str(), nullptr, 10));
+			vector<vector<size_t>> found = runSearchMulti(vector<string>(f.begin() + 4, f.end()), d);
+			vector<size_t> all;
+			for (const auto& l : found) {
+				size_t mid = all.size();
+				all.insert(all.end(), l.begin(), l.end());
+				inplace_merge(all.begin(), all.begin() + mid, all.end());
+				all.erase(unique(all.begin(), all.end()), all.end());
+			}
+			vector<size_t> sample;
+			for (size_t i = 0; i < all.size(); i++) {
+				if (sample.size() < n) sample.push_back(all[i]);
+				else {
+					size_t j = uniform_int_distribution<size_t>(0, i)(rng);
+					if (j < n) sample[j] = all[i];
+				}
+			}
+			shuffle(sample.begin(), sample.end(), rng);
+			total = all.size();
+			lists.push_back(move(sample));
+		}
+		t_budget = nullptr;
+
+		putPod(resp, (int32_t)(budget.expired ? budget.reason.load() : QueryBudget::NONE));
+		putPod(resp, (uint64_t)budget.work.load());
+		putPod(resp, total);
+		for (const auto& l : lists) {
+			putPod(resp, (uint32_t)l.size());
+			for (size_t id : l) putPod(resp, (uint32_t)id);
+		}
+		if (!writeMessage(fd, resp)) break;
+	}
+	return 0;
+}
+
+#endif
+
+// --- MODO SERVIDOR ---
+
+// Diccionario compartido por todas las conexiones. Cada consulta toma una instantánea
+// (shared_ptr) al empezar; /load construye el nuevo diccionario aparte y lo sustituye
+// de forma atómica, así que las consultas en curso terminan sobre el anterior.
+class DictSnapshot {
+public:
+	shared_ptr<const Dict> get() const {
+		lock_guard<mutex> lk(mtx);
+		return cur;
+	}
+
+	void set(shared_ptr<const Dict> d) {
+		lock_guard<mutex> lk(mtx);
+		cur = move(d);
+	}
+
+private:
+	mutable mutex mtx;
+	shared_ptr<const Dict> cur;
+};
+
+// Extrae los campos de un objeto JSON plano ({"clave": "texto" | número | true/false, ...}).
+// Los valores se devuelven como texto. Devuelve false si la línea no es un objeto válido.
+static bool parseFlatJson(const string& s, map<string, string>& fields) {
+	size_t i = 0, n = s.size();
+	auto skipWs = [&]() { while (i < n && isspace((unsigned char)s[i])) i++; };
+	auto readString = [&](string& out) -> bool {
+		if (i >= n || s[i] != '"') return false;
+		i++;
+		while (i < n && s[i] != '"') {
+			if (s[i] == '\\' && i + 1 < n) {
+				char e = s[++i];
+				if (e == 'n') out += '\n';
+				else if (e == 't') out += '\t';
+				else if (e == 'r') out += '\r';
+				else if (e == 'u' && i + 4 < n) {
+					int cp = (int)strtol(s.substr(i + 1, 4).c_str(), nullptr, 16);
+					i += 4;
+					if (cp < 0x80) out += (char)cp;
+					else if (cp < 0x800) { out += (char)(0xC0 | (cp >> 6)); out += (char)(0x80 | (cp & 0x3F)); }
+					else { out += (char)(0xE0 | (cp >> 12)); out += (char)(0x80 | ((cp >> 6) & 0x3F)); out += (char)(0x80 | (cp & 0x3F)); }
+				}
+				else out += e;
+				i++;
+			}
+			else out += s[i++];
+		}
+		if (i >= n) return false;
+		i++;
+		return true;
+	};
+
+	skipWs();
+	if (i >= n || s[i] != '{') return false;
+	i++;
+	skipWs();
+	if (i < n && s[i] == '}') return true;
+	while (i < n) {
+		skipWs();
+		string key, value;
+		if (!readString(key)) return false;
+		skipWs();
+		if (i >= n || s[i] != ':') return false;
+		i++;
+		skipWs();
+		if (i < n && s[i] == '"') { if (!readString(value)) return false; }
+		else {
+			while (i < n && s[i] != ',' && s[i] != '}' && !isspace((unsigned char)s[i])) value += s[i++];
+			if (value.empty()) return false;
+		}
+		fields[key] = value;
+		skipWs();
+		if (i < n && s[i] == ',') { i++; continue; }
+		if (i < n && s[i] == '}') return true;
+		return false;
+	}
+	return false;
+}
+
+// Recorta los resultados a 'limit' elementos en total (0 = sin límite). Los recortados
+// siguen contando en el total (ver ResultBlock::omitted).
+static void applyResultLimit(QueryResult& qr, int limit) {
+	if (limit <= 0 || qr.count_only) return;
+	size_t left = (size_t)limit;
+	for (auto& b : qr.blocks) {
+		size_t before = b.size();
+		if (b.ids.size() > left) b.ids.resize(left);
+		left -= b.ids.size();
+		if (b.items.size() > left) b.items.resize(left);
+		left -= b.items.size();
+		b.omitted += before - b.size();
+		if (b.omitted && !qr.truncated) { qr.truncated = true; qr.truncated_by = "limit"; }
+	}
+}
+
+#ifndef _WIN32
+
+// Opciones por defecto del servidor; cada petición puede reducirlas con "limit" y "timeout_ms"
+struct ServerOptions {
+	string address;        // "unix:/ruta/socket", "tcp:PUERTO" o "PUERTO"
+	int threads = 1;
+	int max_results = 0;   // 0 = sin límite
+	int timeout_ms = 0;    // 0 = sin límite
+	uint64_t max_work = 0; // 0 = sin límite
+	bool watch = false;    // --watch: recarga el diccionario cuando cambia su .txt
+};
+
+struct ServerState {
+	ServerOptions opt;
+	DictSnapshot snapshot;
+	mutex load_mtx;        // serializa las recargas; las consultas no lo usan
+	DictWatcher* watcher = nullptr;
+	ThreadPool pool;
+	atomic<size_t> requests{ 0 };
+
+	explicit ServerState(const ServerOptions& o) : opt(o), pool(o.threads) {}
+};
+
+// Atiende una línea del protocolo y devuelve la respuesta JSON (sin el salto de línea).
+// La línea es una consulta tal cual o un objeto {"query": ..., "limit": n, "timeout_ms": n, "id": ...}.
+static string handleServerRequest(const string& line, ServerState& st) {
+	size_t req_no = ++st.requests;
+	string query = line;
+	string head = "\"req\":" + to_string(req_no);
+	int limit = st.opt.max_results, timeout_ms = st.opt.timeout_ms;
+
+	if (!line.empty() && line[0] == '{') {
+		map<string, string> f;
+		if (!parseFlatJson(line, f) || !f.count("query")) {
+			QueryResult qr; qr.error = "(Petición JSON inválida: se espera {\"query\": \"...\"})";
+			return queryResultToJson(head, line, qr, *st.snapshot.get(), 0.0);
+		}
+		query = f["query"];
+		if (f.count("id")) {
+			const string& id = f["id"];
+			bool numeric = !id.empty() && all_of(id.begin(), id.end(), [](unsigned char c) { return isdigit(c); });
+			head = "\"id\":" + (numeric ? id : "\"" + jsonEscape(id) + "\"");
+		}
+		// Los límites de la petición solo pueden endurecer los del servidor
+		int l = safeStoi(f.count("limit") ? f["limit"] : "", 0);
+		int t = safeStoi(f.count("timeout_ms") ? f["timeout_ms"] : "", 0);
+		if (l > 0 && (limit == 0 || l < limit)) limit = l;
+		if (t > 0 && (timeout_ms == 0 || t < timeout_ms)) timeout_ms = t;
+	}
+	query.erase(0, query.find_first_not_of(" \t\r\n"));
+	size_t lq = query.find_last_not_of(" \t\r\n");
+	if (lq != string::npos) query.erase(lq + 1);
+
+	auto t0 = chrono::steady_clock::now();
+	auto elapsed = [&]() { return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count(); };
+
+	if (isLoadCommand(query)) {
+		string name = loadArgument(query);
+		QueryResult qr;
+		qr.show_total = false;
+		if (name.empty()) qr.error = "(Indica el diccionario a cargar)";
+		else {
+			// Si ya está en memoria solo se activa; si no, se carga y se queda residente
+			lock_guard<mutex> lk(st.load_mtx);
+			shared_ptr<Dict> nd = residentDict(name);
+			if (!nd) {
+				nd = make_shared<Dict>();
+				if (loadDict(name, *nd, cerr)) keepResident(nd);
+				else nd.reset();
 			}
-			else if (isUni_) {
-				char v = '\0'; for (char c : nw) if (isVowel(c)) { v = c; break; }
-				if (v) {
-					inputLine = ". [" + string(1, v);
-					string av = "AEIOU"; for (char c : av) if (c != v) inputLine += ",0" + string(1, c);
-					if (!extra_r.empty()) inputLine += "," + extra_r;
-					inputLine += "]";
-					if (!tol_str.empty()) inputLine += " " + tol_str;
-				}
+			if (!nd) qr.error = "(No se pudo cargar el diccionario '" + name + "')";
+			else {
+				qr.notes.push_back("(Diccionario activo: " + nd->name + ", " + to_string(nd->liveCount()) + " palabras)");
+				st.snapshot.set(move(nd));
+				if (st.watcher) st.watcher->follow(name);
 			}
 		}
+		return queryResultToJson(head, query, qr, *st.snapshot.get(), elapsed());
+	}
+	if (isUnloadCommand(query)) {
+		lock_guard<mutex> lk(st.load_mtx);
+		QueryResult qr = runUnloadCommand(query, st.snapshot.get()->name);
+		return queryResultToJson(head, query, qr, *st.snapshot.get(), elapsed());
+	}
+	if (isUpdateCommand(query)) {
+		// Los cambios van a una capa nueva sobre las mismas entradas: las consultas en curso
+		// terminan sobre la instantánea anterior
+		lock_guard<mutex> lk(st.load_mtx);
+		shared_ptr<Dict> nd = updatableView(st.snapshot.get());
+		QueryResult qr = runUpdateCommand(query, *nd);
+		if (qr.error.empty()) {
+			keepResident(nd);
+			st.snapshot.set(nd);
+		}
+		return queryResultToJson(head, query, qr, *st.snapshot.get(), elapsed());
+	}
+	if (query.empty() || isHelpCommand(query)) {
+		QueryResult qr; qr.error = query.empty() ? "(Consulta vacía)" : "(Comando de ayuda no disponible en modo servidor)";
+		return queryResultToJson(head, query, qr, *st.snapshot.get(), elapsed());
 	}
 
-	// /wp
-	bool isWp_ = (input.size() >= 9 && input.substr(0, 9) == "/wordplay") ||
-		(input.size() >= 3 && input.substr(0, 3) == "/wp" && (input.size() == 3 || input[3] == ' '));
-	string wp_word_ = "", wp_restr_ = "";
-	int wp_n_ = 1; bool wp_ast_ = false;
-	if (isWp_) {
-		string rest = (input.substr(0, 9) == "/wordplay") ? input.substr(9) : input.substr(3);
-		rest.erase(0, rest.find_first_not_of(" "));
-		size_t b2 = rest.find('['); size_t ls = rest.find_last_of(" ");
-		if (b2 != string::npos) {
-			wp_word_ = rest.substr(0, b2);
-			size_t be = rest.find(']', b2);
-			if (be != string::npos) {
-				wp_restr_ = rest.substr(b2 + 1, be - b2 - 1);
-				string pn = rest.substr(be + 1); pn.erase(0, pn.find_first_not_of(" "));
-				if (!pn.empty()) { if (pn.back() == '*') { wp_ast_ = true; pn.pop_back(); } if (!pn.empty() && all_of(pn.begin(), pn.end(), [](unsigned char c) {return isdigit(c);})) wp_n_ = safeStoi(pn); }
+	shared_ptr<const Dict> dict = st.snapshot.get();
+	uint64_t max_work = st.opt.max_work;
+	auto fut = st.pool.submit([dict, query, limit, timeout_ms, max_work]() {
+		QueryBudget budget;
+		if (timeout_ms > 0) budget.deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+		budget.max_work = max_work;
+		mt19937 rng(random_device{}());
+		QueryResult qr;
+		t_resultLimit = limit;
+		try { qr = executeBudgeted(query, *dict, rng, budget); }
+		catch (...) { qr = QueryResult(); qr.error = "(Sintaxis inválida. El programa continúa.)"; }
+		applyResultLimit(qr, limit);
+		return qr;
+		});
+	QueryResult qr = fut.get();
+	return queryResultToJson(head, query, qr, *dict, elapsed());
+}
+
+// Lee líneas de la conexión y responde a cada una; termina al cerrar el cliente o con /exit
+static void serveConnection(int fd, ServerState& st) {
+	string buf;
+	char chunk[4096];
+	bool open = true;
+	while (open) {
+		ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+		if (got <= 0) break;
+		buf.append(chunk, (size_t)got);
+		size_t nl;
+		while ((nl = buf.find('\n')) != string::npos) {
+			string line = buf.substr(0, nl);
+			buf.erase(0, nl + 1);
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			if (line.find_first_not_of(" \t") == string::npos) continue;
+			if (line == "/exit" || line == "/ex") { open = false; break; }
+			string resp = handleServerRequest(line, st) + "\n";
+			size_t sent = 0;
+			while (sent < resp.size()) {
+				ssize_t w = send(fd, resp.data() + sent, resp.size() - sent, MSG_NOSIGNAL);
+				if (w <= 0) { open = false; break; }
+				sent += (size_t)w;
 			}
+			if (!open) break;
 		}
-		else if (ls != string::npos) {
-			string pn = rest.substr(ls + 1); string cn = pn; if (!cn.empty() && cn.back() == '*') { wp_ast_ = true; cn.pop_back(); }
-			if (!cn.empty() && all_of(cn.begin(), cn.end(), [](unsigned char c) { return isdigit(c); })) { wp_word_ = rest.substr(0, ls); wp_n_ = safeStoi(cn); }
-			else wp_word_ = rest;
-		}
-		else wp_word_ = rest;
-		wp_word_.erase(remove(wp_word_.begin(), wp_word_.end(), ' '), wp_word_.end());
 	}
+	close(fd);
+}
+
+static int runServer(const ServerOptions& opt, const string& dictName) {
+	signal(SIGPIPE, SIG_IGN);
+	ServerState st(opt);
+	auto d = make_shared<Dict>();
+	if (!loadDict(dictName, *d, cerr)) return 1;
+	keepResident(d);
+	st.snapshot.set(move(d));
+
+	// --watch: la recarga se prepara aparte, como /add, y se activa de golpe
+	unique_ptr<DictWatcher> watcher;
+	if (opt.watch) {
+		watcher = make_unique<DictWatcher>([&st](const string& name, vector<string>& lines, vector<string>& norms) {
+			lock_guard<mutex> lk(st.load_mtx);
+			shared_ptr<const Dict> cur = st.snapshot.get();
+			if (cur->name != name) return;
+			if (cur->packed && cur->packed->file) {
+				cerr << "('" << name << ".txt' ha cambiado: vuelve a generar '" << name << ".shd' con --make-shards)\n";
+				return;
+			}
+			if (!cur->packed) {
+				shared_ptr<Dict> nd = updatableView(cur);
+				if (applyTextChanges(*nd, lines, cerr)) {
+					keepResident(nd);
+					st.snapshot.set(move(nd));
+					return;
+				}
+				cerr << "('" << name << ".txt' ha cambiado; se vuelve a cargar entero)\n";
+			}
+			rewriteFromText(name, lines, norms);
+			auto nd = make_shared<Dict>();
+			if (!loadDict(name, *nd, cerr)) return;
+			keepResident(nd);
+			st.snapshot.set(move(nd));
+		});
+		watcher->follow(dictName);
+		st.watcher = watcher.get();
+	}
+
+	int fd = -1;
+	if (opt.address.rfind("unix:", 0) == 0) {
+		string path = opt.address.substr(5);
+		sockaddr_un addr{};
+		if (path.empty() || path.size() >= sizeof(addr.sun_path)) { cerr << "Error: ruta de socket inválida\n"; return 1; }
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		unlink(path.c_str());
+		if (fd < 0 || ::bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) { cerr << "Error: no se pudo abrir el socket '" << path << "'\n"; return 1; }
+	}
+	else {
+		string port_str = opt.address.rfind("tcp:", 0) == 0 ? opt.address.substr(4) : opt.address;
+		int port = safeStoi(port_str, -1);
+		if (port <= 0 || port > 65535) { cerr << "Error: puerto inválido '" << port_str << "'\n"; return 1; }
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((uint16_t)port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // solo conexiones locales
+		if (fd < 0 || ::bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) { cerr << "Error: no se pudo escuchar en el puerto " << port << "\n"; return 1; }
+	}
+	if (listen(fd, 64) < 0) { cerr << "Error: listen() ha fallado\n"; return 1; }
+	cerr << "Servidor escuchando en " << opt.address << " (" << opt.threads << " hilos)\n";
 
-	// Bucle de búsqueda
-	bool isAns_loop = (input.size() >= 12 && input.substr(0, 12) == "/anasyllabic") ||
-		(input.size() >= 4 && input.substr(0, 4) == "/ans" && (input.size() == 4 || input[4] == ' '));
 	while (true) {
-		if (isWp_) {
-			inputLine = wp_word_;
-			if (!wp_restr_.empty()) inputLine += " [" + wp_restr_ + "]";
-			inputLine += " " + to_string(wp_n_) + (wp_ast_ ? "*" : "");
-			patterns_to_run = { inputLine };
+		int c = accept(fd, nullptr, nullptr);
+		if (c < 0) {
+			if (errno == EINTR) continue;
+			break;
 		}
-		else if (!isAns_loop) {
-			patterns_to_run = { inputLine };
+		thread(serveConnection, c, ref(st)).detach();
+	}
+	close(fd);
+	return 0;
+}
+
+#endif
+
+// --- BENCHMARK ---
+
+// Genera palabras con aspecto de español (sílabas CV/CCV/CVC, diptongos, tildes, ñ y ü)
+// de forma determinista a partir de la semilla, para poder comparar ejecuciones.
+class SpanishWordGenerator {
+public:
+	explicit SpanishWordGenerator(unsigned seed) : rng(seed) {}
+
+	string next() {
+		static const int sylWeights[] = { 8, 30, 34, 20, 8 }; // 1..5 sílabas
+		discrete_distribution<int> nsyl(begin(sylWeights), end(sylWeights));
+		int n = nsyl(rng) + 1;
+		vector<string> syl;
+		int stressed = -1;
+		for (int k = 0; k < n; k++) syl.push_back(syllable(k == 0, k == n - 1));
+		// ~18% de las palabras llevan tilde en alguna de las tres últimas sílabas
+		if (uniform_int_distribution<int>(0, 99)(rng) < 18) stressed = max(0, n - 1 - uniform_int_distribution<int>(0, min(2, n - 1))(rng));
+		string w;
+		for (int k = 0; k < n; k++) w += (k == stressed) ? accentFirstVowel(syl[k]) : syl[k];
+		// Algunas mayúsculas iniciales (nombres propios) para tener variantes de la misma forma
+		if (uniform_int_distribution<int>(0, 99)(rng) < 3 && !w.empty() && w[0] >= 'a' && w[0] <= 'z') w[0] = (char)toupper((unsigned char)w[0]);
+		return w;
+	}
+
+	mt19937& engine() { return rng; }
+
+private:
+	string pick(const vector<pair<const char*, int>>& table) {
+		int total = 0;
+		for (const auto& t : table) total += t.second;
+		int r = uniform_int_distribution<int>(0, total - 1)(rng);
+		for (const auto& t : table) { if (r < t.second) return t.first; r -= t.second; }
+		return table.back().first;
+	}
+
+	string syllable(bool first, bool last) {
+		static const vector<pair<const char*, int>> onsets = {
+			{ "", 10 }, { "b", 5 }, { "c", 8 }, { "d", 7 }, { "f", 3 }, { "g", 3 }, { "h", 2 }, { "j", 2 },
+			{ "l", 7 }, { "m", 7 }, { "n", 6 }, { "p", 6 }, { "r", 6 }, { "s", 8 }, { "t", 8 }, { "v", 3 },
+			{ "z", 2 }, { "ch", 2 }, { "ll", 2 }, { "rr", 1 }, { "qu", 2 }, { "gu", 1 }, { "\xC3\xB1", 2 },
+			{ "br", 2 }, { "tr", 3 }, { "pr", 3 }, { "pl", 1 }, { "cr", 1 }, { "gr", 1 }, { "fl", 1 }, { "y", 1 }, { "k", 1 }
+		};
+		static const vector<pair<const char*, int>> nuclei = {
+			{ "a", 22 }, { "e", 20 }, { "i", 10 }, { "o", 18 }, { "u", 6 }, { "ia", 3 }, { "ie", 4 }, { "ue", 4 },
+			{ "io", 2 }, { "ua", 2 }, { "ai", 1 }, { "ei", 1 }, { "au", 1 }
+		};
+		static const vector<pair<const char*, int>> codas = {
+			{ "", 60 }, { "n", 10 }, { "s", 10 }, { "r", 8 }, { "l", 6 }, { "d", 2 }, { "z", 2 }, { "x", 1 }, { "c", 1 }
+		};
+		string on = pick(onsets), nu = pick(nuclei);
+		if (on == "rr" && first) on = "r";
+		// "qu"/"gu" solo ante e/i; "gü" ante e/i de vez en cuando
+		if ((on == "qu" || on == "gu") && nu[0] != 'e' && nu[0] != 'i') on = on == "qu" ? "c" : "g";
+		if (on == "gu" && uniform_int_distribution<int>(0, 9)(rng) == 0) on = "g\xC3\xBC";
+		string co = pick(codas);
+		if (!last && co == "x") co = "";
+		return on + nu + co;
+	}
+
+	static string accentFirstVowel(const string& s) {
+		static const string plain = "aeiou";
+		static const char* accented[] = { "\xC3\xA1", "\xC3\xA9", "\xC3\xAD", "\xC3\xB3", "\xC3\xBA" };
+		// En diptongos la tilde va en la vocal abierta (a, e, o) si la hay
+		size_t pos = string::npos;
+		for (size_t i = 0; i < s.size(); i++) {
+			size_t v = plain.find(s[i]);
+			if (v == string::npos) continue;
+			if (pos == string::npos) pos = i;
+			if (s[i] == 'a' || s[i] == 'e' || s[i] == 'o') { pos = i; break; }
 		}
-		fill(matched.begin(), matched.end(), false);
-		for (const string& pLine : patterns_to_run) {
-			vector<PatternElement> elems; vector<ResourceCondition> resources;
-			int tolerance = 0; bool is_total = false;
-			parseInput(pLine, elems, resources, tolerance, is_total);
-			for (size_t i = 0; i < dictionary.size(); i++) {
-				if (matched[i]) continue;
-				const string& w = dictionary[i];
-				if (w.length() >= 100) continue;
-				int res_errors = checkResources(w, raw_dict[i], resources);
-				int rem_tol = tolerance;
-				if (is_total) { if (res_errors > tolerance) continue; rem_tol -= res_errors; }
-				else { if (res_errors > 0) continue; }
-				for (int r = 0; r <= (int)w.length(); r++)
-					for (int e2 = 0; e2 <= (int)elems.size(); e2++)
-						for (int t = 0; t <= rem_tol; t++) memo_buffer[r][e2][t] = -1;
-				if (matchPattern(w, 0, elems, 0, rem_tol)) matched[i] = true;
-			}
-		}
-		if (isWp_) {
-			int cnt = 0; for (bool b : matched) if (b) cnt++;
-			bool self_only = false;
-			if (cnt == 1) {
-				for (size_t i = 0; i < dictionary.size(); i++)
-					if (matched[i] && normalizeWord(raw_dict[i]) == normalizeWord(wp_word_)) { self_only = true; break; }
-			}
-			if ((cnt == 0 || self_only) && wp_n_ < 99) { wp_n_++; continue; }
-			if (vout) *vout << "(B\xC3\xBAsqueda completada con n = " << wp_n_ << ")\n";
+		if (pos == string::npos) return s;
+		return s.substr(0, pos) + accented[plain.find(s[pos])] + s.substr(pos + 1);
+	}
+
+	mt19937 rng;
+};
+
+// Pico de memoria residente del proceso en KB
+static long peakRssKb() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return (long)(pmc.PeakWorkingSetSize / 1024);
+	return 0;
+#else
+	rusage ru{};
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss; // KB en Linux
+#endif
+}
+
+struct BenchOptions {
+	size_t words = 100000;
+	int reps = 5;
+	unsigned seed = 42;
+	string out;        // fichero JSON de salida (vacío = stdout)
+	string save_dict;  // si se indica, guarda el diccionario sintético como NOMBRE.txt
+};
+
+// Percentil p (0..100) de una muestra ya ordenada
+static double percentile(const vector<double>& sorted, double p) {
+	if (sorted.empty()) return 0.0;
+	double idx = p / 100.0 * (sorted.size() - 1);
+	size_t lo = (size_t)idx, hi = min(lo + 1, sorted.size() - 1);
+	return sorted[lo] + (sorted[hi] - sorted[lo]) * (idx - lo);
+}
+
+// Genera un diccionario sintético, ejecuta el corpus fijo de consultas (una o más por familia
+// de comandos) y escribe latencias por consulta, throughput y pico de memoria en JSON.
+static int runBenchmark(const BenchOptions& opt) {
+	using clk = chrono::steady_clock;
+	auto ms = [](clk::time_point a, clk::time_point b) { return chrono::duration<double, milli>(b - a).count(); };
+
+	cerr << "Generando " << opt.words << " palabras (semilla " << opt.seed << ")...\n";
+	auto t0 = clk::now();
+	Dict d;
+	d.name = "synthetic";
+	{
+		SpanishWordGenerator gen(opt.seed);
+		d.raw_dict.reserve(opt.words);
+		for (size_t i = 0; i < opt.words; i++) d.raw_dict.push_back(gen.next());
+	}
+	auto t1 = clk::now();
+	d.dictionary.reserve(d.raw_dict.size());
+	for (const string& r : d.raw_dict) d.dictionary.push_back(normalizeWord(r));
+	auto t2 = clk::now();
+	loadDictIndex(d, "", cerr);
+	buildDictStats(d.stats, d.dictionary, d.raw_dict);
+	if (g_compactDicts) compactDict(d);
+	else buildCalLookup(d);
+	auto t3 = clk::now();
+
+	if (!opt.save_dict.empty()) {
+		ofstream f(opt.save_dict + ".txt");
+		forEachEntry(d, 0, d.size(), [&](size_t, const string& r) { f << r << "\n"; });
+		cerr << "Diccionario guardado en " << opt.save_dict << ".txt\n";
+	}
+
+	// Palabras de referencia elegidas de forma determinista entre las del propio diccionario
+	mt19937 pick_rng(opt.seed ^ 0x9E3779B9u);
+	auto pickWord = [&](size_t minLen, size_t maxLen) -> string {
+		for (int tries = 0; tries < 100000; tries++) {
+			string w = d.norm(uniform_int_distribution<size_t>(0, d.size() - 1)(pick_rng));
+			if (w.size() >= minLen && w.size() <= maxLen && w.find('~') == string::npos) return w;
 		}
-		break;
+		return "CASA";
+	};
+	string W = pickWord(6, 8), W2 = pickWord(4, 5), W3 = pickWord(5, 7), P = W.substr(0, 3), S = W3.substr(W3.size() - 3);
+	string CAL = pickWord(3, 5) + pickWord(3, 5);
+
+	vector<pair<string, string>> corpus = {
+		{ "pattern_struct",   "(1,2,C)A(1,3)." },
+		{ "pattern_tol1",     W + " 1" },
+		{ "pattern_tol2",     W + " 2" },
+		{ "pattern_tol_total", "(1,3,C)E. [>=2V*,0K,<9] 1*" },
+		{ "restr_syllables",  ". [3S*]" },
+		{ "restr_stress",     ". [1T*, >=2S*]" },
+		{ "restr_letters",    ". [5V*, >2O, E, 1P, 0K]" },
+		{ "restr_substring",  ". [TR, 0RR, <8]" },
+		{ "cal_exact",        "/cal " + CAL },
+		{ "cal_tol",          "/cal " + CAL + " 1" },
+		{ "cal_restr",        "/cal " + CAL + " [>2] 1" },
+		{ "ang",              "/ang " + W },
+		{ "ang_tol",          "/ang " + W2 + " 1" },
+		{ "par",              "/par " + W },
+		{ "ans",              "/ans " + W },
+		{ "aso",              "/aso " + W3 },
+		{ "con",              "/con " + W3 },
+		{ "anp",              "/anp " + P },
+		{ "epi",              "/epi " + S },
+		{ "mul",              "/mul " + W3 },
+		{ "uni",              "/uni E [>5]" },
+		{ "wp",               "/wp " + W + "X" },
+		{ "bool_or_diff",     "(" + W + " 1) || (/aso " + W3 + ") - (. [>8])" },
+		{ "bool_not_and",     "!(/uni E) && (" + W + " 2)" },
+		{ "bool_wide",        "(/anp " + P + ") || (/epi " + S + ") || (/mul " + W2 + ") || (" + W3 + " 1)" },
+		{ "nested_aso_rd",    "/aso (/rd 5 . [3S*])" },
+		{ "nested_cal_rd",    "/cal (/rd 3 . [>=8]) 1" },
+		{ "nested_par_bool",  "/par ((/anp " + P + ") && (. [2S*]))" },
+		{ "nested_ang_rd",    "/ang (/rd 5 . [4])" },
+	};
+
+	struct Sample { vector<double> lat; int count = 0; };
+	vector<Sample> samples(corpus.size());
+	double total_ms = 0.0;
+	size_t total_runs = 0;
+	for (int rep = -1; rep < opt.reps; rep++) { // rep -1: calentamiento, no se mide
+		for (size_t qi = 0; qi < corpus.size(); qi++) {
+			mt19937 rng(opt.seed + (unsigned)qi); // /rd reproducible en cada repetición
+			auto a = clk::now();
+			QueryResult qr = executeQuery(corpus[qi].second, d, rng);
+			auto b = clk::now();
+			if (rep < 0) { samples[qi].count = qr.total(); continue; }
+			samples[qi].lat.push_back(ms(a, b));
+			total_ms += ms(a, b);
+			total_runs++;
+		}
+		cerr << (rep < 0 ? "Calentamiento completado" : "Repetición " + to_string(rep + 1) + " completada") << "\n";
 	}
-	return matched;
+
+	ostringstream js;
+	js << fixed;
+	js.precision(3);
+	js << "{\n  \"benchmark\": \"buscador\",\n  \"format\": 1,\n";
+	js << "  \"words\": " << d.size() << ",\n  \"unique_forms\": " << d.formCount() << ",\n";
+	js << "  \"compact\": " << (d.packed ? "true" : "false") << ",\n";
+	js << "  \"seed\": " << opt.seed << ",\n  \"reps\": " << opt.reps << ",\n";
+	js << "  \"threads\": " << computeThreads() << ",\n";
+	js << "  \"load_ms\": { \"generate\": " << ms(t0, t1) << ", \"normalize\": " << ms(t1, t2) << ", \"lookup\": " << ms(t2, t3) << " },\n";
+	js << "  \"queries\": [\n";
+	for (size_t qi = 0; qi < corpus.size(); qi++) {
+		vector<double> lat = samples[qi].lat;
+		sort(lat.begin(), lat.end());
+		double mean = 0.0;
+		for (double v : lat) mean += v;
+		if (!lat.empty()) mean /= lat.size();
+		js << "    { \"name\": \"" << corpus[qi].first << "\", \"query\": \"" << jsonEscape(corpus[qi].second) << "\", \"count\": " << samples[qi].count
+			<< ", \"mean_ms\": " << mean << ", \"p50_ms\": " << percentile(lat, 50) << ", \"p90_ms\": " << percentile(lat, 90)
+			<< ", \"p99_ms\": " << percentile(lat, 99) << ", \"max_ms\": " << (lat.empty() ? 0.0 : lat.back()) << " }"
+			<< (qi + 1 < corpus.size() ? ",\n" : "\n");
+	}
+	js << "  ],\n";
+	js << "  \"total_query_ms\": " << total_ms << ",\n";
+	js << "  \"throughput_qps\": " << (total_ms > 0 ? total_runs * 1000.0 / total_ms : 0.0) << ",\n";
+	js << "  \"peak_rss_kb\": " << peakRssKb() << "\n}\n";
+
+	if (opt.out.empty()) cout << js.str();
+	else {
+		ofstream f(opt.out);
+		if (!f) { cerr << "Error: no se pudo escribir '" << opt.out << "'\n"; return 1; }
+		f << js.str();
+		cerr << "Resultados guardados en " << opt.out << "\n";
+	}
+	return 0;
 }
 
-// --- EXPRESIONES BOOLEANAS ---
+// --- MICRO-BENCHMARKS DE LOS NÚCLEOS DE TEXTO ---
+
+// Contador de reservas de memoria del hilo actual (para medir reservas por palabra). Solo
+// cuenta si se compila con -DBUSCADOR_COUNT_ALLOCS, que sustituye el operator new global;
+// sin esa opción el programa usa el de la biblioteca y --microbench no da reservas.
+thread_local size_t t_alloc_count = 0;
+
+#ifdef BUSCADOR_COUNT_ALLOCS
+static const bool kCountAllocs = true;
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // new/delete sustituidos por malloc/free
+#endif
+void* operator new(size_t n) {
+	t_alloc_count++;
+	if (void* p = malloc(n ? n : 1)) return p;
+	throw bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#else
+static const bool kCountAllocs = false;
+#endif
+
+// Copias congeladas de los núcleos de texto tal como estaban al crear el harness.
+// Cualquier versión optimizada debe dar exactamente los mismos resultados que estas.
+namespace reference {
+
+static string normalizeWord(const string& w) {
+	string res;
+	for (size_t i = 0; i < w.size(); ) {
+		unsigned char c = w[i];
+		if (c < 128) {
+			if (c >= 'a' && c <= 'z') res += (char)toupper(c);
+			else if (c >= 'A' && c <= 'Z') res += c;
+			i++; continue;
+		}
+		if ((unsigned char)c == 0xC3 && i + 1 < w.size()) {
+			unsigned char d = w[i + 1];
+			switch (d) {
+			case 0x81: case 0xA1: res += 'A'; break;
+			case 0x89: case 0xA9: res += 'E'; break;
+			case 0x8D: case 0xAD: res += 'I'; break;
+			case 0x93: case 0xB3: res += 'O'; break;
+			case 0x9A: case 0xBA: res += 'U'; break;
+			case 0x9C: case 0xBC: res += 'U'; break;
+			case 0x91: case 0xB1: res += '~'; break;
+			}
+			i += 2; continue;
+		}
+		i++;
+	}
+	return res;
+}
 
-struct BoolExpr {
-	enum Op { LEAF, AND_OP, OR_OP, NOT_OP, DIFF_OP } op;
-	string query;
-	vector<BoolExpr> children;
-	BoolExpr() : op(LEAF) {}
-};
+static bool isVowel(char c) { return c == 'A' || c == 'E' || c == 'I' || c == 'O' || c == 'U'; }
+static bool isConsonant(char c) { return c == '~' || (isalpha((unsigned char)c) && !isVowel(c)); }
 
-enum BoolTokT { BT_AND, BT_OR, BT_DIFF, BT_NOT, BT_ATOM };
-struct BoolToken { BoolTokT type; string content; };
+static bool isValidOnset(char c1, char c2) {
+	c1 = (char)toupper(c1); c2 = (char)toupper(c2);
+	if (c1 == 'C' && c2 == 'H') return true;
+	if (c1 == 'L' && c2 == 'L') return true;
+	if (c1 == 'R' && c2 == 'R') return true;
+	string valid = "PR BR TR DR CR GR FR PL BL CL GL FL";
+	string pair = { c1, c2 };
+	return valid.find(pair) != string::npos;
+}
 
-static vector<BoolToken> tokenizeBool(const string& s) {
-	vector<BoolToken> toks;
-	size_t i = 0, n = s.size();
+static vector<string> getSyllables(const string& word) {
+	vector<pair<int, int>> nuclei;
+	int n = word.length(), i = 0;
 	while (i < n) {
-		if (s[i] == ' ' || s[i] == '\t') { i++; continue; }
-		if (s[i] == '!') { toks.push_back({ BT_NOT, "" }); i++; continue; }
-		if (i + 1 < n && s[i] == '&' && s[i + 1] == '&') { toks.push_back({ BT_AND, "" }); i += 2; continue; }
-		if (i + 1 < n && s[i] == '|' && s[i + 1] == '|') { toks.push_back({ BT_OR, "" }); i += 2; continue; }
-		if (s[i] == '-' && i > 0 && s[i - 1] == ' ' && i + 1 < n && s[i + 1] == ' ') { toks.push_back({ BT_DIFF, "" }); i++; continue; }
-		if (s[i] == '(') {
-			int dp = 0, db = 0; size_t start = i;
-			while (i < n) {
-				if (s[i] == '[') db++;
-				else if (s[i] == ']' && db > 0) db--;
-				else if (s[i] == '(' && db == 0) dp++;
-				else if (s[i] == ')' && db == 0) { dp--; if (dp == 0) { i++; break; } }
-				i++;
+		if (isVowel(word[i])) {
+			int start = i, end = i;
+			while (end + 1 < n && isVowel(word[end + 1])) {
+				char prev = word[end], curr = word[end + 1];
+				bool prev_strong = (prev == 'A' || prev == 'E' || prev == 'O');
+				bool curr_strong = (curr == 'A' || curr == 'E' || curr == 'O');
+				if (prev_strong && curr_strong) break;
+				end++;
 			}
-			string content = s.substr(start + 1, i - start - 2);
-			for (char& c : content) if (c == '\\') c = '/';
-			toks.push_back({ BT_ATOM, content });
-			continue;
+			nuclei.push_back({ start, end });
+			i = end + 1;
+		}
+		else i++;
+	}
+	if (nuclei.empty()) return { word };
+	vector<int> split_points;
+	for (size_t k = 0; k + 1 < nuclei.size(); ++k) {
+		int c_start = nuclei[k].second + 1, c_end = nuclei[k + 1].first - 1;
+		int L = c_end - c_start + 1;
+		if (L <= 1) split_points.push_back(c_start);
+		else if (L == 2) split_points.push_back(isValidOnset(word[c_start], word[c_start + 1]) ? c_start : c_start + 1);
+		else if (L == 3) split_points.push_back(isValidOnset(word[c_start + 1], word[c_start + 2]) ? c_start + 1 : c_start + 2);
+		else split_points.push_back(c_start + 2);
+	}
+	vector<string> syllables;
+	int current_start = 0;
+	for (int sp : split_points) { syllables.push_back(word.substr(current_start, sp - current_start)); current_start = sp; }
+	syllables.push_back(word.substr(current_start));
+	return syllables;
+}
+
+static int getStressPosition(const string& raw) {
+	string norm;
+	int accent_norm_pos = -1;
+	for (size_t i = 0; i < raw.size(); ) {
+		unsigned char c = raw[i];
+		if (c < 128) {
+			if (c >= 'a' && c <= 'z') norm += (char)toupper(c);
+			else if (c >= 'A' && c <= 'Z') norm += c;
+			i++;
+		}
+		else if (c == 0xC3 && i + 1 < raw.size()) {
+			unsigned char d = raw[i + 1];
+			char mapped = 0; bool accented = false;
+			switch (d) {
+			case 0x81: case 0xA1: mapped = 'A'; accented = true; break;
+			case 0x89: case 0xA9: mapped = 'E'; accented = true; break;
+			case 0x8D: case 0xAD: mapped = 'I'; accented = true; break;
+			case 0x93: case 0xB3: mapped = 'O'; accented = true; break;
+			case 0x9A: case 0xBA: mapped = 'U'; accented = true; break;
+			case 0x9C: case 0xBC: mapped = 'U'; break;
+			case 0x91: case 0xB1: mapped = '~'; break;
+			}
+			if (mapped) { if (accented) accent_norm_pos = (int)norm.size(); norm += mapped; }
+			i += 2;
+		}
+		else i++;
+	}
+	if (norm.empty()) return 2;
+	vector<string> syllables = getSyllables(norm);
+	int n_syl = (int)syllables.size();
+	if (accent_norm_pos >= 0) {
+		int pos = 0;
+		for (int s = 0; s < n_syl; s++) {
+			int end_pos = pos + (int)syllables[s].size();
+			if (accent_norm_pos >= pos && accent_norm_pos < end_pos) return n_syl - s;
+			pos = end_pos;
+		}
+	}
+	char last = norm.back();
+	if (isVowel(last) || last == 'N' || last == 'S') return 2;
+	return 1;
+}
+
+static int levenshtein(const string& a, const string& b, int max_d = INT_MAX) {
+	int m = (int)a.size(), n = (int)b.size();
+	if (abs(m - n) > max_d) return abs(m - n);
+	vector<int> prev(n + 1), curr(n + 1);
+	for (int j = 0; j <= n; j++) prev[j] = j;
+	for (int i = 1; i <= m; i++) {
+		curr[0] = i;
+		int row_min = curr[0];
+		for (int j = 1; j <= n; j++) {
+			int sub = prev[j - 1] + (a[i - 1] != b[j - 1] ? 1 : 0);
+			int del = prev[j] + 1, ins = curr[j - 1] + 1;
+			curr[j] = del < ins ? (del < sub ? del : sub) : (ins < sub ? ins : sub);
+			if (curr[j] < row_min) row_min = curr[j];
+		}
+		if (row_min > max_d) return max_d + 1;
+		swap(prev, curr);
+	}
+	return prev[n];
+}
+
+thread_local int memo[100][50][11];
+
+static bool matchPattern(const string& word, int w_idx, const vector<PatternElement>& elems, int e_idx, int err_left) {
+	if (err_left < 0) return false;
+	if (e_idx == (int)elems.size()) return (int)word.length() - w_idx <= err_left;
+	if (memo[w_idx][e_idx][err_left] != -1) return memo[w_idx][e_idx][err_left] == 1;
+	const auto& E = elems[e_idx];
+	bool matched = false;
+	int max_l = (E.max_count > 50) ? (int)word.length() - w_idx : E.max_count + err_left;
+	for (int L = 0; w_idx + L <= (int)word.length() && L <= max_l; ++L) {
+		int c_err = 0;
+		int m_chars = (std::min)(L, E.max_count);
+		int extra = (L > E.max_count) ? L - E.max_count : 0;
+		int miss = (L < E.min_count) ? E.min_count - L : 0;
+		for (int i = 0; i < m_chars; ++i) {
+			char c = word[w_idx + i];
+			if (E.type == EXACT && c != E.exact_char) c_err++;
+			else if (E.type == VOWEL && !isVowel(c)) c_err++;
+			else if (E.type == CONSONANT && !isConsonant(c)) c_err++;
 		}
-		i++;
+		if (c_err + extra + miss <= err_left &&
+			reference::matchPattern(word, w_idx + L, elems, e_idx + 1, err_left - (c_err + extra + miss))) { matched = true; break; }
 	}
-	return toks;
+	return (memo[w_idx][e_idx][err_left] = matched ? 1 : 0);
 }
 
-struct BoolParser {
-	vector<BoolToken> toks;
-	size_t pos;
-	BoolParser(const vector<BoolToken>& t) : toks(t), pos(0) {}
-	bool atEnd() const { return pos >= toks.size(); }
-	BoolTokT peekType() const { return pos < toks.size() ? toks[pos].type : BT_ATOM; }
-	BoolToken consume() { return toks[pos++]; }
+static bool matchWord(const string& w, const vector<PatternElement>& elems, int tol) {
+	for (int r = 0; r <= (int)w.length(); ++r)
+		for (int e = 0; e <= (int)elems.size(); ++e)
+			for (int t = 0; t <= tol; ++t) memo[r][e][t] = -1;
+	return reference::matchPattern(w, 0, elems, 0, tol);
+}
 
-	BoolExpr parseExpr() {
-		BoolExpr left = parseDiff();
-		while (!atEnd() && peekType() == BT_OR) {
-			consume();
-			BoolExpr right = parseDiff();
-			BoolExpr node; node.op = BoolExpr::OR_OP;
-			node.children.push_back(left); node.children.push_back(right);
-			left = node;
+} // namespace reference
+
+// Ejecución de matchPattern tal como la hace scanPattern (reinicio del memo incluido)
+static bool matchWordKernel(const string& w, const vector<PatternElement>& elems, int tol) {
+	for (int r = 0; r <= (int)w.length(); ++r)
+		for (int e = 0; e <= (int)elems.size(); ++e)
+			for (int t = 0; t <= tol; ++t) memo_buffer[r][e][t] = -1;
+	return matchPattern(w, 0, elems, 0, tol);
+}
+
+// Mide cada núcleo de texto sobre un corpus sintético (ns y reservas por palabra) y
+// comprueba que las implementaciones actuales coinciden con las copias de referencia.
+// Devuelve 1 si alguna comprobación de equivalencia falla.
+static int runMicroBenchmark(const BenchOptions& opt) {
+	using clk = chrono::steady_clock;
+	SpanishWordGenerator gen(opt.seed);
+	vector<string> raw, norm;
+	raw.reserve(opt.words);
+	for (size_t i = 0; i < opt.words; i++) raw.push_back(gen.next());
+	for (const string& r : raw) norm.push_back(normalizeWord(r));
+
+	// Casos límite: todas las secuencias de dos bytes 0xC3 xx, UTF-8 truncado, bytes sueltos y vacíos
+	vector<string> edge = { "", "a", "\xC3", "\xC3\xA1", "a\xC3", "\xC3\xC3\xA1", "\xE2\x82\xAC" "a", "123-abc", "\xFF\xFE" };
+	for (int b = 0x80; b <= 0xBF; b++) { edge.push_back(string("ca\xC3") + (char)b + "n"); edge.push_back(string("\xC3") + (char)b); }
+	// Tramos largos para los bloques SIMD: letras en los límites del rango, separadores y
+	// tildes justo antes, dentro y después de un bloque de 16 o 32 bytes
+	string az = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	edge.push_back(az + az);
+	edge.push_back("@[`{" + az + "@[`{");
+	for (size_t at : { 0, 1, 15, 16, 17, 31, 32, 33, 47 }) {
+		for (const char* ins : { "-", "\xC3\xA1", "\xC3\xB1", "\xC3", "\x7F", "\x80" }) {
+			string t = az.substr(0, 40) + az.substr(0, 10);
+			edge.push_back(t.substr(0, at) + ins + t.substr(at));
 		}
-		return left;
 	}
-	BoolExpr parseDiff() {
-		BoolExpr left = parseConj();
-		while (!atEnd() && peekType() == BT_DIFF) {
-			consume();
-			BoolExpr right = parseConj();
-			BoolExpr node; node.op = BoolExpr::DIFF_OP;
-			node.children.push_back(left); node.children.push_back(right);
-			left = node;
-		}
-		return left;
+	for (size_t i = 0; i + 2 < raw.size() && i < 3000; i += 3) edge.push_back(raw[i] + raw[i + 1] + raw[i + 2]);
+	vector<string> rawAll = raw;
+	rawAll.insert(rawAll.end(), edge.begin(), edge.end());
+
+	vector<pair<string, int>> patterns = { { "(1,2,C)A(1,3).", 0 }, { norm[0] + " 1", 1 }, { ".(0,,C)A(0,,C)O(0,,C)", 0 }, { "(1,3,C)E.", 2 } };
+	vector<vector<PatternElement>> compiled;
+	for (auto& pt : patterns) {
+		vector<PatternElement> el; vector<ResourceCondition> rs; int tol = 0; bool tot = false;
+		parseInput(pt.first, el, rs, tol, tot);
+		pt.second = tol;
+		compiled.push_back(el);
 	}
-	BoolExpr parseConj() {
-		BoolExpr left = parseUnary();
-		while (!atEnd() && peekType() == BT_AND) {
-			consume();
-			BoolExpr right = parseUnary();
-			BoolExpr node; node.op = BoolExpr::AND_OP;
-			node.children.push_back(left); node.children.push_back(right);
-			left = node;
+
+	// Restricciones ordenadas por selectividad (checkRestrictions) frente a checkResources
+	DictStats dstats;
+	buildDictStats(dstats, norm, raw);
+	vector<vector<ResourceCondition>> restrSets;
+	for (const char* rs : { "0K,>=2A", "3S*,<8", "2T*,1R,>1E", "2V*,>=1CH,<=3C*" }) restrSets.push_back(parseConditionList(rs));
+	vector<RestrictionPlan> restrPlans;
+	for (const auto& rs : restrSets) restrPlans.push_back(planRestrictions(rs, dstats));
+
+	struct KernelStat { string name; double ns_per_word = 0; double allocs_per_word = 0; bool equal = true; size_t checked = 0; };
+	vector<KernelStat> stats;
+	volatile size_t sink = 0;
+	auto timeKernel = [&](const string& name, size_t items, const function<void()>& body) {
+		KernelStat ks; ks.name = name;
+		body(); // calentamiento
+		size_t a0 = t_alloc_count;
+		auto t0 = clk::now();
+		for (int rep = 0; rep < opt.reps; rep++) body();
+		double ns = chrono::duration<double, nano>(clk::now() - t0).count();
+		ks.ns_per_word = ns / ((double)items * opt.reps);
+		ks.allocs_per_word = (double)(t_alloc_count - a0) / ((double)items * opt.reps);
+		stats.push_back(ks);
+	};
+
+	timeKernel("normalizeWord", raw.size(), [&] { for (const string& r : raw) sink += normalizeWord(r).size(); });
+	timeKernel("getSyllables", norm.size(), [&] { for (const string& w : norm) sink += getSyllables(w).size(); });
+	timeKernel("getStressPosition", raw.size(), [&] { for (const string& r : raw) sink += getStressPosition(r); });
+	timeKernel("levenshtein", norm.size(), [&] { for (size_t i = 1; i < norm.size(); i++) sink += levenshtein(norm[i - 1], norm[i]); });
+	timeKernel("levenshtein_max2", norm.size(), [&] { for (size_t i = 1; i < norm.size(); i++) sink += levenshtein(norm[i - 1], norm[i], 2); });
+	timeKernel("matchPattern", norm.size() * compiled.size(), [&] {
+		for (size_t p = 0; p < compiled.size(); p++)
+			for (const string& w : norm) if (w.size() < 100) sink += matchWordKernel(w, compiled[p], patterns[p].second);
+		});
+
+	timeKernel("restrictions", norm.size() * restrPlans.size(), [&] {
+		for (const RestrictionPlan& rp : restrPlans)
+			for (size_t i = 0; i < norm.size(); i++) sink += checkRestrictions(norm[i], raw[i], rp, 0, rp.conds.size(), 0);
+		});
+
+	// Conjuntos de resultados: dispersos, densos y con tramos consecutivos
+	vector<vector<bool>> masks;
+	{
+		mt19937 mr(opt.seed);
+		for (double density : { 0.001, 0.05, 0.6 }) {
+			vector<bool> m(norm.size());
+			bernoulli_distribution bd(density);
+			for (size_t i = 0; i < m.size(); i++) m[i] = bd(mr);
+			masks.push_back(move(m));
 		}
-		return left;
+		vector<bool> m(norm.size());
+		for (size_t i = 0; i < m.size(); i++) m[i] = (i / 1000) % 3 == 0;
+		masks.push_back(move(m));
 	}
-	BoolExpr parseUnary() {
-		if (!atEnd() && peekType() == BT_NOT) {
-			consume();
-			BoolExpr child = parseUnary();
-			BoolExpr node; node.op = BoolExpr::NOT_OP;
-			node.children.push_back(child);
-			return node;
+	vector<IdSet> sets;
+	for (const auto& m : masks) sets.push_back(IdSet::fromBitmask(m));
+	timeKernel("idset", norm.size() * sets.size() * sets.size(), [&] {
+		for (const IdSet& a : sets)
+			for (const IdSet& b : sets)
+				sink += IdSet::unite(a, b).size() + IdSet::intersect(a, b).size() + IdSet::subtract(a, b).size();
+		});
+
+	// --- Equivalencia con las implementaciones de referencia ---
+	auto find = [&](const string& name) -> KernelStat& { for (auto& k : stats) if (k.name == name) return k; return stats.back(); };
+	for (const string& r : rawAll) {
+		KernelStat& kn = find("normalizeWord"); kn.checked++;
+		if (normalizeWord(r) != reference::normalizeWord(r)) kn.equal = false;
+		KernelStat& ks = find("getStressPosition"); ks.checked++;
+		if (getStressPosition(r) != reference::getStressPosition(r)) ks.equal = false;
+		string n = reference::normalizeWord(r);
+		KernelStat& ky = find("getSyllables"); ky.checked++;
+		if (getSyllables(n) != reference::getSyllables(n)) ky.equal = false;
+	}
+	for (size_t i = 1; i < norm.size(); i++) {
+		KernelStat& kl = find("levenshtein"); kl.checked++;
+		if (levenshtein(norm[i - 1], norm[i]) != reference::levenshtein(norm[i - 1], norm[i])) kl.equal = false;
+		KernelStat& km = find("levenshtein_max2");
+		for (int md = 0; md <= 3; md++) {
+			km.checked++;
+			if (levenshtein(norm[i - 1], norm[i], md) != reference::levenshtein(norm[i - 1], norm[i], md)) km.equal = false;
 		}
-		return parseAtom();
 	}
-	BoolExpr parseAtom() {
-		if (!atEnd() && peekType() == BT_ATOM) {
-			BoolToken tok = consume();
-			if (hasBoolOps(tok.content)) {
-				BoolParser inner(tokenizeBool(tok.content));
-				return inner.parseExpr();
+	for (size_t p = 0; p < compiled.size(); p++)
+		for (const string& w : norm) {
+			if (w.size() >= 100) continue;
+			KernelStat& kp = find("matchPattern");
+			for (int tol = 0; tol <= 3; tol++) {
+				kp.checked++;
+				if (matchWordKernel(w, compiled[p], tol) != reference::matchWord(w, compiled[p], tol)) kp.equal = false;
 			}
-			BoolExpr leaf; leaf.op = BoolExpr::LEAF; leaf.query = tok.content;
-			return leaf;
 		}
-		return BoolExpr(); // vacío
+
+	// Con presupuesto b, checkRestrictions da el total exacto si no pasa de b y algo mayor que b si lo supera
+	for (size_t p = 0; p < restrSets.size(); p++)
+		for (size_t i = 0; i < norm.size(); i++) {
+			KernelStat& kr = find("restrictions");
+			int full = checkResources(norm[i], raw[i], restrSets[p]);
+			for (int b = 0; b <= 3; b++) {
+				kr.checked++;
+				int got = checkRestrictions(norm[i], raw[i], restrPlans[p], 0, restrPlans[p].conds.size(), b);
+				if (full <= b ? got != full : got <= b) kr.equal = false;
+			}
+		}
+
+	// Uniones, intersecciones y diferencias de IdSet frente a las mismas operaciones sobre bitmasks
+	for (size_t p = 0; p < sets.size(); p++) {
+		KernelStat& ki = find("idset");
+		ki.checked++;
+		if (sets[p].ids() != IdSet::fromSorted(sets[p].ids()).ids()) ki.equal = false;
+		for (size_t q = 0; q < sets.size(); q++) {
+			IdSet u = IdSet::unite(sets[p], sets[q]), n = IdSet::intersect(sets[p], sets[q]), df = IdSet::subtract(sets[p], sets[q]);
+			for (size_t i = 0; i < norm.size(); i++) {
+				ki.checked++;
+				bool a = masks[p][i], b = masks[q][i];
+				if (u.contains(i) != (a || b) || n.contains(i) != (a && b) || df.contains(i) != (a && !b)) ki.equal = false;
+			}
+			if (u.ids().size() != u.size() || n.ids().size() != n.size() || df.ids().size() != df.size()) ki.equal = false;
+		}
 	}
-};
 
-static BoolExpr parseBoolExpr(const string& s) {
-	BoolParser p(tokenizeBool(s));
-	return p.parseExpr();
-}
+	bool all_equal = true;
+	ostringstream js;
+	js << fixed;
+	js.precision(2);
+	js << "{\n  \"microbenchmark\": \"buscador\",\n  \"format\": 1,\n  \"words\": " << raw.size() << ",\n  \"seed\": " << opt.seed
+		<< ",\n  \"reps\": " << opt.reps << ",\n  \"kernels\": [\n";
+	for (size_t k = 0; k < stats.size(); k++) {
+		const KernelStat& ks = stats[k];
+		all_equal = all_equal && ks.equal;
+		js << "    { \"name\": \"" << ks.name << "\", \"ns_per_word\": " << ks.ns_per_word << ", \"allocs_per_word\": ";
+		if (kCountAllocs) js << ks.allocs_per_word;
+		else js << "null";
+		js << ", \"equivalent\": " << (ks.equal ? "true" : "false") << ", \"checked\": " << ks.checked << " }"
+			<< (k + 1 < stats.size() ? ",\n" : "\n");
+	}
+	js << "  ],\n  \"all_equivalent\": " << (all_equal ? "true" : "false") << "\n}\n";
 
-static vector<bool> evalBoolExpr(
-	const BoolExpr& e,
-	const vector<string>& dictionary,
-	const vector<string>& raw_dict,
-	const unordered_map<string, string>& normToRaw,
-	const map<int, vector<string>>& dictByLen
-) {
-	int N = (int)dictionary.size();
-	if (e.op == BoolExpr::LEAF) {
-		return runLeafQuery(e.query, dictionary, raw_dict, normToRaw, dictByLen);
-	}
-	if (e.op == BoolExpr::NOT_OP) {
-		auto inner = evalBoolExpr(e.children[0], dictionary, raw_dict, normToRaw, dictByLen);
-		vector<bool> res(N); for (int i = 0; i < N; i++) res[i] = !inner[i];
-		return res;
-	}
-	if (e.children.size() < 2) return vector<bool>(N, false);
-	auto left = evalBoolExpr(e.children[0], dictionary, raw_dict, normToRaw, dictByLen);
-	auto right = evalBoolExpr(e.children[1], dictionary, raw_dict, normToRaw, dictByLen);
-	vector<bool> res(N);
-	if (e.op == BoolExpr::AND_OP)  for (int i = 0; i < N; i++) res[i] = left[i] && right[i];
-	else if (e.op == BoolExpr::OR_OP)   for (int i = 0; i < N; i++) res[i] = left[i] || right[i];
-	else if (e.op == BoolExpr::DIFF_OP) for (int i = 0; i < N; i++) res[i] = left[i] && !right[i];
-	return res;
+	if (opt.out.empty()) cout << js.str();
+	else {
+		ofstream f(opt.out);
+		if (!f) { cerr << "Error: no se pudo escribir '" << opt.out << "'\n"; return 1; }
+		f << js.str();
+	}
+	if (!all_equal) cerr << "ERROR: alguna implementación no coincide con la de referencia\n";
+	return all_equal ? 0 : 1;
 }
 
-// --- CONSULTAS ANIDADAS ---
-
-// Comprueba si 'arg' empieza por una consulta anidada (expr entre paréntesis que NO sea un rango de patrón).
-// Si sí, resuelve la consulta, llena 'words' con los resultados y 'after' con el texto restante.
-static bool tryResolveNestedArg(
-	const string& arg,
-	const vector<string>& dictionary,
-	const vector<string>& raw_dict,
-	const unordered_map<string, string>& normToRaw,
-	const map<int, vector<string>>& dictByLen,
-	vector<string>& words,
-	string& after
-) {
-	string a = arg;
-	a.erase(0, a.find_first_not_of(" "));
-	if (a.empty() || a[0] != '(') return false;
+// --- CARGA EN SEGUNDO PLANO (REPL) ---
 
-	// Buscar el ) que cierra el primero ( (respetando [ ] anidados)
-	int depth = 0, bdepth = 0;
-	size_t i = 0;
-	for (; i < a.size(); i++) {
-		if (a[i] == '[') bdepth++;
-		else if (a[i] == ']' && bdepth > 0) bdepth--;
-		else if (a[i] == '(' && bdepth == 0) depth++;
-		else if (a[i] == ')' && bdepth == 0) { depth--; if (!depth) { i++; break; } }
-	}
-	if (depth != 0) return false;
+// Carga de un diccionario en un hilo aparte: mientras tanto el REPL atiende la ayuda, el
+// listado de /load y los ajustes; las consultas esperan a que termine (ver finishLoad).
+struct BackgroundLoad {
+	string name;
+	LoadProgress progress;
+	ostringstream log;                // mensajes de loadDict, se muestran al terminar
+	future<shared_ptr<Dict>> result;  // nullptr si la carga falla (se destruye primero: espera al hilo)
+};
 
-	string inner = a.substr(1, i - 2);
-	after = a.substr(i);
-	after.erase(0, after.find_first_not_of(" "));
+static unique_ptr<BackgroundLoad> startLoad(const string& name) {
+	auto bl = make_unique<BackgroundLoad>();
+	bl->name = name;
+	BackgroundLoad* p = bl.get();
+	bl->result = async(launch::async, [p]() {
+		auto d = make_shared<Dict>();
+		try { return loadDict(p->name, *d, p->log, &p->progress) ? d : shared_ptr<Dict>(); }
+		catch (const exception& e) {
+			p->log << "\nError al cargar '" << p->name << "': " << e.what() << "\n";
+			return shared_ptr<Dict>();
+		}
+	});
+	return bl;
+}
 
-	// ¿Es un rango de patrón? (ej: "1,3,V")
-	{
-		auto p = split(inner, ',');
-		bool is_range = (p.size() <= 3);
-		if (is_range && !p.empty() && !p[0].empty())
-			is_range = all_of(p[0].begin(), p[0].end(), [](unsigned char c) { return isdigit(c); });
-		if (is_range && p.size() >= 2 && !p[1].empty())
-			is_range = all_of(p[1].begin(), p[1].end(), [](unsigned char c) { return isdigit(c); });
-		if (is_range && p.size() >= 3 && !p[2].empty())
-			is_range = (p[2] == "V" || p[2] == "C");
-		if (is_range) return false;
+// Si la carga pendiente ha terminado, activa el diccionario y escribe sus mensajes; si falla,
+// sigue activo el anterior. Con 'wait' espera a que termine mostrando el progreso.
+static void finishLoad(unique_ptr<BackgroundLoad>& pending, shared_ptr<Dict>& dict, string& currentDict, bool wait, ostream& out) {
+	if (!pending) return;
+	bool shown = false;
+	while (pending->result.wait_for(chrono::milliseconds(wait ? 200 : 0)) != future_status::ready) {
+		if (!wait) return;
+		size_t total = pending->progress.total, done = pending->progress.done;
+		out << "\r(Cargando '" << pending->name << "': " << pending->progress.stage.load();
+		if (total) out << " " << (std::min)((size_t)100, done * 100 / total) << "%";
+		out << "...)     " << flush;
+		shown = true;
 	}
+	if (shown) out << "\r" << string(70, ' ') << "\r";
+	shared_ptr<Dict> nd = pending->result.get();
+	out << pending->log.str();
+	if (nd) {
+		keepResident(nd);
+		dict = move(nd);
+		currentDict = pending->name;
+	}
+	pending.reset();
+	out.flush();
+}
 
-	// Resolver como subconsulta
-	// Caso especial: /rd n PATRON → limitar a n resultados aleatorios
-	int nested_rd_n = -1; // -1 = no es /rd
-	string inner_for_search = inner;
+// Aplica la recarga que haya dejado el vigilante de --watch (ver RECARGA AUTOMÁTICA) si es
+// del diccionario activo. Con una carga en curso, espera a la siguiente vuelta.
+static void finishReload(TextReload& reload, unique_ptr<BackgroundLoad>& pending, shared_ptr<Dict>& dict, ostream& out) {
+	string name;
+	vector<string> lines, norms;
 	{
-		string t = inner; t.erase(0, t.find_first_not_of(" "));
-		bool is_rd_n = (t.size() >= 7 && t.substr(0, 7) == "/random") ||
-			(t.size() >= 3 && t.substr(0, 3) == "/rd" && (t.size() == 3 || t[3] == ' '));
-		if (is_rd_n) {
-			string rest_r = (t.substr(0, 7) == "/random") ? t.substr(7) : t.substr(3);
-			rest_r.erase(0, rest_r.find_first_not_of(" "));
-			size_t sp2 = rest_r.find(' ');
-			string ftok = (sp2 != string::npos) ? rest_r.substr(0, sp2) : rest_r;
-			if (!ftok.empty() && all_of(ftok.begin(), ftok.end(), [](unsigned char c) {return isdigit(c);})) {
-				nested_rd_n = safeStoi(ftok);
-				string pat_part = (sp2 != string::npos) ? rest_r.substr(sp2 + 1) : "";
-				pat_part.erase(0, pat_part.find_first_not_of(" "));
-				if (pat_part.empty()) pat_part = ".";
-				if (!pat_part.empty() && pat_part[0] == '[') pat_part = ". " + pat_part;
-				inner_for_search = pat_part;
-			}
-		}
+		lock_guard<mutex> lk(reload.mtx);
+		if (!reload.ready || pending) return;
+		reload.ready = false;
+		name = reload.name;
+		lines = move(reload.lines);
+		norms = move(reload.norms);
 	}
-
-	vector<bool> matched = hasBoolOps(inner_for_search)
-		? evalBoolExpr(parseBoolExpr(inner_for_search), dictionary, raw_dict, normToRaw, dictByLen)
-		: runLeafQuery(inner_for_search, dictionary, raw_dict, normToRaw, dictByLen);
-	for (size_t j = 0; j < dictionary.size(); j++)
-		if (matched[j]) words.push_back(raw_dict[j]);
-
-	// Aplicar selección aleatoria si era /rd n
-	if (nested_rd_n > 0 && (int)words.size() > nested_rd_n) {
-		static mt19937 rng_nested(random_device{}());
-		shuffle(words.begin(), words.end(), rng_nested);
-		words.resize(nested_rd_n);
+	if (dict->name != name) return;
+	if (!dict->packed && applyTextChanges(*dict, lines, out)) {}
+	else if (dict->packed && dict->packed->file) out << "('" << name << ".txt' ha cambiado: vuelve a generar '" << name << ".shd' con --make-shards)\n";
+	else {
+		rewriteFromText(name, lines, norms);
+		pending = startLoad(name);
+		out << "('" << name << ".txt' ha cambiado; recargando '" << name << "' en segundo plano)\n";
 	}
-	return true;
+	out.flush();
 }
 
 // --- MAIN ---
 
-int main() {
+// Ctrl-C en el REPL: durante una consulta solo la cancela (el diccionario sigue cargado);
+// en el prompt mantiene el comportamiento por defecto y termina el programa.
+static volatile sig_atomic_t g_sigint = 0, g_inQuery = 0;
+
+static void onSigint(int) {
+	if (g_inQuery) { g_sigint = 1; return; }
+	signal(SIGINT, SIG_DFL);
+	raise(SIGINT);
+}
+
+int main(int argc, char* argv[]) {
+#ifdef _WIN32
 	SetConsoleOutputCP(65001); // UTF-8
 	SetConsoleCP(65001);
+#endif
 	ios_base::sync_with_stdio(false); cin.tie(NULL);
+	// Una compactación de NOMBRE.delta en curso termina antes de salir (ver recordUpdates)
+	struct CompactionGuard { ~CompactionGuard() { finishCompaction(); } } compactionGuard;
 
-	vector<string> dictionary, raw_dict;
 	string currentDict = "default";
 
-	loadDictionary(currentDict, raw_dict, dictionary);
+	// --- ARGUMENTOS DE LÍNEA DE COMANDOS ---
+	// --dict NOMBRE        diccionario inicial
+	// --batch [FICHERO]    modo no interactivo (sin fichero o con '-', lee de stdin)
+	// --jobs N             hilos para el modo batch (por defecto, todos los núcleos)
+	// --seed N             semilla de /random en modo batch (resultados reproducibles)
+	// --serve DIRECCIÓN    modo servidor: "unix:/ruta/socket" o "tcp:PUERTO" (solo localhost)
+	// --limit N            máximo de resultados por consulta en modo servidor
+	// --timeout MS         tiempo máximo por consulta (REPL, batch y servidor)
+	// --max-work N         trabajo máximo por consulta: palabras o claves examinadas, permutaciones...
+	// --bench              benchmark con diccionario sintético (--words N, --reps N, --out FICHERO,
+	//                      --save-dict NOMBRE; --seed fija la semilla, por defecto 42)
+	// --threads N          máximo de hilos de cálculo para repartir cada consulta (por defecto, todos los núcleos)
+	// --microbench         micro-benchmarks de los núcleos de texto con comprobación de equivalencia
+	//                      (--words N, --reps N, --out FICHERO, --seed N)
+	// --compact            diccionarios en memoria en modo compacto (formas ordenadas y
+	//                      comprimidas por prefijos; también en --bench)
+	// --make-shards NOMBRE genera NOMBRE.shd desde NOMBRE.txt (--shard-size N entradas por
+	//                      fragmento) y termina; al cargar NOMBRE se usa el .shd desde el disco
+	// --workers N          reparte los recorridos entre N procesos trabajadores locales
+	//                      (REPL, batch y servidor; con --threads, hilos de cada uno)
+	// --watch              recarga el diccionario activo cuando cambia su .txt (REPL y servidor)
+	bool batch = false, bench = false, microbench = false, seedGiven = false, watch = false;
+	BenchOptions benchOpt;
+	string serveAddress;
+	int maxResults = 0, timeoutMs = 0;
+	uint64_t maxWork = 0;
+	int workers = 0, workerFd = -1;
+	string workerPart;
+	string batchFile = "-", shardDict;
+	size_t shardSize = kDefaultShardSize;
+	int jobs = (int)thread::hardware_concurrency();
+	unsigned seed = random_device{}();
+	for (int a = 1; a < argc; a++) {
+		string arg = argv[a];
+		bool hasValue = a + 1 < argc && argv[a + 1][0] != '-';
+		if (arg == "--dict" && a + 1 < argc) currentDict = argv[++a];
+		else if (arg == "--batch") { batch = true; if (a + 1 < argc && (hasValue || string(argv[a + 1]) == "-")) batchFile = argv[++a]; }
+		else if (arg == "--jobs" && a + 1 < argc) jobs = safeStoi(argv[++a], jobs);
+		else if (arg == "--threads" && a + 1 < argc) g_computeThreads = (std::max)(1, safeStoi(argv[++a], 1));
+		else if (arg == "--seed" && a + 1 < argc) { seed = (unsigned)safeStoi(argv[++a], (int)seed); seedGiven = true; }
+		else if (arg == "--bench") bench = true;
+		else if (arg == "--microbench") microbench = true;
+		else if (arg == "--compact") g_compactDicts = true;
+		else if (arg == "--watch") watch = true;
+		else if (arg == "--workers" && a + 1 < argc) workers = (std::max)(0, safeStoi(argv[++a]));
+		else if (arg == "--worker" && a + 2 < argc) { workerFd = safeStoi(argv[++a], -1); workerPart = argv[++a]; }
+		else if (arg == "--make-shards" && a + 1 < argc) shardDict = argv[++a];
+		else if (arg == "--shard-size" && a + 1 < argc) shardSize = (size_t)max(1LL, atoll(argv[++a]));
+		else if (arg == "--words" && a + 1 < argc) benchOpt.words = (size_t)max(1LL, atoll(argv[++a]));
+		else if (arg == "--reps" && a + 1 < argc) benchOpt.reps = max(1, safeStoi(argv[++a], benchOpt.reps));
+		else if (arg == "--out" && a + 1 < argc) benchOpt.out = argv[++a];
+		else if (arg == "--save-dict" && a + 1 < argc) benchOpt.save_dict = argv[++a];
+		else if (arg == "--serve" && a + 1 < argc) serveAddress = argv[++a];
+		else if (arg == "--limit" && a + 1 < argc) maxResults = safeStoi(argv[++a]);
+		else if (arg == "--timeout" && a + 1 < argc) timeoutMs = safeStoi(argv[++a]);
+		else if (arg == "--max-work" && a + 1 < argc) maxWork = (uint64_t)max(0LL, atoll(argv[++a]));
+		else { cerr << "Argumento desconocido: " << arg << "\n"; return 2; }
+	}
+	if (jobs < 1) jobs = 1;
 
-	// RNG para /random
-	mt19937 rng(random_device{}());
+	if (!shardDict.empty()) return buildShardFile(shardDict, shardSize, cerr) ? 0 : 1;
 
-	// --- ESTRUCTURAS PARA /calembour ---
-	unordered_map<string, string> normToRaw;   // norma → primera forma raw
-	map<int, vector<string>> dictByLen;         // longitud → [palabras normalizadas]
+#ifdef __linux__
+	// Proceso trabajador lanzado por --workers: parte K/N del diccionario
+	if (workerFd >= 0) {
+		size_t slash = workerPart.find('/');
+		g_partIndex = (size_t)safeStoi(workerPart.substr(0, slash));
+		g_partCount = slash == string::npos ? 1 : (size_t)(std::max)(1, safeStoi(workerPart.substr(slash + 1)));
+		return runWorker(workerFd);
+	}
+#endif
+	if (workers > 0 && !bench && !microbench) {
+		int cores = (std::max)(1, (int)thread::hardware_concurrency());
+		vector<string> flags = { "--threads", to_string(g_computeThreads > 0 ? g_computeThreads : (std::max)(1, cores / workers)) };
+		if (g_compactDicts) flags.push_back("--compact");
+		if (!startWorkers(workers, flags)) return 1;
+	}
+	// Al salir por cualquier camino se cierran los trabajadores y se espera a que terminen
+	struct WorkerGuard { ~WorkerGuard() { stopWorkers(); } } workerGuard;
 
-	auto buildCalLookup = [&]() {
-		normToRaw.clear();
-		dictByLen.clear();
-		for (size_t i = 0; i < dictionary.size(); i++) {
-			if (!normToRaw.count(dictionary[i]))
-				normToRaw[dictionary[i]] = raw_dict[i];
-			dictByLen[(int)dictionary[i].size()].push_back(dictionary[i]);
-		}
-		};
-	buildCalLookup();
-
-	// Lambda: ejecuta una búsqueda y devuelve los resultados como vector de raw words
-	auto runSearch = [&](const string& il) -> vector<string> {
-		vector<PatternElement> elems2; vector<ResourceCondition> res2;
-		int tol2 = 0; bool istot2 = false;
-		bool perr = false;
-		parseInput(il, elems2, res2, tol2, istot2, &perr);
-		if (perr) return {};
-		vector<string> out;
-		for (size_t i = 0; i < dictionary.size(); i++) {
-			const string& w = dictionary[i];
-			if (w.length() >= 100) continue;
-			int re = checkResources(w, raw_dict[i], res2);
-			int rt = tol2;
-			if (istot2) { if (re > tol2) continue; rt -= re; }
-			else if (re > 0) continue;
-			for (int r2 = 0; r2 <= (int)w.length(); r2++)
-				for (int e2 = 0; e2 <= (int)elems2.size(); e2++)
-					for (int t2 = 0; t2 <= rt; t2++) memo_buffer[r2][e2][t2] = -1;
-			if (matchPattern(w, 0, elems2, 0, rt)) out.push_back(raw_dict[i]);
-		}
-		return out;
-		};
+	if (bench || microbench) {
+		if (seedGiven) benchOpt.seed = seed;
+		return bench ? runBenchmark(benchOpt) : runMicroBenchmark(benchOpt);
+	}
 
-	// Muestra bloques de resultados con salto de línea entre cada bloque
-	auto displayBlocks = [&](const vector<pair<string, vector<string>>>& blocks) {
-		int total = 0;
-		for (size_t bi = 0; bi < blocks.size(); bi++) {
-			if (bi > 0) cout << "\n";
-			for (const string& r : blocks[bi].second) cout << "- " << r << "\n";
-			total += (int)blocks[bi].second.size();
-		}
-		cout << "Total: " << total << "\n";
-		};
+	if (!serveAddress.empty()) {
+#ifdef _WIN32
+		cerr << "El modo servidor solo está disponible en sistemas POSIX\n";
+		return 1;
+#else
+		ServerOptions opt;
+		opt.address = serveAddress;
+		opt.threads = jobs;
+		opt.max_results = maxResults;
+		opt.timeout_ms = timeoutMs;
+		opt.max_work = maxWork;
+		opt.watch = watch;
+		return runServer(opt, currentDict);
+#endif
+	}
+
+	if (batch) {
+		auto dict = make_shared<Dict>();
+		if (!loadDict(currentDict, *dict, cerr)) return 1;
+		keepResident(dict);
+		if (batchFile == "-") return runBatch(cin, cout, dict, jobs, seed, timeoutMs, maxWork);
+		ifstream bf(batchFile);
+		if (!bf) { cerr << "Error: no se pudo abrir '" << batchFile << "'\n"; return 1; }
+		return runBatch(bf, cout, dict, jobs, seed, timeoutMs, maxWork);
+	}
+
+	// El diccionario se carga en segundo plano; hasta entonces 'dict' está vacío
+	shared_ptr<Dict> dict = make_shared<Dict>();
+	unique_ptr<BackgroundLoad> pending = startLoad(currentDict);
+
+	// --watch: el vigilante lee el .txt en su hilo y el bucle aplica los cambios (finishReload)
+	TextReload reload;
+	unique_ptr<DictWatcher> watcher;
+	string watched;
+	if (watch) watcher = make_unique<DictWatcher>([&reload](const string& name, vector<string>& lines, vector<string>& norms) {
+		lock_guard<mutex> lk(reload.mtx);
+		reload.ready = true;
+		reload.name = name;
+		reload.lines = move(lines);
+		reload.norms = move(norms);
+	});
+
+	// RNG para /random
+	mt19937 rng(random_device{}());
+	bool statsOn = false; // /stats on: tiempos y contadores por hoja tras cada consulta
 
 	cout << "\n=== BUSCADOR DE PALABRAS ===\n";
-	cout << "Diccionario activo: " << currentDict << "\n\n";
+	cout << "Diccionario activo: " << currentDict << " (cargando en segundo plano)\n\n";
 	cout << "Escribe /help para ayuda general, /commands para ver todos los comandos.\n";
 
 	while (true) {
+		finishLoad(pending, dict, currentDict, false, cout);
 		cout << "\n> ";
-		string inputLine; getline(cin, inputLine);
+		string inputLine;
+		if (!getline(cin, inputLine)) break;
+		if (watcher) {
+			finishLoad(pending, dict, currentDict, false, cout);
+			if (watched != currentDict) watcher->follow(watched = currentDict);
+			finishReload(reload, pending, dict, cout);
+		}
 
 		string input = inputLine;
 		input.erase(0, input.find_first_not_of(" \t\r\n"));
@@ -1187,742 +7660,84 @@ int main() {
 		if (input.empty()) continue;
 
 		try {
-
-			// --- LÓGICA BOOLEANA ---
-			if (hasBoolOps(input)) {
-				BoolExpr expr = parseBoolExpr(input);
-				vector<bool> bitmask = evalBoolExpr(expr, dictionary, raw_dict, normToRaw, dictByLen);
-				int total = 0;
-				for (size_t i = 0; i < dictionary.size(); i++)
-					if (bitmask[i]) { cout << "- " << raw_dict[i] << "\n"; total++; }
-				cout << "Total: " << total << endl;
-				continue;
-			}
-
-			if (input == "/commands" || input == "/cmd") {
-				cout << "\n--- LÓGICA BOOLEANA ---\n" << endl;
-				cout << "Combina consultas entre paréntesis con operadores:" << endl;
-				cout << "  (A) && (B)   ->  palabras en A y en B (intersección)" << endl;
-				cout << "  (A) || (B)   ->  palabras en A o en B (unión)" << endl;
-				cout << "  (A) - (B)    ->  palabras en A pero no en B (diferencia)" << endl;
-				cout << "  !(A)         ->  palabras que NO están en A (complemento)" << endl;
-				cout << "  Precedencia: ! > && > - > ||    Agrupables con (())" << endl;
-				cout << "  Ejemplo: ((/cal SUMANDOBLE [>1]) - (* [C*])) || !(\\uni E)" << endl;
-				cout << "\n--- LISTA DE COMANDOS ---\n" << endl;
-				cout << "/random,        /rd   -> Ejecuta una búsqueda y devuelve n palabras al azar." << endl;
-				cout << "  /rd n PATRON [R] m  -> n palabras aleatorias del resultado de PATRON [R] m" << endl;
-				cout << "  Si no se indica PATRON, se usa '.' (todas las palabras)." << endl;
-				cout << "/calembour,     /cal  -> Divide la palabra en trozos que estén en el diccionario." << endl;
-				cout << "  /cal PALABRA           -> Solo divisiones exactas." << endl;
-				cout << "  /cal PALABRA [R1,R2]   -> Solo segmentos que cumplan las restricciones." << endl;
-				cout << "  /cal PALABRA [R1,R2] n -> Ídem con n errores totales permitidos." << endl;
-				cout << "/anagram,       /ang  -> Busca anagramas de la palabra." << endl;
-				cout << "  /ang PALABRA -> . [3A,1B,2R,L,P]" << endl;
-				cout << "/paronomasia,   /par  -> Busca palabras con igual esqueleto consonántico." << endl;
-				cout << "  /par COCHE -> C*CH* [2V*]   (vocales sustituidas por *)" << endl;
-				cout << "/anasyllabic,   /ans  -> Busca palabras reordenando las sílabas de la original." << endl;
-				cout << "  /ans PALABRA -> PABRALA || BRAPALA || BRALAPA || ..." << endl;
-				cout << "/anaphora,      /anp  -> Busca palabras que empiecen por la palabra o letras dadas." << endl;
-				cout << "  /anp PAL -> PAL." << endl;
-				cout << "/epiphora,      /epi  -> Busca palabras que terminen por la palabra o letras dadas." << endl;
-				cout << "  /epi BRA -> .BRA" << endl;
-				cout << "/multisyllabic, /mul  -> Busca palabras con la misma estructura vocálica." << endl;
-				cout << "  /mul PALABRITA -> .A.A.I.A. [4V*]" << endl;
-				cout << "/univocalism,   /uni  -> Busca palabras que solo contengan la vocal indicada." << endl;
-				cout << "  /uni E -> . [E,0A,0I,0O,0U]" << endl;
-				cout << "/assonant,      /aso  -> Busca rima asonante (vocales del sufijo tónico coinciden)." << endl;
-				cout << "  /aso corazón -> palabras cuya estructura vocálica final es O-O" << endl;
-				cout << "/consonant,     /con  -> Busca rima consonante (sufijo exacto desde vocal tónica)." << endl;
-				cout << "  /con corazón -> palabras que terminan en '-azón'" << endl;
-				cout << "/wordplay,      /wp   -> Busca iterando la tolerancia hasta encontrar resultados nuevos." << endl;
-				cout << "  /wp PALABRA -> prueba PALABRA 1, si no hay resultados PALABRA 2, ..." << endl;
-				cout << "\n--- Todos los comandos admiten restricciones [] y tolerancia n ---\n" << endl;
-				cout << "/help,          /hp   -> Explicación general del buscador." << endl;
-				cout << "/pattern,       /pat  -> Cómo definir la estructura (comodines y rangos)." << endl;
-				cout << "/restriction,   /res  -> Cómo usar filtros entre corchetes []." << endl;
-				cout << "/tolerance,     /tol  -> Cómo permitir errores en la búsqueda." << endl;
-				cout << "/nested,        /nes  -> Cómo realizar busquedas anidadas." << endl;
-				cout << "/load,          /ld   -> Muestra o cambia el diccionario activo." << endl;
-				cout << "/exit,          /ex   -> Cierra la aplicación." << endl;
-				continue;
-			}
-
-			// --- DETECCIÓN DE COMANDOS ---
-			bool isAn = (input.substr(0, 8) == "/anagram" || (input.substr(0, 4) == "/ang" && (input.size() == 4 || input[4] == ' ')));
-			bool isPar = (input.substr(0, 12) == "/paronomasia" || (input.substr(0, 4) == "/par" && (input.size() == 4 || input[4] == ' ')));
-			bool isAns = (input.substr(0, 12) == "/anasyllabic" || (input.substr(0, 4) == "/ans" && (input.size() == 4 || input[4] == ' ')));
-			bool isAnp = (input.substr(0, 9) == "/anaphora" || (input.substr(0, 4) == "/anp" && (input.size() == 4 || input[4] == ' ')));
-			bool isEpi = (input.substr(0, 9) == "/epiphora" || (input.substr(0, 4) == "/epi" && (input.size() == 4 || input[4] == ' ')));
-			bool isMul = (input.substr(0, 14) == "/multisyllabic" || (input.substr(0, 4) == "/mul" && (input.size() == 4 || input[4] == ' ')));
-			bool isUni = (input.substr(0, 12) == "/univocalism" || (input.substr(0, 4) == "/uni" && (input.size() == 4 || input[4] == ' ')));
-			bool isAso = (input.size() >= 9 && input.substr(0, 9) == "/assonant") || (input.size() >= 4 && input.substr(0, 4) == "/aso" && (input.size() == 4 || input[4] == ' '));
-			bool isCon = (input.size() >= 10 && input.substr(0, 10) == "/consonant") || (input.size() >= 4 && input.substr(0, 4) == "/con" && (input.size() == 4 || input[4] == ' '));
-
-			// --- DETECCIÓN DE /random (/rd) ---
-			bool isRd = (input.substr(0, 7) == "/random" || (input.substr(0, 3) == "/rd" && (input.size() == 3 || input[3] == ' ')));
-			int rd_n = 1;           // número de palabras a devolver
-			string rd_pattern = ""; // patrón (vacío = ".")
-
-			if (isRd) {
-				// Extraer el resto del comando
-				string rest = (input.substr(0, 7) == "/random") ? input.substr(7) : input.substr(3);
-				rest.erase(0, rest.find_first_not_of(" "));
-
-				// El primer token debe ser n (número entero)
-				// Si el primer token no es un número, asumimos n=1 y todo es el patrón
-				size_t sp = rest.find(' ');
-				string first_token = (sp != string::npos) ? rest.substr(0, sp) : rest;
-				string after_first = (sp != string::npos) ? rest.substr(sp + 1) : "";
-
-				bool first_is_number = !first_token.empty() &&
-					all_of(first_token.begin(), first_token.end(), [](unsigned char c) { return isdigit(c); });
-
-				if (first_is_number) {
-					rd_n = safeStoi(first_token);
-					rd_pattern = after_first;
-				}
-				else {
-					rd_n = 1;
-					rd_pattern = rest;
-				}
-
-				// Si no hay patrón, usar "." (cualquier palabra)
-				if (rd_pattern.empty()) rd_pattern = ".";
-				// Si el patrón empieza por '[', no tiene estructura: añadir '.' implícito
-				if (!rd_pattern.empty() && rd_pattern[0] == '[') rd_pattern = ". " + rd_pattern;
-
-				// Construir el inputLine para la búsqueda normal
-				inputLine = rd_pattern;
-			}
-
-			// Vector para almacenar todos los patrones a evaluar en esta ronda
-			vector<string> patterns_to_run;
-
-			if (isAso || isCon) {
-				int plen = 4;
-				if (isAso && input.size() >= 9 && input.substr(0, 9) == "/assonant") plen = 9;
-				else if (isCon && input.size() >= 10 && input.substr(0, 10) == "/consonant") plen = 10;
-				string rest_full = input.substr(plen);
-				rest_full.erase(0, rest_full.find_first_not_of(" "));
-
-				// Helper: de un 'rest' extrae word, extra_r, tolerance_str y devuelve inputLine para aso/con
-				auto computeRhymeIL = [&](const string& r) -> string {
-					string w2, extra_r2 = "", tol2 = "", rest2 = r;
-					size_t bs = rest2.find('[');
-					size_t ls = rest2.find_last_of(" ");
-					if (bs != string::npos) {
-						size_t be = rest2.find(']', bs);
-						if (be != string::npos) { w2 = rest2.substr(0, bs); extra_r2 = rest2.substr(bs + 1, be - bs - 1); tol2 = rest2.substr(be + 1); tol2.erase(0, tol2.find_first_not_of(" ")); }
-					}
-					else if (ls != string::npos) {
-						string pn = rest2.substr(ls + 1); string cn = pn; if (!cn.empty() && cn.back() == '*') cn.pop_back();
-						if (!cn.empty() && all_of(cn.begin(), cn.end(), [](unsigned char c) {return isdigit(c);})) { w2 = rest2.substr(0, ls); tol2 = pn; }
-						else w2 = rest2;
-					}
-					else w2 = rest2;
-					w2.erase(remove(w2.begin(), w2.end(), ' '), w2.end());
-					string rhyme = getRhymeSuffix(w2);
-					if (rhyme.empty()) return "";
-					string il2;
-					if (isCon) il2 = "." + rhyme;
-					else { il2 = ".(0,,C)"; for (char c : rhyme) if (isVowel(c)) il2 += string(1, c) + "(0,,C)"; }
-					if (!extra_r2.empty()) il2 += " [" + extra_r2 + "]";
-					if (!tol2.empty()) il2 += " " + tol2;
-					return il2;
-					};
-
-				vector<string> nested_words_ac; string nested_after_ac;
-				bool is_nested_ac = tryResolveNestedArg(rest_full, dictionary, raw_dict, normToRaw, dictByLen, nested_words_ac, nested_after_ac);
-				if (is_nested_ac) {
-					if (nested_words_ac.empty()) { cout << "(La consulta anidada no devolvió resultados)" << endl; continue; }
-					vector<pair<string, vector<string>>> blocks;
-					for (const string& nw : nested_words_ac) {
-						string r = nw + (nested_after_ac.empty() ? "" : " " + nested_after_ac);
-						string il = computeRhymeIL(r);
-						if (il.empty()) { cout << "(No se pudo determinar la rima de '" << nw << "')\n"; blocks.push_back({ nw,{} }); continue; }
-						blocks.push_back({ nw, runSearch(il) });
-					}
-					displayBlocks(blocks);
-					continue;
-				}
-				// Caso normal (una sola palabra)
-				string il = computeRhymeIL(rest_full);
-				if (il.empty()) { cout << "(No se pudo determinar la rima de '" << rest_full << "')" << endl; continue; }
-				string rhyme_disp = getRhymeSuffix(rest_full.substr(0, rest_full.find(' ')));
-				if (isCon) cout << "(Buscando rima consonante con sufijo: " << rhyme_disp << ")\n";
-				else { string vd; for (char c : rhyme_disp) if (isVowel(c)) vd += c; cout << "(Buscando rima asonante con vocales: " << vd << ")\n"; }
-				inputLine = il;
-			}
-
-			// Detección de comandos inválidos (empieza por / pero no es reconocido)
-			if (input[0] == '/' && !isAn && !isPar && !isAns && !isAnp && !isEpi && !isMul && !isUni
-				&& !isAso && !isCon
-				&& input != "/help" && input != "/hp"
-				&& input != "/pattern" && input != "/pat"
-				&& input != "/restriction" && input != "/res"
-				&& input != "/tolerance" && input != "/tol"
-				&& input != "/nested" && input!="/nes"
-				&& input != "/commands" && input != "/cmd"
-				&& !(input.size() >= 5 && input.substr(0, 5) == "/load") && !(input.size() >= 3 && input.substr(0, 3) == "/ld")
-				&& !(input.size() >= 7 && input.substr(0, 7) == "/random") && !(input.size() >= 3 && input.substr(0, 3) == "/rd" && (input.size() == 3 || input[3] == ' '))
-				&& !(input.size() >= 10 && input.substr(0, 10) == "/calembour") && !(input.size() >= 4 && input.substr(0, 4) == "/cal" && (input.size() == 4 || input[4] == ' '))
-				&& !(input.size() >= 9 && input.substr(0, 9) == "/wordplay") && !(input.size() >= 3 && input.substr(0, 3) == "/wp" && (input.size() == 3 || input[3] == ' '))
-				&& input != "/exit" && input != "/ex") {
-				cout << "(Sintaxis inválida o comando desconocido. Usa /help o /commands para ver las opciones.)" << endl;
-				continue;
-			}
-
-			// extractWordArgs: alias local para extractWordRestrTol (definida globalmente)
-			auto extractWordArgs = extractWordRestrTol;
-
-			if (isAn || isPar) {
-				bool isAnagram = isAn;
-				string rest_full;
-				if (isAn) rest_full = (input.substr(0, 8) == "/anagram") ? input.substr(8) : input.substr(4);
-				else      rest_full = (input.substr(0, 12) == "/paronomasia") ? input.substr(12) : input.substr(4);
-				rest_full.erase(0, rest_full.find_first_not_of(" "));
-
-				auto computeAnIL = [&](const string& r) -> string {
-					auto [word, extra_r, tol_str] = extractWordArgs(r);
-					string nw = normalizeWord(word);
-					if (isAnagram) {
-						// Normalizar la tolerancia para que siempre incluya '*' (es total)
-						string ts = tol_str;
-						if (!ts.empty()) {
-							string tmp = ts;
-							if (tmp.back() == '*') tmp.pop_back();
-							if (all_of(tmp.begin(), tmp.end(), [](unsigned char c) { return isdigit(c); }))
-								ts = tmp + "*";
-						}
-						map<char, int> cnt;
-						for (char c : nw) cnt[c]++;
-						string exp = ". [";
-						for (auto& [ch, co] : cnt) exp += to_string(co) + ch + ",";
-						exp += to_string(nw.length());
-						if (!extra_r.empty()) exp += "," + extra_r;
-						exp += "] " + ts;
-						return exp;
-					}
-					else {
-						// Esqueleto consonántico: consonantes en su posición, vocales → '*'
-						// Ejemplo: COCHE → C*CH* [2V*]
-						string pat = ""; int vow = 0; string cgrp = "";
-						for (char c : nw) {
-							if (isVowel(c)) { pat += cgrp + "*"; cgrp = ""; vow++; }
-							else cgrp += c;
-						}
-						pat += cgrp; // consonantes finales
-						string exp = pat + " [" + to_string(vow) + "V*";
-						if (!extra_r.empty()) exp += "," + extra_r;
-						exp += "] " + tol_str;
-						return exp;
-					}
-					};
-
-				vector<string> nw_an; string na_an;
-				if (tryResolveNestedArg(rest_full, dictionary, raw_dict, normToRaw, dictByLen, nw_an, na_an)) {
-					if (nw_an.empty()) { cout << "(La consulta anidada no devolvió resultados)" << endl; continue; }
-					vector<pair<string, vector<string>>> blocks;
-					for (const string& nw : nw_an) {
-						string r = nw + (na_an.empty() ? "" : " " + na_an);
-						blocks.push_back({ nw, runSearch(computeAnIL(r)) });
-					}
-					displayBlocks(blocks); continue;
-				}
-				inputLine = computeAnIL(rest_full);
-			}
-
-			if (isAns) {
-				string rest_full = (input.substr(0, 12) == "/anasyllabic") ? input.substr(12) : input.substr(4);
-				rest_full.erase(0, rest_full.find_first_not_of(" "));
-
-				auto computeAnsPatterns = [&](const string& r) -> vector<string> {
-					auto [word, extra_r, tol_str] = extractWordArgs(r);
-					string nw = normalizeWord(word);
-					vector<string> syls = getSyllables(nw); sort(syls.begin(), syls.end());
-					vector<string> result;
-					do {
-						string p = ""; for (const string& s : syls) p += s;
-						if (!extra_r.empty()) p += " [" + extra_r + "]";
-						if (!tol_str.empty()) p += " " + tol_str;
-						result.push_back(p);
-					} while (next_permutation(syls.begin(), syls.end()));
-					return result;
-					};
-
-				vector<string> nw_ans; string na_ans;
-				if (tryResolveNestedArg(rest_full, dictionary, raw_dict, normToRaw, dictByLen, nw_ans, na_ans)) {
-					if (nw_ans.empty()) { cout << "(La consulta anidada no devolvió resultados)" << endl; continue; }
-					vector<pair<string, vector<string>>> blocks;
-					for (const string& nw : nw_ans) {
-						string r = nw + (na_ans.empty() ? "" : " " + na_ans);
-						auto pats = computeAnsPatterns(r);
-						cout << "(Buscando en " << pats.size() << " permutaciones para '" << nw << "'...)\n";
-						// Union de todas las permutaciones
-						unordered_set<string> seen;
-						vector<string> res_nw;
-						for (const string& pLine : pats) {
-							auto partial = runSearch(pLine);
-							for (const string& pw : partial) if (seen.insert(normalizeWord(pw)).second) res_nw.push_back(pw);
-						}
-						blocks.push_back({ nw, res_nw });
-					}
-					displayBlocks(blocks); continue;
-				}
-				patterns_to_run = computeAnsPatterns(rest_full);
-				cout << "(Buscando en " << patterns_to_run.size() << " permutaciones silábicas...)\n";
-			}
-
-			if (isAnp || isEpi || isMul || isUni) {
-				string rest_full;
-				if (isAnp)      rest_full = (input.substr(0, 9) == "/anaphora") ? input.substr(9) : input.substr(4);
-				else if (isEpi) rest_full = (input.substr(0, 9) == "/epiphora") ? input.substr(9) : input.substr(4);
-				else if (isMul) rest_full = (input.substr(0, 14) == "/multisyllabic") ? input.substr(14) : input.substr(4);
-				else            rest_full = (input.substr(0, 12) == "/univocalism") ? input.substr(12) : input.substr(4);
-				rest_full.erase(0, rest_full.find_first_not_of(" "));
-
-				auto computeAnpIL = [&](const string& r) -> string {
-					auto [word, extra_r, tol_str] = extractWordArgs(r);
-					string nw = normalizeWord(word);
-					string exp;
-					if (isAnp) {
-						exp = nw + "."; if (!extra_r.empty()) exp += " [" + extra_r + "]"; if (!tol_str.empty()) exp += " " + tol_str;
-					}
-					else if (isEpi) {
-						exp = "." + nw; if (!extra_r.empty()) exp += " [" + extra_r + "]"; if (!tol_str.empty()) exp += " " + tol_str;
-					}
-					else if (isMul) {
-						string pat = "."; int vow = 0;
-						for (char c : nw) if (isVowel(c)) { pat += c; pat += "."; vow++; }
-						exp = pat + " [" + to_string(vow) + "V*"; if (!extra_r.empty()) exp += "," + extra_r; exp += "]"; if (!tol_str.empty()) exp += " " + tol_str;
-					}
-					else { // isUni
-						char v = '\0';
-						for (char c : nw) if (isVowel(c)) { v = c; break; }
-						if (v) {
-							exp = ". [" + string(1, v);
-							string av = "AEIOU";
-							for (char c : av) if (c != v) exp += ",0" + string(1, c);
-							if (!extra_r.empty()) exp += "," + extra_r;
-							exp += "]";
-							if (!tol_str.empty()) exp += " " + tol_str;
-						}
-					}
-					return exp;
-					};
-
-				vector<string> nw_anp; string na_anp;
-				if (tryResolveNestedArg(rest_full, dictionary, raw_dict, normToRaw, dictByLen, nw_anp, na_anp)) {
-					if (nw_anp.empty()) { cout << "(La consulta anidada no devolvió resultados)" << endl; continue; }
-					vector<pair<string, vector<string>>> blocks;
-					for (const string& nw : nw_anp) {
-						string r = nw + (na_anp.empty() ? "" : " " + na_anp);
-						blocks.push_back({ nw, runSearch(computeAnpIL(r)) });
-					}
-					displayBlocks(blocks); continue;
-				}
-				inputLine = computeAnpIL(rest_full);
-			}
-
-			if (input == "/help" || input == "/hp") {
-
-				cout << "\n--- BUSCADOR DE PALABRAS ---\n\n";
-				cout << "Busca palabras en un diccionario usando un lenguaje de patrones.\n\n";
-				cout << "Una búsqueda se define en una sola línea con hasta 3 partes:\n\n";
-				cout << "  1) Estructura (obligatoria)  ->  describe la forma de la palabra\n";
-				cout << "  2) Restricciones  [R1,R2,...] (opcional)  ->  filtros globales\n";
-				cout << "  3) Tolerancia  n  o  n*  (opcional)  ->  errores permitidos\n\n";
-				cout << "Cada parte es independiente y pueden combinarse libremente.\n\n";
-				cout << "  Usa /pattern     para aprender a definir estructuras.\n";
-				cout << "  Usa /restriction para aprender a usar filtros.\n";
-				cout << "  Usa /tolerance   para entender la tolerancia a errores.\n";
-				cout << "  Usa /nested      para entender las consultas anidadas.\n";
-				cout << "  Usa /commands    para ver todos los comandos disponibles.\n";
+			if (input == "/stats" || input.substr(0, 7) == "/stats ") {
+				string arg = input.substr(6);
+				arg.erase(0, arg.find_first_not_of(" "));
+				if (arg == "on") statsOn = true;
+				else if (arg == "off") statsOn = false;
+				else if (!arg.empty()) { cout << "(Uso: /stats on | /stats off)" << endl; continue; }
+				cout << "(Estadísticas " << (statsOn ? "activadas" : "desactivadas") << ")" << endl;
 				continue;
 			}
-
-			if (input == "/pattern" || input == "/pat") {
-
-				cout << "\n--- 1. ESTRUCTURA DE LA PALABRA ---\n\n";
-				cout << "Describe la forma interna de la palabra, de izquierda a derecha.\n";
-				cout << "El patrón debe cubrir la palabra completa.\n\n";
-				cout << "ELEMENTOS DISPONIBLES:\n";
-				cout << "  *        ->  exactamente 1 letra cualquiera\n";
-				cout << "  X        ->  la letra X exacta (ej: A, B, ~)\n";
-				cout << "  .        ->  cualquier número de letras (incluido cero)\n\n";
-				cout << "RANGOS (entre paréntesis):\n";
-				cout << "  (n,m)    ->  entre n y m letras cualquiera\n";
-				cout << "  (n,m,V)  ->  entre n y m vocales\n";
-				cout << "  (n,m,C)  ->  entre n y m consonantes\n\n";
-				cout << "NOTAS:\n";
-				cout << "  - Si n está vacío, se asume 0\n";
-				cout << "  - Si m está vacío, se asume infinito\n";
-				cout << "  - Cada elemento consume letras consecutivas\n\n";
-				cout << "EJEMPLOS:\n";
-				cout << "  (1,2,C)A.   -> 1-2 consonantes, luego 'A', luego cualquier cosa\n";
-				cout << "  CAS*        -> palabras de 4 letras que empiecen por CAS\n";
+			if (input == "/budget" || input.substr(0, 8) == "/budget ") {
+				istringstream args(input.substr(7));
+				string what, value;
+				args >> what >> value;
+				bool number = !value.empty() && value.size() < 19 && all_of(value.begin(), value.end(), [](unsigned char c) { return isdigit(c); });
+				long long v = number ? atoll(value.c_str()) : 0;
+				if (what == "off") { timeoutMs = 0; maxWork = 0; }
+				else if (what == "time" && number) timeoutMs = (int)(std::min)(v, (long long)INT_MAX);
+				else if (what == "work" && number) maxWork = (uint64_t)v;
+				else if (!what.empty()) { cout << "(Uso: /budget time MS | /budget work N | /budget off)" << endl; continue; }
+				cout << "(Límite por consulta: tiempo " << (timeoutMs ? to_string(timeoutMs) + " ms" : "sin límite")
+					<< ", trabajo " << (maxWork ? to_string(maxWork) : "sin límite") << ")" << endl;
 				continue;
-
 			}
-
-
-
-			if (input == "/restriction" || input == "/res") {
-				cout << "\n--- 2. RESTRICCIONES [Filtros] ---\n\n";
-				cout << "Se escriben entre corchetes después del patrón: PATRON [R1,R2,...]\n";
-				cout << "Cada restricción tiene la forma: [operador][número][elemento]\n\n";
-				cout << "OPERADORES: ==  >=  <=  >  <   (si se omite, se asume ==)\n\n";
-				cout << "ELEMENTOS DISPONIBLES:\n";
-				cout << "  V*       ->  número total de vocales\n";
-				cout << "  C*       ->  número total de consonantes\n";
-				cout << "  S*       ->  número de sílabas\n";
-				cout << "  T*       ->  posición de la sílaba tónica desde la derecha\n";
-				cout << "               (1 = aguda, 2 = llana, 3 = esdrújula)\n";
-				cout << "  A-Z      ->  ocurrencias de una letra concreta\n";
-				cout << "  (vacío)  ->  longitud total de la palabra\n\n";
-				cout << "EJEMPLOS:\n";
-				cout << "  [3S*]          ->  palabras de exactamente 3 sílabas\n";
-				cout << "  [>=2V*,0K]     ->  al menos 2 vocales y ninguna K\n";
-				cout << "  A. [2S*, <7]   ->  empieza por A, 2 sílabas y menos de 7 letras\n";
-				cout << "  . [T*==1]      ->  palabras agudas\n";
+			if (input == "/explain" || input.substr(0, 9) == "/explain ") {
+				finishLoad(pending, dict, currentDict, true, cout);
+				explainQuery(input.substr(8), *dict, cout);
 				continue;
 			}
 
+			if (!hasBoolOps(input) && printHelp(input)) continue;
 
-
-			if (input == "/tolerance" || input == "/tol") {
-				cout << "\n--- 3. TOLERANCIA A ERRORES ---\n\n";
-				cout << "Número al final del patrón que indica cuántos errores se permiten.\n\n";
-				cout << "Se considera un error, por ejemplo:\n";
-				cout << "  - Una letra que no cumple el tipo esperado (vocal en lugar de consonante, etc.)\n";
-				cout << "  - Letras que sobran o faltan para satisfacer un rango\n\n";
-				cout << "TOLERANCIA PARCIAL (n):\n";
-				cout << "  Solo se aplica al patrón. Las restricciones [] son siempre obligatorias.\n\n";
-				cout << "TOLERANCIA TOTAL (n*):\n";
-				cout << "  El asterisco hace que la tolerancia sea global: los errores en las\n";
-				cout << "  restricciones [] también consumen del límite.\n\n";
-				cout << "EJEMPLOS:\n";
-				cout << "  HOLA 1       ->  permite 1 error en el patrón (BOLA, OLA, HOLI...)\n";
-				cout << "  . [3A] 1*    ->  busca 3 letras 'A', pero acepta 2 o 4 con 1 error total\n";
+			if (isLoadCommand(input)) {
+				string rest = loadArgument(input);
+				if (rest.empty()) { listDictionaries(residentNames()); continue; }
+				finishLoad(pending, dict, currentDict, true, cout); // una carga cada vez
+				if (shared_ptr<Dict> rd = residentDict(rest)) {
+					dict = rd;
+					currentDict = rest;
+					cout << "(Diccionario activo: " << rest << ", " << rd->liveCount() << " palabras; ya estaba en memoria)" << endl;
+					continue;
+				}
+				pending = startLoad(rest);
+				cout << "(Cargando '" << rest << "' en segundo plano; las consultas esperarán a que termine)" << endl;
 				continue;
 			}
-
-			if (input == "/nested" || input == "/nes") {
-				cout << "\n--- CONSULTAS ANIDADAS ---\n\n";
-				cout << "Una consulta anidada es una búsqueda escrita entre paréntesis que se evalúa primero,\n";
-				cout << "y cuyo resultado (una lista de palabras) se usa como entrada de otro comando.\n\n";
-				cout << "Permite encadenar búsquedas complejas y componer operaciones en varios niveles.\n\n";
-
-				cout << "SINTAXIS GENERAL:\n\n";
-				cout << "  COMANDO (CONSULTA_INTERNA) [RESTRICCIONES] n\n\n";
-
-				cout << "La CONSULTA_INTERNA puede ser cualquier búsqueda válida:\n";
-				cout << "  - un patrón normal\n";
-				cout << "  - un comando (/cal, /aso, /an, /mul, etc.)\n";
-				cout << "  - una expresión booleana\n";
-				cout << "  - una búsqueda aleatoria (/rd)\n\n";
-
-				cout << "EJEMPLOS BÁSICOS:\n\n";
-				cout << "  /cal (CASA)\n";
-				cout << "    -> divide CASA solo usando palabras que estén en el diccionario\n\n";
-				cout << "  /aso (AMOR)\n";
-				cout << "    -> busca rima asonante con cada resultado de la consulta interna\n\n";
-
-				cout << "EJEMPLOS CON /random:\n\n";
-				cout << "  /cal (/rd 3 [E])\n";
-				cout << "    -> elige 3 palabras al azar que tengan E y aplica /cal a cada una\n\n";
-				cout << "  /con (/rd 5 .)\n";
-				cout << "    -> rima consonante con 5 palabras aleatorias del diccionario\n\n";
-
-				cout << "EJEMPLOS AVANZADOS:\n\n";
-				cout << "  /cal ((/rd 2 [>=3V*]) || (/rd 2 [>=3C*]))\n";
-				cout << "    -> mezcla dos conjuntos aleatorios y divide cada palabra\n\n";
-				cout << "  /anp (/rd 5 . [3S*])\n";
-				cout << "    -> busca anáforas de 5 palabras trisílabas al azar\n\n";
-				cout << "  /aso ((/cal SOL) || (/cal LUNA))\n";
-				cout << "    -> rima asonante con todas las palabras obtenidas de ambos calembours\n\n";
-
-				cout << "NOTAS IMPORTANTES:\n\n";
-				cout << "  - La consulta interna se evalúa completamente antes del comando externo.\n";
-				cout << "  - Puede contener operadores booleanos: &&, ||, -, !\n";
-				cout << "  - Puede incluir /random (/rd n).\n";
-				cout << "  - Los paréntesis de consultas NO se confunden con rangos de patrón (n,m,V).\n";
-				cout << "  - Si la consulta anidada no devuelve resultados, el comando externo no se ejecuta.\n\n";
-
-				cout << "Los comandos que aceptan consultas anidadas incluyen, entre otros:\n";
-				cout << "  /cal, /anagram, /paronomasia, /anasyllabic,\n";
-				cout << "  /anaphora, /epiphora, /multisyllabic, /univocalism,\n";
-				cout << "  /assonant, /consonant, /wordplay\n";
-			}
-
-			if ((input.size() >= 5 && input.substr(0, 5) == "/load") || (input.size() >= 3 && input.substr(0, 3) == "/ld")) {
-				string rest = (input.substr(0, 5) == "/load") ? input.substr(5) : input.substr(3);
-				rest.erase(0, rest.find_first_not_of(" \t"));
-				if (rest.empty()) listDictionaries();
-				else if (loadDictionary(rest, raw_dict, dictionary)) { currentDict = rest; buildCalLookup(); }
+			if (isUnloadCommand(input)) {
+				finishLoad(pending, dict, currentDict, true, cout);
+				printQueryResult(runUnloadCommand(input, currentDict), *dict, cout);
 				continue;
 			}
-
-			// --- DETECCIÓN DE /calembour (/cal) ---
-			bool isCal = (input.substr(0, 10) == "/calembour" || (input.substr(0, 4) == "/cal" && (input.size() == 4 || input[4] == ' ')));
-
-			if (isCal) {
-				string rest = (input.substr(0, 10) == "/calembour") ? input.substr(10) : input.substr(4);
-				rest.erase(0, rest.find_first_not_of(" "));
-
-				// Detectar consulta anidada: /cal (/rd 2 [E]) [>1]
-				vector<string> nw_cal; string na_cal;
-				bool cal_nested = tryResolveNestedArg(rest, dictionary, raw_dict, normToRaw, dictByLen, nw_cal, na_cal);
-				if (cal_nested) {
-					if (nw_cal.empty()) { cout << "(La consulta anidada no devolvió resultados)" << endl; continue; }
-					rest = ""; // se reasignará por cada palabra
-				}
-
-				// Lista de (word, cal_restr, cal_n) a procesar
-				vector<tuple<string, string, int>> cal_tasks;
-				auto parseCal = [](const string& r) -> tuple<string, string, int> {
-					int cal_n = 0; string cal_word = r, cal_restr = "";
-					size_t bs = r.find('[');
-					if (bs != string::npos) {
-						size_t be = r.find(']', bs);
-						if (be != string::npos) {
-							cal_word = r.substr(0, bs); cal_restr = r.substr(bs + 1, be - bs - 1);
-							string rem = r.substr(be + 1); rem.erase(0, rem.find_first_not_of(" "));
-							if (!rem.empty() && all_of(rem.begin(), rem.end(), [](unsigned char c) {return isdigit(c);})) cal_n = stoi(rem);
-						}
-					}
-					else {
-						size_t lsp = r.find_last_of(" ");
-						if (lsp != string::npos) {
-							string pn = r.substr(lsp + 1);
-							if (!pn.empty() && all_of(pn.begin(), pn.end(), [](unsigned char c) {return isdigit(c);})) { cal_n = stoi(pn); cal_word = r.substr(0, lsp); }
-						}
-					}
-					cal_word.erase(remove(cal_word.begin(), cal_word.end(), ' '), cal_word.end());
-					return { cal_word, cal_restr, cal_n };
-					};
-
-				if (cal_nested) {
-					for (const string& nw : nw_cal)
-						cal_tasks.push_back(parseCal(nw + (na_cal.empty() ? "" : " " + na_cal)));
-				}
-				else {
-					cal_tasks.push_back(parseCal(rest));
-				}
-
-				bool first_cal_block = true;
-				int total_cal_all = 0;
-
-				for (auto& [cal_word, cal_restr, cal_n] : cal_tasks) {
-					string normCal = normalizeWord(cal_word);
-					if (normCal.empty()) { cout << "(Indica una palabra para /cal)" << endl; continue; }
-					if ((int)normCal.size() > 20) { cout << "(Palabra demasiado larga, max 20: " << cal_word << ")" << endl; continue; }
-
-					if (!first_cal_block) cout << "\n";
-					first_cal_block = false;
-
-					// Parsear restricciones para los segmentos
-					vector<ResourceCondition> cal_resources = parseConditionList(cal_restr);
-
-					int L = (int)normCal.size();
-					vector<vector<pair<int, string>>> best(L, vector<pair<int, string>>(L + 1, { INT_MAX, "" }));
-					for (int i = 0; i < L; i++) for (int j = i + 1; j <= L; j++) {
-						string part = normCal.substr(i, j - i); int plen2 = (int)part.size();
-						auto it_exact = normToRaw.find(part);
-						if (it_exact != normToRaw.end()) {
-							if (cal_resources.empty() || checkResources(part, it_exact->second, cal_resources) == 0) best[i][j] = { 0, it_exact->second };
-							continue;
-						}
-						if (cal_n == 0) continue;
-						int be = cal_n + 1; string bw = "";
-						for (int len = max(1, plen2 - cal_n); len <= plen2 + cal_n; len++) {
-							auto il = dictByLen.find(len); if (il == dictByLen.end()) continue;
-							for (const string& w2 : il->second) {
-								if (!cal_resources.empty() && checkResources(w2, normToRaw.at(w2), cal_resources) > 0) continue;
-								int d = levenshtein(part, w2, be - 1);
-								if (d < be) { be = d; bw = normToRaw.at(w2); if (be == 0) break; }
-							}
-							if (be == 0) break;
-						}
-						if (be <= cal_n) best[i][j] = { be, bw };
-					}
-
-					vector<vector<pair<string, int>>> all_results;
-					function<void(int, int, vector<pair<string, int>>&)> cal_search =
-						[&](int pos, int err_left, vector<pair<string, int>>& current) {
-						if (pos == L) { if ((int)current.size() >= 2) all_results.push_back(current); return; }
-						for (int end = pos + 1; end <= L; end++) {
-							int berr = best[pos][end].first; const string& braw = best[pos][end].second;
-							if (berr == INT_MAX || berr > err_left) continue;
-							current.push_back({ braw, berr }); cal_search(end, err_left - berr, current); current.pop_back();
-						}
-						};
-					vector<pair<string, int>> cur; cal_search(0, cal_n, cur);
-
-					if (all_results.empty()) { cout << "(Sin resultados para " << cal_word << ")" << endl; }
-					else {
-						for (auto& parts2 : all_results) {
-							for (int k = 0; k < (int)parts2.size(); k++) {
-								if (k > 0) cout << " ";
-								cout << parts2[k].first;
-								if (parts2[k].second > 0) cout << "(~" << parts2[k].second << ")";
-							}
-							cout << "\n";
-						}
-						total_cal_all += (int)all_results.size();
-					}
-				}
-				if (!cal_tasks.empty()) cout << "Total: " << total_cal_all << endl;
+			if (isUpdateCommand(input)) {
+				finishLoad(pending, dict, currentDict, true, cout);
+				printQueryResult(runUpdateCommand(input, *dict), *dict, cout);
 				continue;
 			}
-			// --- CONFIGURACIÓN DE WORDPLAY ---
-			bool is_wordplay = false;
-			string wp_word = "";
-			string wp_restr = "";
-			int wp_n = 1;
-			bool wp_asterisk = false;
-
-			bool isWp = (input.substr(0, 9) == "/wordplay" || (input.substr(0, 3) == "/wp" && (input.size() == 3 || input[3] == ' ')));
-
-			if (isWp) {
-				is_wordplay = true;
-				string rest = (input.substr(0, 9) == "/wordplay") ? input.substr(9) : input.substr(3);
-				rest.erase(0, rest.find_first_not_of(" "));
-
-				size_t b_start = rest.find('[');
-				size_t last_space = rest.find_last_of(" ");
-
-				if (b_start != string::npos) {
-					wp_word = rest.substr(0, b_start);
-					size_t b_end = rest.find(']', b_start);
-					if (b_end != string::npos) {
-						wp_restr = rest.substr(b_start + 1, b_end - b_start - 1);
-						string possible_n = rest.substr(b_end + 1);
-						possible_n.erase(0, possible_n.find_first_not_of(" "));
-						if (!possible_n.empty()) {
-							if (possible_n.back() == '*') { wp_asterisk = true; possible_n.pop_back(); }
-							if (!possible_n.empty() && all_of(possible_n.begin(), possible_n.end(), [](unsigned char c) { return isdigit(c); })) {
-								wp_n = safeStoi(possible_n);
-							}
-						}
-					}
-				}
-				else if (last_space != string::npos) {
-					string possible_n = rest.substr(last_space + 1);
-					string check_n = possible_n;
-					if (!check_n.empty() && check_n.back() == '*') { wp_asterisk = true; check_n.pop_back(); }
-
-					if (!check_n.empty() && all_of(check_n.begin(), check_n.end(), [](unsigned char c) { return isdigit(c); })) {
-						wp_word = rest.substr(0, last_space);
-						wp_n = safeStoi(check_n);
-					}
-					else wp_word = rest;
-				}
-				else {
-					wp_word = rest;
-				}
-				wp_word.erase(remove(wp_word.begin(), wp_word.end(), ' '), wp_word.end());
-			}
-
-			// --- LÓGICA DE BÚSQUEDA ---
-			while (true) {
-				if (is_wordplay) {
-					inputLine = wp_word;
-					if (!wp_restr.empty()) inputLine += " [" + wp_restr + "]";
-					inputLine += " " + to_string(wp_n) + (wp_asterisk ? "*" : "");
-					patterns_to_run = { inputLine };
-				}
-				else if (!isAns) {
-					patterns_to_run = { inputLine };
-				}
-
-				vector<string> results;
-				// Usamos un vector booleano para evitar duplicados si una palabra matchea más de un patrón (O(1) lookup)
-				vector<bool> matched_words(dictionary.size(), false);
-
-				for (const string& pLine : patterns_to_run) {
-					vector<PatternElement> elems;
-					vector<ResourceCondition> resources;
-					int tolerance = 0;
-					bool is_total = false;
-					bool parse_err = false;
-
-					parseInput(pLine, elems, resources, tolerance, is_total, &parse_err);
-					if (parse_err) { cout << "(Sintaxis inválida en el patrón. El programa continúa.)" << endl; break; }
-
-					for (size_t i = 0; i < dictionary.size(); ++i) {
-						if (matched_words[i]) continue; // Ya fue encontrada en otra permutación
-
-						const string& w = dictionary[i];
-						if (w.length() >= 100) continue;
-
-						int res_errors = checkResources(w, raw_dict[i], resources);
-						int remaining_tolerance = tolerance;
-
-						if (is_total) {
-							if (res_errors > tolerance) continue;
-							remaining_tolerance -= res_errors;
-						}
-						else {
-							if (res_errors > 0) continue;
-						}
-
-						for (int r = 0; r <= (int)w.length(); ++r)
-							for (int e = 0; e <= (int)elems.size(); ++e)
-								for (int t = 0; t <= remaining_tolerance; ++t) memo_buffer[r][e][t] = -1;
-
-						if (matchPattern(w, 0, elems, 0, remaining_tolerance)) {
-							matched_words[i] = true;
-							results.push_back(raw_dict[i]);
-						}
-					}
-				}
 
-				// Control de ciclo para Wordplay
-				if (is_wordplay) {
-					bool empty_or_self = false;
-					if (results.empty()) {
-						empty_or_self = true;
-					}
-					else if (results.size() == 1 && normalizeWord(results[0]) == normalizeWord(wp_word)) {
-						empty_or_self = true;
-					}
-
-					if (empty_or_self && wp_n < 99) {
-						wp_n++;
-						continue;
-					}
-				}
-
-				// --- SELECCIÓN ALEATORIA para /random ---
-				if (isRd) {
-					if (results.empty()) {
-						cout << "(Sin resultados para el patron dado)" << endl;
-					}
-					else {
-						// Mezclar y tomar los primeros rd_n (o todos si hay menos)
-						shuffle(results.begin(), results.end(), rng);
-						int take = (std::min)(rd_n, (int)results.size());
-						cout << "(Mostrando " << take << " de " << results.size() << " resultados)\n";
-						for (int i = 0; i < take; ++i) {
-							cout << "- " << results[i] << "\n";
-						}
-					}
-					break;
-				}
-
-				// Imprimir resultados
-				for (const string& res : results) {
-					cout << "- " << res << "\n";
-				}
-				cout << "Total: " << results.size() << endl;
-
-				if (is_wordplay) {
-					cout << "(B\xC3\xBAsqueda completada con n = " << wp_n << ")" << endl;
-				}
-
-				break;
-			}
+			// Las consultas necesitan el diccionario completo (las secciones del .idx se leen al usarlas)
+			finishLoad(pending, dict, currentDict, true, cout);
+
+			QueryBudget budget;
+			auto t0 = chrono::steady_clock::now();
+			if (timeoutMs > 0) budget.deadline = t0 + chrono::milliseconds(timeoutMs);
+			budget.max_work = maxWork;
+			budget.interrupt = &g_sigint;
+			QueryStats st;
+			if (statsOn) t_stats = &st;
+			g_sigint = 0;
+			signal(SIGINT, onSigint);   // en Windows el manejador se desinstala tras cada señal
+			g_inQuery = 1;
+			QueryResult qr;
+			try { qr = executeBudgeted(input, *dict, rng, budget); }
+			catch (...) { g_inQuery = 0; t_stats = nullptr; throw; }
+			g_inQuery = 0;
+			g_sigint = 0;
+			double total_ms = msSince(t0);
+			t_stats = nullptr;
+			printQueryResult(qr, *dict, cout);
+			if (statsOn) printQueryStats(st, total_ms, cout);
 		}
 		catch (...) {
 			cout << "(Sintaxis inválida. El programa continúa.)" << endl;